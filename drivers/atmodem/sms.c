@@ -76,6 +76,7 @@ struct sms_data {
 	char *cnma_ack_pdu;
 	int cnma_ack_pdu_len;
 	guint timeout_source;
+	int cmms;		/* +CMMS mode, 0 if not set yet, -1 while setting */
 	GAtChat *chat;
 	unsigned int vendor;
 };
@@ -210,6 +211,17 @@ err:
 	CALLBACK_WITH_FAILURE(cb, -1, cbd->data);
 }
 
+static void at_cmms_cb(gboolean ok, GAtResult *result, gpointer user_data)
+{
+	struct sms_data *data = user_data;
+
+	/*
+	 * With +CMMS=2 the modem keeps the link open between sends by
+	 * itself, otherwise +CMMS=1 has to be set again before each one
+	 */
+	data->cmms = ok ? 2 : 1;
+}
+
 static void at_cmgs(struct ofono_sms *sms, const unsigned char *pdu,
 			int pdu_len, int tpdu_len, int mms,
 			ofono_sms_submit_cb_t cb, void *user_data)
@@ -225,9 +237,18 @@ static void at_cmgs(struct ofono_sms *sms, const unsigned char *pdu,
 			/* no mms support */
 			break;
 		default:
-			snprintf(buf, sizeof(buf), "AT+CMMS=%d", mms);
-			g_at_chat_send(data->chat, buf, none_prefix,
-					NULL, NULL, NULL);
+			if (data->cmms == 0) {
+				if (g_at_chat_send(data->chat, "AT+CMMS=2",
+						none_prefix, at_cmms_cb,
+						data, NULL) > 0)
+					data->cmms = -1;
+				else
+					data->cmms = 1;
+			}
+
+			if (data->cmms == 1)
+				g_at_chat_send(data->chat, "AT+CMMS=1",
+						none_prefix, NULL, NULL, NULL);
 			break;
 		}
 	}
@@ -1359,6 +1380,7 @@ static void at_sms_remove(struct ofono_sms *sms)
 
 static const struct ofono_sms_driver driver = {
 	.name		= "atmodem",
+	.max_pending_submits	= 2,
 	.probe		= at_sms_probe,
 	.remove		= at_sms_remove,
 	.sca_query	= at_csca_query,
@@ -959,9 +959,15 @@ static inline size_t grow_buf(void **buf, size_t *buf_size, size_t *pos,
 {
 	size_t size = align_len(*pos, alignment);
 
+	/* Grow geometrically to keep the number of reallocations low */
 	if (size + len > *buf_size) {
-		*buf = l_realloc(*buf, size + len);
-		*buf_size = size + len;
+		size_t new_size = *buf_size ? *buf_size * 2 : 64;
+
+		while (new_size < size + len)
+			new_size *= 2;
+
+		*buf = l_realloc(*buf, new_size);
+		*buf_size = new_size;
 	}
 
 	if (size - *pos > 0)
@@ -982,6 +988,53 @@ static inline size_t grow_buf(void **buf, size_t *buf_size, size_t *pos,
 #define GROW_OBUF(c) \
 	grow_buf(&c->obuf, &c->obuf_size, &c->obuf_pos, 4, 4)
 
+static void reserve_buf(void **buf, size_t *buf_size, size_t size)
+{
+	if (size <= *buf_size)
+		return;
+
+	*buf = l_realloc(*buf, size);
+	*buf_size = size;
+}
+
+/*
+ * Size of the static part described by a signature: fixed size members
+ * are stored inline, everything else as an offset/length pair
+ */
+static size_t signature_static_size(const char *signature)
+{
+	const char *sig = signature;
+	size_t size = 0;
+
+	while (*sig) {
+		const char *sigend = _signature_end(sig);
+
+		if (!sigend)
+			break;
+
+		switch (*sig) {
+		case 'y':
+		case 'q':
+		case 'u':
+		case 't':
+			size = align_len(size, get_alignment(*sig));
+			size += get_basic_size(*sig);
+			break;
+		case '0' ... '9':
+			size += strtoul(sig, NULL, 10);
+			break;
+		default:
+			size = align_len(size, 4);
+			size += 8;
+			break;
+		}
+
+		sig = sigend + 1;
+	}
+
+	return size;
+}
+
 static void add_offset_and_length(struct container *container,
 					uint32_t offset, uint32_t len)
 {
@@ -1482,6 +1535,11 @@ static bool append_arguments(struct mbim_message *message,
 
 	builder = mbim_message_builder_new(message);
 
+	/* Size the static buffer up front, it is grown only for arrays */
+	reserve_buf(&builder->stack[0].sbuf, &builder->stack[0].sbuf_size,
+				builder->stack[0].base_offset +
+				signature_static_size(signature));
+
 	stack[stack_index].type = CONTAINER_TYPE_STRUCT;
 	stack[stack_index].sig_start = signature;
 	stack[stack_index].sig_end = signature + strlen(signature);
@@ -24,6 +24,8 @@
 #endif
 
 #define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
@@ -36,8 +38,11 @@
 #include "mbim.h"
 #include "mbim-message.h"
 #include "mbim-private.h"
+#include "latency.h"
 
 #define MAX_CONTROL_TRANSFER 4096
+/* Fragmented messages are dropped if they would grow bigger than this */
+#define MAX_MESSAGE_SIZE (256 * 1024)
 #define HEADER_SIZE (sizeof(struct mbim_message_header) + \
 					sizeof(struct mbim_fragment_header))
 
@@ -121,16 +126,25 @@ const uint8_t mbim_context_type_local[] = {
 	0x03, 0x3C, 0x39, 0xF6, 0x0D, 0xB9,
 };
 
+/*
+ * Fragmented messages are reassembled into a single buffer, sized from
+ * the number of fragments announced by the first one.  All but the last
+ * fragment are of maximum size, so the following fragments can be read
+ * straight into place, see message_assembly_get_buffer.
+ */
 struct message_assembly_node {
 	struct mbim_message_header msg_hdr;
 	struct mbim_fragment_header frag_hdr;
-	struct iovec *iov;
-	size_t n_iov;
-	size_t cur_iov;
-} __attribute((packed))__;
+	void *buf;
+	size_t len;
+	size_t size;
+	uint32_t n_frags;
+	uint32_t cur_frag;
+};
 
 struct message_assembly {
 	struct l_queue *transactions;
+	size_t max_frag_len;
 };
 
 static bool message_assembly_node_match_tid(const void *a, const void *b)
@@ -144,20 +158,17 @@ static bool message_assembly_node_match_tid(const void *a, const void *b)
 static void message_assembly_node_free(void *data)
 {
 	struct message_assembly_node *node = data;
-	size_t i;
-
-	for (i = 0; i < node->n_iov; i++)
-		l_free(node->iov[i].iov_base);
 
-	l_free(node->iov);
+	l_free(node->buf);
 	l_free(node);
 }
 
-static struct message_assembly *message_assembly_new()
+static struct message_assembly *message_assembly_new(size_t max_frag_len)
 {
 	struct message_assembly *assembly = l_new(struct message_assembly, 1);
 
 	assembly->transactions = l_queue_new();
+	assembly->max_frag_len = max_frag_len;
 
 	return assembly;
 }
@@ -168,10 +179,37 @@ static void message_assembly_free(struct message_assembly *assembly)
 	l_free(assembly);
 }
 
+/*
+ * Returns where the next fragment of transaction tid should be read to,
+ * or NULL if there is no assembly in progress that has room for it
+ */
+static void *message_assembly_get_buffer(struct message_assembly *assembly,
+						uint32_t tid, size_t frag_len)
+{
+	struct message_assembly_node *node;
+
+	node = l_queue_find(assembly->transactions,
+				message_assembly_node_match_tid,
+				L_UINT_TO_PTR(tid));
+	if (!node)
+		return NULL;
+
+	if (node->len + frag_len > node->size)
+		return NULL;
+
+	return node->buf + node->len;
+}
+
+/*
+ * Adds a fragment to the assembly.  If the fragment buffer has been taken
+ * over by the assembly, consumed is set to true and the caller must not
+ * reuse it.
+ */
 static struct mbim_message *message_assembly_add(
 					struct message_assembly *assembly,
 					const void *header,
-					void *frag, size_t frag_len)
+					void *frag, size_t frag_len,
+					bool *consumed)
 {
 	const struct mbim_message_header *msg_hdr = header;
 	const struct mbim_fragment_header *frag_hdr = header +
@@ -182,6 +220,9 @@ static struct mbim_message *message_assembly_add(
 	uint32_t cur_frag = L_LE32_TO_CPU(frag_hdr->cur_frag);
 	struct message_assembly_node *node;
 	struct mbim_message *message;
+	struct iovec *iov;
+
+	*consumed = false;
 
 	if (unlikely(type != MBIM_COMMAND_DONE &&
 				type != MBIM_INDICATE_STATUS_MSG))
@@ -196,47 +237,69 @@ static struct mbim_message *message_assembly_add(
 			return NULL;
 
 		if (n_frags == 1) {
-			struct iovec *iov = l_new(struct iovec, 1);
-
+			iov = l_new(struct iovec, 1);
 			iov[0].iov_base = frag;
 			iov[0].iov_len = frag_len;
 
+			*consumed = true;
 			return _mbim_message_build(header, iov, 1);
 		}
 
+		if (n_frags == 0 || frag_len > assembly->max_frag_len ||
+				n_frags > MAX_MESSAGE_SIZE /
+						assembly->max_frag_len)
+			return NULL;
+
+		/*
+		 * The first fragment is at the start of the segment buffer,
+		 * grow it to hold the whole message so the data stays put
+		 */
 		node = l_new(struct message_assembly_node, 1);
 		memcpy(&node->msg_hdr, msg_hdr, sizeof(*msg_hdr));
 		memcpy(&node->frag_hdr, frag_hdr, sizeof(*frag_hdr));
-		node->iov = l_new(struct iovec, n_frags);
-		node->n_iov = n_frags;
-		node->cur_iov = cur_frag;
-		node->iov[node->cur_iov].iov_base = frag;
-		node->iov[node->cur_iov].iov_len = frag_len;
+		node->size = n_frags * assembly->max_frag_len;
+		node->buf = l_realloc(frag, node->size);
+		node->len = frag_len;
+		node->n_frags = n_frags;
+		node->cur_frag = cur_frag;
 
 		l_queue_push_head(assembly->transactions, node);
 
+		*consumed = true;
 		return NULL;
 	}
 
-	if (node->n_iov != n_frags)
+	if (node->n_frags != n_frags)
 		return NULL;
 
-	if (node->cur_iov + 1 != cur_frag)
+	if (node->cur_frag + 1 != cur_frag)
 		return NULL;
 
-	node->cur_iov = cur_frag;
-	node->iov[node->cur_iov].iov_base = frag;
-	node->iov[node->cur_iov].iov_len = frag_len;
+	/* Fragment was read elsewhere, e.g. the buffer had no room for it */
+	if (frag != node->buf + node->len) {
+		if (node->len + frag_len > node->size)
+			return NULL;
+
+		memcpy(node->buf + node->len, frag, frag_len);
+	}
 
-	if (node->cur_iov + 1 < node->n_iov)
+	node->cur_frag = cur_frag;
+	node->len += frag_len;
+
+	if (node->cur_frag + 1 < node->n_frags)
 		return NULL;
 
 	l_queue_remove(assembly->transactions, node);
-	message = _mbim_message_build(&node->msg_hdr, node->iov, node->n_iov);
 
-	if (!message)
+	iov = l_new(struct iovec, 1);
+	iov[0].iov_base = node->buf;
+	iov[0].iov_len = node->len;
+
+	message = _mbim_message_build(&node->msg_hdr, iov, 1);
+	if (!message) {
+		l_free(iov);
 		message_assembly_node_free(node);
-	else
+	} else
 		l_free(node);
 
 	return message;
@@ -261,12 +324,15 @@ struct mbim_device {
 	uint8_t header[HEADER_SIZE];
 	size_t header_offset;
 	size_t segment_bytes_remaining;
+	size_t discard_bytes_remaining;
 	void *segment;
+	void *read_buf;
 	struct l_queue *pending_commands;
 	struct l_queue *sent_commands;
 	struct l_queue *notifications;
 	struct message_assembly *assembly;
 	struct l_idle *close_io;
+	struct latency_stats *stats;
 
 	bool is_ready : 1;
 	bool in_notify : 1;
@@ -276,11 +342,50 @@ struct pending_command {
 	uint32_t tid;
 	uint32_t gid;
 	struct mbim_message *message;
+	uint64_t sent;
 	mbim_device_reply_func_t callback;
 	mbim_device_destroy_func_t destroy;
 	void *user_data;
 };
 
+static const struct {
+	const uint8_t *uuid;
+	const char *name;
+} latency_services[] = {
+	{ mbim_uuid_basic_connect,	"BASIC_CONNECT"	},
+	{ mbim_uuid_sms,		"SMS"		},
+	{ mbim_uuid_ussd,		"USSD"		},
+	{ mbim_uuid_phonebook,		"PHONEBOOK"	},
+	{ mbim_uuid_stk,		"STK"		},
+	{ mbim_uuid_auth,		"AUTH"		},
+	{ mbim_uuid_dss,		"DSS"		},
+};
+
+/* Latency statistics are keyed by service index and CID */
+static uint32_t latency_id(struct mbim_message *message)
+{
+	const uint8_t *uuid = mbim_message_get_uuid(message);
+	uint32_t cid = mbim_message_get_cid(message);
+	unsigned int i;
+
+	for (i = 0; i < L_ARRAY_SIZE(latency_services); i++)
+		if (!memcmp(uuid, latency_services[i].uuid, 16))
+			return i << 16 | (cid & 0xffff);
+
+	return 0xffff << 16 | (cid & 0xffff);
+}
+
+static void latency_format(uint32_t id, char *buf, size_t len)
+{
+	unsigned int service = id >> 16;
+
+	if (service < L_ARRAY_SIZE(latency_services))
+		snprintf(buf, len, "%s %u", latency_services[service].name,
+								id & 0xffff);
+	else
+		snprintf(buf, len, "UNKNOWN %u", id & 0xffff);
+}
+
 static bool pending_command_match_tid(const void *a, const void *b)
 {
 	const struct pending_command *pending = a;
@@ -494,6 +599,8 @@ static bool command_write_handler(struct l_io *io, void *user_data)
 
 		l_util_hexdump(false, buf, written, device->debug_handler,
 				device->debug_data);
+
+		pending->sent = latency_now();
 	} else {
 		/* TODO: Handle fragmented writes */
 		l_util_debug(device->debug_handler, device->debug_data,
@@ -525,6 +632,9 @@ static void dispatch_command_done(struct mbim_device *device,
 	if (!pending)
 		goto done;
 
+	latency_stats_record(device->stats, latency_id(pending->message),
+								pending->sent);
+
 	if (pending->callback)
 		pending->callback(message, pending->user_data);
 
@@ -612,10 +722,32 @@ static bool command_read_handler(struct l_io *io, void *user_data)
 	uint32_t n_iov = 0;
 	uint32_t header_size;
 	struct mbim_message *message;
+	bool consumed;
 	uint32_t i;
 
 	fd = l_io_get_fd(io);
 
+	/* Skip the rest of a fragment that was too big to keep */
+	if (device->discard_bytes_remaining > 0) {
+		len = L_TFR(read(fd, device->segment,
+				minsize(device->discard_bytes_remaining,
+					device->max_segment_size -
+								HEADER_SIZE)));
+		if (len < 0) {
+			if (errno == EAGAIN)
+				return true;
+
+			return false;
+		}
+
+		device->discard_bytes_remaining -= len;
+
+		if (device->discard_bytes_remaining == 0)
+			device->header_offset = 0;
+
+		return true;
+	}
+
 	if (device->header_offset < sizeof(struct mbim_message_header)) {
 		if (!receive_header(device, fd))
 			return false;
@@ -627,16 +759,45 @@ static bool command_read_handler(struct l_io *io, void *user_data)
 	hdr = (struct mbim_message_header *) device->header;
 	type = L_LE32_TO_CPU(hdr->type);
 
-	if (device->segment_bytes_remaining == 0)
-		device->segment_bytes_remaining =
-					L_LE32_TO_CPU(hdr->len) -
-					sizeof(struct mbim_message_header);
-
 	if (type == MBIM_COMMAND_DONE || type == MBIM_INDICATE_STATUS_MSG)
 		header_size = HEADER_SIZE;
 	else
 		header_size = sizeof(struct mbim_message_header);
 
+	if (device->segment_bytes_remaining == 0) {
+		size_t frag_len;
+
+		if (L_LE32_TO_CPU(hdr->len) < header_size)
+			return false;
+
+		/* Must fit into the segment buffer, drop it otherwise */
+		frag_len = L_LE32_TO_CPU(hdr->len) - header_size;
+		if (frag_len > device->max_segment_size - HEADER_SIZE) {
+			l_warn("Dropping oversized fragment: %u bytes",
+						L_LE32_TO_CPU(hdr->len));
+			device->discard_bytes_remaining =
+					L_LE32_TO_CPU(hdr->len) -
+					device->header_offset;
+			return true;
+		}
+
+		device->segment_bytes_remaining =
+					L_LE32_TO_CPU(hdr->len) -
+					sizeof(struct mbim_message_header);
+
+		/* Read continuation fragments directly into the assembly */
+		device->read_buf = NULL;
+
+		if (header_size == HEADER_SIZE)
+			device->read_buf = message_assembly_get_buffer(
+						device->assembly,
+						L_LE32_TO_CPU(hdr->tid),
+						frag_len);
+
+		if (!device->read_buf)
+			device->read_buf = device->segment;
+	}
+
 	/* Put the rest of the header into the first chunk */
 	if (device->header_offset < header_size) {
 		iov[n_iov].iov_base = device->header + device->header_offset;
@@ -649,7 +810,7 @@ static bool command_read_handler(struct l_io *io, void *user_data)
 	l_info("header_offset: %zu", device->header_offset);
 	l_info("segment_bytes_remaining: %zu", device->segment_bytes_remaining);
 
-	iov[n_iov].iov_base = device->segment + L_LE32_TO_CPU(hdr->len) -
+	iov[n_iov].iov_base = device->read_buf + L_LE32_TO_CPU(hdr->len) -
 				device->header_offset -
 				device->segment_bytes_remaining;
 	iov[n_iov].iov_len = device->segment_bytes_remaining -
@@ -691,9 +852,14 @@ static bool command_read_handler(struct l_io *io, void *user_data)
 
 	device->header_offset = 0;
 	message = message_assembly_add(device->assembly, device->header,
-					device->segment,
-					L_LE32_TO_CPU(hdr->len) - header_size);
-	device->segment = l_malloc(device->max_segment_size - HEADER_SIZE);
+					device->read_buf,
+					L_LE32_TO_CPU(hdr->len) - header_size,
+					&consumed);
+	device->read_buf = NULL;
+
+	if (consumed)
+		device->segment = l_malloc(device->max_segment_size -
+								HEADER_SIZE);
 
 	if (!message)
 		return true;
@@ -919,7 +1085,10 @@ struct mbim_device *mbim_device_new(int fd, uint32_t max_segment_size)
 	device->pending_commands = l_queue_new();
 	device->sent_commands = l_queue_new();
 	device->notifications = l_queue_new();
-	device->assembly = message_assembly_new();
+	device->assembly = message_assembly_new(max_segment_size - HEADER_SIZE);
+
+	device->stats = latency_stats_new("mbim");
+	latency_stats_set_format(device->stats, latency_format);
 
 	return mbim_device_ref(device);
 }
@@ -961,6 +1130,7 @@ void mbim_device_unref(struct mbim_device *device)
 	l_queue_destroy(device->sent_commands, pending_command_free);
 	l_queue_destroy(device->notifications, notification_free);
 	message_assembly_free(device->assembly);
+	latency_stats_free(device->stats);
 	l_free(device);
 }
 
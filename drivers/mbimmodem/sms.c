@@ -497,6 +497,7 @@ static void mbim_sms_remove(struct ofono_sms *sms)
 
 static const struct ofono_sms_driver driver = {
 	.name		= "mbim",
+	.max_pending_submits	= 4,
 	.probe		= mbim_sms_probe,
 	.remove		= mbim_sms_remove,
 	.sca_query	= mbim_sca_query,
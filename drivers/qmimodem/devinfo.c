@@ -39,11 +39,36 @@ struct devinfo_data {
 	bool device_is_3gpp;
 };
 
+/* Manufacturer, model and revision all come as a single string */
+struct string_info {
+	bool str_set;
+	char str[256];
+};
+
+static const struct qmi_tlv_desc string_desc[] = {
+	QMI_TLV_STRING(0x01, struct string_info, str, true),
+};
+
+struct ids_info {
+	bool esn_set;
+	char esn[32];
+	bool imei_set;
+	char imei[32];
+	bool meid_set;
+	char meid[32];
+};
+
+static const struct qmi_tlv_desc ids_desc[] = {
+	QMI_TLV_STRING(QMI_DMS_RESULT_ESN, struct ids_info, esn, false),
+	QMI_TLV_STRING(QMI_DMS_RESULT_IMEI, struct ids_info, imei, false),
+	QMI_TLV_STRING(QMI_DMS_RESULT_MEID, struct ids_info, meid, false),
+};
+
 static void string_cb(struct qmi_result *result, void *user_data)
 {
 	struct cb_data *cbd = user_data;
 	ofono_devinfo_query_cb_t cb = cbd->cb;
-	char *str;
+	struct string_info info;
 
 	DBG("");
 
@@ -52,15 +77,13 @@ static void string_cb(struct qmi_result *result, void *user_data)
 		return;
 	}
 
-	str = qmi_result_get_string(result, 0x01);
-	if (!str) {
+	if (qmi_result_parse(result, string_desc, G_N_ELEMENTS(string_desc),
+							&info) != NONE) {
 		CALLBACK_WITH_FAILURE(cb, NULL, cbd->data);
 		return;
 	}
 
-	CALLBACK_WITH_SUCCESS(cb, str, cbd->data);
-
-	qmi_free(str);
+	CALLBACK_WITH_SUCCESS(cb, info.str, cbd->data);
 }
 
 static void qmi_query_manufacturer(struct ofono_devinfo *devinfo,
@@ -120,10 +143,8 @@ static void get_ids_cb(struct qmi_result *result, void *user_data)
 	struct ofono_devinfo *devinfo = cbd->user;
 	struct devinfo_data *data = ofono_devinfo_get_data(devinfo);
 	ofono_devinfo_query_cb_t cb = cbd->cb;
-	char *esn;
-	char *imei;
-	char *meid;
-	char *str;
+	struct ids_info ids;
+	const char *str;
 
 	DBG("");
 
@@ -132,28 +153,22 @@ static void get_ids_cb(struct qmi_result *result, void *user_data)
 		return;
 	}
 
-	esn = qmi_result_get_string(result, QMI_DMS_RESULT_ESN);
-	imei = qmi_result_get_string(result, QMI_DMS_RESULT_IMEI);
-	meid = qmi_result_get_string(result, QMI_DMS_RESULT_MEID);
+	qmi_result_parse(result, ids_desc, G_N_ELEMENTS(ids_desc), &ids);
 
 	str = NULL;
 
-	if (data->device_is_3gpp && imei && strcmp(imei, "0"))
-		str = imei;
-	else if (esn && strcmp(esn, "0"))
-		str = esn;
+	if (data->device_is_3gpp && ids.imei_set && strcmp(ids.imei, "0"))
+		str = ids.imei;
+	else if (ids.esn_set && strcmp(ids.esn, "0"))
+		str = ids.esn;
 
-	if (str == NULL && meid && strcmp(meid, "0"))
-		str = meid;
+	if (str == NULL && ids.meid_set && strcmp(ids.meid, "0"))
+		str = ids.meid;
 
 	if (str)
 		CALLBACK_WITH_SUCCESS(cb, str, cbd->data);
 	else
 		CALLBACK_WITH_FAILURE(cb, NULL, cbd->data);
-
-	qmi_free(esn);
-	qmi_free(imei);
-	qmi_free(meid);
 }
 
 static void qmi_query_serial(struct ofono_devinfo *devinfo,
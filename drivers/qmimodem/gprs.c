@@ -44,15 +44,16 @@ struct gprs_data {
 static bool extract_ss_info(struct qmi_result *result, int *status, int *tech)
 {
 	const struct qmi_nas_serving_system *ss;
-	uint16_t len;
+	struct qmi_nas_ss_info info;
 	int i;
 
 	DBG("");
 
-	ss = qmi_result_get(result, QMI_NAS_RESULT_SERVING_SYSTEM, &len);
-	if (!ss)
+	if (qmi_nas_ss_info_parse(result, &info) != NONE)
 		return false;
 
+	ss = info.ss;
+
 	if (ss->ps_state == QMI_NAS_ATTACH_STATE_ATTACHED)
 		*status = NETWORK_REGISTRATION_STATUS_REGISTERED;
 	else
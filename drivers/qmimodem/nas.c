@@ -23,6 +23,47 @@
 
 #include "src/common.h"
 
+static const struct qmi_tlv_desc ss_info_desc[] = {
+	QMI_TLV_DATA(QMI_NAS_RESULT_SERVING_SYSTEM, struct qmi_nas_ss_info,
+			ss, true, sizeof(struct qmi_nas_serving_system)),
+	QMI_TLV_UINT8(QMI_NAS_RESULT_ROAMING_STATUS, struct qmi_nas_ss_info,
+			roaming_status, false),
+	QMI_TLV_DATA(QMI_NAS_RESULT_CURRENT_PLMN, struct qmi_nas_ss_info,
+			plmn, false, sizeof(struct qmi_nas_current_plmn)),
+	QMI_TLV_UINT8(QMI_NAS_RESULT_3GGP_DST, struct qmi_nas_ss_info,
+			dst_3gpp, false),
+	QMI_TLV_DATA(QMI_NAS_RESULT_3GPP_TIME, struct qmi_nas_ss_info,
+			time_3gpp, false, sizeof(struct qmi_nas_3gpp_time)),
+	QMI_TLV_UINT16(QMI_NAS_RESULT_LOCATION_AREA_CODE,
+			struct qmi_nas_ss_info, lac, false),
+	QMI_TLV_UINT32(QMI_NAS_RESULT_CELL_ID, struct qmi_nas_ss_info,
+			cellid, false),
+};
+
+enum parse_error qmi_nas_ss_info_parse(struct qmi_result *result,
+					struct qmi_nas_ss_info *info)
+{
+	enum parse_error err;
+
+	err = qmi_result_parse(result, ss_info_desc,
+				G_N_ELEMENTS(ss_info_desc), info);
+	if (err != NONE)
+		return err;
+
+	/* The radio interface list follows the fixed part */
+	if (info->ss_len < sizeof(struct qmi_nas_serving_system) +
+						info->ss->radio_if_count)
+		return INVALID_LENGTH;
+
+	/* Drop a truncated operator name rather than reading past it */
+	if (info->plmn_set && info->plmn_len <
+			sizeof(struct qmi_nas_current_plmn) +
+						info->plmn->desc_len)
+		info->plmn_set = false;
+
+	return NONE;
+}
+
 int qmi_nas_rat_to_tech(uint8_t rat)
 {
 	switch (rat) {
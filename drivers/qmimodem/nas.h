@@ -21,6 +21,8 @@
 
 #include <stdint.h>
 
+#include "qmi.h"
+
 #define QMI_NAS_RESET			0	/* Reset NAS service state variables */
 #define QMI_NAS_ABORT			1	/* Abort previously issued NAS command */
 #define QMI_NAS_EVENT			2	/* Connection state report indication */
@@ -209,5 +211,29 @@ struct qmi_nas_home_network {
 
 #define QMI_NAS_RESULT_SYSTEM_SELECTION_PREF_MODE	0x11
 
+/* Decoded serving system info, see qmi_nas_ss_info_parse */
+struct qmi_nas_ss_info {
+	bool ss_set;
+	uint16_t ss_len;
+	const struct qmi_nas_serving_system *ss;
+	bool roaming_status_set;
+	uint8_t roaming_status;
+	bool plmn_set;
+	uint16_t plmn_len;
+	const struct qmi_nas_current_plmn *plmn;
+	bool dst_3gpp_set;
+	uint8_t dst_3gpp;
+	bool time_3gpp_set;
+	uint16_t time_3gpp_len;
+	const struct qmi_nas_3gpp_time *time_3gpp;
+	bool lac_set;
+	uint16_t lac;
+	bool cellid_set;
+	uint32_t cellid;
+};
+
+enum parse_error qmi_nas_ss_info_parse(struct qmi_result *result,
+					struct qmi_nas_ss_info *info);
+
 int qmi_nas_rat_to_tech(uint8_t rat);
 int qmi_nas_cap_to_bearer_tech(int cap_tech);
@@ -53,22 +53,15 @@ enum roaming_status {
 	ROAMING_STATUS_NO_CHANGE,
 };
 
-static bool extract_ss_info_time(
-		struct qmi_result *result,
-		struct ofono_network_time *time)
+static bool extract_ss_info_time(const struct qmi_nas_ss_info *info,
+					struct ofono_network_time *time)
 {
-	const struct qmi_nas_3gpp_time *time_3gpp = NULL;
-	uint8_t dst_3gpp;
-	bool dst_3gpp_valid;
-	uint16_t len;
+	const struct qmi_nas_3gpp_time *time_3gpp = info->time_3gpp;
 
 	/* parse 3gpp time & dst */
-	dst_3gpp_valid = qmi_result_get_uint8(result, QMI_NAS_RESULT_3GGP_DST,
-						&dst_3gpp);
-
-	time_3gpp = qmi_result_get(result, QMI_NAS_RESULT_3GPP_TIME, &len);
-	if (time_3gpp && len == sizeof(struct qmi_nas_3gpp_time) &&
-			dst_3gpp_valid) {
+	if (info->time_3gpp_set &&
+			info->time_3gpp_len == sizeof(struct qmi_nas_3gpp_time) &&
+			info->dst_3gpp_set) {
 		time->year = le16toh(time_3gpp->year);
 		time->mon = time_3gpp->month;
 		time->mday = time_3gpp->day;
@@ -76,7 +69,7 @@ static bool extract_ss_info_time(
 		time->min = time_3gpp->minute;
 		time->sec = time_3gpp->second;
 		time->utcoff = time_3gpp->timezone * 15 * 60;
-		time->dst = dst_3gpp;
+		time->dst = info->dst_3gpp;
 		return true;
 	}
 
@@ -85,23 +78,18 @@ static bool extract_ss_info_time(
 	return false;
 }
 
-static bool extract_ss_info(struct qmi_result *result, int *status,
+static void extract_ss_info(const struct qmi_nas_ss_info *info, int *status,
 				int *lac, int *cellid, int *tech,
 				enum roaming_status *roaming,
 				struct ofono_network_operator *operator)
 {
-	const struct qmi_nas_serving_system *ss;
-	const struct qmi_nas_current_plmn *plmn;
-	uint8_t i, roaming_status;
-	uint16_t value16, len, opname_len;
-	uint32_t value32;
+	const struct qmi_nas_serving_system *ss = info->ss;
+	const struct qmi_nas_current_plmn *plmn = info->plmn;
+	uint8_t i;
+	uint16_t opname_len;
 
 	DBG("");
 
-	ss = qmi_result_get(result, QMI_NAS_RESULT_SERVING_SYSTEM, &len);
-	if (!ss)
-		return false;
-
 	*status = ss->status;
 
 	DBG("serving system status %d", ss->status);
@@ -115,19 +103,17 @@ static bool extract_ss_info(struct qmi_result *result, int *status,
 	}
 
 	*roaming = ROAMING_STATUS_NO_CHANGE;
-	if (qmi_result_get_uint8(result, QMI_NAS_RESULT_ROAMING_STATUS,
-							&roaming_status)) {
-		if (roaming_status == 0)
+	if (info->roaming_status_set) {
+		if (info->roaming_status == 0)
 			*roaming = ROAMING_STATUS_ON;
-		else if (roaming_status == 1)
+		else if (info->roaming_status == 1)
 			*roaming = ROAMING_STATUS_OFF;
 	}
 
 	if (!operator)
-		return true;
+		return;
 
-	plmn = qmi_result_get(result, QMI_NAS_RESULT_CURRENT_PLMN, &len);
-	if (plmn) {
+	if (info->plmn_set) {
 		uint16_t mcc = GUINT16_FROM_LE(plmn->mcc);
 		uint16_t mnc = GUINT16_FROM_LE(plmn->mnc);
 
@@ -159,21 +145,18 @@ static bool extract_ss_info(struct qmi_result *result, int *status,
 		DBG("%s (%s:%s)", operator->name, operator->mcc, operator->mnc);
 	}
 
-	if (qmi_result_get_uint16(result, QMI_NAS_RESULT_LOCATION_AREA_CODE,
-								&value16))
-		*lac = value16;
+	if (info->lac_set)
+		*lac = info->lac;
 	else
 		*lac = -1;
 
-	if (qmi_result_get_uint32(result, QMI_NAS_RESULT_CELL_ID, &value32))
-		*cellid = value32;
+	if (info->cellid_set)
+		*cellid = info->cellid;
 	else
 		*cellid = -1;
 
 	DBG("roaming %u lac %d cellid %d tech %d", *roaming, *lac, *cellid,
 									*tech);
-
-	return true;
 }
 
 static int remember_ss_info(struct netreg_data *data, int status, int lac,
@@ -206,18 +189,24 @@ static void ss_info_notify(struct qmi_result *result, void *user_data)
 	struct ofono_netreg *netreg = user_data;
 	struct ofono_network_time net_time;
 	struct netreg_data *data = ofono_netreg_get_data(netreg);
+	struct qmi_nas_ss_info info;
+	enum parse_error err;
 	int status, lac, cellid, tech;
 	enum roaming_status roaming;
 
 	DBG("");
 
-	if (extract_ss_info_time(result, &net_time))
+	err = qmi_nas_ss_info_parse(result, &info);
+
+	if (extract_ss_info_time(&info, &net_time))
 		ofono_netreg_time_notify(netreg, &net_time);
 
-	if (!extract_ss_info(result, &status, &lac, &cellid, &tech, &roaming,
-							&data->operator))
+	if (err != NONE)
 		return;
 
+	extract_ss_info(&info, &status, &lac, &cellid, &tech, &roaming,
+							&data->operator);
+
 	status = remember_ss_info(data, status, lac, cellid, roaming);
 
 	ofono_netreg_status_notify(netreg, status, data->lac, data->cellid,
@@ -229,6 +218,7 @@ static void get_ss_info_cb(struct qmi_result *result, void *user_data)
 	struct cb_data *cbd = user_data;
 	ofono_netreg_status_cb_t cb = cbd->cb;
 	struct netreg_data *data = cbd->user;
+	struct qmi_nas_ss_info info;
 	int status, lac, cellid, tech;
 	enum roaming_status roaming;
 
@@ -239,12 +229,14 @@ static void get_ss_info_cb(struct qmi_result *result, void *user_data)
 		return;
 	}
 
-	if (!extract_ss_info(result, &status, &lac, &cellid, &tech, &roaming,
-							&data->operator)) {
+	if (qmi_nas_ss_info_parse(result, &info) != NONE) {
 		CALLBACK_WITH_FAILURE(cb, -1, -1, -1, -1, cbd->data);
 		return;
 	}
 
+	extract_ss_info(&info, &status, &lac, &cellid, &tech, &roaming,
+							&data->operator);
+
 	status = remember_ss_info(data, status, lac, cellid, roaming);
 
 	CALLBACK_WITH_SUCCESS(cb, status, data->lac, data->cellid, tech,
@@ -280,13 +272,31 @@ static void qmi_current_operator(struct ofono_netreg *netreg,
 	CALLBACK_WITH_SUCCESS(cb, &data->operator, user_data);
 }
 
+struct scan_nets_info {
+	bool netlist_set;
+	uint16_t netlist_len;
+	const struct qmi_nas_network_list *netlist;
+	bool netrat_set;
+	uint16_t netrat_count;
+	const struct qmi_nas_network_rat *netrat;
+};
+
+static const struct qmi_tlv_desc scan_nets_desc[] = {
+	/* Entries carry their name, so they are walked in scan_nets_cb */
+	QMI_TLV_DATA(QMI_NAS_RESULT_NETWORK_LIST, struct scan_nets_info,
+			netlist, true, sizeof(struct qmi_nas_network_list)),
+	QMI_TLV_ARRAY(QMI_NAS_RESULT_NETWORK_RAT, struct scan_nets_info,
+			netrat, false, 2,
+			sizeof(((struct qmi_nas_network_rat *) 0)->info[0])),
+};
+
 static void scan_nets_cb(struct qmi_result *result, void *user_data)
 {
 	struct cb_data *cbd = user_data;
 	ofono_netreg_operator_list_cb_t cb = cbd->cb;
 	struct ofono_network_operator *list;
-	const struct qmi_nas_network_list *netlist;
 	const struct qmi_nas_network_rat *netrat;
+	struct scan_nets_info info;
 	const void *ptr;
 	uint16_t len, num, offset, i;
 
@@ -297,15 +307,15 @@ static void scan_nets_cb(struct qmi_result *result, void *user_data)
 		return;
 	}
 
-	ptr = qmi_result_get(result, QMI_NAS_RESULT_NETWORK_LIST, &len);
-	if (!ptr) {
+	if (qmi_result_parse(result, scan_nets_desc,
+				G_N_ELEMENTS(scan_nets_desc), &info) != NONE) {
 		CALLBACK_WITH_FAILURE(cb, 0, NULL, cbd->data);
 		return;
 	}
 
-	netlist = ptr;
-
-	num = GUINT16_FROM_LE(netlist->count);
+	ptr = info.netlist;
+	len = info.netlist_len;
+	num = GUINT16_FROM_LE(info.netlist->count);
 
 	DBG("found %d operators", num);
 
@@ -319,8 +329,21 @@ static void scan_nets_cb(struct qmi_result *result, void *user_data)
 
 	for (i = 0; i < num; i++) {
 		const struct qmi_nas_network_info *netinfo = ptr + offset;
-		uint16_t mcc = GUINT16_FROM_LE(netinfo->mcc);
-		uint16_t mnc = GUINT16_FROM_LE(netinfo->mnc);
+		uint16_t mcc, mnc;
+		uint8_t desc_len;
+
+		/* Keep the operators before a truncated entry */
+		if (offset + sizeof(*netinfo) > len ||
+				offset + sizeof(*netinfo) +
+						netinfo->desc_len > len) {
+			num = i;
+			break;
+		}
+
+		mcc = GUINT16_FROM_LE(netinfo->mcc);
+		mnc = GUINT16_FROM_LE(netinfo->mnc);
+		desc_len = MIN(netinfo->desc_len,
+					OFONO_MAX_OPERATOR_NAME_LENGTH);
 
 		if (mcc > 999)
 			mcc = 999;
@@ -330,8 +353,8 @@ static void scan_nets_cb(struct qmi_result *result, void *user_data)
 
 		snprintf(list[i].mcc, OFONO_MAX_MCC_LENGTH + 1, "%03d", mcc);
 		snprintf(list[i].mnc, OFONO_MAX_MNC_LENGTH + 1, "%03d", mnc);
-		strncpy(list[i].name, netinfo->desc, netinfo->desc_len);
-		list[i].name[netinfo->desc_len] = '\0';
+		memcpy(list[i].name, netinfo->desc, desc_len);
+		list[i].name[desc_len] = '\0';
 
 		if (netinfo->status & 0x10)
 			list[i].status = 3;
@@ -351,11 +374,8 @@ static void scan_nets_cb(struct qmi_result *result, void *user_data)
 							netinfo->desc_len;
 	}
 
-	netrat = qmi_result_get(result, QMI_NAS_RESULT_NETWORK_RAT, &len);
-	if (!netrat)
-		goto done;
-
-	if (GUINT16_FROM_LE(netrat->count) != num)
+	netrat = info.netrat;
+	if (!info.netrat_set || info.netrat_count != num)
 		goto done;
 
 	for (i = 0; i < num; i++) {
@@ -40,6 +40,9 @@
 
 #include <ofono/log.h>
 
+#include "frametrace.h"
+#include "latency.h"
+
 #include "qmi.h"
 #include "ctl.h"
 
@@ -79,12 +82,20 @@ struct qmi_device {
 	uint16_t next_service_tid;
 	qmi_debug_func_t debug_func;
 	void *debug_data;
+	struct frame_trace *trace;
+	struct latency_stats *stats;
 	uint16_t control_major;
 	uint16_t control_minor;
 	char *version_str;
 	struct qmi_version *version_list;
 	uint8_t version_count;
 	GHashTable *service_list;
+	GHashTable *notify_index;
+	GQueue *notify_dispatch;
+	char *discovery_cache;
+	char *discovery_identity;
+	bool discovery_cached;
+	bool discovery_stale;
 	unsigned int release_users;
 	qmi_shutdown_func_t shutdown_func;
 	void *shutdown_user_data;
@@ -103,7 +114,7 @@ struct qmi_service {
 	uint16_t minor;
 	uint8_t client_id;
 	uint16_t next_notify_id;
-	GList *notify_list;
+	GHashTable *notify_table;
 };
 
 struct qmi_param {
@@ -124,6 +135,7 @@ struct qmi_request {
 	uint8_t client;
 	void *buf;
 	size_t len;
+	uint64_t sent;
 	qmi_message_func_t callback;
 	void *user_data;
 };
@@ -134,8 +146,20 @@ struct qmi_notify {
 	qmi_result_func_t callback;
 	void *user_data;
 	qmi_destroy_func_t destroy;
+	struct qmi_device *device;
+	gpointer key;
+	GQueue *queue;
+	GList *link;
 };
 
+/*
+ * Indication handlers are indexed by service type, client id and message
+ * id, so an indication reaches its handlers with a single lookup.
+ */
+#define NOTIFY_KEY(type, client, message) \
+	GUINT_TO_POINTER((type) | ((client) << 8) | \
+				((unsigned int) (message) << 16))
+
 struct qmi_mux_hdr {
 	uint8_t  frame;		/* Always 0x01 */
 	uint16_t length;	/* Packet size without frame byte */
@@ -175,6 +199,7 @@ struct qrtr_service_create_data {
 	struct qmi_service *service;
 	qmi_create_func_t func;
 	void *user_data;
+	qmi_destroy_func_t destroy;
 };
 
 void qmi_free(void *ptr)
@@ -253,22 +278,54 @@ static void __discovery_free(gpointer data, gpointer user_data)
 	destroy(d);
 }
 
-static void __notify_free(gpointer data, gpointer user_data)
+static void __notify_detach(struct qmi_notify *notify)
+{
+	struct qmi_device *device = notify->device;
+
+	if (!notify->queue)
+		return;
+
+	if (notify->queue == device->notify_dispatch) {
+		/* Unregistered from a callback, service_notify sweeps it */
+		notify->link->data = NULL;
+		return;
+	}
+
+	g_queue_delete_link(notify->queue, notify->link);
+
+	if (g_queue_is_empty(notify->queue))
+		g_hash_table_remove(device->notify_index, notify->key);
+}
+
+static void __notify_free(gpointer data)
 {
 	struct qmi_notify *notify = data;
 
+	__notify_detach(notify);
+
 	if (notify->destroy)
 		notify->destroy(notify->user_data);
 
 	g_free(notify);
 }
 
-static gint __notify_compare(gconstpointer a, gconstpointer b)
+static void __notify_queue_free(gpointer data)
 {
-	const struct qmi_notify *notify = a;
-	uint16_t id = GPOINTER_TO_UINT(b);
+	GQueue *queue = data;
+	GList *list;
 
-	return notify->id - id;
+	/* The service owns the notify, only detach it from the index */
+	for (list = queue->head; list; list = list->next) {
+		struct qmi_notify *notify = list->data;
+
+		if (!notify)
+			continue;
+
+		notify->queue = NULL;
+		notify->link = NULL;
+	}
+
+	g_queue_free(queue);
 }
 
 static gboolean __service_compare_shared(gpointer key, gpointer value,
@@ -397,6 +454,16 @@ static const char *__service_type_to_string(uint8_t type)
 	return NULL;
 }
 
+static void __latency_format(uint32_t id, char *buf, size_t len)
+{
+	const char *service = __service_type_to_string(id >> 16);
+
+	if (service)
+		snprintf(buf, len, "%s 0x%04x", service, id & 0xffff);
+	else
+		snprintf(buf, len, "0x%02x 0x%04x", id >> 16, id & 0xffff);
+}
+
 static const struct {
 	uint16_t err;
 	const char *str;
@@ -675,6 +742,11 @@ static gboolean can_write_data(GIOChannel *channel, GIOCondition cond,
 	if (bytes_written < 0)
 		return FALSE;
 
+	frame_trace_record(device->trace, FRAME_TRACE_TX,
+				req->buf, bytes_written);
+
+	req->sent = latency_now();
+
 	__hexdump('>', req->buf, bytes_written,
 				device->debug_func, device->debug_data);
 
@@ -850,6 +922,10 @@ static void qrtr_request_submit(struct qmi_device *device,
 			req->len - QMI_MUX_HDR_SIZE))
 		DBG("Failed to send request");
 
+	frame_trace_record(device->trace, FRAME_TRACE_TX, req->buf, req->len);
+
+	req->sent = latency_now();
+
 	__hexdump('>', req->buf, req->len,
 				device->debug_func, device->debug_data);
 
@@ -898,6 +974,10 @@ static gboolean qrtr_service_create_callback(gpointer callback_data)
 
 	data->func(data->service, data->user_data);
 	qmi_service_unref(data->service);
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
 	g_free(data);
 	return FALSE;
 }
@@ -948,6 +1028,7 @@ static bool qrtr_service_create(struct qmi_device *device,
 	data->service = service;
 	data->func = func;
 	data->user_data = user_data;
+	data->destroy = destroy;
 
 	__debug_device(device, "service created [client=%d,type=%d,port=%u]",
 					service->client_id, service->type,
@@ -1004,28 +1085,48 @@ static uint16_t __request_submit(struct qmi_device *device,
 	return req->tid;
 }
 
-static void service_notify(gpointer key, gpointer value, gpointer user_data)
+static void service_notify(struct qmi_device *device, uint8_t type,
+				uint8_t client_id, struct qmi_result *result)
 {
-	struct qmi_service *service = value;
-	struct qmi_result *result = user_data;
+	gpointer key = NOTIFY_KEY(type, client_id, result->message);
+	GQueue *queue;
 	GList *list;
 
-	for (list = g_list_first(service->notify_list); list;
-						list = g_list_next(list)) {
+	queue = g_hash_table_lookup(device->notify_index, key);
+	if (!queue)
+		return;
+
+	/*
+	 * A callback may unregister any handler of this queue, so while
+	 * dispatching unregistered handlers only clear their link and are
+	 * unlinked once every callback has run.
+	 */
+	device->notify_dispatch = queue;
+
+	for (list = queue->head; list; list = list->next) {
 		struct qmi_notify *notify = list->data;
 
-		if (notify->message == result->message)
-			notify->callback(result, notify->user_data);
+		if (!notify)
+			continue;
+
+		notify->callback(result, notify->user_data);
 	}
+
+	device->notify_dispatch = NULL;
+
+	g_queue_remove_all(queue, NULL);
+
+	if (g_queue_is_empty(queue))
+		g_hash_table_remove(device->notify_index, key);
 }
 
 static void handle_indication(struct qmi_device *device,
 			uint8_t service_type, uint8_t client_id,
 			uint16_t message, uint16_t length, const void *data)
 {
-	struct qmi_service *service;
 	struct qmi_result result;
-	unsigned int hash_id;
+	GHashTableIter iter;
+	gpointer key, value;
 
 	if (service_type == QMI_SERVICE_CONTROL)
 		return;
@@ -1036,20 +1137,23 @@ static void handle_indication(struct qmi_device *device,
 	result.data = data;
 	result.length = length;
 
-	if (client_id == 0xff) {
-		g_hash_table_foreach(device->service_list,
-						service_notify, &result);
+	if (client_id != 0xff) {
+		service_notify(device, service_type, client_id, &result);
 		return;
 	}
 
-	hash_id = service_type | (client_id << 8);
+	/* Broadcast indication, deliver to every client of the service */
+	g_hash_table_iter_init(&iter, device->service_list);
 
-	service = g_hash_table_lookup(device->service_list,
-					GUINT_TO_POINTER(hash_id));
-	if (!service)
-		return;
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct qmi_service *service = value;
 
-	service_notify(NULL, service, &result);
+		if (service->type != service_type)
+			continue;
+
+		service_notify(device, service_type, service->client_id,
+								&result);
+	}
 }
 
 static void handle_packet(struct qmi_device *device,
@@ -1123,6 +1227,9 @@ static void handle_packet(struct qmi_device *device,
 		g_queue_delete_link(device->service_queue, list);
 	}
 
+	latency_stats_record(device->stats, hdr->service << 16 | message,
+								req->sent);
+
 	if (req->callback)
 		req->callback(message, length, data, req->user_data);
 
@@ -1145,6 +1252,8 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 	if (bytes_read < 0)
 		return TRUE;
 
+	frame_trace_record(device->trace, FRAME_TRACE_RX, buf, bytes_read);
+
 	__hexdump('<', buf, bytes_read,
 				device->debug_func, device->debug_data);
 
@@ -1261,9 +1370,17 @@ struct qmi_device *qmi_device_new(int fd)
 	device->service_list = g_hash_table_new_full(g_direct_hash,
 					g_direct_equal, NULL, service_destroy);
 
+	device->notify_index = g_hash_table_new_full(g_direct_hash,
+				g_direct_equal, NULL, __notify_queue_free);
+
 	device->next_control_tid = 1;
 	device->next_service_tid = 256;
 
+	device->trace = frame_trace_open(FRAME_TRACE_QMI);
+
+	device->stats = latency_stats_new("qmi");
+	latency_stats_set_format(device->stats, __latency_format);
+
 	return device;
 }
 
@@ -1311,6 +1428,8 @@ static gboolean qrtr_receive(GSocket *socket,
 	hdr->length = GUINT16_TO_LE(bytes_recv - 1);
 	hdr->flags = 0x80;
 
+	frame_trace_record(device->trace, FRAME_TRACE_RX, buf, bytes_recv);
+
 	__hexdump('<', (guchar *) buf, bytes_recv,
 	          device->debug_func, device->debug_data);
 
@@ -1367,9 +1486,17 @@ struct qmi_device *qmi_device_new_qrtr(int node)
 	device->service_list = g_hash_table_new_full(g_direct_hash,
 					g_direct_equal, NULL, service_destroy);
 
+	device->notify_index = g_hash_table_new_full(g_direct_hash,
+				g_direct_equal, NULL, __notify_queue_free);
+
 	device->next_control_tid = 1;
 	device->next_service_tid = 256;
 
+	device->trace = frame_trace_open(FRAME_TRACE_QMI);
+
+	device->stats = latency_stats_new("qmi");
+	latency_stats_set_format(device->stats, __latency_format);
+
 	return device;
 }
 
@@ -1418,9 +1545,15 @@ void qmi_device_unref(struct qmi_device *device)
 		g_source_remove(device->shutdown_source);
 
 	g_hash_table_destroy(device->service_list);
+	g_hash_table_destroy(device->notify_index);
 
 	g_free(device->version_str);
 	g_free(device->version_list);
+	g_free(device->discovery_cache);
+	g_free(device->discovery_identity);
+
+	frame_trace_close(device->trace);
+	latency_stats_free(device->stats);
 
 	if (device->shutting_down)
 		device->destroyed = true;
@@ -1547,11 +1680,11 @@ static void discover_data_free(gpointer user_data)
 	g_free(data);
 }
 
-static void discover_callback(uint16_t message, uint16_t length,
-					const void *buffer, void *user_data)
+static bool parse_version_info(struct qmi_device *device,
+				const void *buffer, uint16_t length,
+				struct qmi_version **out_list,
+				uint8_t *out_count, char **out_version)
 {
-	struct discover_data *data = user_data;
-	struct qmi_device *device = data->device;
 	const struct qmi_result_code *result_code;
 	const struct qmi_service_list *service_list;
 	const void *ptr;
@@ -1560,26 +1693,29 @@ static void discover_callback(uint16_t message, uint16_t length,
 	uint8_t count;
 	unsigned int i;
 
-	count = 0;
-	list = NULL;
+	*out_list = NULL;
+	*out_count = 0;
+	*out_version = NULL;
 
 	result_code = tlv_get(buffer, length, 0x02, &len);
 	if (!result_code)
-		goto done;
+		return false;
 
 	if (len != QMI_RESULT_CODE_SIZE)
-		goto done;
+		return false;
 
 	service_list = tlv_get(buffer, length, 0x01, &len);
 	if (!service_list)
-		goto done;
+		return false;
 
 	if (len < QMI_SERVICE_LIST_SIZE)
-		goto done;
+		return false;
 
 	list = g_try_malloc(sizeof(struct qmi_version) * service_list->count);
 	if (!list)
-		goto done;
+		return false;
+
+	count = 0;
 
 	for (i = 0; i < service_list->count; i++) {
 		uint16_t major =
@@ -1602,6 +1738,7 @@ static void discover_callback(uint16_t message, uint16_t length,
 			continue;
 		}
 
+		memset(&list[count], 0, sizeof(struct qmi_version));
 		list[count].type = type;
 		list[count].major = major;
 		list[count].minor = minor;
@@ -1610,13 +1747,223 @@ static void discover_callback(uint16_t message, uint16_t length,
 		count++;
 	}
 
+	*out_list = list;
+	*out_count = count;
+
 	ptr = tlv_get(buffer, length, 0x10, &len);
-	if (!ptr)
+	if (ptr)
+		*out_version = strndup(ptr + 1, *((uint8_t *) ptr));
+
+	return true;
+}
+
+/*
+ * The discovery cache stores the CTL version information of a device so
+ * that the next discovery can complete without waiting for the modem.
+ * The cached data is used optimistically and revalidated in the background,
+ * the user then has to confirm the identity of the device, see
+ * qmi_device_check_discovery_cache, before deriving anything from it.
+ */
+static bool discovery_cache_load(struct qmi_device *device)
+{
+	GKeyFile *keyfile;
+	char *identity = NULL;
+	char **services = NULL;
+	struct qmi_version *list = NULL;
+	uint8_t count = 0;
+	int control_major, control_minor;
+	gsize length = 0;
+	gsize i;
+	bool ret = false;
+
+	keyfile = g_key_file_new();
+
+	if (!g_key_file_load_from_file(keyfile, device->discovery_cache,
+						G_KEY_FILE_NONE, NULL))
+		goto done;
+
+	control_major = g_key_file_get_integer(keyfile, "Discovery",
+						"ControlMajor", NULL);
+	control_minor = g_key_file_get_integer(keyfile, "Discovery",
+						"ControlMinor", NULL);
+
+	identity = g_key_file_get_string(keyfile, "Discovery",
+						"Identity", NULL);
+	if (!identity || *identity == '\0')
+		goto done;
+
+	services = g_key_file_get_string_list(keyfile, "Discovery",
+						"Services", &length, NULL);
+	if (!services || length == 0 || length > 255)
 		goto done;
 
-	device->version_str = strndup(ptr + 1, *((uint8_t *) ptr));
+	list = g_try_new0(struct qmi_version, length);
+	if (!list)
+		goto done;
+
+	for (i = 0; i < length; i++) {
+		unsigned int type, major, minor;
+
+		if (sscanf(services[i], "%u:%u.%u", &type, &major, &minor) != 3)
+			goto done;
+
+		if (type == QMI_SERVICE_CONTROL || type > 255)
+			goto done;
+
+		list[count].type = type;
+		list[count].major = major;
+		list[count].minor = minor;
+		list[count].name = __service_type_to_string(type);
+
+		__debug_device(device, "cached service [%s %d.%d]",
+				list[count].name ?: "unknown", major, minor);
+
+		count++;
+	}
+
+	device->control_major = control_major;
+	device->control_minor = control_minor;
+	device->version_str = g_key_file_get_string(keyfile, "Discovery",
+							"Version", NULL);
+	device->version_list = list;
+	device->version_count = count;
+	list = NULL;
+
+	g_free(device->discovery_identity);
+	device->discovery_identity = identity;
+	identity = NULL;
+
+	device->discovery_cached = true;
+	device->discovery_stale = false;
+	ret = true;
 
 done:
+	g_free(list);
+	g_free(identity);
+	g_strfreev(services);
+	g_key_file_free(keyfile);
+
+	return ret;
+}
+
+static void discovery_cache_store(struct qmi_device *device)
+{
+	GKeyFile *keyfile;
+	char **services;
+	char *data;
+	gsize length;
+	unsigned int i;
+
+	if (!device->discovery_cache || !device->version_list ||
+					!device->discovery_identity)
+		return;
+
+	keyfile = g_key_file_new();
+
+	g_key_file_set_string(keyfile, "Discovery", "Identity",
+						device->discovery_identity);
+
+	g_key_file_set_integer(keyfile, "Discovery", "ControlMajor",
+						device->control_major);
+	g_key_file_set_integer(keyfile, "Discovery", "ControlMinor",
+						device->control_minor);
+
+	if (device->version_str)
+		g_key_file_set_string(keyfile, "Discovery", "Version",
+						device->version_str);
+
+	services = g_new0(char *, device->version_count + 1);
+
+	for (i = 0; i < device->version_count; i++)
+		services[i] = g_strdup_printf("%u:%u.%u",
+					device->version_list[i].type,
+					device->version_list[i].major,
+					device->version_list[i].minor);
+
+	g_key_file_set_string_list(keyfile, "Discovery", "Services",
+				(const char * const *) services,
+				device->version_count);
+
+	data = g_key_file_to_data(keyfile, &length, NULL);
+	if (data) {
+		if (!g_file_set_contents(device->discovery_cache, data,
+							length, NULL))
+			__debug_device(device, "discovery cache store failed");
+
+		g_free(data);
+	}
+
+	g_strfreev(services);
+	g_key_file_free(keyfile);
+}
+
+static bool version_list_equal(const struct qmi_version *a, uint8_t a_count,
+				const struct qmi_version *b, uint8_t b_count)
+{
+	unsigned int i;
+
+	if (a_count != b_count)
+		return false;
+
+	for (i = 0; i < a_count; i++) {
+		if (a[i].type != b[i].type || a[i].major != b[i].major ||
+						a[i].minor != b[i].minor)
+			return false;
+	}
+
+	return true;
+}
+
+static void revalidate_callback(uint16_t message, uint16_t length,
+					const void *buffer, void *user_data)
+{
+	struct qmi_device *device = user_data;
+	struct qmi_version *list;
+	uint8_t count;
+	char *version_str;
+
+	if (!parse_version_info(device, buffer, length,
+					&list, &count, &version_str)) {
+		__debug_device(device, "discovery revalidation failed");
+		return;
+	}
+
+	if (version_list_equal(device->version_list, device->version_count,
+						list, count) &&
+			g_strcmp0(device->version_str, version_str) == 0) {
+		__debug_device(device, "discovery cache valid");
+		g_free(list);
+		free(version_str);
+		return;
+	}
+
+	/*
+	 * Keep the cached list until the user checks the cache, so that
+	 * it drops everything derived from it and discovers again
+	 */
+	__debug_device(device, "discovery cache outdated");
+
+	device->discovery_stale = true;
+
+	g_free(list);
+	free(version_str);
+}
+
+static void discover_callback(uint16_t message, uint16_t length,
+					const void *buffer, void *user_data)
+{
+	struct discover_data *data = user_data;
+	struct qmi_device *device = data->device;
+	struct qmi_version *list;
+	uint8_t count;
+	char *version_str;
+
+	if (parse_version_info(device, buffer, length,
+					&list, &count, &version_str)) {
+		device->version_str = g_strdup(version_str);
+		free(version_str);
+	}
+
 	device->version_list = list;
 	device->version_count = count;
 
@@ -1667,6 +2014,57 @@ static gboolean discover_reply(gpointer user_data)
 	return FALSE;
 }
 
+void qmi_device_set_discovery_cache(struct qmi_device *device,
+							const char *path)
+{
+	if (!device)
+		return;
+
+	g_free(device->discovery_cache);
+	device->discovery_cache = g_strdup(path);
+}
+
+bool qmi_device_check_discovery_cache(struct qmi_device *device,
+						const char *identity)
+{
+	if (!device || !device->discovery_cache)
+		return true;
+
+	/* Fresh results, keep them for the next time */
+	if (!device->discovery_cached) {
+		if (!identity)
+			return true;
+
+		g_free(device->discovery_identity);
+		device->discovery_identity = g_strdup(identity);
+		discovery_cache_store(device);
+		return true;
+	}
+
+	if (!device->discovery_stale &&
+			g_strcmp0(identity, device->discovery_identity) == 0)
+		return true;
+
+	__debug_device(device, "discovery cache does not match the device");
+
+	unlink(device->discovery_cache);
+
+	g_free(device->version_list);
+	device->version_list = NULL;
+	device->version_count = 0;
+
+	g_free(device->version_str);
+	device->version_str = NULL;
+
+	g_free(device->discovery_identity);
+	device->discovery_identity = NULL;
+
+	device->discovery_cached = false;
+	device->discovery_stale = false;
+
+	return false;
+}
+
 bool qmi_device_discover(struct qmi_device *device, qmi_discover_func_t func,
 				void *user_data, qmi_destroy_func_t destroy)
 {
@@ -1695,6 +2093,20 @@ bool qmi_device_discover(struct qmi_device *device, qmi_discover_func_t func,
 		return true;
 	}
 
+	if (!device->socket && device->discovery_cache &&
+					discovery_cache_load(device)) {
+		__debug_device(device, "using cached discovery");
+
+		req = __request_alloc(QMI_SERVICE_CONTROL, 0x00,
+				QMI_CTL_GET_VERSION_INFO,
+				NULL, 0, revalidate_callback, device);
+		__request_submit(device, req);
+
+		data->timeout = g_timeout_add_seconds(0, discover_reply, data);
+		__qmi_device_discovery_started(device, &data->super);
+		return true;
+	}
+
 	if (device->socket) {
 		if (!qrtr_send_lookup(device->socket))
 		{
@@ -2329,6 +2741,135 @@ bool qmi_result_get_uint64(struct qmi_result *result, uint8_t type,
 	return true;
 }
 
+static bool tlv_decode(const struct qmi_tlv_desc *desc, const uint8_t *value,
+					uint16_t length, uint8_t *base)
+{
+	uint16_t u16;
+	uint32_t u32;
+	uint8_t *str;
+
+	if (length < desc->min_length)
+		return false;
+
+	switch (desc->kind) {
+	case QMI_TLV_KIND_UINT8:
+		*(uint8_t *) (base + desc->offset) = value[0];
+		break;
+	case QMI_TLV_KIND_UINT16:
+		memcpy(&u16, value, 2);
+		*(uint16_t *) (base + desc->offset) = GUINT16_FROM_LE(u16);
+		break;
+	case QMI_TLV_KIND_INT16:
+		memcpy(&u16, value, 2);
+		*(int16_t *) (base + desc->offset) = GINT16_FROM_LE(u16);
+		break;
+	case QMI_TLV_KIND_UINT32:
+		memcpy(&u32, value, 4);
+		*(uint32_t *) (base + desc->offset) = GUINT32_FROM_LE(u32);
+		break;
+	case QMI_TLV_KIND_DATA:
+		*(const void **) (base + desc->offset) = value;
+		*(uint16_t *) (base + desc->len_offset) = length;
+		break;
+	case QMI_TLV_KIND_STRING:
+		/* Room is needed for the terminating NUL */
+		if (length >= desc->size)
+			return false;
+
+		str = base + desc->offset;
+		memcpy(str, value, length);
+		str[length] = '\0';
+		break;
+	case QMI_TLV_KIND_ARRAY:
+		switch (desc->count_size) {
+		case 1:
+			u32 = value[0];
+			break;
+		case 2:
+			memcpy(&u16, value, 2);
+			u32 = GUINT16_FROM_LE(u16);
+			break;
+		case 4:
+			memcpy(&u32, value, 4);
+			u32 = GUINT32_FROM_LE(u32);
+			break;
+		default:
+			return false;
+		}
+
+		if ((uint64_t) u32 * desc->size > length - desc->count_size)
+			return false;
+
+		*(const void **) (base + desc->offset) = value;
+		*(uint16_t *) (base + desc->len_offset) = u32;
+		break;
+	default:
+		return false;
+	}
+
+	*(bool *) (base + desc->set_offset) = true;
+
+	return true;
+}
+
+enum parse_error qmi_result_parse(struct qmi_result *result,
+					const struct qmi_tlv_desc *desc,
+					unsigned int n_desc, void *out)
+{
+	uint8_t *base = out;
+	const void *ptr;
+	uint16_t len;
+	unsigned int i;
+	enum parse_error err = NONE;
+
+	if (!result || !desc || !out)
+		return MISSING_MANDATORY;
+
+	for (i = 0; i < n_desc; i++)
+		*(bool *) (base + desc[i].set_offset) = false;
+
+	ptr = result->data;
+	len = result->length;
+
+	/* Single pass over the TLVs, each one is matched against the table */
+	while (len > QMI_TLV_HDR_SIZE) {
+		const struct qmi_tlv_hdr *tlv = ptr;
+		uint16_t tlv_length = GUINT16_FROM_LE(tlv->length);
+
+		if (QMI_TLV_HDR_SIZE + tlv_length > len)
+			break;
+
+		for (i = 0; i < n_desc; i++) {
+			if (desc[i].type != tlv->type)
+				continue;
+
+			/* Like tlv_get, the first occurrence wins */
+			if (*(bool *) (base + desc[i].set_offset))
+				break;
+
+			if (!tlv_decode(&desc[i], tlv->value, tlv_length,
+							base) &&
+					desc[i].mandatory)
+				err = INVALID_LENGTH;
+
+			break;
+		}
+
+		ptr += QMI_TLV_HDR_SIZE + tlv_length;
+		len -= QMI_TLV_HDR_SIZE + tlv_length;
+	}
+
+	if (err != NONE)
+		return err;
+
+	for (i = 0; i < n_desc; i++) {
+		if (desc[i].mandatory && !*(bool *) (base + desc[i].set_offset))
+			return MISSING_MANDATORY;
+	}
+
+	return NONE;
+}
+
 struct service_create_data {
 	struct discovery super;
 	struct qmi_device *device;
@@ -2545,7 +3086,7 @@ bool qmi_service_create_shared(struct qmi_device *device,
 					service_create_shared_reply, data);
 		__qmi_device_discovery_started(device, &data->super);
 
-		return 0;
+		return true;
 	}
 
 	return service_create(device, type, func, user_data, destroy);
@@ -2559,6 +3100,135 @@ bool qmi_service_create(struct qmi_device *device,
 						user_data, destroy);
 }
 
+struct service_create_multi_data;
+
+struct service_create_multi_entry {
+	struct service_create_multi_data *multi;
+	unsigned int index;
+};
+
+struct service_create_multi_data {
+	qmi_create_multi_func_t func;
+	void *user_data;
+	qmi_destroy_func_t destroy;
+	unsigned int count;
+	unsigned int pending;
+	unsigned int completed;
+	struct qmi_service **services;
+	struct service_create_multi_entry *entries;
+};
+
+static void service_create_multi_unref(struct service_create_multi_data *data)
+{
+	unsigned int i;
+
+	if (--data->pending > 0)
+		return;
+
+	/*
+	 * Only report back if every single request has been answered,
+	 * otherwise the device went away while clients were allocated.
+	 */
+	if (data->completed == data->count)
+		data->func(data->services, data->user_data);
+
+	for (i = 0; i < data->count; i++)
+		qmi_service_unref(data->services[i]);
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	g_free(data->services);
+	g_free(data->entries);
+	g_free(data);
+}
+
+static void service_create_multi_callback(struct qmi_service *service,
+							void *user_data)
+{
+	struct service_create_multi_entry *entry = user_data;
+	struct service_create_multi_data *data = entry->multi;
+
+	data->services[entry->index] = qmi_service_ref(service);
+	data->completed++;
+}
+
+static void service_create_multi_destroy(void *user_data)
+{
+	struct service_create_multi_entry *entry = user_data;
+
+	service_create_multi_unref(entry->multi);
+}
+
+/*
+ * Allocate clients for several services at once.  The CTL client id
+ * requests are all submitted before the first reply arrives, the callback
+ * is called once all of them have completed, with the services in the
+ * same order as the requested types.  Failed services are NULL.
+ */
+bool qmi_service_create_shared_multi(struct qmi_device *device,
+				const uint8_t *types, unsigned int count,
+				qmi_create_multi_func_t func,
+				void *user_data, qmi_destroy_func_t destroy)
+{
+	struct service_create_multi_data *data;
+	unsigned int i;
+
+	if (!device || !types || !count || !func)
+		return false;
+
+	data = g_try_new0(struct service_create_multi_data, 1);
+	if (!data)
+		return false;
+
+	data->services = g_try_new0(struct qmi_service *, count);
+	data->entries = g_try_new0(struct service_create_multi_entry, count);
+	if (!data->services || !data->entries) {
+		g_free(data->services);
+		g_free(data->entries);
+		g_free(data);
+		return false;
+	}
+
+	data->func = func;
+	data->user_data = user_data;
+	data->count = count;
+
+	/* Hold an extra reference until all requests have been submitted */
+	data->pending = count + 1;
+
+	for (i = 0; i < count; i++) {
+		struct service_create_multi_entry *entry = &data->entries[i];
+
+		entry->multi = data;
+		entry->index = i;
+
+		if (qmi_service_create_shared(device, types[i],
+					service_create_multi_callback, entry,
+					service_create_multi_destroy))
+			continue;
+
+		/* Synchronous failure, no callback will follow */
+		data->completed++;
+		data->pending--;
+	}
+
+	if (data->pending == 1) {
+		for (i = 0; i < count; i++)
+			qmi_service_unref(data->services[i]);
+
+		g_free(data->services);
+		g_free(data->entries);
+		g_free(data);
+		return false;
+	}
+
+	data->destroy = destroy;
+	service_create_multi_unref(data);
+
+	return true;
+}
+
 static void service_release_callback(uint16_t message, uint16_t length,
 					const void *buffer, void *user_data)
 {
@@ -2815,11 +3485,24 @@ uint16_t qmi_service_register(struct qmi_service *service,
 				uint16_t message, qmi_result_func_t func,
 				void *user_data, qmi_destroy_func_t destroy)
 {
+	struct qmi_device *device;
 	struct qmi_notify *notify;
+	gpointer key;
 
 	if (!service || !func)
 		return 0;
 
+	device = service->device;
+	if (!device)
+		return 0;
+
+	if (!service->notify_table) {
+		service->notify_table = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, __notify_free);
+		if (!service->notify_table)
+			return 0;
+	}
+
 	notify = g_try_new0(struct qmi_notify, 1);
 	if (!notify)
 		return 0;
@@ -2832,8 +3515,22 @@ uint16_t qmi_service_register(struct qmi_service *service,
 	notify->callback = func;
 	notify->user_data = user_data;
 	notify->destroy = destroy;
+	notify->device = device;
+
+	key = NOTIFY_KEY(service->type, service->client_id, message);
+	notify->key = key;
+
+	notify->queue = g_hash_table_lookup(device->notify_index, key);
+	if (!notify->queue) {
+		notify->queue = g_queue_new();
+		g_hash_table_insert(device->notify_index, key, notify->queue);
+	}
+
+	g_queue_push_tail(notify->queue, notify);
+	notify->link = g_queue_peek_tail_link(notify->queue);
 
-	service->notify_list = g_list_append(service->notify_list, notify);
+	g_hash_table_insert(service->notify_table,
+				GUINT_TO_POINTER(notify->id), notify);
 
 	return notify->id;
 }
@@ -2841,24 +3538,16 @@ uint16_t qmi_service_register(struct qmi_service *service,
 bool qmi_service_unregister(struct qmi_service *service, uint16_t id)
 {
 	unsigned int nid = id;
-	struct qmi_notify *notify;
-	GList *list;
 
 	if (!service || !id)
 		return false;
 
-	list = g_list_find_custom(service->notify_list,
-				GUINT_TO_POINTER(nid), __notify_compare);
-	if (!list)
+	if (!service->notify_table)
 		return false;
 
-	notify = list->data;
-
-	service->notify_list = g_list_delete_link(service->notify_list, list);
-
-	__notify_free(notify, NULL);
-
-	return true;
+	/* The table's destroy function detaches the notify from the index */
+	return g_hash_table_remove(service->notify_table,
+						GUINT_TO_POINTER(nid));
 }
 
 bool qmi_service_unregister_all(struct qmi_service *service)
@@ -2866,10 +3555,10 @@ bool qmi_service_unregister_all(struct qmi_service *service)
 	if (!service)
 		return false;
 
-	g_list_foreach(service->notify_list, __notify_free, NULL);
-	g_list_free(service->notify_list);
-
-	service->notify_list = NULL;
+	if (service->notify_table) {
+		g_hash_table_destroy(service->notify_table);
+		service->notify_table = NULL;
+	}
 
 	return true;
 }
@@ -23,6 +23,7 @@
 #define __OFONO_QMI_QMI_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <gio/gio.h>
 
@@ -95,6 +96,11 @@ void qmi_device_set_debug(struct qmi_device *device,
 
 void qmi_device_set_close_on_unref(struct qmi_device *device, bool do_close);
 
+void qmi_device_set_discovery_cache(struct qmi_device *device,
+							const char *path);
+bool qmi_device_check_discovery_cache(struct qmi_device *device,
+						const char *identity);
+
 bool qmi_device_discover(struct qmi_device *device, qmi_discover_func_t func,
 				void *user_data, qmi_destroy_func_t destroy);
 bool qmi_device_shutdown(struct qmi_device *device, qmi_shutdown_func_t func,
@@ -167,6 +173,14 @@ bool qmi_service_create_shared(struct qmi_device *device,
 				uint8_t type, qmi_create_func_t func,
 				void *user_data, qmi_destroy_func_t destroy);
 
+typedef void (*qmi_create_multi_func_t)(struct qmi_service **services,
+							void *user_data);
+
+bool qmi_service_create_shared_multi(struct qmi_device *device,
+				const uint8_t *types, unsigned int count,
+				qmi_create_multi_func_t func,
+				void *user_data, qmi_destroy_func_t destroy);
+
 struct qmi_service *qmi_service_ref(struct qmi_service *service);
 void qmi_service_unref(struct qmi_service *service);
 
@@ -195,4 +209,68 @@ enum parse_error {
 	INVALID_LENGTH = 2,
 };
 
+/*
+ * Table driven TLV decoding.  A message is described by an array of
+ * struct qmi_tlv_desc, each entry naming the TLV type, how to decode it
+ * and where to store it.  For a field "foo" the target structure has a
+ * "bool foo_set" member and, for data TLVs, a "uint16_t foo_len" member.
+ * Data TLVs are not copied, they point into the result buffer and are
+ * only valid for the lifetime of the result.
+ *
+ * String TLVs are copied into a "char foo[]" member and NUL terminated,
+ * a string that does not fit is treated as having the wrong length.
+ * Array TLVs are a little endian count of count_size bytes followed by
+ * that many elements of a fixed size.  Like data TLVs they point into the
+ * result buffer, the count is checked against the TLV length and stored
+ * in host order in a "uint16_t foo_count" member.
+ */
+enum qmi_tlv_kind {
+	QMI_TLV_KIND_UINT8,
+	QMI_TLV_KIND_UINT16,
+	QMI_TLV_KIND_INT16,
+	QMI_TLV_KIND_UINT32,
+	QMI_TLV_KIND_DATA,
+	QMI_TLV_KIND_STRING,
+	QMI_TLV_KIND_ARRAY,
+};
+
+struct qmi_tlv_desc {
+	uint8_t type;
+	uint8_t kind;
+	bool mandatory;
+	uint16_t min_length;
+	uint16_t offset;
+	uint16_t set_offset;
+	uint16_t len_offset;	/* data length or array count */
+	uint16_t size;		/* string capacity or array element size */
+	uint8_t count_size;	/* bytes in the count of an array */
+};
+
+#define QMI_TLV_DESC(t, k, m, st, field, min) \
+	{ (t), (k), (m), (min), offsetof(st, field), \
+				offsetof(st, field##_set), 0 }
+
+#define QMI_TLV_UINT8(t, st, field, m) \
+	QMI_TLV_DESC(t, QMI_TLV_KIND_UINT8, m, st, field, 1)
+#define QMI_TLV_UINT16(t, st, field, m) \
+	QMI_TLV_DESC(t, QMI_TLV_KIND_UINT16, m, st, field, 2)
+#define QMI_TLV_INT16(t, st, field, m) \
+	QMI_TLV_DESC(t, QMI_TLV_KIND_INT16, m, st, field, 2)
+#define QMI_TLV_UINT32(t, st, field, m) \
+	QMI_TLV_DESC(t, QMI_TLV_KIND_UINT32, m, st, field, 4)
+#define QMI_TLV_DATA(t, st, field, m, min) \
+	{ (t), QMI_TLV_KIND_DATA, (m), (min), offsetof(st, field), \
+		offsetof(st, field##_set), offsetof(st, field##_len) }
+#define QMI_TLV_STRING(t, st, field, m) \
+	{ (t), QMI_TLV_KIND_STRING, (m), 0, offsetof(st, field), \
+		offsetof(st, field##_set), 0, sizeof(((st *) 0)->field) }
+#define QMI_TLV_ARRAY(t, st, field, m, count_size, elem_size) \
+	{ (t), QMI_TLV_KIND_ARRAY, (m), (count_size), offsetof(st, field), \
+		offsetof(st, field##_set), offsetof(st, field##_count), \
+		(elem_size), (count_size) }
+
+enum parse_error qmi_result_parse(struct qmi_result *result,
+					const struct qmi_tlv_desc *desc,
+					unsigned int n_desc, void *out);
+
 #endif /* __OFONO_QMI_QMI_H */
@@ -478,11 +478,24 @@ done:
 	data->msg_list_chk = false;
 }
 
+struct msg_list_info {
+	bool list_set;
+	uint16_t list_count;
+	const struct qmi_wms_result_msg_list *list;
+};
+
+static const struct qmi_tlv_desc msg_list_desc[] = {
+	QMI_TLV_ARRAY(QMI_WMS_RESULT_MSG_LIST, struct msg_list_info, list,
+		true, 4,
+		sizeof(((struct qmi_wms_result_msg_list *) 0)->msg[0])),
+};
+
 static void get_msg_list_cb(struct qmi_result *result, void *user_data)
 {
 	struct ofono_sms *sms = user_data;
 	struct sms_data *data = ofono_sms_get_data(sms);
 	const struct qmi_wms_result_msg_list *list;
+	struct msg_list_info info;
 	uint32_t cnt = 0;
 	uint16_t tmp;
 
@@ -494,13 +507,14 @@ static void get_msg_list_cb(struct qmi_result *result, void *user_data)
 		goto done;
 	}
 
-	list = qmi_result_get(result, QMI_WMS_RESULT_MSG_LIST, NULL);
-	if (list == NULL) {
+	if (qmi_result_parse(result, msg_list_desc,
+				G_N_ELEMENTS(msg_list_desc), &info) != NONE) {
 		DBG("Err: get msg list empty");
 		goto done;
 	}
 
-	cnt = GUINT32_FROM_LE(list->cnt);
+	list = info.list;
+	cnt = info.list_count;
 	DBG("msgs found %d", cnt);
 
 	for (tmp = 0; tmp < cnt; tmp++) {
@@ -610,25 +624,51 @@ static void get_msg_protocol(struct ofono_sms *sms)
 				get_msg_protocol_cb, sms, NULL);
 }
 
+struct event_report {
+	bool notify_set;
+	uint16_t notify_len;
+	const struct qmi_wms_result_new_msg_notify *notify;
+	bool message_set;
+	uint16_t message_len;
+	const struct qmi_wms_result_message *message;
+	bool msg_mode_set;
+	uint8_t msg_mode;
+};
+
+static const struct qmi_tlv_desc event_report_desc[] = {
+	QMI_TLV_DATA(QMI_WMS_RESULT_NEW_MSG_NOTIFY, struct event_report,
+		notify, false, sizeof(struct qmi_wms_result_new_msg_notify)),
+	QMI_TLV_DATA(QMI_WMS_RESULT_MESSAGE, struct event_report,
+		message, false, sizeof(struct qmi_wms_result_message)),
+	QMI_TLV_UINT8(QMI_WMS_RESULT_MSG_MODE, struct event_report,
+		msg_mode, false),
+};
+
 static void event_notify(struct qmi_result *result, void *user_data)
 {
 	struct ofono_sms *sms = user_data;
 	struct sms_data *data = ofono_sms_get_data(sms);
-	const struct qmi_wms_result_new_msg_notify *notify;
+	struct event_report report;
 
 	DBG("");
 
+	qmi_result_parse(result, event_report_desc,
+				G_N_ELEMENTS(event_report_desc), &report);
+
 	/*
 	 * The 2 types of MT message TLVs are mutually exclusive, depending on
 	 * how the route action is configured. If action is store and notify,
 	 * then the MT message TLV is sent. If action is transfer only or
 	 * transfer and ack, then the transfer route MT message TLV is sent.
 	 */
-	notify = qmi_result_get(result, QMI_WMS_RESULT_NEW_MSG_NOTIFY, NULL);
-	if (notify) {
+	if (report.notify_set) {
+		const struct qmi_wms_result_new_msg_notify *notify =
+								report.notify;
+
 		/* route is store and notify */
-		if (!qmi_result_get_uint8(result, QMI_WMS_RESULT_MSG_MODE,
-						&data->msg_mode))
+		if (report.msg_mode_set)
+			data->msg_mode = report.msg_mode;
+		else
 			DBG("msg mode not found, use mode %d", data->msg_mode);
 
 		DBG("msg type %d ndx %d mode %d", notify->storage_type,
@@ -638,25 +678,25 @@ static void event_notify(struct qmi_result *result, void *user_data)
 		if (!data->msg_list_chk)
 			raw_read(sms, notify->storage_type,
 					GUINT32_FROM_LE(notify->storage_index));
-	} else {
+	} else if (report.message_set) {
 		/* route is either transfer only or transfer and ACK */
-		const struct qmi_wms_result_message *message;
-
-		message = qmi_result_get(result, QMI_WMS_RESULT_MESSAGE, NULL);
-		if (message) {
-			uint16_t plen;
+		const struct qmi_wms_result_message *message = report.message;
+		uint16_t plen;
 
-			plen = GUINT16_FROM_LE(message->msg_length);
+		plen = GUINT16_FROM_LE(message->msg_length);
 
-			DBG("ack_required %d transaction id %u",
-				message->ack_required,
-				GUINT32_FROM_LE(message->transaction_id));
-			DBG("msg format %d PDU length %d",
-				message->msg_format, plen);
+		DBG("ack_required %d transaction id %u",
+			message->ack_required,
+			GUINT32_FROM_LE(message->transaction_id));
+		DBG("msg format %d PDU length %d",
+			message->msg_format, plen);
 
-			ofono_sms_deliver_notify(sms, message->msg_data,
-							plen, plen);
+		if (report.message_len < sizeof(*message) + plen) {
+			DBG("truncated message TLV");
+			return;
 		}
+
+		ofono_sms_deliver_notify(sms, message->msg_data, plen, plen);
 	}
 }
 
@@ -689,6 +729,21 @@ static void set_routes_cb(struct qmi_result *result, void *user_data)
 	get_msg_protocol(sms);
 }
 
+struct routes_info {
+	bool list_set;
+	uint16_t list_count;
+	const struct qmi_wms_route_list *list;
+	bool status_report_set;
+	uint8_t status_report;
+};
+
+static const struct qmi_tlv_desc routes_desc[] = {
+	QMI_TLV_ARRAY(QMI_WMS_RESULT_ROUTE_LIST, struct routes_info, list,
+		true, 2, sizeof(((struct qmi_wms_route_list *) 0)->route[0])),
+	QMI_TLV_UINT8(QMI_WMS_RESULT_STATUS_REPORT, struct routes_info,
+		status_report, false),
+};
+
 static void get_routes_cb(struct qmi_result *result, void *user_data)
 {
 	struct ofono_sms *sms = user_data;
@@ -696,19 +751,20 @@ static void get_routes_cb(struct qmi_result *result, void *user_data)
 	const struct qmi_wms_route_list *list;
 	struct qmi_wms_route_list *new_list;
 	struct qmi_param *param;
+	struct routes_info info;
 	uint16_t len, num, i;
-	uint8_t value;
 
 	DBG("");
 
 	if (qmi_result_set_error(result, NULL))
 		goto done;
 
-	list = qmi_result_get(result, QMI_WMS_RESULT_ROUTE_LIST, &len);
-        if (!list)
+	if (qmi_result_parse(result, routes_desc, G_N_ELEMENTS(routes_desc),
+							&info) != NONE)
 		goto done;
 
-	num = GUINT16_FROM_LE(list->count);
+	list = info.list;
+	num = info.list_count;
 
 	DBG("found %d routes", num);
 
@@ -719,8 +775,8 @@ static void get_routes_cb(struct qmi_result *result, void *user_data)
 					list->route[i].storage_type,
 					list->route[i].action);
 
-	if (qmi_result_get_uint8(result, QMI_WMS_RESULT_STATUS_REPORT, &value))
-		DBG("transfer status report %d", value);
+	if (info.status_report_set)
+		DBG("transfer status report %d", info.status_report);
 
 	len = 2 + (1 * 4);
 	new_list = alloca(len);
@@ -839,6 +895,7 @@ static void qmi_sms_remove(struct ofono_sms *sms)
 
 static const struct ofono_sms_driver driver = {
 	.name		= "qmimodem",
+	.max_pending_submits	= 4,
 	.probe		= qmi_sms_probe,
 	.remove		= qmi_sms_remove,
 	.sca_query	= qmi_sca_query,
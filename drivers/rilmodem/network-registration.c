@@ -532,30 +532,39 @@ static void ril_cops_list_cb(struct ril_msg *message, gpointer user_data)
 	ops = g_new0(struct ofono_network_operator, num_ops);
 
 	for (i = 0; num_ops; num_ops--) {
+		char lalpha_buf[OFONO_MAX_OPERATOR_NAME_LENGTH + 1];
+		char salpha_buf[OFONO_MAX_OPERATOR_NAME_LENGTH + 1];
+		char numeric_buf[16];
+		char status_buf[16];
 		char *lalpha;
 		char *salpha;
 		char *numeric;
 		char *status;
 		int tech = -1;
 
-		lalpha = parcel_r_string(&rilp);
-		salpha = parcel_r_string(&rilp);
-		numeric = parcel_r_string(&rilp);
-		status = parcel_r_string(&rilp);
+		/* Lists can be long, decode straight into stack buffers */
+		lalpha = parcel_r_string_buf(&rilp, lalpha_buf,
+						sizeof(lalpha_buf));
+		salpha = parcel_r_string_buf(&rilp, salpha_buf,
+						sizeof(salpha_buf));
+		numeric = parcel_r_string_buf(&rilp, numeric_buf,
+						sizeof(numeric_buf));
+		status = parcel_r_string_buf(&rilp, status_buf,
+						sizeof(status_buf));
 
 		/*
 		 * MTK: additional string with technology: 2G/3G are the only
 		 * valid values currently.
 		 */
 		if (g_ril_vendor(nd->ril) == OFONO_RIL_VENDOR_MTK) {
-			char *t = parcel_r_string(&rilp);
+			char t_buf[8];
+			char *t = parcel_r_string_buf(&rilp, t_buf,
+							sizeof(t_buf));
 
-			if (strcmp(t, "3G") == 0)
+			if (t && strcmp(t, "3G") == 0)
 				tech = ACCESS_TECHNOLOGY_UTRAN;
 			else
 				tech = ACCESS_TECHNOLOGY_GSM;
-
-			g_free(t);
 		}
 
 		if (lalpha == NULL && salpha == NULL)
@@ -587,10 +596,6 @@ next:
 				" numeric=%s status=%s]",
 				print_buf,
 				lalpha, salpha, numeric, status);
-		g_free(lalpha);
-		g_free(salpha);
-		g_free(numeric);
-		g_free(status);
 	}
 
 	g_ril_append_print_buf(nd->ril, "%s}", print_buf);
@@ -1482,6 +1482,7 @@ static void ril_sim_remove(struct ofono_sim *sim)
 
 static const struct ofono_sim_driver driver = {
 	.name			= RILMODEM,
+	.max_pending_reads	= 4,
 	.probe			= ril_sim_probe,
 	.remove			= ril_sim_remove,
 	.read_file_info		= ril_sim_read_info,
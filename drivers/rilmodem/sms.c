@@ -333,10 +333,12 @@ static void ril_cmgs(struct ofono_sms *sms, const unsigned char *pdu,
 	struct parcel rilp;
 	int smsc_len;
 	char hexbuf[tpdu_len * 2 + 1];
+	int request;
 
 	DBG("pdu_len: %d, tpdu_len: %d mms: %d", pdu_len, tpdu_len, mms);
 
-	/* TODO: if (mms) { ... } */
+	/* Keeps the link open for the messages that follow, like +CMMS */
+	request = mms ? RIL_REQUEST_SEND_SMS_EXPECT_MORE : RIL_REQUEST_SEND_SMS;
 
 	parcel_init(&rilp);
 	parcel_w_int32(&rilp, 2);	/* Number of strings */
@@ -368,7 +370,7 @@ static void ril_cmgs(struct ofono_sms *sms, const unsigned char *pdu,
 
 	g_ril_append_print_buf(sd->ril, "(%s)", hexbuf);
 
-	if (g_ril_send(sd->ril, RIL_REQUEST_SEND_SMS, &rilp,
+	if (g_ril_send(sd->ril, request, &rilp,
 			ril_submit_sms_cb, cbd, g_free) > 0)
 		return;
 
@@ -504,6 +506,7 @@ static void ril_sms_remove(struct ofono_sms *sms)
 
 static const struct ofono_sms_driver driver = {
 	.name		= RILMODEM,
+	.max_pending_submits	= 2,
 	.probe		= ril_sms_probe,
 	.sca_query	= ril_csca_query,
 	.sca_set	= ril_csca_set,
@@ -0,0 +1,270 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include <glib.h>
+
+#include "frametrace.h"
+
+#define ALIGN8(x) (((x) + 7) & ~7U)
+
+static const char *const transport_names[] = {
+	[FRAME_TRACE_AT] = "at",
+	[FRAME_TRACE_QMI] = "qmi",
+	[FRAME_TRACE_RIL] = "ril",
+	[FRAME_TRACE_ISI] = "isi",
+};
+
+struct frame_trace {
+	int fd;				/* Held open for the lock */
+	struct frame_trace_header *hdr;
+	uint8_t *ring;
+	size_t map_size;
+	unsigned int snaplen;
+};
+
+static unsigned int ring_size(void)
+{
+	const char *str = getenv("OFONO_TRACE_SIZE");
+	unsigned long kib;
+	char *end;
+
+	if (str == NULL)
+		return FRAME_TRACE_RING_SIZE;
+
+	kib = strtoul(str, &end, 10);
+	if (*end != '\0' || kib < 64 || kib > 65536)
+		return FRAME_TRACE_RING_SIZE;
+
+	return kib * 1024;
+}
+
+/*
+ * Each transport has FRAME_TRACE_MAX_FILES files, locked while in use.
+ * Returns the unused one that was written to least recently, so the
+ * traces of the last runs, including one that crashed, stay around.
+ */
+static int open_slot(const char *dir, enum frame_trace_transport transport)
+{
+	int best = -1;
+	time_t best_mtime = 0;
+	unsigned int i;
+
+	for (i = 0; i < FRAME_TRACE_MAX_FILES; i++) {
+		struct stat st;
+		char *path;
+		int fd;
+
+		path = g_strdup_printf("%s/%s-%u.trace", dir,
+					transport_names[transport], i);
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		g_free(path);
+
+		if (fd < 0)
+			continue;
+
+		if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0) {
+			close(fd);
+			continue;
+		}
+
+		/* A file that was just created has never been used */
+		if (st.st_size == 0)
+			st.st_mtime = 0;
+
+		if (best >= 0 && st.st_mtime >= best_mtime) {
+			close(fd);
+			continue;
+		}
+
+		if (best >= 0)
+			close(best);
+
+		best = fd;
+		best_mtime = st.st_mtime;
+	}
+
+	return best;
+}
+
+struct frame_trace *frame_trace_open(enum frame_trace_transport transport)
+{
+	const char *dir = getenv("OFONO_TRACE_DIR");
+	struct frame_trace *trace;
+	unsigned int size;
+	void *map;
+	int fd;
+
+	if (dir == NULL || *dir == '\0')
+		return NULL;
+
+	if (g_mkdir_with_parents(dir, 0700) < 0)
+		return NULL;
+
+	fd = open_slot(dir, transport);
+	if (fd < 0)
+		return NULL;
+
+	size = ring_size();
+
+	/*
+	 * The blocks are reserved up front, a full disk then disables
+	 * tracing here instead of raising SIGBUS on a store into the ring
+	 */
+	if (ftruncate(fd, 0) < 0 || posix_fallocate(fd, 0,
+				sizeof(struct frame_trace_header) + size) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, sizeof(struct frame_trace_header) + size,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	trace = g_new0(struct frame_trace, 1);
+	trace->fd = fd;
+	trace->hdr = map;
+	trace->ring = (uint8_t *) map + sizeof(struct frame_trace_header);
+	trace->map_size = sizeof(struct frame_trace_header) + size;
+	trace->snaplen = MIN(FRAME_TRACE_SNAPLEN, size / 4);
+
+	trace->hdr->version = FRAME_TRACE_VERSION;
+	trace->hdr->transport = transport;
+	trace->hdr->size = size;
+	trace->hdr->snaplen = trace->snaplen;
+	trace->hdr->magic = FRAME_TRACE_MAGIC;
+
+	return trace;
+}
+
+void frame_trace_close(struct frame_trace *trace)
+{
+	if (trace == NULL)
+		return;
+
+	munmap(trace->hdr, trace->map_size);
+	close(trace->fd);
+	g_free(trace);
+}
+
+/* Drops the oldest records until len more bytes fit in the ring */
+static void make_room(struct frame_trace *trace, unsigned int len)
+{
+	struct frame_trace_header *hdr = trace->hdr;
+
+	while (hdr->head + len - hdr->tail > hdr->size) {
+		struct frame_trace_record *rec;
+
+		rec = (void *) (trace->ring + hdr->tail % hdr->size);
+		hdr->tail += rec->size;
+	}
+}
+
+void frame_trace_recordv(struct frame_trace *trace, enum frame_trace_dir dir,
+				uint16_t tag, const struct iovec *iov,
+				unsigned int iovcnt)
+{
+	struct frame_trace_header *hdr;
+	struct frame_trace_record *rec;
+	unsigned int len = 0;
+	unsigned int caplen;
+	unsigned int need;
+	unsigned int room;
+	struct timespec ts;
+	uint8_t *dst;
+	unsigned int i;
+
+	if (trace == NULL)
+		return;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	hdr = trace->hdr;
+	caplen = MIN(len, trace->snaplen);
+	need = ALIGN8(sizeof(struct frame_trace_record) + caplen);
+	room = hdr->size - hdr->head % hdr->size;
+
+	/* Records never wrap, pad out the end of the ring instead */
+	if (room < need) {
+		make_room(trace, room);
+
+		rec = (void *) (trace->ring + hdr->head % hdr->size);
+		rec->size = room;
+		rec->type = FRAME_TRACE_PAD;
+		hdr->head += room;
+	}
+
+	make_room(trace, need);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	rec = (void *) (trace->ring + hdr->head % hdr->size);
+	rec->type = FRAME_TRACE_FRAME;
+	rec->dir = dir;
+	rec->tag = tag;
+	rec->len = len;
+	rec->caplen = caplen;
+	rec->timestamp = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	dst = (uint8_t *) (rec + 1);
+
+	for (i = 0; i < iovcnt && caplen > 0; i++) {
+		unsigned int n = MIN(iov[i].iov_len, caplen);
+
+		memcpy(dst, iov[i].iov_base, n);
+		dst += n;
+		caplen -= n;
+	}
+
+	/* Publish the record last so a live reader never sees it half done */
+	rec->size = need;
+	hdr->head += need;
+	hdr->frames++;
+}
+
+void frame_trace_record(struct frame_trace *trace, enum frame_trace_dir dir,
+				const void *data, unsigned int len)
+{
+	struct iovec iov = {
+		.iov_base = (void *) data,
+		.iov_len = len,
+	};
+
+	if (trace == NULL)
+		return;
+
+	frame_trace_recordv(trace, dir, 0, &iov, 1);
+}
@@ -0,0 +1,116 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Binary frame trace shared by the modem transports.
+ *
+ * Tracing is enabled by pointing OFONO_TRACE_DIR at a directory, for
+ * example /run/ofono/trace. Each transport instance then maps a file
+ * of the form <transport>-<n>.trace and appends raw frames to a ring
+ * inside it. There are FRAME_TRACE_MAX_FILES files per transport, an
+ * instance takes the one not in use that was written to least recently,
+ * so the space used stays bounded across restarts and reconnects.
+ * Recording a frame is a timestamp and a memcpy into the mapping,
+ * nothing is formatted on the hot path, and the kernel keeps the data
+ * even if ofonod crashes. tools/trace-decode renders the files offline.
+ *
+ * The file is a struct frame_trace_header followed by a ring of
+ * FRAME_TRACE_RING_SIZE bytes (or OFONO_TRACE_SIZE KiB). Records are
+ * 8 byte aligned and never wrap; the unused tail of the ring is
+ * covered by a FRAME_TRACE_PAD record instead. head and tail are
+ * logical byte offsets, the physical offset is the value modulo size.
+ */
+
+#define FRAME_TRACE_MAGIC 0x5254464f	/* "OFTR" */
+#define FRAME_TRACE_VERSION 1
+#define FRAME_TRACE_RING_SIZE (1024 * 1024)
+#define FRAME_TRACE_SNAPLEN 2048
+#define FRAME_TRACE_MAX_FILES 4
+
+enum frame_trace_transport {
+	FRAME_TRACE_AT = 1,
+	FRAME_TRACE_QMI = 2,
+	FRAME_TRACE_RIL = 3,
+	FRAME_TRACE_ISI = 4,
+};
+
+enum frame_trace_dir {
+	FRAME_TRACE_RX = 0,
+	FRAME_TRACE_TX = 1,
+};
+
+enum frame_trace_type {
+	FRAME_TRACE_FRAME = 1,
+	FRAME_TRACE_PAD = 2,
+};
+
+struct frame_trace_header {
+	uint32_t magic;
+	uint16_t version;
+	uint8_t transport;
+	uint8_t reserved;
+	uint32_t size;		/* Ring size in bytes */
+	uint32_t snaplen;	/* Longest frame prefix recorded */
+	uint64_t head;		/* Logical offset of the next record */
+	uint64_t tail;		/* Logical offset of the oldest record */
+	uint64_t frames;	/* Frames recorded since the file was made */
+	uint8_t padding[24];
+} __attribute__ ((packed));
+
+struct frame_trace_record {
+	uint32_t size;		/* Record size including header, aligned */
+	uint8_t type;
+	uint8_t dir;
+	uint16_t tag;		/* Transport specific, e.g. PhoNet address */
+	uint32_t len;		/* Length of the frame on the wire */
+	uint32_t caplen;	/* Bytes of the frame following the header */
+	uint64_t timestamp;	/* CLOCK_MONOTONIC in nanoseconds */
+} __attribute__ ((packed));
+
+struct frame_trace;
+
+/*!
+ * Opens a trace file for a transport instance.  Returns NULL if tracing
+ * is disabled or no file is available, the other
+ * frame_trace functions accept NULL and do nothing in that case
+ */
+struct frame_trace *frame_trace_open(enum frame_trace_transport transport);
+
+/*!
+ * Unmaps and unlocks the trace file, the file itself is left for
+ * decoding until a later instance reuses it
+ */
+void frame_trace_close(struct frame_trace *trace);
+
+/*!
+ * Records a frame of len bytes, only the first snaplen bytes are stored
+ */
+void frame_trace_record(struct frame_trace *trace, enum frame_trace_dir dir,
+				const void *data, unsigned int len);
+
+/*!
+ * Records a frame gathered from iovcnt buffers, with a transport specific
+ * tag stored alongside it
+ */
+void frame_trace_recordv(struct frame_trace *trace, enum frame_trace_dir dir,
+				uint16_t tag, const struct iovec *iov,
+				unsigned int iovcnt);
@@ -33,6 +33,7 @@
 #include <glib.h>
 
 #include "ringbuffer.h"
+#include "latency.h"
 #include "gatchat.h"
 #include "gatio.h"
 
@@ -56,6 +57,7 @@ struct at_command {
 	GAtNotifyFunc listing;
 	gpointer user_data;
 	GDestroyNotify notify;
+	guint64 sent;				/* When writing started */
 };
 
 struct at_notify_node {
@@ -103,6 +105,7 @@ struct at_chat {
 	gboolean in_notify;
 	GSList *terminator_list;		/* Non-standard terminator */
 	guint16 terminator_blacklist;		/* Blacklisted terinators */
+	struct latency_stats *stats;		/* Round trip histograms */
 };
 
 struct _GAtChat {
@@ -360,6 +363,9 @@ static void chat_cleanup(struct at_chat *chat)
 		g_slist_free_full(chat->terminator_list, free_terminator);
 		chat->terminator_list = NULL;
 	}
+
+	latency_stats_free(chat->stats);
+	chat->stats = NULL;
 }
 
 static void io_disconnect(gpointer user_data)
@@ -431,6 +437,35 @@ static gboolean at_chat_match_notify(struct at_chat *chat, char *line)
 	return ret;
 }
 
+/*
+ * Names a command for the latency statistics: the extended command name
+ * such as "+CSQ", or just the letter of a basic command so that dial
+ * strings and other arguments never end up in the report.
+ */
+static void command_name(const char *cmd, char *buf, size_t size)
+{
+	size_t len = 0;
+
+	if (g_ascii_strncasecmp(cmd, "AT", 2) == 0)
+		cmd += 2;
+
+	if (g_ascii_isalpha(cmd[0])) {
+		buf[len++] = g_ascii_toupper(cmd[0]);
+	} else if (cmd[0] != '\0' && cmd[0] != '\r') {
+		buf[len++] = *cmd++;
+
+		while (g_ascii_isalnum(*cmd) && len < size - 1)
+			buf[len++] = g_ascii_toupper(*cmd++);
+	}
+
+	if (len == 0) {
+		g_strlcpy(buf, "AT", size);
+		return;
+	}
+
+	buf[len] = '\0';
+}
+
 static void at_chat_finish_command(struct at_chat *p, gboolean ok, char *final)
 {
 	struct at_command *cmd = g_queue_pop_head(p->command_queue);
@@ -442,6 +477,13 @@ static void at_chat_finish_command(struct at_chat *p, gboolean ok, char *final)
 
 	p->cmd_bytes_written = 0;
 
+	if (p->stats != NULL && cmd->sent != 0) {
+		char name[LATENCY_NAME_LEN];
+
+		command_name(cmd->cmd, name, sizeof(name));
+		latency_stats_record_name(p->stats, name, cmd->sent);
+	}
+
 	if (g_queue_peek_head(p->command_queue))
 		chat_wakeup_writer(p);
 
@@ -904,6 +946,9 @@ static gboolean can_write_data(gpointer data)
 	if (bytes_written == 0)
 		return FALSE;
 
+	if (chat->cmd_bytes_written == 0)
+		cmd->sent = latency_now();
+
 	chat->cmd_bytes_written += bytes_written;
 
 	if (bytes_written < towrite)
@@ -1315,6 +1360,8 @@ static struct at_chat *create_chat(GIOChannel *channel, GIOFlags flags,
 
 	chat->syntax = g_at_syntax_ref(syntax);
 
+	chat->stats = latency_stats_new("at");
+
 	return chat;
 
 error:
@@ -33,6 +33,7 @@
 #include <glib.h>
 
 #include "ringbuffer.h"
+#include "frametrace.h"
 #include "gatio.h"
 #include "gatutil.h"
 
@@ -55,6 +56,7 @@ struct _GAtIO {
 	GAtDisconnectFunc write_done_func;	/* tx empty notifier */
 	gpointer write_done_data;		/* tx empty data */
 	gboolean destroyed;			/* Re-entrancy guard */
+	struct frame_trace *trace;		/* Binary frame trace */
 };
 
 static void read_watcher_destroy_notify(gpointer user_data)
@@ -64,6 +66,9 @@ static void read_watcher_destroy_notify(gpointer user_data)
 	ring_buffer_free(io->buf);
 	io->buf = NULL;
 
+	frame_trace_close(io->trace);
+	io->trace = NULL;
+
 	io->debugf = NULL;
 	io->debug_data = NULL;
 
@@ -112,8 +117,11 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 
 		total_read += rbytes;
 
-		if (rbytes > 0)
+		if (rbytes > 0) {
+			frame_trace_record(io->trace, FRAME_TRACE_RX,
+						buf, rbytes);
 			ring_buffer_write_advance(io->buf, rbytes);
+		}
 
 	} while (status == G_IO_STATUS_NORMAL && rbytes > 0 &&
 					read_count < io->max_read_attempts);
@@ -150,6 +158,8 @@ gsize g_at_io_write(GAtIO *io, const gchar *data, gsize count)
 	g_at_util_debug_chat(FALSE, data, bytes_written,
 				io->debugf, io->debug_data);
 
+	frame_trace_record(io->trace, FRAME_TRACE_TX, data, bytes_written);
+
 	return bytes_written;
 }
 
@@ -218,6 +228,8 @@ static GAtIO *create_io(GIOChannel *channel, GIOFlags flags)
 				received_data, io,
 				read_watcher_destroy_notify);
 
+	io->trace = frame_trace_open(FRAME_TRACE_AT);
+
 	return io;
 
 error:
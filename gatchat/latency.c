@@ -0,0 +1,353 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+/* Distinct commands tracked per instance, the rest are lumped together */
+#define MAX_COMMANDS 128
+#define TABLE_SIZE 256
+#define OVERFLOW_ID 0xffffffff
+
+struct latency_entry {
+	uint32_t id;
+	char name[LATENCY_NAME_LEN];
+	struct latency_hist hist;
+};
+
+struct latency_stats {
+	char *transport;
+	char *owner;
+	latency_format_func_t format;
+	unsigned int count;
+	struct latency_entry *table[TABLE_SIZE];
+	struct latency_entry *overflow;
+	struct latency_stats *next;
+};
+
+static struct latency_stats *stats_list;
+static char *current_owner;
+
+void latency_set_owner(const char *owner)
+{
+	free(current_owner);
+	current_owner = owner ? strdup(owner) : NULL;
+}
+
+struct latency_stats *latency_stats_new(const char *transport)
+{
+	struct latency_stats *stats;
+
+	stats = calloc(1, sizeof(struct latency_stats));
+	if (stats == NULL)
+		return NULL;
+
+	stats->transport = strdup(transport);
+	stats->owner = current_owner ? strdup(current_owner) : NULL;
+
+	stats->next = stats_list;
+	stats_list = stats;
+
+	return stats;
+}
+
+void latency_stats_set_format(struct latency_stats *stats,
+				latency_format_func_t format)
+{
+	if (stats == NULL)
+		return;
+
+	stats->format = format;
+}
+
+void latency_stats_free(struct latency_stats *stats)
+{
+	struct latency_stats **pp;
+	unsigned int i;
+
+	if (stats == NULL)
+		return;
+
+	for (pp = &stats_list; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == stats) {
+			*pp = stats->next;
+			break;
+		}
+	}
+
+	for (i = 0; i < TABLE_SIZE; i++)
+		free(stats->table[i]);
+
+	free(stats->overflow);
+	free(stats->transport);
+	free(stats->owner);
+	free(stats);
+}
+
+uint64_t latency_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + 1;
+}
+
+static unsigned int bucket_index(uint32_t usec)
+{
+	unsigned int msb;
+
+	if (usec < (1U << LATENCY_SUB_BITS))
+		return usec;
+
+	msb = 31 - __builtin_clz(usec);
+
+	return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+		((usec >> (msb - LATENCY_SUB_BITS)) &
+					((1U << LATENCY_SUB_BITS) - 1));
+}
+
+uint32_t latency_bucket_lower(unsigned int idx)
+{
+	unsigned int msb;
+	unsigned int sub;
+
+	if (idx < (1U << LATENCY_SUB_BITS))
+		return idx;
+
+	msb = (idx >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+	sub = idx & ((1U << LATENCY_SUB_BITS) - 1);
+
+	return ((1U << LATENCY_SUB_BITS) + sub) << (msb - LATENCY_SUB_BITS);
+}
+
+uint32_t latency_hist_percentile(const struct latency_hist *hist,
+					unsigned int percent)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = ((uint64_t) hist->count * percent + 99) / 100;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += hist->buckets[i];
+
+		if (seen < rank || seen == 0)
+			continue;
+
+		/* The bucket ends where the next one starts */
+		if (i + 1 < LATENCY_BUCKETS &&
+				latency_bucket_lower(i + 1) - 1 < hist->max)
+			return latency_bucket_lower(i + 1) - 1;
+
+		break;
+	}
+
+	return hist->max;
+}
+
+static void hist_add(struct latency_hist *hist, uint64_t start)
+{
+	uint64_t elapsed = latency_now() - start;
+	uint32_t usec = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+
+	hist->buckets[bucket_index(usec)]++;
+	hist->count++;
+	hist->sum += usec;
+
+	if (usec > hist->max)
+		hist->max = usec;
+}
+
+static struct latency_entry *entry_new(struct latency_stats *stats,
+					uint32_t id, const char *name)
+{
+	struct latency_entry *entry;
+
+	if (stats->count >= MAX_COMMANDS) {
+		if (stats->overflow == NULL) {
+			stats->overflow = calloc(1, sizeof(*entry));
+			if (stats->overflow == NULL)
+				return NULL;
+
+			stats->overflow->id = OVERFLOW_ID;
+			strcpy(stats->overflow->name, "other");
+		}
+
+		return stats->overflow;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		return NULL;
+
+	entry->id = id;
+
+	if (name != NULL)
+		strncpy(entry->name, name, LATENCY_NAME_LEN - 1);
+
+	stats->count++;
+
+	return entry;
+}
+
+/* Open addressing, ids are spread with a multiplicative hash */
+static struct latency_entry *lookup(struct latency_stats *stats,
+					uint32_t id, const char *name)
+{
+	unsigned int slot = (id * 2654435761U) >> 24;
+	unsigned int i;
+
+	for (i = 0; i < TABLE_SIZE; i++) {
+		struct latency_entry *entry;
+
+		entry = stats->table[(slot + i) % TABLE_SIZE];
+
+		if (entry == NULL) {
+			entry = entry_new(stats, id, name);
+
+			if (entry != NULL && entry != stats->overflow)
+				stats->table[(slot + i) % TABLE_SIZE] = entry;
+
+			return entry;
+		}
+
+		if (entry->id != id)
+			continue;
+
+		if (name == NULL ||
+				strncmp(entry->name, name,
+					LATENCY_NAME_LEN - 1) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+void latency_stats_record(struct latency_stats *stats, uint32_t id,
+				uint64_t start)
+{
+	struct latency_entry *entry;
+
+	if (stats == NULL || start == 0)
+		return;
+
+	entry = lookup(stats, id, NULL);
+	if (entry != NULL)
+		hist_add(&entry->hist, start);
+}
+
+void latency_stats_record_name(struct latency_stats *stats,
+				const char *name, uint64_t start)
+{
+	struct latency_entry *entry;
+	uint32_t id = 2166136261U;
+	const char *p;
+
+	if (stats == NULL || start == 0)
+		return;
+
+	/* FNV-1a over the part of the name that is kept */
+	for (p = name; *p != '\0' && p - name < LATENCY_NAME_LEN - 1; p++)
+		id = (id ^ (uint8_t) *p) * 16777619U;
+
+	entry = lookup(stats, id, name);
+	if (entry != NULL)
+		hist_add(&entry->hist, start);
+}
+
+static int owner_matches(const struct latency_stats *stats,
+				const char *owner)
+{
+	if (stats->owner == NULL || owner == NULL)
+		return 1;
+
+	return strcmp(stats->owner, owner) == 0;
+}
+
+static void report_entry(const struct latency_stats *stats,
+				const struct latency_entry *entry,
+				latency_foreach_func_t func, void *user_data)
+{
+	char name[LATENCY_NAME_LEN + 16];
+
+	if (entry->hist.count == 0)
+		return;
+
+	if (entry->name[0] != '\0')
+		strcpy(name, entry->name);
+	else if (stats->format != NULL)
+		stats->format(entry->id, name, sizeof(name));
+	else
+		snprintf(name, sizeof(name), "0x%x", entry->id);
+
+	func(stats->transport, name, &entry->hist, user_data);
+}
+
+void latency_foreach(const char *owner, latency_foreach_func_t func,
+			void *user_data)
+{
+	struct latency_stats *stats;
+	unsigned int i;
+
+	for (stats = stats_list; stats != NULL; stats = stats->next) {
+		if (!owner_matches(stats, owner))
+			continue;
+
+		for (i = 0; i < TABLE_SIZE; i++)
+			if (stats->table[i] != NULL)
+				report_entry(stats, stats->table[i],
+						func, user_data);
+
+		if (stats->overflow != NULL)
+			report_entry(stats, stats->overflow, func, user_data);
+	}
+}
+
+void latency_reset(const char *owner)
+{
+	struct latency_stats *stats;
+	unsigned int i;
+
+	for (stats = stats_list; stats != NULL; stats = stats->next) {
+		if (!owner_matches(stats, owner))
+			continue;
+
+		for (i = 0; i < TABLE_SIZE; i++)
+			if (stats->table[i] != NULL)
+				memset(&stats->table[i]->hist, 0,
+					sizeof(struct latency_hist));
+
+		if (stats->overflow != NULL)
+			memset(&stats->overflow->hist, 0,
+				sizeof(struct latency_hist));
+	}
+}
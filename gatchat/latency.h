@@ -0,0 +1,116 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Request/response latency histograms for the modem transports.
+ *
+ * Each transport instance owns a struct latency_stats and records the
+ * round trip of every command into a log-linear histogram keyed by
+ * command: four linear buckets per power of two microseconds, so the
+ * relative error is bounded by 25% from 1us up to over an hour. This
+ * only depends on libc so it can be used from both GLib and ell based
+ * transports.
+ *
+ * Instances are kept on a global list tagged with the owner that was
+ * current when they were created, see latency_set_owner(), so that
+ * the core can report them per modem.
+ */
+
+#define LATENCY_SUB_BITS 2
+#define LATENCY_BUCKETS ((32 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+#define LATENCY_NAME_LEN 24
+
+struct latency_hist {
+	uint32_t buckets[LATENCY_BUCKETS];
+	uint32_t count;
+	uint32_t max;		/* Microseconds */
+	uint64_t sum;		/* Microseconds */
+};
+
+struct latency_stats;
+
+typedef void (*latency_format_func_t)(uint32_t id, char *buf, size_t len);
+typedef void (*latency_foreach_func_t)(const char *transport,
+					const char *command,
+					const struct latency_hist *hist,
+					void *user_data);
+
+/*!
+ * Sets the owner that latency_stats_new() tags new instances with, NULL
+ * to clear it.  The string is copied
+ */
+void latency_set_owner(const char *owner);
+
+/*!
+ * Creates the statistics of one transport instance, e.g. "qmi"
+ */
+struct latency_stats *latency_stats_new(const char *transport);
+
+/*!
+ * Sets how numeric command ids are named in reports.  The default is
+ * the id in hex
+ */
+void latency_stats_set_format(struct latency_stats *stats,
+				latency_format_func_t format);
+
+void latency_stats_free(struct latency_stats *stats);
+
+/*!
+ * Returns a monotonic timestamp in microseconds to pass as start.  Never
+ * returns 0 so callers can use 0 for "not sent yet"
+ */
+uint64_t latency_now(void);
+
+/*!
+ * Records a round trip that began at start for a numeric command id
+ */
+void latency_stats_record(struct latency_stats *stats, uint32_t id,
+				uint64_t start);
+
+/*!
+ * Records a round trip that began at start for a named command
+ */
+void latency_stats_record_name(struct latency_stats *stats,
+				const char *name, uint64_t start);
+
+/*!
+ * Calls func for every command of every instance tagged with owner or
+ * with no owner at all.  Instances of other owners are skipped
+ */
+void latency_foreach(const char *owner, latency_foreach_func_t func,
+			void *user_data);
+
+/*!
+ * Clears the histograms of the instances latency_foreach would report
+ */
+void latency_reset(const char *owner);
+
+/*!
+ * Returns the smallest latency in microseconds counted by bucket idx
+ */
+uint32_t latency_bucket_lower(unsigned int idx);
+
+/*!
+ * Returns an upper bound of the given percentile in microseconds
+ */
+uint32_t latency_hist_percentile(const struct latency_hist *hist,
+					unsigned int percent);
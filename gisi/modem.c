@@ -40,14 +40,30 @@
 #include "common.h"
 #include "modem.h"
 #include "socket.h"
+#include "frametrace.h"
 
 #define ISIDBG(m, fmt, ...)				\
 	if ((m) != NULL && (m)->debug != NULL)		\
 		m->debug("gisi: "fmt, ##__VA_ARGS__);
 
+/* Request timeouts have a one second resolution, one slot per second */
+#define TIMER_WHEEL_SLOTS 64
+
+/*
+ * Receive batching: up to ISI_RX_BATCH datagrams are read per syscall.
+ * Each slot fits the largest PhoNet datagram; since the kernel only
+ * writes what it receives, the pages of unused slot tails are never
+ * touched and stay unbacked.
+ */
+#define ISI_RX_BATCH 16
+#define ISI_RX_SLOT_SIZE 65536
+#define ISI_RX_ROUNDS 4
+
 struct _GIsiServiceMux {
 	GIsiModem *modem;
-	GSList *pending;
+	GIsiPending *resps[256];	/* Pending RESPs by UTID */
+	GSList *subs[256];		/* REQ, IND and NTF by message ID */
+	GSList *pings;			/* Pending version queries */
 	GIsiVersion version;
 	uint8_t resource;
 	uint8_t last_utid;
@@ -72,13 +88,22 @@ struct _GIsiModem {
 	GIsiNotifyFunc trace;
 	void *opaque;
 	unsigned long flags;
+	GQueue wheel[TIMER_WHEEL_SLOTS];
+	unsigned wheel_tick;
+	unsigned wheel_count;
+	guint wheel_source;
+	gboolean *wheel_destroyed;
+	uint8_t *rx_buf;
+	gboolean *rx_destroyed;
+	struct frame_trace *frames;
 };
 
 struct _GIsiPending {
 	enum GIsiMessageType type;
 	GIsiServiceMux *service;
 	gpointer owner;
-	guint timeout;
+	GList *timer;		/* Link in the timer wheel, if any */
+	unsigned expires;	/* Wheel tick the timer fires on */
 	GIsiNotifyFunc notify;
 	GDestroyNotify destroy;
 	void *data;
@@ -111,12 +136,102 @@ static GIsiServiceMux *service_get(GIsiModem *modem, uint8_t resource)
 	return mux;
 }
 
-static gint utid_equal(gconstpointer a, gconstpointer b)
+static gboolean service_utid_busy(GIsiServiceMux *mux, uint8_t utid)
 {
-	const GIsiPending *pa = a;
-	const GIsiPending *pb = b;
+	GSList *l;
+
+	if (mux->resps[utid] != NULL)
+		return TRUE;
 
-	return pa->utid - pb->utid;
+	for (l = mux->pings; l != NULL; l = l->next) {
+		GIsiPending *ping = l->data;
+
+		if (ping->utid == utid)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void pending_link(GIsiPending *op)
+{
+	GIsiServiceMux *mux = op->service;
+
+	switch (op->type) {
+	case GISI_MESSAGE_TYPE_RESP:
+		mux->resps[op->utid] = op;
+		break;
+	case GISI_MESSAGE_TYPE_COMMON:
+		mux->pings = g_slist_prepend(mux->pings, op);
+		break;
+	case GISI_MESSAGE_TYPE_REQ:
+	case GISI_MESSAGE_TYPE_IND:
+	case GISI_MESSAGE_TYPE_NTF:
+		/* Handlers are notified in the order they subscribed */
+		mux->subs[op->msgid] = g_slist_append(mux->subs[op->msgid],
+							op);
+		break;
+	}
+}
+
+static void pending_unlink(GIsiPending *op)
+{
+	GIsiServiceMux *mux = op->service;
+
+	switch (op->type) {
+	case GISI_MESSAGE_TYPE_RESP:
+		if (mux->resps[op->utid] == op)
+			mux->resps[op->utid] = NULL;
+		break;
+	case GISI_MESSAGE_TYPE_COMMON:
+		mux->pings = g_slist_remove(mux->pings, op);
+		break;
+	case GISI_MESSAGE_TYPE_REQ:
+	case GISI_MESSAGE_TYPE_IND:
+	case GISI_MESSAGE_TYPE_NTF:
+		mux->subs[op->msgid] = g_slist_remove(mux->subs[op->msgid],
+							op);
+		break;
+	}
+}
+
+static gboolean timer_wheel_tick(gpointer data);
+
+/*
+ * All request timeouts of a modem share one timer wheel driven by a
+ * single one second source, which only runs while timers are armed.
+ */
+static void pending_timer_start(GIsiPending *op, unsigned seconds)
+{
+	GIsiModem *modem = op->service->modem;
+	GQueue *slot;
+
+	/* Round up, part of the current tick has already passed */
+	op->expires = modem->wheel_tick + seconds + 1;
+	slot = &modem->wheel[op->expires % TIMER_WHEEL_SLOTS];
+
+	g_queue_push_tail(slot, op);
+	op->timer = slot->tail;
+	modem->wheel_count++;
+
+	if (modem->wheel_source == 0)
+		modem->wheel_source = g_timeout_add_seconds(1,
+						timer_wheel_tick, modem);
+}
+
+static void pending_timer_stop(GIsiPending *op)
+{
+	GIsiModem *modem;
+
+	if (op->timer == NULL)
+		return;
+
+	modem = op->service->modem;
+
+	g_queue_delete_link(&modem->wheel[op->expires % TIMER_WHEEL_SLOTS],
+				op->timer);
+	op->timer = NULL;
+	modem->wheel_count--;
 }
 
 static const char *pend_type_to_str(enum GIsiMessageType type)
@@ -157,7 +272,8 @@ static void pending_remove_and_dispatch(GIsiPending *op, GIsiMessage *msg)
 {
 	GIsiModem *modem;
 
-	op->service->pending = g_slist_remove(op->service->pending, op);
+	pending_unlink(op);
+	pending_timer_stop(op);
 
 	if (op->notify == NULL || msg == NULL)
 		goto destroy;
@@ -173,9 +289,6 @@ static void pending_remove_and_dispatch(GIsiPending *op, GIsiMessage *msg)
 	op->notify(msg, op->data);
 
 destroy:
-	if (op->timeout > 0)
-		g_source_remove(op->timeout);
-
 	if (op->destroy != NULL)
 		op->destroy(op->data);
 
@@ -187,47 +300,50 @@ static void service_dispatch(GIsiServiceMux *mux, GIsiMessage *msg,
 {
 	uint8_t msgid = g_isi_msg_id(msg);
 	uint8_t utid = g_isi_msg_utid(msg);
+	GIsiPending *resp;
+	GSList *l;
+	GSList *next;
 
-	GSList *l = mux->pending;
-
-	while (l != NULL) {
-		GSList *next = l->next;
-		GIsiPending *pend = l->data;
-
-		/*
-		 * REQs, NTFs and INDs are dispatched on message ID.  While
-		 * INDs have the unique transaction ID set to zero, NTFs
-		 * typically mirror the UTID of the request that set up the
-		 * session, and REQs can naturally have any transaction ID.
-		 *
-		 * RESPs are dispatched on unique transaction ID, explicitly
-		 * ignoring the msgid.  A RESP also completes a transaction,
-		 * so it needs to be removed after being notified of.
-		 *
-		 * Version query responses are dispatched in a similar fashion
-		 * as RESPs, but based on the pending type and the message ID.
-		 * Some of these may be synthesized, but nevertheless need to
-		 * be removed.
-		 */
-		if (pend->type < GISI_MESSAGE_TYPE_RESP
-				&& pend->msgid == msgid) {
-
-			pending_dispatch(pend, msg);
+	/*
+	 * Version query responses are dispatched based on the pending
+	 * type and the message ID rather than the transaction ID. Some
+	 * of these may be synthesized, but nevertheless need to be
+	 * removed. Detach the list first, a handler may ping again.
+	 */
+	if (msgid == COMMON_MESSAGE && mux->pings != NULL) {
+		GSList *pings = mux->pings;
 
-		} else if (pend->type == GISI_MESSAGE_TYPE_RESP &&
-				!is_indication && pend->utid == utid) {
+		mux->pings = NULL;
 
-			pending_remove_and_dispatch(pend, msg);
-			break;
+		for (l = pings; l != NULL; l = l->next)
+			pending_remove_and_dispatch(l->data, msg);
 
-		} else if (pend->type == GISI_MESSAGE_TYPE_COMMON &&
-				msgid == COMMON_MESSAGE &&
-				pend->msgid == COMM_ISI_VERSION_GET_REQ) {
+		g_slist_free(pings);
+	}
 
-			pending_remove_and_dispatch(pend, msg);
+	/*
+	 * RESPs are dispatched on unique transaction ID, explicitly
+	 * ignoring the msgid.  A RESP also completes a transaction,
+	 * so it needs to be removed after being notified of.
+	 */
+	if (!is_indication) {
+		resp = mux->resps[utid];
+
+		if (resp != NULL) {
+			pending_remove_and_dispatch(resp, msg);
+			return;
 		}
+	}
 
-		l = next;
+	/*
+	 * REQs, NTFs and INDs are dispatched on message ID.  While
+	 * INDs have the unique transaction ID set to zero, NTFs
+	 * typically mirror the UTID of the request that set up the
+	 * session, and REQs can naturally have any transaction ID.
+	 */
+	for (l = mux->subs[msgid]; l != NULL; l = next) {
+		next = l->next;
+		pending_dispatch(l->data, msg);
 	}
 }
 
@@ -279,62 +395,126 @@ static void firewall_notify_handle(GIsiModem *modem, GIsiMessage *msg)
 	ISIDBG(modem, "firewall blocked message 0x%02X", id);
 }
 
+static void frame_trace_isi(GIsiModem *modem, enum frame_trace_dir dir,
+				const struct sockaddr_pn *addr,
+				const struct iovec *iov, size_t iovlen)
+{
+	uint16_t tag = addr->spn_dev << 8 | addr->spn_resource;
+
+	frame_trace_recordv(modem->frames, dir, tag, iov, iovlen);
+}
+
+static void frame_trace_isi_buf(GIsiModem *modem, enum frame_trace_dir dir,
+				const struct sockaddr_pn *addr,
+				const void *buf, size_t len)
+{
+	struct iovec iov = {
+		.iov_base = (void *) buf,
+		.iov_len = len,
+	};
+
+	if (modem->frames != NULL)
+		frame_trace_isi(modem, dir, addr, &iov, 1);
+}
+
+static void isi_dispatch(GIsiModem *modem, struct sockaddr_pn *addr,
+				void *buf, size_t len, gboolean is_indication)
+{
+	GIsiServiceMux *mux;
+	GIsiMessage msg;
+	unsigned key;
+
+	msg.addr = addr;
+	msg.error = 0;
+	msg.data = buf;
+	msg.len = len;
+
+	frame_trace_isi_buf(modem, FRAME_TRACE_RX, addr, buf, len);
+
+	if (modem->trace != NULL)
+		modem->trace(&msg, NULL);
+
+	key = addr->spn_resource;
+	mux = g_hash_table_lookup(modem->services, GINT_TO_POINTER(key));
+	if (mux == NULL) {
+		/*
+		 * Unfortunately, the FW report has the wrong
+		 * resource ID in the N900 modem.
+		 */
+		if (key == PN_FIREWALL)
+			firewall_notify_handle(modem, &msg);
+
+		return;
+	}
+
+	msg.version = &mux->version;
+
+	if (g_isi_msg_id(&msg) == COMMON_MESSAGE)
+		common_message_decode(mux, &msg);
+
+	service_dispatch(mux, &msg, is_indication);
+}
+
 static gboolean isi_callback(GIOChannel *channel, GIOCondition cond,
 				gpointer data)
 {
 	GIsiModem *modem = data;
-	int len;
-	int fd;
+	struct sockaddr_pn addrs[ISI_RX_BATCH];
+	size_t lens[ISI_RX_BATCH];
+	gboolean destroyed = FALSE;
+	gboolean is_indication;
+	unsigned pass;
+	int count;
+	int i;
 
 	if (cond & (G_IO_NVAL|G_IO_HUP)) {
 		ISIDBG(modem, "Unexpected event on PhoNet channel %p", channel);
 		return FALSE;
 	}
 
-	fd = g_io_channel_unix_get_fd(channel);
-	len = g_isi_phonet_peek_length(channel);
+	if (modem->rx_buf == NULL) {
+		modem->rx_buf = g_try_malloc(ISI_RX_BATCH * ISI_RX_SLOT_SIZE);
+		if (modem->rx_buf == NULL)
+			return TRUE;
+	}
 
-	if (len > 0) {
-		struct sockaddr_pn addr;
-		uint32_t buf[(len + 3) / 4];
+	is_indication = g_io_channel_unix_get_fd(channel) == modem->ind_fd;
+
+	/*
+	 * Drain the socket a batch at a time, dispatching in arrival
+	 * order. The number of rounds is bounded so that a chatty modem
+	 * cannot starve the rest of the main loop; whatever is left is
+	 * picked up on the next wakeup.
+	 */
+	for (pass = 0; pass < ISI_RX_ROUNDS; pass++) {
+		count = g_isi_phonet_read_batch(channel, modem->rx_buf,
+						ISI_RX_SLOT_SIZE, ISI_RX_BATCH,
+						addrs, lens);
+		if (count <= 0)
+			break;
 
-		GIsiServiceMux *mux;
-		GIsiMessage msg;
-		unsigned key;
+		modem->rx_destroyed = &destroyed;
 
-		len = g_isi_phonet_read(channel, buf, len, &addr);
-		if (len < 2)
-			return TRUE;
+		for (i = 0; i < count; i++) {
+			uint8_t *buf = modem->rx_buf + i * ISI_RX_SLOT_SIZE;
 
-		msg.addr = &addr;
-		msg.error = 0;
-		msg.data = buf;
-		msg.len = len;
-
-		if (modem->trace != NULL)
-			modem->trace(&msg, NULL);
-
-		key = addr.spn_resource;
-		mux = g_hash_table_lookup(modem->services,
-						GINT_TO_POINTER(key));
-		if (mux == NULL) {
-			/*
-			 * Unfortunately, the FW report has the wrong
-			 * resource ID in the N900 modem.
-			 */
-			if (key == PN_FIREWALL)
-				firewall_notify_handle(modem, &msg);
+			if (lens[i] < 2)
+				continue;
 
-			return TRUE;
-		}
+			isi_dispatch(modem, &addrs[i], buf, lens[i],
+					is_indication);
 
-		msg.version = &mux->version;
+			/* The modem may have been destroyed by the handler */
+			if (destroyed)
+				return FALSE;
+		}
 
-		if (g_isi_msg_id(&msg) == COMMON_MESSAGE)
-			common_message_decode(mux, &msg);
+		modem->rx_destroyed = NULL;
 
-		service_dispatch(mux, &msg, fd == modem->ind_fd);
+		if (count < ISI_RX_BATCH)
+			break;
 	}
+
 	return TRUE;
 }
 
@@ -382,6 +562,8 @@ static gboolean modem_subs_update(gpointer data)
 	len = legacy ? 3 + count : 4 + count * 4;
 	msg[2] = count;
 
+	frame_trace_isi_buf(modem, FRAME_TRACE_TX, &commgr, msg, len);
+
 	sendto(modem->ind_fd, msg, len, MSG_NOSIGNAL, (void *) &commgr,
 		sizeof(commgr));
 
@@ -421,6 +603,9 @@ static void service_name_register(GIsiServiceMux *mux)
 	msg[8] = object >> 8;
 	msg[9] = object & 0xFF;
 
+	frame_trace_isi_buf(mux->modem, FRAME_TRACE_TX, &namesrv,
+				msg, sizeof(msg));
+
 	sendto(mux->modem->req_fd, msg, sizeof(msg), MSG_NOSIGNAL,
 		(void *) &namesrv, sizeof(namesrv));
 }
@@ -437,6 +622,9 @@ static void service_name_deregister(GIsiServiceMux *mux)
 		0, 0, 0, mux->resource,
 	};
 
+	frame_trace_isi_buf(mux->modem, FRAME_TRACE_TX, &namesrv,
+				msg, sizeof(msg));
+
 	sendto(mux->modem->req_fd, msg, sizeof(msg), MSG_NOSIGNAL,
 		(void *) &namesrv, sizeof(namesrv));
 }
@@ -448,8 +636,7 @@ static void pending_destroy(gpointer value, gpointer user)
 	if (op == NULL)
 		return;
 
-	if (op->timeout > 0)
-		g_source_remove(op->timeout);
+	pending_timer_stop(op);
 
 	if (op->destroy != NULL)
 		op->destroy(op->data);
@@ -461,6 +648,7 @@ static void service_finalize(gpointer value)
 {
 	GIsiServiceMux *mux = value;
 	GIsiModem *modem = mux->modem;
+	unsigned i;
 
 	if (mux->subscriptions > 0)
 		modem_subs_update_when_idle(modem);
@@ -468,8 +656,15 @@ static void service_finalize(gpointer value)
 	if (mux->registrations > 0)
 		service_name_deregister(mux);
 
-	g_slist_foreach(mux->pending, pending_destroy, NULL);
-	g_slist_free(mux->pending);
+	for (i = 0; i < G_N_ELEMENTS(mux->resps); i++) {
+		pending_destroy(mux->resps[i], NULL);
+
+		g_slist_foreach(mux->subs[i], pending_destroy, NULL);
+		g_slist_free(mux->subs[i]);
+	}
+
+	g_slist_foreach(mux->pings, pending_destroy, NULL);
+	g_slist_free(mux->pings);
 	g_free(mux);
 }
 
@@ -510,6 +705,8 @@ GIsiModem *g_isi_modem_create(unsigned index)
 	g_io_channel_unref(reqs);
 	g_io_channel_unref(inds);
 
+	modem->frames = frame_trace_open(FRAME_TRACE_ISI);
+
 	modem->index = index;
 	modem->services = g_hash_table_new_full(g_direct_hash, NULL,
 						NULL, service_finalize);
@@ -644,12 +841,23 @@ void g_isi_modem_destroy(GIsiModem *modem)
 
 	g_hash_table_unref(modem->services);
 
+	if (modem->wheel_source > 0)
+		g_source_remove(modem->wheel_source);
+
+	if (modem->wheel_destroyed != NULL)
+		*modem->wheel_destroyed = TRUE;
+
+	if (modem->rx_destroyed != NULL)
+		*modem->rx_destroyed = TRUE;
+
 	if (modem->ind_watch > 0)
 		g_source_remove(modem->ind_watch);
 
 	if (modem->req_watch > 0)
 		g_source_remove(modem->req_watch);
 
+	frame_trace_close(modem->frames);
+	g_free(modem->rx_buf);
 	g_free(modem);
 }
 
@@ -724,17 +932,52 @@ static void vtrace(struct sockaddr_pn *dst,
 	trace(&msg, NULL);
 }
 
-static gboolean resp_timeout(gpointer data)
+static GIsiPending *timer_wheel_pop_expired(GIsiModem *modem)
 {
-	GIsiPending *op = data;
-	GIsiMessage msg = {
-		.error = ETIMEDOUT,
-	};
+	GQueue *slot = &modem->wheel[modem->wheel_tick % TIMER_WHEEL_SLOTS];
+	GList *l;
+
+	/* Timers further than one revolution away share the slot */
+	for (l = slot->head; l != NULL; l = l->next) {
+		GIsiPending *op = l->data;
+
+		if (op->expires != modem->wheel_tick)
+			continue;
+
+		pending_timer_stop(op);
+		return op;
+	}
+
+	return NULL;
+}
+
+static gboolean timer_wheel_tick(gpointer data)
+{
+	GIsiModem *modem = data;
+	gboolean destroyed = FALSE;
+	GIsiPending *op;
+
+	modem->wheel_tick++;
+	modem->wheel_destroyed = &destroyed;
+
+	while ((op = timer_wheel_pop_expired(modem)) != NULL) {
+		GIsiMessage msg = {
+			.error = ETIMEDOUT,
+		};
+
+		pending_remove_and_dispatch(op, &msg);
+
+		/* The modem may have been destroyed by the handler */
+		if (destroyed)
+			return FALSE;
+	}
 
-	op->timeout = 0;
+	modem->wheel_destroyed = NULL;
 
-	pending_remove_and_dispatch(op, &msg);
+	if (modem->wheel_count > 0)
+		return TRUE;
 
+	modem->wheel_source = 0;
 	return FALSE;
 }
 
@@ -784,7 +1027,7 @@ GIsiPending *g_isi_request_vsendto(GIsiModem *modem, struct sockaddr_pn *dst,
 	resp->destroy = destroy;
 	resp->data = data;
 
-	if (g_slist_find_custom(mux->pending, resp, utid_equal)) {
+	if (service_utid_busy(mux, resp->utid)) {
 		/*
 		 * FIXME: perhaps retry with randomized access after
 		 * initial miss. Although if the rate at which
@@ -805,6 +1048,8 @@ GIsiPending *g_isi_request_vsendto(GIsiModem *modem, struct sockaddr_pn *dst,
 		len += iov[i].iov_len;
 	}
 
+	frame_trace_isi(modem, FRAME_TRACE_TX, dst, _iov, 1 + iovlen);
+
 	if (modem->trace != NULL)
 		vtrace(dst, _iov, 1 + iovlen, len, modem->trace);
 
@@ -817,11 +1062,10 @@ GIsiPending *g_isi_request_vsendto(GIsiModem *modem, struct sockaddr_pn *dst,
 		goto error;
 	}
 
-	mux->pending = g_slist_prepend(mux->pending, resp);
+	pending_link(resp);
 
 	if (timeout > 0)
-		resp->timeout = g_timeout_add_seconds(timeout, resp_timeout,
-							resp);
+		pending_timer_start(resp, timeout);
 
 	mux->last_utid = resp->utid;
 	return resp;
@@ -856,8 +1100,7 @@ void g_isi_pending_remove(GIsiPending *op)
 		return;
 	}
 
-	op->service->pending = g_slist_remove(op->service->pending, op);
-
+	pending_unlink(op);
 	pending_destroy(op, NULL);
 }
 
@@ -888,32 +1131,54 @@ void g_isi_pending_set_owner(GIsiPending *op, gpointer owner)
 	op->owner = owner;
 }
 
+static GSList *take_owned(GSList **list, gpointer owner, GSList *owned)
+{
+	GSList *l;
+	GSList *next;
+
+	for (l = *list; l != NULL; l = next) {
+		GIsiPending *op = l->data;
+
+		next = l->next;
+
+		if (op->owner != owner)
+			continue;
+
+		*list = g_slist_remove_link(*list, l);
+
+		l->next = owned;
+		owned = l;
+	}
+
+	return owned;
+}
+
 void g_isi_remove_pending_by_owner(GIsiModem *modem, uint8_t resource,
 					gpointer owner)
 {
 	GIsiServiceMux *mux;
 	GSList *l;
-	GSList *next;
 	GIsiPending *op;
 	GSList *owned = NULL;
+	unsigned i;
 
 	mux = service_get(modem, resource);
 	if (mux == NULL)
 		return;
 
-	for (l = mux->pending; l != NULL; l = next) {
-		next = l->next;
-		op = l->data;
+	for (i = 0; i < G_N_ELEMENTS(mux->resps); i++) {
+		op = mux->resps[i];
 
-		if (op->owner != owner)
-			continue;
-
-		mux->pending = g_slist_remove_link(mux->pending, l);
+		if (op != NULL && op->owner == owner) {
+			mux->resps[i] = NULL;
+			owned = g_slist_prepend(owned, op);
+		}
 
-		l->next = owned;
-		owned = l;
+		owned = take_owned(&mux->subs[i], owner, owned);
 	}
 
+	owned = take_owned(&mux->pings, owner, owned);
+
 	for (l = owned; l != NULL; l = l->next) {
 		op = l->data;
 
@@ -949,7 +1214,7 @@ GIsiPending *g_isi_ntf_subscribe(GIsiModem *modem, uint8_t resource,
 	ntf->destroy = destroy;
 	ntf->msgid = msgid;
 
-	mux->pending = g_slist_append(mux->pending, ntf);
+	pending_link(ntf);
 
 	ISIDBG(modem, "Subscribed to %s (%p) [res=0x%02X, id=0x%02X]",
 		pend_type_to_str(ntf->type), ntf, resource, msgid);
@@ -983,7 +1248,7 @@ GIsiPending *g_isi_service_bind(GIsiModem *modem, uint8_t resource,
 	srv->destroy = destroy;
 	srv->msgid = msgid;
 
-	mux->pending = g_slist_append(mux->pending, srv);
+	pending_link(srv);
 
 	ISIDBG(modem, "Bound service for %s (%p) [res=0x%02X, id=0x%02X]",
 		pend_type_to_str(srv->type), srv, resource, msgid);
@@ -1019,7 +1284,7 @@ GIsiPending *g_isi_ind_subscribe(GIsiModem *modem, uint8_t resource,
 	ind->destroy = destroy;
 	ind->msgid = msgid;
 
-	mux->pending = g_slist_append(mux->pending, ind);
+	pending_link(ind);
 
 	ISIDBG(modem, "Subscribed for %s (%p) [res=0x%02X, id=0x%02X]",
 		pend_type_to_str(ind->type), ind, resource, msgid);
@@ -1122,6 +1387,8 @@ int g_isi_modem_vsendto(GIsiModem *modem, struct sockaddr_pn *dst,
 	for (i = 0, len = 0; i < iovlen; i++)
 		len += iov[i].iov_len;
 
+	frame_trace_isi(modem, FRAME_TRACE_TX, dst, iov, iovlen);
+
 	if (modem->trace != NULL)
 		vtrace(dst, iov, iovlen, len, modem->trace);
 
@@ -1167,9 +1434,11 @@ static int version_get_send(GIsiModem *modem, GIsiPending *ping)
 	};
 	ssize_t ret;
 
-	if (g_slist_find_custom(mux->pending, ping, utid_equal))
+	if (service_utid_busy(mux, ping->utid))
 		return -EBUSY;
 
+	frame_trace_isi_buf(modem, FRAME_TRACE_TX, &dst, msg, sizeof(msg));
+
 	ret = sendto(modem->req_fd, msg, sizeof(msg), MSG_NOSIGNAL,
 			(void *)&dst, sizeof(dst));
 
@@ -1247,9 +1516,8 @@ GIsiPending *g_isi_resource_ping(GIsiModem *modem, uint8_t resource,
 		mux->last_utid = ping->utid;
 	}
 
-	ping->timeout = g_timeout_add_seconds(COMMON_TIMEOUT, resp_timeout,
-						ping);
-	mux->pending = g_slist_prepend(mux->pending, ping);
+	pending_link(ping);
+	pending_timer_start(ping, COMMON_TIMEOUT);
 	mux->version_pending = TRUE;
 
 	ISIDBG(modem, "Ping sent %s (%p) [res=0x%02X]",
@@ -23,13 +23,17 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <net/if.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <glib.h>
 
 #pragma GCC diagnostic ignored "-Wpragmas"
@@ -94,3 +98,67 @@ ssize_t g_isi_phonet_read(GIOChannel *channel, void *restrict buf, size_t len,
 
 	return ret;
 }
+
+/*
+ * Reads up to count queued datagrams without blocking. Datagram i is
+ * stored at buf + i * slot_size, its sender in addrs[i] and its length
+ * in lens[i]. A datagram that did not fit in its slot has its length
+ * set to zero. Returns the number of datagrams read, 0 if the socket
+ * queue was empty or -1 on error.
+ */
+int g_isi_phonet_read_batch(GIOChannel *channel, void *buf, size_t slot_size,
+				unsigned int count, struct sockaddr_pn *addrs,
+				size_t *lens)
+{
+	int fd = g_io_channel_unix_get_fd(channel);
+	uint8_t *slots = buf;
+	unsigned int i;
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[count];
+	struct iovec iov[count];
+	int ret;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = slots + i * slot_size;
+		iov[i].iov_len = slot_size;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_pn);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL);
+	if (ret == -1)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+	for (i = 0; i < (unsigned int) ret; i++) {
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			lens[i] = 0;
+		else
+			lens[i] = msgs[i].msg_len;
+	}
+
+	return ret;
+#else
+	for (i = 0; i < count; i++) {
+		socklen_t addrlen = sizeof(struct sockaddr_pn);
+		ssize_t ret;
+
+		ret = recvfrom(fd, slots + i * slot_size, slot_size,
+				MSG_DONTWAIT | MSG_TRUNC, (void *) &addrs[i],
+				&addrlen);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			return i > 0 ? (int) i : -1;
+		}
+
+		lens[i] = (size_t) ret > slot_size ? 0 : (size_t) ret;
+	}
+
+	return i;
+#endif
+}
@@ -40,6 +40,7 @@
 
 #include <ofono/log.h>
 #include "ringbuffer.h"
+#include "latency.h"
 #include "gril.h"
 #include "grilutil.h"
 
@@ -48,12 +49,37 @@
 		ofono_debug(fmt, ## arg);	\
 } while (0)
 
+/*
+ * Queued requests are sent in order of these lanes, so that call control
+ * does not wait behind SIM reads or periodic polls. Order is preserved
+ * within a lane only, requests that depend on each other have to share
+ * one, see request_lane().
+ */
+enum ril_lane {
+	RIL_LANE_CALL = 0,
+	RIL_LANE_SMS,
+	RIL_LANE_NETWORK,
+	RIL_LANE_DEFAULT,
+	RIL_LANE_SIM,
+	RIL_LANE_POLL,
+	RIL_LANE_COUNT,
+};
+
+/* Small requests queued together are coalesced into one write up to this */
+#define RIL_WRITE_BATCH_SIZE 4096
+
+/* Microseconds a poll may wait behind the other lanes before it goes first */
+#define RIL_POLL_MAX_WAIT 2000000
+
 struct ril_request {
 	gchar *data;
 	guint data_len;
 	gint req;
 	gint id;
 	guint gid;
+	enum ril_lane lane;
+	gint64 queued;
+	guint64 sent;
 	GRilResponseFunc callback;
 	gpointer user_data;
 	GDestroyNotify notify;
@@ -80,13 +106,19 @@ struct ril_s {
 	guint next_notify_id;			/* Next notify id */
 	guint next_gid;				/* Next group id */
 	GRilIO *io;				/* GRil IO */
-	GQueue *command_queue;			/* Command queue */
-	GQueue *out_queue;			/* Commands sent/been sent */
-	guint req_bytes_written;		/* bytes written from req */
+	GQueue command_queue[RIL_LANE_COUNT];	/* Commands not yet sent */
+	GHashTable *sent_table;			/* Commands sent, by serial */
+	gchar *write_buf;			/* Coalesced commands */
+	gsize write_buf_size;			/* Allocated size of write_buf */
+	gsize write_len;			/* Bytes queued in write_buf */
+	gsize write_off;			/* Bytes written from write_buf */
 	GHashTable *notify_list;		/* List of notification reg */
 	GRilDisconnectFunc user_disconnect;	/* user disconnect func */
 	gpointer user_disconnect_data;		/* user disconnect data */
-	guint read_so_far;			/* Number of bytes processed */
+	guchar *rx_buf;				/* Parcel being reassembled */
+	gsize rx_buf_size;			/* Allocated size of rx_buf */
+	gsize rx_len;				/* Bytes stored in rx_buf */
+	gsize rx_need;				/* Length of the parcel */
 	gboolean suspended;			/* Are we suspended? */
 	gboolean debug;
 	gboolean trace;
@@ -98,6 +130,7 @@ struct ril_s {
 	int slot;
 	GRilMsgIdToStrFunc req_to_string;
 	GRilMsgIdToStrFunc unsol_to_string;
+	struct latency_stats *stats;		/* Round trip histograms */
 };
 
 struct _GRil {
@@ -113,10 +146,17 @@ struct req_hdr {
 	uint32_t serial;
 };
 
+/*
+ * Upper bound for a single parcel. Anything beyond this is treated as a
+ * corrupted stream rather than something worth allocating memory for.
+ */
+#define RIL_MAX_PARCEL_SIZE (4 * 1024 * 1024)
+
 #define RIL_PRINT_BUF_SIZE 8096
 char print_buf[RIL_PRINT_BUF_SIZE] __attribute__((used));
 
 static void ril_wakeup_writer(struct ril_s *ril);
+static void ril_suspend(struct ril_s *ril);
 
 static const char *request_id_to_string(struct ril_s *ril, int req)
 {
@@ -232,6 +272,76 @@ static gboolean ril_unregister_all(struct ril_s *ril,
 	return TRUE;
 }
 
+static enum ril_lane request_lane(int req)
+{
+	switch (req) {
+	case RIL_REQUEST_DIAL:
+	case RIL_REQUEST_ANSWER:
+	case RIL_REQUEST_HANGUP:
+	case RIL_REQUEST_HANGUP_WAITING_OR_BACKGROUND:
+	case RIL_REQUEST_HANGUP_FOREGROUND_RESUME_BACKGROUND:
+	case RIL_REQUEST_SWITCH_WAITING_OR_HOLDING_AND_ACTIVE:
+	case RIL_REQUEST_CONFERENCE:
+	case RIL_REQUEST_UDUB:
+	case RIL_REQUEST_SEPARATE_CONNECTION:
+	case RIL_REQUEST_EXPLICIT_CALL_TRANSFER:
+	case RIL_REQUEST_GET_CURRENT_CALLS:
+	case RIL_REQUEST_LAST_CALL_FAIL_CAUSE:
+	case RIL_REQUEST_DTMF:
+	case RIL_REQUEST_DTMF_START:
+	case RIL_REQUEST_DTMF_STOP:
+	case RIL_REQUEST_SET_MUTE:
+		return RIL_LANE_CALL;
+	case RIL_REQUEST_SEND_SMS:
+	case RIL_REQUEST_SEND_SMS_EXPECT_MORE:
+	case RIL_REQUEST_SMS_ACKNOWLEDGE:
+	case RIL_REQUEST_ACKNOWLEDGE_INCOMING_GSM_SMS_WITH_PDU:
+	case RIL_REQUEST_WRITE_SMS_TO_SIM:
+	case RIL_REQUEST_DELETE_SMS_ON_SIM:
+		return RIL_LANE_SMS;
+	case RIL_REQUEST_VOICE_REGISTRATION_STATE:
+	case RIL_REQUEST_DATA_REGISTRATION_STATE:
+	case RIL_REQUEST_OPERATOR:
+	case RIL_REQUEST_RADIO_POWER:
+	case RIL_REQUEST_QUERY_NETWORK_SELECTION_MODE:
+	case RIL_REQUEST_SET_NETWORK_SELECTION_AUTOMATIC:
+	case RIL_REQUEST_SET_NETWORK_SELECTION_MANUAL:
+	case RIL_REQUEST_VOICE_RADIO_TECH:
+		return RIL_LANE_NETWORK;
+	/*
+	 * SIM reads may depend on the outcome of the status and PIN
+	 * requests queued before them, so they all share one lane
+	 */
+	case RIL_REQUEST_GET_SIM_STATUS:
+	case RIL_REQUEST_ENTER_SIM_PIN:
+	case RIL_REQUEST_ENTER_SIM_PUK:
+	case RIL_REQUEST_ENTER_SIM_PIN2:
+	case RIL_REQUEST_ENTER_SIM_PUK2:
+	case RIL_REQUEST_CHANGE_SIM_PIN:
+	case RIL_REQUEST_CHANGE_SIM_PIN2:
+	case RIL_REQUEST_ENTER_NETWORK_DEPERSONALIZATION:
+	case RIL_REQUEST_GET_IMSI:
+	case RIL_REQUEST_QUERY_FACILITY_LOCK:
+	case RIL_REQUEST_SET_FACILITY_LOCK:
+	case RIL_REQUEST_SIM_IO:
+	case RIL_REQUEST_STK_GET_PROFILE:
+	case RIL_REQUEST_STK_SET_PROFILE:
+	case RIL_REQUEST_STK_SEND_ENVELOPE_COMMAND:
+	case RIL_REQUEST_STK_SEND_TERMINAL_RESPONSE:
+	case RIL_REQUEST_STK_HANDLE_CALL_SETUP_REQUESTED_FROM_SIM:
+	case RIL_REQUEST_STK_SEND_ENVELOPE_WITH_STATUS:
+	case RIL_REQUEST_ISIM_AUTHENTICATION:
+		return RIL_LANE_SIM;
+	case RIL_REQUEST_SIGNAL_STRENGTH:
+	case RIL_REQUEST_GET_CELL_INFO_LIST:
+	case RIL_REQUEST_GET_NEIGHBORING_CELL_IDS:
+	case RIL_REQUEST_DATA_CALL_LIST:
+		return RIL_LANE_POLL;
+	}
+
+	return RIL_LANE_DEFAULT;
+}
+
 /*
  * This function creates a RIL request.  For a good reference on
  * the layout of RIL requests, responses, and unsolicited requests
@@ -286,6 +396,8 @@ static struct ril_request *ril_request_create(struct ril_s *ril,
 	r->req = req;
 	r->gid = gid;
 	r->id = id;
+	r->lane = request_lane(req);
+	r->queued = g_get_monotonic_time();
 	r->callback = func;
 	r->user_data = user_data;
 	r->notify = notify;
@@ -293,6 +405,25 @@ static struct ril_request *ril_request_create(struct ril_s *ril,
 	return r;
 }
 
+static struct ril_request *ril_peek_request(struct ril_s *ril)
+{
+	struct ril_request *req;
+	int i;
+
+	/* Keep a steady stream of calls or SIM reads from starving polls */
+	req = g_queue_peek_head(&ril->command_queue[RIL_LANE_POLL]);
+	if (req != NULL &&
+			g_get_monotonic_time() - req->queued > RIL_POLL_MAX_WAIT)
+		return req;
+
+	for (i = 0; i < RIL_LANE_COUNT; i++) {
+		if (!g_queue_is_empty(&ril->command_queue[i]))
+			return g_queue_peek_head(&ril->command_queue[i]);
+	}
+
+	return NULL;
+}
+
 static void ril_request_destroy(struct ril_request *req)
 {
 	if (req->notify)
@@ -302,20 +433,31 @@ static void ril_request_destroy(struct ril_request *req)
 	g_free(req);
 }
 
+static void ril_free(struct ril_s *p)
+{
+	latency_stats_free(p->stats);
+	g_free(p->rx_buf);
+	g_free(p->write_buf);
+	g_free(p);
+}
+
 static void ril_cleanup(struct ril_s *p)
 {
+	int i;
+
 	/* Cleanup pending commands */
 
-	if (p->command_queue) {
-		g_queue_free(p->command_queue);
-		p->command_queue = NULL;
-	}
+	for (i = 0; i < RIL_LANE_COUNT; i++)
+		g_queue_clear(&p->command_queue[i]);
 
-	if (p->out_queue) {
-		g_queue_free(p->out_queue);
-		p->out_queue = NULL;
+	if (p->sent_table) {
+		g_hash_table_destroy(p->sent_table);
+		p->sent_table = NULL;
 	}
 
+	p->write_len = 0;
+	p->write_off = 0;
+
 	/* Cleanup registered notifications */
 	if (p->notify_list) {
 		g_hash_table_destroy(p->notify_list);
@@ -351,60 +493,40 @@ static void io_disconnect(gpointer user_data)
 
 static void handle_response(struct ril_s *p, struct ril_msg *message)
 {
-	guint count = g_queue_get_length(p->command_queue);
 	struct ril_request *req;
-	gboolean found = FALSE;
-	guint i, len;
-	gint id;
-
-	for (i = 0; i < count; i++) {
-		req = g_queue_peek_nth(p->command_queue, i);
-
-		if (req->id == message->serial_no) {
-			found = TRUE;
-			message->req = req->req;
-
-			if (message->error != RIL_E_SUCCESS)
-				RIL_TRACE(p, "[%d,%04d]< %s failed %s",
-					p->slot, message->serial_no,
-					request_id_to_string(p, message->req),
-					ril_error_to_string(message->error));
 
-			req = g_queue_pop_nth(p->command_queue, i);
-			if (req->callback)
-				req->callback(message, req->user_data);
+	req = g_hash_table_lookup(p->sent_table,
+					GINT_TO_POINTER(message->serial_no));
+	if (req == NULL) {
+		ofono_error("No matching request for reply: %s serial_no: %d!",
+			request_id_to_string(p, message->req),
+			message->serial_no);
+		return;
+	}
 
-			/* gril may have been destroyed in the request callback */
-			if (p->destroyed) {
-				ril_request_destroy(req);
-				return;
-			}
+	g_hash_table_steal(p->sent_table, GINT_TO_POINTER(req->id));
 
-			len = g_queue_get_length(p->out_queue);
+	message->req = req->req;
 
-			for (i = 0; i < len; i++) {
-				id = GPOINTER_TO_INT(g_queue_peek_nth(
-							p->out_queue, i));
-				if (id == req->id) {
-					g_queue_pop_nth(p->out_queue, i);
-					break;
-				}
-			}
+	latency_stats_record(p->stats, req->req, req->sent);
 
-			ril_request_destroy(req);
+	if (message->error != RIL_E_SUCCESS)
+		RIL_TRACE(p, "[%d,%04d]< %s failed %s",
+				p->slot, message->serial_no,
+				request_id_to_string(p, message->req),
+				ril_error_to_string(message->error));
 
-			if (g_queue_peek_head(p->command_queue))
-				ril_wakeup_writer(p);
+	if (req->callback)
+		req->callback(message, req->user_data);
 
-			break;
-		}
-	}
+	ril_request_destroy(req);
 
-	if (found == FALSE)
-		ofono_error("No matching request for reply: %s serial_no: %d!",
-			request_id_to_string(p, message->req),
-			message->serial_no);
+	/* gril may have been destroyed in the request callback */
+	if (p->destroyed)
+		return;
 
+	if (ril_peek_request(p))
+		ril_wakeup_writer(p);
 }
 
 static gboolean node_check_destroyed(struct ril_notify_node *node,
@@ -454,188 +576,197 @@ static void handle_unsol_req(struct ril_s *p, struct ril_msg *message)
 					GUINT_TO_POINTER(TRUE));
 }
 
-static void dispatch(struct ril_s *p, struct ril_msg *message)
+/*
+ * Dispatch a complete parcel, not including the length field. The parcel
+ * is either parsed in place in the ring buffer or in the reassembly
+ * buffer, it is only valid for the duration of the call.
+ */
+static void dispatch(struct ril_s *p, guchar *parcel, gsize len)
 {
-	int32_t *unsolicited_field, *id_num_field;
-	gchar *bufp = message->buf;
-	gchar *datap;
-	gsize data_len;
-
-	/* This could be done with a struct/union... */
-	unsolicited_field = (int32_t *) (void *) bufp;
-	if (*unsolicited_field)
-		message->unsolicited = TRUE;
-	else
-		message->unsolicited = FALSE;
+	struct ril_msg message;
+	gsize hdr_len;
+	int32_t field;
+
+	memset(&message, 0, sizeof(message));
+
+	if (len < 8) {
+		ofono_error("%s: parcel too short (%zu)", __func__, len);
+		return;
+	}
+
+	memcpy(&field, parcel, 4);
+	message.unsolicited = field ? TRUE : FALSE;
 
-	bufp += 4;
+	memcpy(&field, parcel + 4, 4);
 
-	id_num_field = (int32_t *) (void *) bufp;
-	if (message->unsolicited) {
-		message->req = (int) *id_num_field;
+	if (message.unsolicited) {
+		message.req = (int) field;
 
 		/*
 		 * A RIL Unsolicited Event is two UINT32 fields ( unsolicited,
-		 * and req/ev ), so subtract the length of the header from the
-		 * overall length to calculate the length of the Event Data.
+		 * and req/ev ), so skip those to get to the Event Data.
 		 */
-		data_len = message->buf_len - 8;
+		hdr_len = 8;
 	} else {
-		message->serial_no = (int) *id_num_field;
+		if (len < 12) {
+			ofono_error("%s: response too short (%zu)",
+					__func__, len);
+			return;
+		}
+
+		message.serial_no = (int) field;
 
-		bufp += 4;
-		message->error = *((int32_t *) (void *) bufp);
+		memcpy(&field, parcel + 8, 4);
+		message.error = field;
 
 		/*
-		 * A RIL Solicited Response is three UINT32 fields ( unsolicied,
-		 * serial_no and error ), so subtract the length of the header
-		 * from the overall length to calculate the length of the Event
-		 * Data.
+		 * A RIL Solicited Response is three UINT32 fields
+		 * ( unsolicited, serial_no and error ), so skip those to get
+		 * to the Event Data.
 		 */
-		data_len = message->buf_len - 12;
+		hdr_len = 12;
 	}
 
-	/* advance to start of data.. */
-	bufp += 4;
-
-	/*
-	 * Now, use buffer for event data if present
-	 */
-	if (data_len) {
-		datap = g_try_malloc(data_len);
-		if (datap == NULL)
-			goto error;
-
-		/* Copy event bytes from message->buf into new buffer */
-		memcpy(datap, bufp, data_len);
-
-		/* Free buffer that includes header */
-		g_free(message->buf);
-
-		/* ...and replace with new buffer */
-		message->buf = datap;
-		message->buf_len = data_len;
-	} else {
-		/* Free buffer that includes header */
-		g_free(message->buf);
-
-		/* To know if there was no data when parsing */
-		message->buf = NULL;
-		message->buf_len = 0;
+	/* To know if there was no data when parsing, buf is left NULL */
+	if (len > hdr_len) {
+		message.buf = (gchar *) parcel + hdr_len;
+		message.buf_len = len - hdr_len;
 	}
 
-	if (message->unsolicited == TRUE)
-		handle_unsol_req(p, message);
+	if (message.unsolicited == TRUE)
+		handle_unsol_req(p, &message);
 	else
-		handle_response(p, message);
+		handle_response(p, &message);
+}
 
-error:
-	g_free(message->buf);
-	g_free(message);
+static void ril_stream_error(struct ril_s *p)
+{
+	GIOChannel *channel = g_ril_io_get_channel(p->io);
+
+	ril_suspend(p);
+
+	/* The read watch notices the shutdown and reports a disconnect */
+	if (channel)
+		g_io_channel_shutdown(channel, FALSE, NULL);
 }
 
-static struct ril_msg *read_fixed_record(struct ril_s *p,
-						const guchar *bytes, gsize *len)
+/*
+ * Start reassembling a parcel that is either larger than the ring buffer
+ * or split by its wrap point. The length field is already consumed.
+ */
+static gboolean rx_begin(struct ril_s *p, gsize plen)
 {
-	struct ril_msg *message;
-	unsigned message_len, plen;
+	if (plen > p->rx_buf_size) {
+		guchar *buf = g_try_realloc(p->rx_buf, plen);
 
-	/* First four bytes are length in TCP byte order (Big Endian) */
-	plen = ntohl(*((uint32_t *) (void *) bytes));
-	bytes += 4;
+		if (buf == NULL)
+			return FALSE;
 
-	/*
-	 * TODO: Verify that 8k is the max message size from rild.
-	 *
-	 * This condition shouldn't happen.  If it does
-	 * there are three options:
-	 *
-	 * 1) Exit; ofono will restart via DBus (this is what we do now)
-	 * 2) Consume the bytes & continue
-	 * 3) force a disconnect
-	 */
-	if (plen > GRIL_BUFFER_SIZE - 4) {
-		ofono_error("ERROR RIL parcel bigger than buffer (%u), exiting",
-				plen);
-		exit(1);
+		p->rx_buf = buf;
+		p->rx_buf_size = plen;
 	}
 
-	/*
-	 * If we don't have the whole fixed record in the ringbuffer
-	 * then return NULL & leave ringbuffer as is.
-	 */
-
-	message_len = *len - 4;
-	if (message_len < plen)
-		return NULL;
+	p->rx_len = 0;
+	p->rx_need = plen;
 
-	message = g_malloc(sizeof(struct ril_msg));
+	return TRUE;
+}
 
-	/* allocate ril_msg->buffer */
-	message->buf_len = plen;
-	message->buf = g_malloc(plen);
+/* Move as much of the pending parcel as possible out of the ring buffer */
+static gboolean rx_fill(struct ril_s *p, struct ring_buffer *rbuf)
+{
+	gsize avail = ring_buffer_len(rbuf);
+	gsize n = MIN(avail, p->rx_need - p->rx_len);
 
-	/* Copy bytes into message buffer */
-	memmove(message->buf, (const void *) bytes, plen);
+	if (n > 0) {
+		ring_buffer_read(rbuf, p->rx_buf + p->rx_len, n);
+		p->rx_len += n;
+	}
 
-	/* Indicate to caller size of record we extracted */
-	*len = plen + 4;
-	return message;
+	return p->rx_len == p->rx_need;
 }
 
 static void new_bytes(struct ring_buffer *rbuf, gpointer user_data)
 {
-	struct ril_msg *message;
 	struct ril_s *p = user_data;
-	unsigned int len = ring_buffer_len(rbuf);
-	unsigned int wrap = ring_buffer_len_no_wrap(rbuf);
-	guchar *buf = ring_buffer_read_ptr(rbuf, p->read_so_far);
+	unsigned int capacity = ring_buffer_capacity(rbuf);
+	unsigned int len, wrap;
+	uint32_t plen;
 
 	p->in_read_handler = TRUE;
 
-	while (p->suspended == FALSE && (p->read_so_far < len)) {
-		gsize rbytes = MIN(len - p->read_so_far, wrap - p->read_so_far);
+	while (p->suspended == FALSE) {
+		/* Finish a parcel that is being reassembled */
+		if (p->rx_need) {
+			if (!rx_fill(p, rbuf))
+				break;
 
-		if (rbytes < 4) {
-			DBG("Not enough bytes for header length: len: %d", len);
-			return;
-		}
+			plen = p->rx_need;
+			p->rx_need = 0;
 
-		/*
-		 * This function attempts to read the next full length
-		 * fixed message from the stream.  if not all bytes are
-		 * available, it returns NULL.  otherwise it allocates
-		 * and returns a ril_message with the copied bytes, and
-		 * drains those bytes from the ring_buffer
-		 */
-		message = read_fixed_record(p, buf, &rbytes);
+			dispatch(p, p->rx_buf, plen);
+			continue;
+		}
 
-		/* wait for the rest of the record... */
-		if (message == NULL)
+		len = ring_buffer_len(rbuf);
+		if (len < 4)
 			break;
 
-		buf += rbytes;
-		p->read_so_far += rbytes;
+		/* First four bytes are length in TCP byte order (Big Endian) */
+		wrap = ring_buffer_len_no_wrap(rbuf);
+
+		if (wrap >= 4) {
+			memcpy(&plen, ring_buffer_read_ptr(rbuf, 0), 4);
+		} else {
+			guchar hdr[4];
+			unsigned int i;
 
-		/* TODO: need to better understand how wrap works! */
-		if (p->read_so_far == wrap) {
-			buf = ring_buffer_read_ptr(rbuf, p->read_so_far);
-			wrap = len;
+			for (i = 0; i < 4; i++)
+				hdr[i] = *ring_buffer_read_ptr(rbuf, i);
+
+			memcpy(&plen, hdr, 4);
 		}
 
-		dispatch(p, message);
+		plen = ntohl(plen);
 
-		ring_buffer_drain(rbuf, p->read_so_far);
+		if (plen > RIL_MAX_PARCEL_SIZE) {
+			ofono_error("RIL parcel too big (%u), disconnecting",
+					plen);
+			ril_stream_error(p);
+			break;
+		}
+
+		/* Common case, the whole parcel is contiguous: parse in place */
+		if (wrap >= plen + 4) {
+			dispatch(p, ring_buffer_read_ptr(rbuf, 4), plen);
+			ring_buffer_drain(rbuf, plen + 4);
+			continue;
+		}
+
+		/*
+		 * Wait for the rest of a parcel that fits the ring buffer,
+		 * it might still end up contiguous. Leave some headroom so
+		 * that the reader never sees a full buffer, it treats that
+		 * as an overflow.
+		 */
+		if (len < plen + 4 && plen + 4 < capacity / 2)
+			break;
 
-		len -= p->read_so_far;
-		wrap -= p->read_so_far;
-		p->read_so_far = 0;
+		/* Split by the wrap point or too big, stream it out */
+		if (!rx_begin(p, plen)) {
+			ofono_error("Can't allocate %u bytes for RIL parcel",
+					plen);
+			ril_stream_error(p);
+			break;
+		}
+
+		ring_buffer_drain(rbuf, 4);
 	}
 
 	p->in_read_handler = FALSE;
 
 	if (p->destroyed)
-		g_free(p);
+		ril_free(p);
 }
 
 /*
@@ -647,73 +778,46 @@ static gboolean can_write_data(gpointer data)
 {
 	struct ril_s *ril = data;
 	struct ril_request *req;
-	gsize bytes_written, towrite, len;
-	guint qlen, oqlen;
-	gint id;
-	gboolean written = TRUE;
-	guint i, j;
-
-	qlen = g_queue_get_length(ril->command_queue);
-	if (qlen < 1)
-		return FALSE;
-
-	/* if the whole request was not written */
-	if (ril->req_bytes_written != 0) {
-
-		for (i = 0; i < qlen; i++) {
-			req = g_queue_peek_nth(ril->command_queue, i);
-			if (req) {
-				id = GPOINTER_TO_INT(g_queue_peek_head(
-							ril->out_queue));
-				if (req->id == id)
-					goto out;
-			} else {
-				return FALSE;
-			}
-		}
-	}
-	/* if no requests already sent */
-	oqlen = g_queue_get_length(ril->out_queue);
-	if (oqlen < 1) {
-		req = g_queue_peek_head(ril->command_queue);
-		if (req == NULL)
-			return FALSE;
+	gsize bytes_written, towrite;
 
-		g_queue_push_head(ril->out_queue, GINT_TO_POINTER(req->id));
-
-		goto out;
-	}
+	/*
+	 * Once the previous batch is out, coalesce as many queued requests
+	 * as fit, highest lane first. They go into the sent table right
+	 * away so that their replies can be matched by serial.
+	 */
+	if (ril->write_off == ril->write_len) {
+		ril->write_len = 0;
+		ril->write_off = 0;
 
-	for (i = 0; i < qlen; i++) {
-		req = g_queue_peek_nth(ril->command_queue, i);
-		if (req == NULL)
-			return FALSE;
+		while ((req = ril_peek_request(ril)) != NULL) {
+			gsize len = ril->write_len + req->data_len;
 
-		for (j = 0; j < oqlen; j++) {
-			id = GPOINTER_TO_INT(
-					g_queue_peek_nth(ril->out_queue, j));
-			if (req->id == id) {
-				written = TRUE;
+			if (ril->write_len > 0 && len > RIL_WRITE_BATCH_SIZE)
 				break;
-			} else {
-				written = FALSE;
+
+			if (len > ril->write_buf_size) {
+				ril->write_buf_size = MAX(len,
+							RIL_WRITE_BATCH_SIZE);
+				ril->write_buf = g_realloc(ril->write_buf,
+							ril->write_buf_size);
 			}
-		}
 
-		if (written == FALSE)
-			break;
-	}
+			g_queue_pop_head(&ril->command_queue[req->lane]);
 
-	/* watcher fired though requests already written */
-	if (written == TRUE)
-		return FALSE;
+			memcpy(ril->write_buf + ril->write_len, req->data,
+				req->data_len);
+			ril->write_len = len;
 
-	g_queue_push_head(ril->out_queue, GINT_TO_POINTER(req->id));
+			req->sent = latency_now();
+			g_hash_table_insert(ril->sent_table,
+					GINT_TO_POINTER(req->id), req);
+		}
 
-out:
-	len = req->data_len;
+		if (ril->write_len == 0)
+			return FALSE;
+	}
 
-	towrite = len - ril->req_bytes_written;
+	towrite = ril->write_len - ril->write_off;
 
 #ifdef WRITE_SCHEDULER_DEBUG
 	if (towrite > 5)
@@ -721,17 +825,18 @@ out:
 #endif
 
 	bytes_written = g_ril_io_write(ril->io,
-					req->data + ril->req_bytes_written,
+					ril->write_buf + ril->write_off,
 					towrite);
 
 	if (bytes_written == 0)
 		return FALSE;
 
-	ril->req_bytes_written += bytes_written;
-	if (bytes_written < towrite)
+	ril->write_off += bytes_written;
+	if (ril->write_off < ril->write_len)
 		return TRUE;
-	else
-		ril->req_bytes_written = 0;
+
+	ril->write_len = 0;
+	ril->write_off = 0;
 
 	return FALSE;
 }
@@ -780,7 +885,7 @@ static void ril_unref(struct ril_s *ril)
 	if (ril->in_read_handler)
 		ril->destroyed = TRUE;
 	else
-		g_free(ril);
+		ril_free(ril);
 }
 
 static gboolean node_compare_by_group(struct ril_notify_node *node,
@@ -794,6 +899,16 @@ static gboolean node_compare_by_group(struct ril_notify_node *node,
 	return FALSE;
 }
 
+static void request_format(uint32_t id, char *buf, size_t len)
+{
+	const char *str = ril_request_id_to_string(id);
+
+	if (g_str_has_prefix(str, "RIL_REQUEST_"))
+		g_strlcpy(buf, str + strlen("RIL_REQUEST_"), len);
+	else
+		snprintf(buf, len, "%u", id);
+}
+
 static struct ril_s *create_ril(const char *sock_path, unsigned int uid,
 					unsigned int gid)
 
@@ -812,9 +927,11 @@ static struct ril_s *create_ril(const char *sock_path, unsigned int uid,
 	ril->next_cmd_id = 1;
 	ril->next_notify_id = 1;
 	ril->next_gid = 0;
-	ril->req_bytes_written = 0;
 	ril->trace = FALSE;
 
+	ril->stats = latency_stats_new("ril");
+	latency_stats_set_format(ril->stats, request_format);
+
 	/* sock_path is allowed to be NULL for unit tests */
 	if (sock_path == NULL)
 		return ril;
@@ -876,17 +993,7 @@ static struct ril_s *create_ril(const char *sock_path, unsigned int uid,
 
 	g_ril_io_set_disconnect_function(ril->io, io_disconnect, ril);
 
-	ril->command_queue = g_queue_new();
-	if (ril->command_queue == NULL) {
-		ofono_error("create_ril: Couldn't create command_queue.");
-		goto error;
-	}
-
-	ril->out_queue = g_queue_new();
-	if (ril->out_queue == NULL) {
-		ofono_error("create_ril: Couldn't create out_queue.");
-		goto error;
-	}
+	ril->sent_table = g_hash_table_new(g_direct_hash, g_direct_equal);
 
 	ril->notify_list = g_hash_table_new_full(g_int_hash, g_int_equal,
 							g_free,
@@ -925,39 +1032,40 @@ static struct ril_notify *ril_notify_create(struct ril_s *ril,
 
 static void ril_cancel_group(struct ril_s *ril, guint group)
 {
-	int n = 0;
-	guint len, i;
+	GHashTableIter iter;
+	gpointer value;
 	struct ril_request *req;
-	gboolean sent;
+	GList *l, *next;
+	int i;
 
-	if (ril->command_queue == NULL)
+	if (ril->sent_table == NULL)
 		return;
 
-	while ((req = g_queue_peek_nth(ril->command_queue, n)) != NULL) {
-		if (req->id == 0 || req->gid != group) {
-			n += 1;
-			continue;
-		}
+	/* Requests not yet on the wire can simply be dropped */
+	for (i = 0; i < RIL_LANE_COUNT; i++) {
+		GQueue *queue = &ril->command_queue[i];
 
-		req->callback = NULL;
-		sent = FALSE;
+		for (l = queue->head; l; l = next) {
+			next = l->next;
+			req = l->data;
 
-		len = g_queue_get_length(ril->out_queue);
-		for (i = 0; i < len; i++) {
-			if (GPOINTER_TO_INT(
-					g_queue_peek_nth(ril->out_queue, i))
-					== req->id) {
-				n += 1;
-				sent = TRUE;
-				break;
-			}
-		 }
+			if (req->id == 0 || req->gid != group)
+				continue;
 
-		if (sent)
-			continue;
+			g_queue_delete_link(queue, l);
+			req->callback = NULL;
+			ril_request_destroy(req);
+		}
+	}
+
+	/* Sent requests stay around until their reply arrives */
+	g_hash_table_iter_init(&iter, ril->sent_table);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		req = value;
 
-		g_queue_remove(ril->command_queue, req);
-		ril_request_destroy(req);
+		if (req->gid == group)
+			req->callback = NULL;
 	}
 }
 
@@ -1134,7 +1242,7 @@ gint g_ril_send(GRil *ril, const gint reqid, struct parcel *rilp,
 
 	if (ril == NULL
 		|| ril->parent == NULL
-		|| ril->parent->command_queue == NULL)
+		|| ril->parent->sent_table == NULL)
 			return 0;
 
 	p = ril->parent;
@@ -1150,7 +1258,7 @@ gint g_ril_send(GRil *ril, const gint reqid, struct parcel *rilp,
 
 	p->next_cmd_id++;
 
-	g_queue_push_tail(p->command_queue, r);
+	g_queue_push_tail(&p->command_queue[r->lane], r);
 
 	ril_wakeup_writer(p);
 
@@ -33,6 +33,7 @@
 #include <glib.h>
 
 #include "ringbuffer.h"
+#include "frametrace.h"
 #include "grilio.h"
 #include "grilutil.h"
 
@@ -55,6 +56,7 @@ struct _GRilIO {
 	GRilDisconnectFunc write_done_func;	/* tx empty notifier */
 	gpointer write_done_data;		/* tx empty data */
 	gboolean destroyed;			/* Re-entrancy guard */
+	struct frame_trace *trace;		/* Binary frame trace */
 };
 
 static void read_watcher_destroy_notify(gpointer user_data)
@@ -64,6 +66,9 @@ static void read_watcher_destroy_notify(gpointer user_data)
 	ring_buffer_free(io->buf);
 	io->buf = NULL;
 
+	frame_trace_close(io->trace);
+	io->trace = NULL;
+
 	io->debugf = NULL;
 	io->debug_data = NULL;
 
@@ -113,8 +118,11 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 
 		total_read += rbytes;
 
-		if (rbytes > 0)
+		if (rbytes > 0) {
+			frame_trace_record(io->trace, FRAME_TRACE_RX,
+						buf, rbytes);
 			ring_buffer_write_advance(io->buf, rbytes);
+		}
 
 	} while (status == G_IO_STATUS_NORMAL && rbytes > 0 &&
 					read_count < io->max_read_attempts);
@@ -151,6 +159,8 @@ gsize g_ril_io_write(GRilIO *io, const gchar *data, gsize count)
 	g_ril_util_debug_hexdump(FALSE, (guchar *) data, bytes_written,
 				io->debugf, io->debug_data);
 
+	frame_trace_record(io->trace, FRAME_TRACE_TX, data, bytes_written);
+
 	return bytes_written;
 }
 
@@ -219,6 +229,8 @@ static GRilIO *create_io(GIOChannel *channel, GIOFlags flags)
 				received_data, io,
 				read_watcher_destroy_notify);
 
+	io->trace = frame_trace_open(FRAME_TRACE_RIL);
+
 	return io;
 
 error:
@@ -55,11 +55,45 @@ void parcel_init(struct parcel *p)
 	p->malformed = 0;
 }
 
+/*
+ * Grow by at least size bytes, but never by less than the current capacity
+ * so that building a parcel one field at a time stays linear.
+ */
 void parcel_grow(struct parcel *p, size_t size)
 {
-	char *new = g_realloc(p->data, p->capacity + size);
-	p->data = new;
-	p->capacity += size;
+	size_t capacity = p->capacity * 2;
+
+	if (capacity < p->capacity + size)
+		capacity = p->capacity + size;
+
+	p->data = g_realloc(p->data, capacity);
+	p->capacity = capacity;
+}
+
+/*
+ * The ASCII checks below are written as plain reductions over a known
+ * length so that the compiler can vectorize them.
+ */
+static gboolean is_ascii(const char *str, size_t len)
+{
+	unsigned char acc = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		acc |= (unsigned char) str[i];
+
+	return acc < 0x80;
+}
+
+static gboolean is_ascii16(const char16_t *str, size_t len)
+{
+	char16_t acc = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		acc |= str[i];
+
+	return acc < 0x80;
 }
 
 void parcel_free(struct parcel *p)
@@ -108,7 +142,7 @@ int parcel_w_int32(struct parcel *p, int32_t val)
 
 int parcel_w_string(struct parcel *p, const char *str)
 {
-	gunichar2 *gs16;
+	gunichar2 *gs16 = NULL;
 	glong gs16_len;
 	size_t len;
 	size_t gs16_size;
@@ -118,10 +152,20 @@ int parcel_w_string(struct parcel *p, const char *str)
 		return 0;
 	}
 
-	gs16 = g_utf8_to_utf16(str, -1, NULL, &gs16_len, NULL);
+	/* ASCII maps 1:1 to UTF-16, skip the conversion */
+	len = strlen(str);
+	if (is_ascii(str, len)) {
+		gs16_len = len;
+	} else {
+		gs16 = g_utf8_to_utf16(str, -1, NULL, &gs16_len, NULL);
+		if (gs16 == NULL)
+			return -1;
+	}
 
-	if (parcel_w_int32(p, gs16_len) == -1)
+	if (parcel_w_int32(p, gs16_len) == -1) {
+		g_free(gs16);
 		return -1;
+	}
 
 	gs16_size = gs16_len * sizeof(char16_t);
 	len = gs16_size + sizeof(char16_t);
@@ -130,9 +174,19 @@ int parcel_w_string(struct parcel *p, const char *str)
 
 		if (p->offset + len < p->capacity) {
 			/* There's enough space */
-			memcpy(p->data + p->offset, gs16, gs16_size);
-			*((char16_t *) (void *)
-				(p->data + p->offset + gs16_size)) = 0;
+			char16_t *dst = (char16_t *) (void *)
+						(p->data + p->offset);
+
+			if (gs16) {
+				memcpy(dst, gs16, gs16_size);
+			} else {
+				glong i;
+
+				for (i = 0; i < gs16_len; i++)
+					dst[i] = (unsigned char) str[i];
+			}
+
+			dst[gs16_len] = 0;
 			p->offset += padded;
 			p->size += padded;
 			if (padded != len) {
@@ -166,9 +220,13 @@ int parcel_w_string(struct parcel *p, const char *str)
 	return 0;
 }
 
-char *parcel_r_string(struct parcel *p)
+/*
+ * Consume a string and return its UTF-16 characters, which stay owned by
+ * the parcel. Returns NULL for a null string or a malformed parcel.
+ */
+static const char16_t *parcel_r_string16(struct parcel *p, int *len)
 {
-	char *ret;
+	const char16_t *ret;
 	int len16 = parcel_r_int32(p);
 	int strbytes;
 
@@ -186,38 +244,110 @@ char *parcel_r_string(struct parcel *p)
 		return NULL;
 	}
 
-	ret = g_utf16_to_utf8((gunichar2 *) (void *) (p->data + p->offset),
-				len16, NULL, NULL, NULL);
+	ret = (const char16_t *) (void *) (p->data + p->offset);
+	p->offset += strbytes;
+	*len = len16;
+
+	return ret;
+}
+
+char *parcel_r_string(struct parcel *p)
+{
+	const char16_t *str16;
+	char *ret;
+	int len16;
+	int i;
+
+	str16 = parcel_r_string16(p, &len16);
+	if (str16 == NULL)
+		return NULL;
+
+	if (is_ascii16(str16, len16)) {
+		ret = g_malloc(len16 + 1);
+
+		for (i = 0; i < len16; i++)
+			ret[i] = str16[i];
+
+		ret[len16] = '\0';
+		return ret;
+	}
+
+	ret = g_utf16_to_utf8((const gunichar2 *) str16, len16,
+				NULL, NULL, NULL);
 	if (ret == NULL) {
 		ofono_error("%s: wrong UTF16 coding", __func__);
 		p->malformed = 1;
 		return NULL;
 	}
 
-	p->offset += strbytes;
-
 	return ret;
 }
 
-void parcel_skip_string(struct parcel *p)
+/*
+ * Like parcel_r_string(), but decodes into buf, which must be at least one
+ * byte long. A string that does not fit is truncated on a character
+ * boundary. Returns buf, or NULL for a null string or a malformed parcel.
+ */
+char *parcel_r_string_buf(struct parcel *p, char *buf, size_t size)
 {
-	int len16 = parcel_r_int32(p);
-	int strbytes;
+	const char16_t *str16;
+	size_t n = 0;
+	int len16;
+	int i;
 
-	if (p->malformed)
-		return;
+	str16 = parcel_r_string16(p, &len16);
+	if (str16 == NULL)
+		return NULL;
 
-	/* This is how a null string is sent */
-	if (len16 < 0)
-		return;
+	if (is_ascii16(str16, len16)) {
+		n = MIN((size_t) len16, size - 1);
 
-	strbytes = PAD_SIZE((len16 + 1) * sizeof(char16_t));
-	if (p->offset + strbytes > p->size) {
-		p->malformed = 1;
-		return;
+		for (i = 0; i < (int) n; i++)
+			buf[i] = str16[i];
+
+		buf[n] = '\0';
+		return buf;
 	}
 
-	p->offset += strbytes;
+	for (i = 0; i < len16 && str16[i]; i++) {
+		gunichar c = str16[i];
+		char utf8[6];
+		int utf8_len;
+
+		if (c >= 0xdc00 && c < 0xe000)
+			goto error;
+
+		if (c >= 0xd800 && c < 0xdc00) {
+			if (i + 1 == len16 || str16[i + 1] < 0xdc00 ||
+					str16[i + 1] >= 0xe000)
+				goto error;
+
+			c = 0x10000 + ((c - 0xd800) << 10) +
+						(str16[++i] - 0xdc00);
+		}
+
+		utf8_len = g_unichar_to_utf8(c, utf8);
+		if (n + utf8_len >= size)
+			break;
+
+		memcpy(buf + n, utf8, utf8_len);
+		n += utf8_len;
+	}
+
+	buf[n] = '\0';
+	return buf;
+
+error:
+	ofono_error("%s: wrong UTF16 coding", __func__);
+	p->malformed = 1;
+	return NULL;
+}
+
+void parcel_skip_string(struct parcel *p)
+{
+	int len16;
+
+	parcel_r_string16(p, &len16);
 }
 
 int parcel_w_raw(struct parcel *p, const void *data, size_t len)
@@ -138,6 +138,11 @@ typedef void (*ofono_sim_set_active_card_slot_cb_t)(
 
 struct ofono_sim_driver {
 	const char *name;
+	/*
+	 * Number of file reads that may be in flight at once, 0 or 1 reads
+	 * one file at a time.  Replies are still delivered in request order
+	 */
+	unsigned int max_pending_reads;
 	int (*probe)(struct ofono_sim *sim, unsigned int vendor, void *data);
 	void (*remove)(struct ofono_sim *sim);
 	void (*read_file_info)(struct ofono_sim *sim, int fileid,
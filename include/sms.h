@@ -44,6 +44,13 @@ typedef void (*ofono_sms_bearer_query_cb_t)(const struct ofono_error *error,
 
 struct ofono_sms_driver {
 	const char *name;
+	/*
+	 * Number of submits that may be in flight at once, 0 or 1 sends
+	 * one PDU at a time.  Replies may come back in any order.  Drivers
+	 * whose transport runs one command at a time, like AT and RIL,
+	 * gain only the next command being queued ahead of the reply
+	 */
+	unsigned int max_pending_submits;
 	int (*probe)(struct ofono_sms *sms, unsigned int vendor, void *data);
 	void (*remove)(struct ofono_sms *sms);
 	void (*sca_query)(struct ofono_sms *sms, ofono_sms_sca_query_cb_t cb,
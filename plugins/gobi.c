@@ -47,6 +47,7 @@
 #include <ofono/location-reporting.h>
 #include <ofono/log.h>
 #include <ofono/message-waiting.h>
+#include <ofono/storage.h>
 
 #include <drivers/qmimodem/qmi.h>
 #include <drivers/qmimodem/dms.h>
@@ -68,9 +69,16 @@
 struct gobi_data {
 	struct qmi_device *device;
 	struct qmi_service *dms;
+	GSList *services;
+	uint8_t service_types[8];
+	unsigned int n_service_types;
 	unsigned long features;
 	unsigned int discover_attempts;
 	uint8_t oper_mode;
+	unsigned int startup_pending;
+	bool startup_failed;
+	char *imei;
+	char *revision;
 };
 
 static void gobi_debug(const char *str, void *user_data)
@@ -104,9 +112,13 @@ static void gobi_remove(struct ofono_modem *modem)
 	ofono_modem_set_data(modem, NULL);
 
 	qmi_service_unref(data->dms);
+	g_slist_free_full(data->services,
+				(GDestroyNotify) qmi_service_unref);
 
 	qmi_device_unref(data->device);
 
+	g_free(data->imei);
+	g_free(data->revision);
 	g_free(data);
 }
 
@@ -134,6 +146,10 @@ static void shutdown_device(struct ofono_modem *modem)
 	qmi_service_unref(data->dms);
 	data->dms = NULL;
 
+	g_slist_free_full(data->services,
+				(GDestroyNotify) qmi_service_unref);
+	data->services = NULL;
+
 	qmi_device_shutdown(data->device, shutdown_cb, modem, NULL);
 }
 
@@ -203,6 +219,70 @@ static void get_oper_mode_cb(struct qmi_result *result, void *user_data)
 	}
 }
 
+static void discover_cb(void *user_data);
+
+/*
+ * GET_CAPS and, unless on QRTR, the identity queries confirming a cached
+ * discovery are sent together.  Once the last reply is in, the modem
+ * either goes on with GET_OPER_MODE or discovers the device again.
+ */
+static void startup_reply(struct ofono_modem *modem)
+{
+	struct gobi_data *data = ofono_modem_get_data(modem);
+	char *identity;
+	bool valid = true;
+
+	if (--data->startup_pending > 0)
+		return;
+
+	if (data->startup_failed)
+		goto error;
+
+	if (!ofono_modem_get_boolean(modem, "QRTRDevice")) {
+		/* The same firmware on one device reports the same services */
+		identity = g_strdup_printf("%s/%s",
+					data->imei ? data->imei : "",
+					data->revision ? data->revision : "");
+		valid = qmi_device_check_discovery_cache(data->device,
+								identity);
+		g_free(identity);
+	}
+
+	g_free(data->imei);
+	data->imei = NULL;
+	g_free(data->revision);
+	data->revision = NULL;
+
+	if (valid) {
+		if (qmi_service_send(data->dms, QMI_DMS_GET_OPER_MODE, NULL,
+					get_oper_mode_cb, modem, NULL) > 0)
+			return;
+
+		goto error;
+	}
+
+	/* Drop what came out of the cache and discover the device again */
+	qmi_service_unref(data->dms);
+	data->dms = NULL;
+
+	g_slist_free_full(data->services,
+				(GDestroyNotify) qmi_service_unref);
+	data->services = NULL;
+
+	data->features = 0;
+
+	if (qmi_device_discover(data->device, discover_cb, modem, NULL))
+		return;
+
+error:
+	g_free(data->imei);
+	data->imei = NULL;
+	g_free(data->revision);
+	data->revision = NULL;
+
+	shutdown_device(modem);
+}
+
 static void get_caps_cb(struct qmi_result *result, void *user_data)
 {
 	struct ofono_modem *modem = user_data;
@@ -226,41 +306,144 @@ static void get_caps_cb(struct qmi_result *result, void *user_data)
         for (i = 0; i < caps->radio_if_count; i++)
                 DBG("radio = %d", caps->radio_if[i]);
 
-	if (qmi_service_send(data->dms, QMI_DMS_GET_OPER_MODE, NULL,
-					get_oper_mode_cb, modem, NULL) > 0)
-		return;
+	startup_reply(modem);
+	return;
 
 error:
-	shutdown_device(modem);
+	data->startup_failed = true;
+	startup_reply(modem);
 }
 
-static void create_dms_cb(struct qmi_service *service, void *user_data)
+static void get_rev_id_cb(struct qmi_result *result, void *user_data)
 {
 	struct ofono_modem *modem = user_data;
 	struct gobi_data *data = ofono_modem_get_data(modem);
+	char *revision;
 
 	DBG("");
 
-	if (!service)
+	if (!qmi_result_set_error(result, NULL)) {
+		revision = qmi_result_get_string(result,
+						QMI_DMS_RESULT_REV_ID);
+		data->revision = g_strdup(revision);
+		qmi_free(revision);
+	}
+
+	startup_reply(modem);
+}
+
+static void get_ids_cb(struct qmi_result *result, void *user_data)
+{
+	struct ofono_modem *modem = user_data;
+	struct gobi_data *data = ofono_modem_get_data(modem);
+	char *imei;
+
+	DBG("");
+
+	/* Devices without an IMEI are told apart by their firmware only */
+	if (!qmi_result_set_error(result, NULL)) {
+		imei = qmi_result_get_string(result, QMI_DMS_RESULT_IMEI);
+		data->imei = g_strdup(imei);
+		qmi_free(imei);
+	}
+
+	startup_reply(modem);
+}
+
+static void startup_send(struct ofono_modem *modem, uint16_t message,
+						qmi_result_func_t func)
+{
+	struct gobi_data *data = ofono_modem_get_data(modem);
+
+	if (qmi_service_send(data->dms, message, NULL, func, modem, NULL) > 0)
+		data->startup_pending += 1;
+	else
+		data->startup_failed = true;
+}
+
+static void create_services_cb(struct qmi_service **services,
+							void *user_data)
+{
+	struct ofono_modem *modem = user_data;
+	struct gobi_data *data = ofono_modem_get_data(modem);
+	unsigned int i;
+
+	DBG("");
+
+	/* The DMS client is always requested first */
+	if (!services[0])
 		goto error;
 
-	data->dms = qmi_service_ref(service);
+	data->dms = qmi_service_ref(services[0]);
 
-	if (qmi_service_send(data->dms, QMI_DMS_GET_CAPS, NULL,
-					get_caps_cb, modem, NULL) > 0)
-		return;
+	/*
+	 * Keep the remaining clients around, the atom drivers pick them up
+	 * through qmi_service_create_shared without another CTL round trip.
+	 */
+	for (i = 1; i < data->n_service_types; i++) {
+		if (!services[i])
+			continue;
+
+		data->services = g_slist_prepend(data->services,
+						qmi_service_ref(services[i]));
+	}
+
+	g_free(data->imei);
+	data->imei = NULL;
+	g_free(data->revision);
+	data->revision = NULL;
+
+	/* Held until all the requests below are sent */
+	data->startup_pending = 1;
+	data->startup_failed = false;
+
+	startup_send(modem, QMI_DMS_GET_CAPS, get_caps_cb);
+
+	if (!ofono_modem_get_boolean(modem, "QRTRDevice")) {
+		startup_send(modem, QMI_DMS_GET_IDS, get_ids_cb);
+		startup_send(modem, QMI_DMS_GET_REV_ID, get_rev_id_cb);
+	}
+
+	startup_reply(modem);
+	return;
 
 error:
 	shutdown_device(modem);
 }
 
-static void create_shared_dms(void *user_data)
+static void create_services(void *user_data)
 {
 	struct ofono_modem *modem = user_data;
 	struct gobi_data *data = ofono_modem_get_data(modem);
+	static const struct {
+		unsigned long feature;
+		uint8_t type;
+	} optional[] = {
+		{ GOBI_NAS,	QMI_SERVICE_NAS		},
+		{ GOBI_WDS,	QMI_SERVICE_WDS		},
+		{ GOBI_WMS,	QMI_SERVICE_WMS		},
+		{ GOBI_UIM,	QMI_SERVICE_UIM		},
+		{ GOBI_VOICE,	QMI_SERVICE_VOICE	},
+		{ GOBI_PDS,	QMI_SERVICE_PDS		},
+		{ GOBI_WDA,	QMI_SERVICE_WDA		},
+	};
+	unsigned int i;
+
+	data->n_service_types = 0;
+	data->service_types[data->n_service_types++] = QMI_SERVICE_DMS;
+
+	for (i = 0; i < G_N_ELEMENTS(optional); i++) {
+		if (!(data->features & optional[i].feature))
+			continue;
+
+		data->service_types[data->n_service_types++] =
+							optional[i].type;
+	}
 
-	qmi_service_create_shared(data->device, QMI_SERVICE_DMS,
-				  create_dms_cb, modem, NULL);
+	if (!qmi_service_create_shared_multi(data->device,
+				data->service_types, data->n_service_types,
+				create_services_cb, modem, NULL))
+		shutdown_device(modem);
 }
 
 static void discover_cb(void *user_data)
@@ -308,9 +491,9 @@ static void discover_cb(void *user_data)
 	}
 
 	if (qmi_device_is_sync_supported(data->device))
-		qmi_device_sync(data->device, create_shared_dms, modem);
+		qmi_device_sync(data->device, create_services, modem);
 	else
-		create_shared_dms(modem);
+		create_services(modem);
 }
 
 static int gobi_qrtr_enable(struct ofono_modem *modem)
@@ -336,6 +519,7 @@ static int gobi_enable(struct ofono_modem *modem)
 {
 	struct gobi_data *data = ofono_modem_get_data(modem);
 	const char *device;
+	char *node, *cache;
 	int fd;
 
 	DBG("%p", modem);
@@ -362,6 +546,17 @@ static int gobi_enable(struct ofono_modem *modem)
 
 	qmi_device_set_close_on_unref(data->device, true);
 
+	/*
+	 * Discovery results are cached per control node, the cache is
+	 * only trusted once IMEI and firmware revision match, see
+	 * startup_reply.
+	 */
+	node = g_path_get_basename(device);
+	cache = g_strdup_printf("%s/qmi-%s", ofono_storage_dir(), node);
+	qmi_device_set_discovery_cache(data->device, cache);
+	g_free(cache);
+	g_free(node);
+
 	qmi_device_discover(data->device, discover_cb, modem, NULL);
 
 	return -EINPROGRESS;
@@ -32,6 +32,7 @@
 #define OFONO_ERROR_INTERFACE "org.ofono.Error"
 
 static DBusConnection *g_connection;
+static ofono_dbus_property_notify_func property_notify;
 
 struct error_mapping_entry {
 	int error;
@@ -231,6 +232,9 @@ int ofono_dbus_signal_property_changed(DBusConnection *conn,
 
 	append_variant(&iter, type, value);
 
+	if (property_notify)
+		property_notify(path, interface, name);
+
 	return g_dbus_send_message(conn, signal);
 }
 
@@ -257,6 +261,9 @@ int ofono_dbus_signal_array_property_changed(DBusConnection *conn,
 
 	append_array_variant(&iter, type, value);
 
+	if (property_notify)
+		property_notify(path, interface, name);
+
 	return g_dbus_send_message(conn, signal);
 }
 
@@ -283,6 +290,9 @@ int ofono_dbus_signal_dict_property_changed(DBusConnection *conn,
 
 	append_dict_variant(&iter, type, value);
 
+	if (property_notify)
+		property_notify(path, interface, name);
+
 	return g_dbus_send_message(conn, signal);
 }
 
@@ -485,6 +495,11 @@ static void dbus_gsm_set_connection(DBusConnection *conn)
 	g_connection = conn;
 }
 
+void __ofono_dbus_set_property_notify(ofono_dbus_property_notify_func func)
+{
+	property_notify = func;
+}
+
 int __ofono_dbus_init(DBusConnection *conn)
 {
 	dbus_gsm_set_connection(conn);
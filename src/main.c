@@ -35,6 +35,7 @@
 #include <ell/ell.h>
 
 #include "ofono.h"
+#include "storage.h"
 
 #define SHUTDOWN_GRACE_SECONDS 10
 
@@ -291,6 +292,8 @@ int main(int argc, char **argv)
 
 	__ofono_modemwatch_cleanup();
 
+	storage_cleanup();
+
 	__ofono_dbus_cleanup();
 	dbus_connection_unref(conn);
 
@@ -33,8 +33,11 @@
 #include "ofono.h"
 
 #include "common.h"
+#include "latency.h"
 
 #define DEFAULT_POWERED_TIMEOUT (20)
+#define TIMELINE_MAX_EVENTS 256
+#define TIMELINE_SETTLE_TIME (10 * G_USEC_PER_SEC)
 
 static GSList *g_devinfo_drivers;
 static GSList *g_driver_list;
@@ -45,6 +48,7 @@ static gboolean powering_down;
 static int modems_remaining;
 
 static struct ofono_watchlist *g_modemwatches;
+static unsigned int latency_owner_depth;
 
 enum property_type {
 	PROPERTY_TYPE_INVALID = 0,
@@ -90,6 +94,15 @@ struct ofono_modem {
 	void			*driver_data;
 	char			*driver_type;
 	char			*name;
+	GArray			*timeline;
+	GHashTable		*timeline_interfaces;
+	gint64			timeline_end;
+};
+
+struct timeline_event {
+	gint64 time;
+	const char *event;
+	char *subject;
 };
 
 struct ofono_devinfo {
@@ -139,6 +152,145 @@ static const char *modem_type_to_string(enum ofono_modem_type type)
 	return "unknown";
 }
 
+static const char *const atom_type_names[] = {
+	[OFONO_ATOM_TYPE_DEVINFO] = "devinfo",
+	[OFONO_ATOM_TYPE_CALL_BARRING] = "call-barring",
+	[OFONO_ATOM_TYPE_CALL_FORWARDING] = "call-forwarding",
+	[OFONO_ATOM_TYPE_CALL_METER] = "call-meter",
+	[OFONO_ATOM_TYPE_CALL_SETTINGS] = "call-settings",
+	[OFONO_ATOM_TYPE_NETREG] = "netreg",
+	[OFONO_ATOM_TYPE_PHONEBOOK] = "phonebook",
+	[OFONO_ATOM_TYPE_SMS] = "sms",
+	[OFONO_ATOM_TYPE_SIM] = "sim",
+	[OFONO_ATOM_TYPE_USSD] = "ussd",
+	[OFONO_ATOM_TYPE_VOICECALL] = "voicecall",
+	[OFONO_ATOM_TYPE_HISTORY] = "history",
+	[OFONO_ATOM_TYPE_SSN] = "ssn",
+	[OFONO_ATOM_TYPE_MESSAGE_WAITING] = "message-waiting",
+	[OFONO_ATOM_TYPE_CBS] = "cbs",
+	[OFONO_ATOM_TYPES_CALL_VOLUME] = "call-volume",
+	[OFONO_ATOM_TYPE_GPRS] = "gprs",
+	[OFONO_ATOM_TYPE_GPRS_CONTEXT] = "gprs-context",
+	[OFONO_ATOM_TYPE_RADIO_SETTINGS] = "radio-settings",
+	[OFONO_ATOM_TYPE_AUDIO_SETTINGS] = "audio-settings",
+	[OFONO_ATOM_TYPE_STK] = "stk",
+	[OFONO_ATOM_TYPE_NETTIME] = "nettime",
+	[OFONO_ATOM_TYPE_CTM] = "ctm",
+	[OFONO_ATOM_TYPE_CDMA_VOICECALL_MANAGER] = "cdma-voicecall",
+	[OFONO_ATOM_TYPE_CDMA_CONNMAN] = "cdma-connman",
+	[OFONO_ATOM_TYPE_SIM_AUTH] = "sim-auth",
+	[OFONO_ATOM_TYPE_EMULATOR_DUN] = "emulator-dun",
+	[OFONO_ATOM_TYPE_EMULATOR_HFP] = "emulator-hfp",
+	[OFONO_ATOM_TYPE_LOCATION_REPORTING] = "location-reporting",
+	[OFONO_ATOM_TYPE_GNSS] = "gnss",
+	[OFONO_ATOM_TYPE_CDMA_SMS] = "cdma-sms",
+	[OFONO_ATOM_TYPE_CDMA_NETREG] = "cdma-netreg",
+	[OFONO_ATOM_TYPE_HANDSFREE] = "handsfree",
+	[OFONO_ATOM_TYPE_SIRI] = "siri",
+	[OFONO_ATOM_TYPE_NETMON] = "netmon",
+	[OFONO_ATOM_TYPE_LTE] = "lte",
+	[OFONO_ATOM_TYPE_IMS] = "ims",
+};
+
+static const char *atom_type_to_string(enum ofono_atom_type type)
+{
+	if (type < G_N_ELEMENTS(atom_type_names) && atom_type_names[type])
+		return atom_type_names[type];
+
+	return "unknown";
+}
+
+static void timeline_event_clear(gpointer data)
+{
+	struct timeline_event *event = data;
+
+	g_free(event->subject);
+}
+
+/*
+ * The startup timeline records when the modem, its atoms and their D-Bus
+ * interfaces come up, see GetStartupTimeline in doc/debug-api.txt.  It
+ * starts over whenever the modem is powered down and is capped so that a
+ * modem flapping its properties cannot grow it without bound.
+ */
+static void timeline_add(struct ofono_modem *modem, const char *event,
+				const char *subject)
+{
+	struct timeline_event entry;
+
+	if (modem->timeline == NULL) {
+		modem->timeline = g_array_sized_new(FALSE, FALSE,
+						sizeof(struct timeline_event),
+						64);
+		g_array_set_clear_func(modem->timeline, timeline_event_clear);
+	}
+
+	if (modem->timeline->len >= TIMELINE_MAX_EVENTS)
+		return;
+
+	entry.time = g_get_monotonic_time();
+	entry.event = event;
+	entry.subject = g_strdup(subject);
+
+	g_array_append_val(modem->timeline, entry);
+}
+
+static void timeline_reset(struct ofono_modem *modem)
+{
+	modem->timeline_end = 0;
+
+	if (modem->timeline_interfaces)
+		g_hash_table_remove_all(modem->timeline_interfaces);
+
+	if (modem->timeline == NULL)
+		return;
+
+	g_array_set_size(modem->timeline, 0);
+}
+
+static void timeline_property(const char *path, const char *interface,
+				const char *name)
+{
+	struct ofono_modem *modem = NULL;
+	GSList *l;
+	char *subject;
+
+	for (l = g_modem_list; l; l = l->next) {
+		struct ofono_modem *candidate = l->data;
+
+		if (g_str_equal(candidate->path, path)) {
+			modem = candidate;
+			break;
+		}
+	}
+
+	/* Nothing is recorded between powering down and up again */
+	if (modem == NULL || modem->timeline == NULL ||
+			modem->timeline->len == 0 ||
+			modem->timeline->len >= TIMELINE_MAX_EVENTS)
+		return;
+
+	/* Nor once startup is over */
+	if (modem->timeline_end &&
+			g_get_monotonic_time() > modem->timeline_end)
+		return;
+
+	if (modem->timeline_interfaces == NULL)
+		modem->timeline_interfaces = g_hash_table_new_full(g_str_hash,
+							g_str_equal,
+							g_free, NULL);
+
+	/* Only the first property signalled on each interface is kept */
+	if (g_hash_table_contains(modem->timeline_interfaces, interface))
+		return;
+
+	g_hash_table_add(modem->timeline_interfaces, g_strdup(interface));
+
+	subject = g_strconcat(interface, ".", name, NULL);
+	timeline_add(modem, "PropertyChanged", subject);
+	g_free(subject);
+}
+
 unsigned int __ofono_modem_callid_next(struct ofono_modem *modem)
 {
 	unsigned int i;
@@ -222,6 +374,8 @@ struct ofono_atom *__ofono_modem_add_atom(struct ofono_modem *modem,
 
 	modem->atoms = g_slist_prepend(modem->atoms, atom);
 
+	timeline_add(modem, "AtomCreated", atom_type_to_string(type));
+
 	return atom;
 }
 
@@ -282,6 +436,9 @@ void __ofono_atom_register(struct ofono_atom *atom,
 
 	atom->unregister = unregister;
 
+	timeline_add(atom->modem, "AtomRegistered",
+			atom_type_to_string(atom->type));
+
 	call_watches(atom, OFONO_ATOM_WATCH_CONDITION_REGISTERED);
 }
 
@@ -498,6 +655,9 @@ static void set_online(struct ofono_modem *modem, ofono_bool_t new_online)
 
 	modem->online = new_online;
 
+	if (new_online)
+		timeline_add(modem, "Online", modem->path);
+
 	ofono_dbus_signal_property_changed(conn, modem->path,
 						OFONO_MODEM_INTERFACE,
 						"Online", DBUS_TYPE_BOOLEAN,
@@ -506,6 +666,22 @@ static void set_online(struct ofono_modem *modem, ofono_bool_t new_online)
 	notify_online_watches(modem);
 }
 
+/*
+ * Transports created from within driver callbacks have their latency
+ * statistics attributed to the modem, see org.ofono.Debug
+ */
+static void latency_owner_begin(struct ofono_modem *modem)
+{
+	if (latency_owner_depth++ == 0)
+		latency_set_owner(modem->path);
+}
+
+static void latency_owner_end(void)
+{
+	if (--latency_owner_depth == 0)
+		latency_set_owner(NULL);
+}
+
 static void modem_change_state(struct ofono_modem *modem,
 				enum modem_state new_state)
 {
@@ -522,17 +698,24 @@ static void modem_change_state(struct ofono_modem *modem,
 	if (old_state > new_state)
 		flush_atoms(modem, new_state);
 
+	latency_owner_begin(modem);
+
 	switch (new_state) {
 	case MODEM_STATE_POWER_OFF:
 		modem->call_ids = 0;
+		timeline_reset(modem);
 		break;
 
 	case MODEM_STATE_PRE_SIM:
+		timeline_add(modem, "State", "pre-sim");
+
 		if (old_state < MODEM_STATE_PRE_SIM && driver->pre_sim)
 			driver->pre_sim(modem);
 		break;
 
 	case MODEM_STATE_OFFLINE:
+		timeline_add(modem, "State", "offline");
+
 		if (old_state < MODEM_STATE_OFFLINE) {
 			if (driver->post_sim)
 				driver->post_sim(modem);
@@ -544,11 +727,19 @@ static void modem_change_state(struct ofono_modem *modem,
 		break;
 
 	case MODEM_STATE_ONLINE:
+		timeline_add(modem, "State", "online");
+
+		/* Leaves time for the atoms coming up once online */
+		modem->timeline_end = g_get_monotonic_time() +
+						TIMELINE_SETTLE_TIME;
+
 		if (driver->post_online)
 			driver->post_online(modem);
 
 		break;
 	}
+
+	latency_owner_end();
 }
 
 unsigned int __ofono_modem_add_online_watch(struct ofono_modem *modem,
@@ -913,7 +1104,11 @@ static int set_powered(struct ofono_modem *modem, ofono_bool_t powered)
 	if (driver == NULL)
 		return -EINVAL;
 
+	latency_owner_begin(modem);
+
 	if (powered == TRUE) {
+		timeline_add(modem, "PowerOn", driver->name);
+
 		if (driver->enable)
 			err = driver->enable(modem);
 	} else {
@@ -921,9 +1116,14 @@ static int set_powered(struct ofono_modem *modem, ofono_bool_t powered)
 			err = driver->disable(modem);
 	}
 
+	latency_owner_end();
+
 	if (err == 0) {
 		modem->powered = powered;
 		notify_powered_watches(modem);
+
+		if (powered)
+			timeline_add(modem, "Powered", modem->path);
 	} else if (err != -EINPROGRESS)
 		modem->powered_pending = modem->powered;
 
@@ -1188,6 +1388,189 @@ static const GDBusSignalTable modem_signals[] = {
 	{ }
 };
 
+static void append_latency_buckets(DBusMessageIter *dict,
+					const struct latency_hist *hist)
+{
+	DBusMessageIter entry, value, array, bucket;
+	const char *key = "Buckets";
+	unsigned int i;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY,
+						NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT,
+					DBUS_TYPE_ARRAY_AS_STRING
+					DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_UINT32_AS_STRING
+					DBUS_TYPE_UINT32_AS_STRING
+					DBUS_STRUCT_END_CHAR_AS_STRING,
+					&value);
+	dbus_message_iter_open_container(&value, DBUS_TYPE_ARRAY,
+					DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_UINT32_AS_STRING
+					DBUS_TYPE_UINT32_AS_STRING
+					DBUS_STRUCT_END_CHAR_AS_STRING,
+					&array);
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		dbus_uint32_t lower;
+
+		if (hist->buckets[i] == 0)
+			continue;
+
+		lower = latency_bucket_lower(i);
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+							NULL, &bucket);
+		dbus_message_iter_append_basic(&bucket, DBUS_TYPE_UINT32,
+						&lower);
+		dbus_message_iter_append_basic(&bucket, DBUS_TYPE_UINT32,
+						&hist->buckets[i]);
+		dbus_message_iter_close_container(&array, &bucket);
+	}
+
+	dbus_message_iter_close_container(&value, &array);
+	dbus_message_iter_close_container(&entry, &value);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_latency_histogram(const char *transport,
+					const char *command,
+					const struct latency_hist *hist,
+					void *user_data)
+{
+	DBusMessageIter *array = user_data;
+	DBusMessageIter dict;
+	dbus_uint32_t value;
+
+	dbus_message_iter_open_container(array, DBUS_TYPE_ARRAY,
+					OFONO_PROPERTIES_ARRAY_SIGNATURE,
+					&dict);
+
+	ofono_dbus_dict_append(&dict, "Transport", DBUS_TYPE_STRING,
+				&transport);
+	ofono_dbus_dict_append(&dict, "Command", DBUS_TYPE_STRING, &command);
+	ofono_dbus_dict_append(&dict, "Count", DBUS_TYPE_UINT32,
+				&hist->count);
+
+	value = hist->sum / hist->count;
+	ofono_dbus_dict_append(&dict, "Average", DBUS_TYPE_UINT32, &value);
+
+	ofono_dbus_dict_append(&dict, "Maximum", DBUS_TYPE_UINT32,
+				&hist->max);
+
+	value = latency_hist_percentile(hist, 50);
+	ofono_dbus_dict_append(&dict, "Median", DBUS_TYPE_UINT32, &value);
+
+	value = latency_hist_percentile(hist, 90);
+	ofono_dbus_dict_append(&dict, "Percentile90", DBUS_TYPE_UINT32,
+				&value);
+
+	value = latency_hist_percentile(hist, 99);
+	ofono_dbus_dict_append(&dict, "Percentile99", DBUS_TYPE_UINT32,
+				&value);
+
+	append_latency_buckets(&dict, hist);
+
+	dbus_message_iter_close_container(array, &dict);
+}
+
+static DBusMessage *debug_get_latency(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	struct ofono_modem *modem = data;
+	DBusMessage *reply;
+	DBusMessageIter iter;
+	DBusMessageIter array;
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply == NULL)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+					DBUS_TYPE_ARRAY_AS_STRING
+					OFONO_PROPERTIES_ARRAY_SIGNATURE,
+					&array);
+
+	latency_foreach(modem->path, append_latency_histogram, &array);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return reply;
+}
+
+static DBusMessage *debug_reset_latency(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	struct ofono_modem *modem = data;
+
+	latency_reset(modem->path);
+
+	return dbus_message_new_method_return(msg);
+}
+
+static DBusMessage *debug_get_timeline(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	struct ofono_modem *modem = data;
+	DBusMessage *reply;
+	DBusMessageIter iter;
+	DBusMessageIter array;
+	DBusMessageIter entry;
+	GArray *timeline = modem->timeline;
+	unsigned int i;
+
+	reply = dbus_message_new_method_return(msg);
+	if (reply == NULL)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+					DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_UINT64_AS_STRING
+					DBUS_TYPE_STRING_AS_STRING
+					DBUS_TYPE_STRING_AS_STRING
+					DBUS_STRUCT_END_CHAR_AS_STRING,
+					&array);
+
+	/* Offsets are in microseconds from the first event */
+	for (i = 0; timeline && i < timeline->len; i++) {
+		struct timeline_event *event = &g_array_index(timeline,
+						struct timeline_event, i);
+		dbus_uint64_t offset = event->time -
+			g_array_index(timeline, struct timeline_event, 0).time;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+							NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64,
+						&offset);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+						&event->event);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+						&event->subject);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return reply;
+}
+
+static const GDBusMethodTable debug_methods[] = {
+	{ GDBUS_METHOD("GetLatencyHistograms",
+			NULL, GDBUS_ARGS({ "histograms", "aa{sv}" }),
+			debug_get_latency) },
+	{ GDBUS_METHOD("ResetLatencyHistograms", NULL, NULL,
+			debug_reset_latency) },
+	{ GDBUS_METHOD("GetStartupTimeline",
+			NULL, GDBUS_ARGS({ "timeline", "a(tss)" }),
+			debug_get_timeline) },
+	{ }
+};
+
 void ofono_modem_set_powered(struct ofono_modem *modem, ofono_bool_t powered)
 {
 	DBusConnection *conn = ofono_dbus_get_connection();
@@ -1218,6 +1601,9 @@ void ofono_modem_set_powered(struct ofono_modem *modem, ofono_bool_t powered)
 	modem->powered = powered;
 	notify_powered_watches(modem);
 
+	if (powered)
+		timeline_add(modem, "Powered", modem->path);
+
 	if (modem->lockdown)
 		ofono_dbus_signal_property_changed(conn, modem->path,
 					OFONO_MODEM_INTERFACE,
@@ -1334,6 +1720,8 @@ void ofono_modem_add_interface(struct ofono_modem *modem,
 	modem->interface_list = g_slist_prepend(modem->interface_list,
 						g_strdup(interface));
 
+	timeline_add(modem, "InterfaceAdded", interface);
+
 	feature = get_feature(interface);
 	if (feature)
 		modem->feature_list = g_slist_prepend(modem->feature_list,
@@ -1924,6 +2312,8 @@ struct ofono_modem *ofono_modem_create(const char *name, const char *type)
 	if (name == NULL)
 		next_modem_id += 1;
 
+	timeline_add(modem, "Created", type);
+
 	return modem;
 }
 
@@ -1946,10 +2336,14 @@ static void sim_watch(struct ofono_atom *atom,
 void __ofono_modemwatch_init(void)
 {
 	g_modemwatches = __ofono_watchlist_new(g_free);
+
+	__ofono_dbus_set_property_notify(timeline_property);
 }
 
 void __ofono_modemwatch_cleanup(void)
 {
+	__ofono_dbus_set_property_notify(NULL);
+
 	__ofono_watchlist_free(g_modemwatches);
 }
 
@@ -2047,6 +2441,8 @@ int ofono_modem_register(struct ofono_modem *modem)
 	if (modem->driver != NULL)
 		return -EALREADY;
 
+	latency_owner_begin(modem);
+
 	for (l = g_driver_list; l; l = l->next) {
 		const struct ofono_modem_driver *drv = l->data;
 
@@ -2060,9 +2456,13 @@ int ofono_modem_register(struct ofono_modem *modem)
 		break;
 	}
 
+	latency_owner_end();
+
 	if (modem->driver == NULL)
 		return -ENODEV;
 
+	timeline_add(modem, "Registered", modem->driver->name);
+
 	if (!g_dbus_register_interface(conn, modem->path,
 					OFONO_MODEM_INTERFACE,
 					modem_methods, modem_signals, NULL,
@@ -2077,6 +2477,9 @@ int ofono_modem_register(struct ofono_modem *modem)
 		return -EIO;
 	}
 
+	g_dbus_register_interface(conn, modem->path, OFONO_DEBUG_INTERFACE,
+					debug_methods, NULL, NULL, modem, NULL);
+
 	g_free(modem->driver_type);
 	modem->driver_type = NULL;
 
@@ -2157,6 +2560,7 @@ static void modem_unregister(struct ofono_modem *modem)
 					&modem->lockdown);
 	}
 
+	g_dbus_unregister_interface(conn, modem->path, OFONO_DEBUG_INTERFACE);
 	g_dbus_unregister_interface(conn, modem->path, OFONO_MODEM_INTERFACE);
 
 	if (modem->driver && modem->driver->remove)
@@ -2183,6 +2587,12 @@ void ofono_modem_remove(struct ofono_modem *modem)
 
 	g_modem_list = g_slist_remove(g_modem_list, modem);
 
+	if (modem->timeline)
+		g_array_free(modem->timeline, TRUE);
+
+	if (modem->timeline_interfaces)
+		g_hash_table_destroy(modem->timeline_interfaces);
+
 	g_free(modem->driver_type);
 	g_free(modem->name);
 	g_free(modem->path);
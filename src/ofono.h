@@ -49,6 +49,12 @@ void __ofono_log_enable(struct ofono_debug_desc *start,
 int __ofono_dbus_init(DBusConnection *conn);
 void __ofono_dbus_cleanup(void);
 
+typedef void (*ofono_dbus_property_notify_func)(const char *path,
+						const char *interface,
+						const char *name);
+
+void __ofono_dbus_set_property_notify(ofono_dbus_property_notify_func func);
+
 DBusMessage *__ofono_error_invalid_args(DBusMessage *msg);
 DBusMessage *__ofono_error_invalid_format(DBusMessage *msg);
 DBusMessage *__ofono_error_not_implemented(DBusMessage *msg);
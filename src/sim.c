@@ -1644,6 +1644,7 @@ static void sim_set_ready(struct ofono_sim *sim)
 	sim->state = OFONO_SIM_STATE_READY;
 
 	sim_fs_check_version(sim->simfs);
+	sim_fs_history_ready(sim->simfs);
 
 	call_state_watches(sim);
 }
@@ -2118,6 +2119,9 @@ static void sim_initialize_after_pin(struct ofono_sim *sim)
 {
 	sim->context = ofono_sim_context_create(sim);
 
+	/* Get the files this SIM needed last time on their way */
+	sim_fs_history_start(sim->simfs, sim->iccid);
+
 	/*
 	 * Discover applications on SIM
 	 */
@@ -2763,6 +2767,8 @@ static void sim_free_main_state(struct ofono_sim *sim)
 
 	sim_spn_close(sim);
 
+	sim_fs_history_stop(sim->simfs);
+
 	if (sim->context) {
 		ofono_sim_context_free(sim->context);
 		sim->context = NULL;
@@ -25,8 +25,10 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #include <glib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -44,16 +46,155 @@
 #define SIM_CACHE_BASEPATH STORAGEDIR "/%s-%i"
 #define SIM_CACHE_VERSION SIM_CACHE_BASEPATH "/version"
 #define SIM_CACHE_PATH SIM_CACHE_BASEPATH "/%04x"
+#define SIM_CACHE_PACK SIM_CACHE_BASEPATH "/pack"
 #define SIM_CACHE_HEADER_SIZE 39
 #define SIM_FILE_INFO_SIZE 7
 #define SIM_IMAGE_CACHE_BASEPATH STORAGEDIR "/%s-%i/images"
 #define SIM_IMAGE_CACHE_PATH SIM_IMAGE_CACHE_BASEPATH "/%d.xpm"
+#define SIM_HISTORY_PATH STORAGEDIR "/%s/sim_history"
 
-#define SIM_FS_VERSION 2
+/* Bytes of recently read cacheable EFs kept in memory */
+#define SIM_LRU_BUDGET (32 * 1024)
+
+/*
+ * EFs read from the time the PIN is verified until SIM_HISTORY_WINDOW
+ * seconds after the SIM became ready, keyed by ICCID.  On the next
+ * boot they are read in one batch as soon as the PIN is verified.
+ */
+#define SIM_HISTORY_VERSION 1
+#define SIM_HISTORY_WINDOW 10
+#define SIM_HISTORY_MAX 32
+#define SIM_HISTORY_ENTRY_SIZE 10
+
+#define SIM_FS_VERSION 3
+
+/*
+ * All cached EFs of a SIM are kept in a single pack file, which stays
+ * mapped while the SIM is present.  A fixed size index at the start maps
+ * file ids to a region of the data area.  The region of an EF is
+ * allocated at the end of the data area when its file info is cached and
+ * holds the contents at the same offsets as on the SIM.  The header of
+ * an index entry has the same layout as the header of the per-EF cache
+ * files used up to version 2: the file info, then a bitmap of the blocks
+ * or records present in the region.
+ *
+ * The blocks of the file are reserved up front, so that running out of
+ * space shows as a failure to grow rather than a SIGBUS on first store.
+ * Bits of newly cached blocks are kept aside until the data has been
+ * synced, so the index never claims a block that is not on disk.  The
+ * sync is deferred by SIM_PACK_SYNC_DELAY so the files read during SIM
+ * initialization share one.
+ *
+ * The pack is shared by all the sim_fs of a SIM, e.g. the USIM and ISIM
+ * ones, so that they see the same mapping.  Since either may start the
+ * pack over, a sim_fs only uses the slot of its current op while the
+ * generation of the pack is the one it was taken in.
+ */
+#define SIM_PACK_MAGIC 0x4b504653	/* "SFPK" */
+#define SIM_PACK_VERSION 1
+#define SIM_PACK_ENTRIES 128
+#define SIM_PACK_GROW 16384
+#define SIM_PACK_MAX_SIZE (1024 * 1024)
+#define SIM_PACK_SYNC_DELAY 1000
+#define SIM_PACK_DATA_START (sizeof(struct sim_pack_header) + \
+			SIM_PACK_ENTRIES * sizeof(struct sim_pack_entry))
+
+struct sim_pack_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entries;
+	uint32_t data_end;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct sim_pack_entry {
+	uint16_t id;
+	uint8_t valid;
+	uint8_t reserved;
+	uint32_t offset;
+	uint32_t length;
+	unsigned char header[SIM_CACHE_HEADER_SIZE];
+	uint8_t padding;
+} __attribute__((packed));
+
+struct sim_pack {
+	int refcount;
+	char *imsi;
+	enum ofono_sim_phase phase;
+	int fd;
+	unsigned char *map;
+	size_t size;
+	unsigned int generation;
+	gboolean dirty;
+	guint sync_source;
+	unsigned char pending[SIM_PACK_ENTRIES]
+				[SIM_CACHE_HEADER_SIZE - SIM_FILE_INFO_SIZE];
+};
+
+static GSList *sim_packs;
 
 static gboolean sim_fs_op_next(gpointer user_data);
 static gboolean sim_fs_op_read_record(gpointer user);
 static gboolean sim_fs_op_read_block(gpointer user_data);
+static void sim_fs_prefetch_schedule(struct sim_fs *fs);
+
+/*
+ * Reads queued behind the current operation are fetched from the driver
+ * ahead of time when it allows more than one read in flight.  The
+ * results are kept here until the operation reaches the head of the
+ * queue, where they are fed through the usual callbacks, so the cache
+ * is written and the callers are notified in request order.
+ */
+struct sim_fs_prefetch {
+	struct sim_fs *fs;
+	struct sim_fs_op *op;		/* NULL once the op is gone */
+	gboolean pending;		/* A driver request is in flight */
+	gboolean head_waiting;		/* The op is at the head, waiting */
+	gboolean info_done;
+	struct ofono_error error;
+	int length;
+	enum ofono_sim_file_structure structure;
+	int record_length;
+	unsigned char access[3];
+	unsigned char file_status;
+	unsigned char *data;
+	int unit_len;
+	int first_unit;
+	int last_unit;
+	int next_unit;			/* Units before this one are in data */
+};
+
+/* Files read by the boot prefetch, kept until the history window ends */
+struct sim_fs_warm {
+	struct sim_fs *fs;
+	struct sim_fs_op *op;		/* The read, NULL once done */
+	int id;
+	enum ofono_sim_file_structure structure;
+	unsigned char path[6];
+	unsigned char path_len;
+	int length;
+	int record_length;
+	unsigned char *data;
+};
+
+/* A whole cacheable EF, most recently read first in sim_fs->lru */
+struct sim_fs_lru_entry {
+	int id;
+	enum ofono_sim_file_structure structure;
+	unsigned char path[6];
+	unsigned char path_len;
+	int length;
+	int record_length;
+	unsigned char *data;
+};
+
+struct sim_fs_history_entry {
+	int id;
+	enum ofono_sim_file_structure structure;
+	unsigned char path[6];
+	unsigned char path_len;
+	gboolean cached;		/* Served by the pack, no need to read */
+};
 
 struct sim_fs_op {
 	int id;
@@ -71,6 +212,9 @@ struct sim_fs_op {
 	gboolean is_read;
 	void *userdata;
 	struct ofono_sim_context *context;
+	struct sim_fs_prefetch *prefetch;
+	gboolean no_prefetch;
+	gboolean cacheable;
 };
 
 struct ofono_sim_context {
@@ -81,20 +225,446 @@ struct ofono_sim_context {
 struct sim_fs {
 	GQueue *op_q;
 	gint op_source;
-	unsigned char bitmap[32];
-	int fd;
+	guint prefetch_source;
+	struct sim_pack *pack;
+	int cache_slot;
+	unsigned int cache_generation;
 	struct ofono_sim *sim;
 	const struct ofono_sim_driver *driver;
 	GSList *contexts;
 	struct ofono_sim_aid_session *session;
 	int session_id;
 	unsigned int watch_id;
+	GList *lru;
+	unsigned int lru_size;
+	GSList *warm;
+	GArray *history;
+	char *history_iccid;
+	guint history_source;
 };
 
+static void sim_fs_op_request_unit(struct sim_fs *fs, struct sim_fs_op *op);
+static void sim_fs_warm_remove(struct sim_fs *fs, int id);
+static void sim_fs_lru_remove(struct sim_fs *fs, int id);
+static void sim_fs_history_mark_cached(struct sim_fs *fs, int id);
+static gboolean sim_fs_op_is_cached(struct sim_fs *fs, struct sim_fs_op *op);
+
+static struct sim_pack_header *sim_pack_header(struct sim_pack *pack)
+{
+	return (struct sim_pack_header *) pack->map;
+}
+
+static struct sim_pack_entry *sim_pack_entry(struct sim_pack *pack, int slot)
+{
+	return (struct sim_pack_entry *) (pack->map +
+				sizeof(struct sim_pack_header) +
+				slot * sizeof(struct sim_pack_entry));
+}
+
+/* Leaves the pack unmapped if the new mapping fails */
+static gboolean sim_pack_resize(struct sim_pack *pack, size_t size)
+{
+	void *map;
+
+	if (pack->map && size == pack->size)
+		return TRUE;
+
+	if (size != pack->size && ftruncate(pack->fd, size) < 0)
+		return FALSE;
+
+	if (posix_fallocate(pack->fd, 0, size) != 0)
+		return FALSE;
+
+	if (pack->map)
+		munmap(pack->map, pack->size);
+
+	pack->map = NULL;
+	pack->size = 0;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pack->fd, 0);
+	if (map == MAP_FAILED)
+		return FALSE;
+
+	pack->map = map;
+	pack->size = size;
+
+	return TRUE;
+}
+
+static void sim_pack_sync(struct sim_pack *pack)
+{
+	gboolean pending = FALSE;
+	int i, j;
+
+	if (pack->sync_source) {
+		g_source_remove(pack->sync_source);
+		pack->sync_source = 0;
+	}
+
+	if (pack->dirty == FALSE || pack->map == NULL)
+		return;
+
+	/* Block data first, then the bits that say it is there */
+	msync(pack->map, pack->size, MS_SYNC);
+
+	for (i = 0; i < SIM_PACK_ENTRIES; i++) {
+		struct sim_pack_entry *entry = sim_pack_entry(pack, i);
+
+		for (j = 0; j < SIM_CACHE_HEADER_SIZE - SIM_FILE_INFO_SIZE;
+									j++) {
+			if (pack->pending[i][j] == 0)
+				continue;
+
+			entry->header[SIM_FILE_INFO_SIZE + j] |=
+							pack->pending[i][j];
+			pack->pending[i][j] = 0;
+			pending = TRUE;
+		}
+	}
+
+	if (pending)
+		msync(pack->map, SIM_PACK_DATA_START, MS_SYNC);
+
+	pack->dirty = FALSE;
+}
+
+static gboolean sim_pack_sync_timeout(gpointer user_data)
+{
+	struct sim_pack *pack = user_data;
+
+	pack->sync_source = 0;
+	sim_pack_sync(pack);
+
+	return FALSE;
+}
+
+static void sim_pack_sync_later(struct sim_pack *pack)
+{
+	if (pack->dirty == FALSE || pack->sync_source)
+		return;
+
+	pack->sync_source = g_timeout_add(SIM_PACK_SYNC_DELAY,
+						sim_pack_sync_timeout, pack);
+}
+
+static gboolean sim_pack_reset(struct sim_pack *pack)
+{
+	struct sim_pack_header *hdr;
+
+	/* Slots taken before are no longer valid */
+	pack->generation += 1;
+
+	/* Drop the index first, in case the file can't be shrunk */
+	if (pack->map)
+		memset(pack->map, 0, MIN(pack->size, SIM_PACK_DATA_START));
+
+	memset(pack->pending, 0, sizeof(pack->pending));
+
+	if (sim_pack_resize(pack, SIM_PACK_DATA_START) == FALSE)
+		return FALSE;
+
+	hdr = sim_pack_header(pack);
+	hdr->magic = SIM_PACK_MAGIC;
+	hdr->version = SIM_PACK_VERSION;
+	hdr->entries = SIM_PACK_ENTRIES;
+	hdr->data_end = SIM_PACK_DATA_START;
+	pack->dirty = TRUE;
+
+	return TRUE;
+}
+
+static gboolean sim_pack_check(struct sim_pack *pack)
+{
+	struct sim_pack_header *hdr = sim_pack_header(pack);
+	int i;
+
+	if (hdr->magic != SIM_PACK_MAGIC || hdr->version != SIM_PACK_VERSION ||
+			hdr->entries != SIM_PACK_ENTRIES ||
+			hdr->data_end < SIM_PACK_DATA_START ||
+			hdr->data_end > pack->size)
+		return FALSE;
+
+	/* Entries pointing outside the data area are dropped */
+	for (i = 0; i < SIM_PACK_ENTRIES; i++) {
+		struct sim_pack_entry *entry = sim_pack_entry(pack, i);
+
+		if (entry->valid == 0)
+			continue;
+
+		if (entry->offset < SIM_PACK_DATA_START ||
+				entry->length > hdr->data_end ||
+				entry->offset > hdr->data_end - entry->length)
+			entry->valid = 0;
+	}
+
+	return TRUE;
+}
+
+static void sim_pack_unref(struct sim_pack *pack)
+{
+	if (--pack->refcount > 0)
+		return;
+
+	sim_packs = g_slist_remove(sim_packs, pack);
+	sim_pack_sync(pack);
+
+	if (pack->map)
+		munmap(pack->map, pack->size);
+
+	L_TFR(close(pack->fd));
+	g_free(pack->imsi);
+	g_free(pack);
+}
+
+static struct sim_pack *sim_pack_open(const char *imsi,
+					enum ofono_sim_phase phase)
+{
+	struct sim_pack *pack;
+	struct stat st;
+	char *path;
+	GSList *l;
+	int fd;
+
+	for (l = sim_packs; l; l = l->next) {
+		pack = l->data;
+
+		if (pack->phase == phase && g_str_equal(pack->imsi, imsi)) {
+			pack->refcount += 1;
+			return pack;
+		}
+	}
+
+	path = g_strdup_printf(SIM_CACHE_PACK, imsi, phase);
+
+	if (create_dirs(path, SIM_CACHE_MODE | S_IXUSR) != 0) {
+		g_free(path);
+		return NULL;
+	}
+
+	fd = L_TFR(open(path, O_RDWR | O_CREAT, SIM_CACHE_MODE));
+	g_free(path);
+
+	if (fd == -1) {
+		DBG("Error %i opening cache pack for IMSI %s", errno, imsi);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		L_TFR(close(fd));
+		return NULL;
+	}
+
+	pack = g_new0(struct sim_pack, 1);
+	pack->refcount = 1;
+	pack->imsi = g_strdup(imsi);
+	pack->phase = phase;
+	pack->fd = fd;
+
+	if (st.st_size >= (off_t) SIM_PACK_DATA_START &&
+			st.st_size <= SIM_PACK_MAX_SIZE) {
+		pack->size = st.st_size;
+		pack->map = mmap(NULL, pack->size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0);
+
+		if (pack->map == MAP_FAILED) {
+			pack->map = NULL;
+			pack->size = 0;
+		}
+
+		/* Packs may be sparse if a previous reservation failed */
+		if (pack->map && posix_fallocate(fd, 0, pack->size) != 0) {
+			munmap(pack->map, pack->size);
+			pack->map = NULL;
+			pack->size = 0;
+		}
+	}
+
+	if ((pack->map && sim_pack_check(pack)) || sim_pack_reset(pack)) {
+		sim_packs = g_slist_prepend(sim_packs, pack);
+		return pack;
+	}
+
+	sim_pack_unref(pack);
+	return NULL;
+}
+
+static int sim_pack_find(struct sim_pack *pack, int id)
+{
+	int i;
+
+	for (i = 0; i < SIM_PACK_ENTRIES; i++) {
+		struct sim_pack_entry *entry = sim_pack_entry(pack, i);
+
+		if (entry->valid && entry->id == id)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the slot of a region of length bytes for the EF, with its file
+ * info set and no blocks present.  The region of an older entry of the
+ * same file is reused when large enough.  Once the index or the file is
+ * full the whole pack is started over.
+ */
+static int sim_pack_add(struct sim_pack *pack, int id,
+				const unsigned char *fileinfo, int length)
+{
+	struct sim_pack_header *hdr;
+	struct sim_pack_entry *entry;
+	size_t end;
+	int slot;
+
+	if ((size_t) length > SIM_PACK_MAX_SIZE - SIM_PACK_DATA_START)
+		return -1;
+
+	slot = sim_pack_find(pack, id);
+
+	if (slot >= 0) {
+		entry = sim_pack_entry(pack, slot);
+
+		if (entry->length >= (uint32_t) length)
+			goto done;
+
+		entry->valid = 0;
+	}
+
+	for (slot = 0; slot < SIM_PACK_ENTRIES; slot++)
+		if (sim_pack_entry(pack, slot)->valid == 0)
+			break;
+
+	hdr = sim_pack_header(pack);
+	end = (hdr->data_end + length + 7) & ~7;
+
+	if (slot == SIM_PACK_ENTRIES || end > SIM_PACK_MAX_SIZE) {
+		if (sim_pack_reset(pack) == FALSE)
+			return -1;
+
+		slot = 0;
+		hdr = sim_pack_header(pack);
+		end = (hdr->data_end + length + 7) & ~7;
+	}
+
+	if (end > pack->size) {
+		size_t size = (end + SIM_PACK_GROW - 1) & ~(SIM_PACK_GROW - 1);
+
+		if (sim_pack_resize(pack, MIN(size, SIM_PACK_MAX_SIZE)) == FALSE)
+			return -1;
+
+		hdr = sim_pack_header(pack);
+	}
+
+	entry = sim_pack_entry(pack, slot);
+	entry->id = id;
+	entry->offset = hdr->data_end;
+	entry->length = length;
+	entry->valid = 1;
+	hdr->data_end = end;
+
+done:
+	memset(entry->header, 0, SIM_CACHE_HEADER_SIZE);
+	memcpy(entry->header, fileinfo, SIM_FILE_INFO_SIZE);
+	memset(pack->pending[slot], 0, sizeof(pack->pending[slot]));
+	pack->dirty = TRUE;
+
+	return slot;
+}
+
+static struct sim_pack *sim_fs_pack(struct sim_fs *fs)
+{
+	const char *imsi = ofono_sim_get_imsi(fs->sim);
+	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
+
+	if (imsi == NULL || phase == OFONO_SIM_PHASE_UNKNOWN)
+		return NULL;
+
+	if (fs->pack && (fs->pack->phase != phase ||
+				g_str_equal(fs->pack->imsi, imsi) == FALSE)) {
+		sim_pack_unref(fs->pack);
+		fs->pack = NULL;
+		fs->cache_slot = -1;
+		sim_fs_lru_remove(fs, -1);
+	}
+
+	if (fs->pack == NULL)
+		fs->pack = sim_pack_open(imsi, phase);
+
+	if (fs->pack == NULL || fs->pack->map == NULL)
+		return NULL;
+
+	return fs->pack;
+}
+
+static void sim_fs_set_cache_slot(struct sim_fs *fs, int slot)
+{
+	fs->cache_slot = slot;
+
+	if (fs->pack)
+		fs->cache_generation = fs->pack->generation;
+}
+
+/* The pack entry of the current op, unless another sim_fs dropped it */
+static struct sim_pack_entry *sim_fs_cache_entry(struct sim_fs *fs)
+{
+	struct sim_pack_entry *entry;
+
+	if (fs->cache_slot < 0 || fs->pack == NULL || fs->pack->map == NULL)
+		return NULL;
+
+	if (fs->cache_generation != fs->pack->generation) {
+		fs->cache_slot = -1;
+		return NULL;
+	}
+
+	entry = sim_pack_entry(fs->pack, fs->cache_slot);
+	if (entry->valid == 0)
+		return NULL;
+
+	return entry;
+}
+
+/* Returns the cached contents of a block or record of the current op */
+static const unsigned char *sim_fs_cached_data(struct sim_fs *fs, int block,
+						int offset, int len)
+{
+	struct sim_pack_entry *entry;
+
+	if (block < 0 || block >= (SIM_CACHE_HEADER_SIZE -
+					SIM_FILE_INFO_SIZE) * 8)
+		return NULL;
+
+	entry = sim_fs_cache_entry(fs);
+	if (entry == NULL)
+		return NULL;
+
+	if (((entry->header[SIM_FILE_INFO_SIZE + block / 8] |
+			fs->pack->pending[fs->cache_slot][block / 8]) &
+						(1 << block % 8)) == 0)
+		return NULL;
+
+	if (offset < 0 || (uint32_t) (offset + len) > entry->length)
+		return NULL;
+
+	return fs->pack->map + entry->offset + offset;
+}
+
+static void sim_fs_prefetch_free(struct sim_fs_prefetch *pf)
+{
+	g_free(pf->data);
+	g_free(pf);
+}
+
 static void sim_fs_op_free(gpointer pointer)
 {
 	struct sim_fs_op *node = pointer;
 
+	/* A request still in flight frees the prefetch when it returns */
+	if (node->prefetch && node->prefetch->pending)
+		node->prefetch->op = NULL;
+	else if (node->prefetch)
+		sim_fs_prefetch_free(node->prefetch);
+
 	g_free(node->buffer);
 	g_free(node);
 }
@@ -109,6 +679,19 @@ void sim_fs_free(struct sim_fs *fs)
 		fs->op_source = 0;
 	}
 
+	if (fs->prefetch_source) {
+		g_source_remove(fs->prefetch_source);
+		fs->prefetch_source = 0;
+	}
+
+	if (fs->pack) {
+		sim_pack_unref(fs->pack);
+		fs->pack = NULL;
+	}
+
+	sim_fs_history_stop(fs);
+	sim_fs_lru_remove(fs, -1);
+
 	/*
 	 * Note: users of sim_fs must not assume that the callback happens
 	 * for operations still in progress
@@ -143,7 +726,7 @@ struct sim_fs *sim_fs_new(struct ofono_sim *sim,
 
 	fs->sim = sim;
 	fs->driver = driver;
-	fs->fd = -1;
+	fs->cache_slot = -1;
 
 	return fs;
 }
@@ -246,6 +829,8 @@ void sim_fs_notify_file_watches(struct sim_fs *fs, int id)
 {
 	GSList *l;
 
+	sim_fs_lru_remove(fs, id);
+
 	for (l = fs->contexts; l; l = l->next) {
 		struct ofono_sim_context *context = l->data;
 		GSList *k;
@@ -273,74 +858,237 @@ static void sim_fs_end_current(struct sim_fs *fs)
 	else if (fs->watch_id) /* release the session if no pending reads */
 		__ofono_sim_remove_session_watch(fs->session, fs->watch_id);
 
-	if (fs->fd != -1) {
-		L_TFR(close(fs->fd));
-		fs->fd = -1;
-	}
+	/* What the ops add to the cache goes out together, later */
+	if (fs->pack)
+		sim_pack_sync_later(fs->pack);
 
-	memset(fs->bitmap, 0, sizeof(fs->bitmap));
+	fs->cache_slot = -1;
 
 	sim_fs_op_free(op);
+
+	sim_fs_prefetch_schedule(fs);
 }
 
 static void sim_fs_op_error(struct sim_fs *fs)
 {
 	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
 
-	if (op->cb == NULL) {
-		sim_fs_end_current(fs);
+	if (op->cb == NULL) {
+		sim_fs_end_current(fs);
+		return;
+	}
+
+	if (op->info_only == TRUE)
+		((sim_fs_read_info_cb_t) op->cb)
+			(0, 0, 0, 0, op->userdata);
+	else if (op->is_read == TRUE)
+		((ofono_sim_file_read_cb_t) op->cb)
+			(0, 0, 0, 0, 0, op->userdata);
+	else
+		((ofono_sim_file_write_cb_t) op->cb)
+			(0, op->userdata);
+
+	sim_fs_end_current(fs);
+}
+
+/*
+ * Completes the read at the head of the queue with the whole contents
+ * of its file.  The callbacks may drop the memory data came from, so
+ * they get a copy
+ */
+static gboolean sim_fs_op_deliver(struct sim_fs *fs, const unsigned char *data,
+					int length, int record_length)
+{
+	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	ofono_sim_file_read_cb_t cb;
+	int num_bytes;
+	int i;
+
+	if (op->structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT) {
+		num_bytes = op->num_bytes ? op->num_bytes : length;
+
+		if (op->offset + num_bytes > length)
+			return FALSE;
+
+		op->buffer = g_memdup(data + op->offset, num_bytes);
+
+		cb = op->cb;
+		cb(1, num_bytes, 0, op->buffer, length, op->userdata);
+
+		sim_fs_end_current(fs);
+		return TRUE;
+	}
+
+	if (record_length <= 0)
+		return FALSE;
+
+	op->buffer = g_memdup(data, length);
+	op->length = length;
+	op->record_length = record_length;
+
+	for (i = 1; i <= op->length / op->record_length && op->cb; i++) {
+		cb = op->cb;
+		cb(1, op->length, i, op->buffer + (i - 1) * op->record_length,
+				op->record_length, op->userdata);
+	}
+
+	sim_fs_end_current(fs);
+	return TRUE;
+}
+
+static struct sim_fs_lru_entry *sim_fs_lru_find(struct sim_fs *fs,
+						struct sim_fs_op *op)
+{
+	GList *l;
+
+	for (l = fs->lru; l; l = l->next) {
+		struct sim_fs_lru_entry *e = l->data;
+
+		if (e->id == op->id && e->structure == op->structure &&
+				e->path_len == op->path_len &&
+				memcmp(e->path, op->path, op->path_len) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+static void sim_fs_lru_unlink(struct sim_fs *fs, struct sim_fs_lru_entry *e)
+{
+	fs->lru = g_list_remove(fs->lru, e);
+	fs->lru_size -= e->length;
+
+	g_free(e->data);
+	g_free(e);
+}
+
+/* Id of -1 drops everything */
+static void sim_fs_lru_remove(struct sim_fs *fs, int id)
+{
+	GList *l = fs->lru;
+
+	while (l) {
+		struct sim_fs_lru_entry *e = l->data;
+
+		l = l->next;
+
+		if (id == -1 || e->id == id)
+			sim_fs_lru_unlink(fs, e);
+	}
+}
+
+/* Records of cacheable files are collected for sim_fs_lru_store */
+static void sim_fs_op_keep_record(struct sim_fs_op *op,
+					const unsigned char *data)
+{
+	if (op->cacheable == FALSE)
+		return;
+
+	if (op->buffer == NULL) {
+		op->buffer = g_try_malloc0(op->length);
+
+		if (op->buffer == NULL) {
+			op->cacheable = FALSE;
+			return;
+		}
+	}
+
+	memcpy(op->buffer + (op->current - 1) * op->record_length, data,
+			op->record_length);
+}
+
+/* Remembers the contents of the op once a whole cacheable file is read */
+static void sim_fs_lru_store(struct sim_fs *fs, struct sim_fs_op *op)
+{
+	struct sim_fs_lru_entry *e;
+
+	if (op->cacheable == FALSE || op->buffer == NULL)
+		return;
+
+	if (op->length <= 0 || op->length > SIM_LRU_BUDGET)
+		return;
+
+	if (op->structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT &&
+			(op->offset != 0 || op->num_bytes != op->length))
+		return;
+
+	/* Tied to the IMSI of the pack, which drops it for another SIM */
+	if (sim_fs_pack(fs) == NULL)
+		return;
+
+	e = sim_fs_lru_find(fs, op);
+	if (e)
+		sim_fs_lru_unlink(fs, e);
+
+	e = g_try_new0(struct sim_fs_lru_entry, 1);
+	if (e == NULL)
+		return;
+
+	e->data = g_try_malloc(op->length);
+	if (e->data == NULL) {
+		g_free(e);
 		return;
 	}
 
-	if (op->info_only == TRUE)
-		((sim_fs_read_info_cb_t) op->cb)
-			(0, 0, 0, 0, op->userdata);
-	else if (op->is_read == TRUE)
-		((ofono_sim_file_read_cb_t) op->cb)
-			(0, 0, 0, 0, 0, op->userdata);
-	else
-		((ofono_sim_file_write_cb_t) op->cb)
-			(0, op->userdata);
+	memcpy(e->data, op->buffer, op->length);
+	e->id = op->id;
+	e->structure = op->structure;
+	memcpy(e->path, op->path, op->path_len);
+	e->path_len = op->path_len;
+	e->length = op->length;
+	e->record_length = op->record_length;
 
-	sim_fs_end_current(fs);
+	fs->lru = g_list_prepend(fs->lru, e);
+	fs->lru_size += e->length;
+
+	while (fs->lru_size > SIM_LRU_BUDGET)
+		sim_fs_lru_unlink(fs, g_list_last(fs->lru)->data);
 }
 
-static gboolean cache_block(struct sim_fs *fs, int block, int block_len,
-				const unsigned char *data, int num_bytes)
+/* Serves the read at the head of the queue from memory */
+static gboolean sim_fs_op_check_lru(struct sim_fs *fs)
 {
-	int offset;
-	int bit;
-	ssize_t r;
-	unsigned char b;
+	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_lru_entry *e;
 
-	if (fs->fd == -1)
+	if (op->info_only || fs->session || fs->lru == NULL)
 		return FALSE;
 
-	if (lseek(fs->fd, block * block_len +
-				SIM_CACHE_HEADER_SIZE, SEEK_SET) == (off_t) -1)
+	if (sim_fs_pack(fs) == NULL)
 		return FALSE;
 
-	r = L_TFR(write(fs->fd, data, num_bytes));
-
-	if (r != num_bytes)
+	e = sim_fs_lru_find(fs, op);
+	if (e == NULL)
 		return FALSE;
 
-	/* update present bit for this block */
-	offset = block / 8;
-	bit = block % 8;
+	fs->lru = g_list_remove(fs->lru, e);
+	fs->lru = g_list_prepend(fs->lru, e);
+
+	return sim_fs_op_deliver(fs, e->data, e->length, e->record_length);
+}
 
-	/* lseek to correct byte (skip file info) */
-	lseek(fs->fd, offset + SIM_FILE_INFO_SIZE, SEEK_SET);
+static gboolean cache_block(struct sim_fs *fs, int block, int block_len,
+				const unsigned char *data, int num_bytes)
+{
+	struct sim_pack_entry *entry;
 
-	b = fs->bitmap[offset];
-	b |= 1 << bit;
+	/* Blocks beyond what the bitmap can describe are not cached */
+	if (block >= (SIM_CACHE_HEADER_SIZE - SIM_FILE_INFO_SIZE) * 8)
+		return FALSE;
 
-	r = L_TFR(write(fs->fd, &b, sizeof(b)));
+	entry = sim_fs_cache_entry(fs);
+	if (entry == NULL)
+		return FALSE;
 
-	if (r != sizeof(b))
+	if ((uint32_t) (block * block_len + num_bytes) > entry->length)
 		return FALSE;
 
-	fs->bitmap[offset] = b;
+	memcpy(fs->pack->map + entry->offset + block * block_len,
+			data, num_bytes);
+
+	/* Set in the index by sim_pack_sync once the data is on disk */
+	fs->pack->pending[fs->cache_slot][block / 8] |= 1 << block % 8;
+	fs->pack->dirty = TRUE;
 
 	return TRUE;
 }
@@ -412,6 +1160,8 @@ static void sim_fs_op_read_block_cb(const struct ofono_error *error,
 	if (op->current > end_block) {
 		ofono_sim_file_read_cb_t cb = op->cb;
 
+		sim_fs_lru_store(fs, op);
+
 		cb(1, op->num_bytes, 0, op->buffer,
 				op->record_length, op->userdata);
 
@@ -427,7 +1177,6 @@ static gboolean sim_fs_op_read_block(gpointer user_data)
 	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
 	int start_block;
 	int end_block;
-	unsigned short read_bytes;
 
 	fs->op_source = 0;
 
@@ -448,37 +1197,32 @@ static gboolean sim_fs_op_read_block(gpointer user_data)
 		}
 	}
 
-	while (fs->fd != -1 && op->current <= end_block) {
-		int offset = op->current / 8;
-		int bit = 1 << op->current % 8;
+	while (op->current <= end_block) {
+		const unsigned char *cached;
 		int bufoff;
 		int seekoff;
 		int toread;
 
-		if ((fs->bitmap[offset] & bit) == 0)
-			break;
-
 		if (op->current == start_block) {
 			bufoff = 0;
-			seekoff = SIM_CACHE_HEADER_SIZE + op->current * 256 +
-				op->offset % 256;
+			seekoff = op->current * 256 + op->offset % 256;
 			toread = MIN(256 - op->offset % 256,
 					op->num_bytes - op->current * 256);
 		} else {
 			bufoff = (op->current - start_block - 1) * 256 +
 					op->offset % 256;
-			seekoff = SIM_CACHE_HEADER_SIZE + op->current * 256;
+			seekoff = op->current * 256;
 			toread = MIN(256, op->num_bytes - op->current * 256);
 		}
 
+		cached = sim_fs_cached_data(fs, op->current, seekoff, toread);
+		if (cached == NULL)
+			break;
+
 		DBG("bufoff: %d, seekoff: %d, toread: %d",
 				bufoff, seekoff, toread);
 
-		if (lseek(fs->fd, seekoff, SEEK_SET) == (off_t) -1)
-			break;
-
-		if (L_TFR(read(fs->fd, op->buffer + bufoff, toread)) != toread)
-			break;
+		memcpy(op->buffer + bufoff, cached, toread);
 
 		op->current += 1;
 	}
@@ -486,6 +1230,8 @@ static gboolean sim_fs_op_read_block(gpointer user_data)
 	if (op->current > end_block) {
 		ofono_sim_file_read_cb_t cb = op->cb;
 
+		sim_fs_lru_store(fs, op);
+
 		cb(1, op->num_bytes, 0, op->buffer,
 				op->record_length, op->userdata);
 
@@ -494,18 +1240,7 @@ static gboolean sim_fs_op_read_block(gpointer user_data)
 		return FALSE;
 	}
 
-	if (fs->driver->read_file_transparent == NULL) {
-		sim_fs_op_error(fs);
-		return FALSE;
-	}
-
-	read_bytes = MIN(op->length - op->current * 256, 256);
-	fs->driver->read_file_transparent(fs->sim, op->id,
-						op->current * 256,
-						read_bytes,
-						op->path_len ? op->path : NULL,
-						op->path_len,
-						sim_fs_op_read_block_cb, fs);
+	sim_fs_op_request_unit(fs, op);
 
 	return FALSE;
 }
@@ -526,12 +1261,16 @@ static void sim_fs_op_retrieve_cb(const struct ofono_error *error,
 
 	cache_block(fs, op->current - 1, op->record_length,
 			data, op->record_length);
+	sim_fs_op_keep_record(op, data);
 
 	if (cb == NULL) {
 		sim_fs_end_current(fs);
 		return;
 	}
 
+	if (op->current == total)
+		sim_fs_lru_store(fs, op);
+
 	cb(1, op->length, op->current, data, op->record_length, op->userdata);
 
 	if (op->current < total) {
@@ -546,7 +1285,6 @@ static gboolean sim_fs_op_read_record(gpointer user)
 {
 	struct sim_fs *fs = user;
 	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	const struct ofono_sim_driver *driver = fs->driver;
 	int total = op->length / op->record_length;
 	unsigned char buf[256];
 
@@ -557,21 +1295,22 @@ static gboolean sim_fs_op_read_record(gpointer user)
 		return FALSE;
 	}
 
-	while (fs->fd != -1 && op->current <= total) {
-		int offset = (op->current - 1) / 8;
-		int bit = 1 << ((op->current - 1) % 8);
+	while (op->current <= total) {
 		ofono_sim_file_read_cb_t cb = op->cb;
+		const unsigned char *cached;
 
-		if ((fs->bitmap[offset] & bit) == 0)
+		cached = sim_fs_cached_data(fs, op->current - 1,
+					(op->current - 1) * op->record_length,
+					op->record_length);
+		if (cached == NULL)
 			break;
 
-		if (lseek(fs->fd, (op->current - 1) * op->record_length +
-				SIM_CACHE_HEADER_SIZE, SEEK_SET) == (off_t) -1)
-			break;
+		/* The callback may flush the cache, hand it a copy */
+		memcpy(buf, cached, op->record_length);
+		sim_fs_op_keep_record(op, buf);
 
-		if (L_TFR(read(fs->fd, buf, op->record_length)) !=
-				op->record_length)
-			break;
+		if (op->current == total)
+			sim_fs_lru_store(fs, op);
 
 		cb(1, op->length, op->current,
 				buf, op->record_length, op->userdata);
@@ -585,32 +1324,7 @@ static gboolean sim_fs_op_read_record(gpointer user)
 		return FALSE;
 	}
 
-	switch (op->structure) {
-	case OFONO_SIM_FILE_STRUCTURE_FIXED:
-		if (driver->read_file_linear == NULL) {
-			sim_fs_op_error(fs);
-			return FALSE;
-		}
-
-		driver->read_file_linear(fs->sim, op->id, op->current,
-						op->record_length,
-						NULL, 0,
-						sim_fs_op_retrieve_cb, fs);
-		break;
-	case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
-		if (driver->read_file_cyclic == NULL) {
-			sim_fs_op_error(fs);
-			return FALSE;
-		}
-
-		driver->read_file_cyclic(fs->sim, op->id, op->current,
-						op->record_length,
-						NULL, 0,
-						sim_fs_op_retrieve_cb, fs);
-		break;
-	default:
-		ofono_error("Unrecognized file structure, this can't happen");
-	}
+	sim_fs_op_request_unit(fs, op);
 
 	return FALSE;
 }
@@ -624,14 +1338,12 @@ static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
 					unsigned char file_status)
 {
 	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	const char *imsi = ofono_sim_get_imsi(fs->sim);
-	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
 	enum sim_file_access update;
 	enum sim_file_access invalidate;
 	enum sim_file_access rehabilitate;
-	unsigned char fileinfo[SIM_CACHE_HEADER_SIZE];
+	unsigned char fileinfo[SIM_FILE_INFO_SIZE];
+	struct sim_pack *pack;
 	gboolean cache;
-	char *path;
 
 	/* TS 11.11, Section 9.3 */
 	update = file_access_condition_decode(access[0] & 0xf);
@@ -646,10 +1358,14 @@ static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
 			(rehabilitate == SIM_FILE_ACCESS_ADM ||
 				rehabilitate == SIM_FILE_ACCESS_NEVER);
 
-	if (imsi == NULL || phase == OFONO_SIM_PHASE_UNKNOWN || cache == FALSE)
+	if (cache == FALSE)
 		return;
 
-	memset(fileinfo, 0, SIM_CACHE_HEADER_SIZE);
+	op->cacheable = TRUE;
+
+	pack = sim_fs_pack(fs);
+	if (pack == NULL)
+		return;
 
 	fileinfo[0] = error->type;
 	fileinfo[1] = length >> 8;
@@ -659,19 +1375,10 @@ static void sim_fs_op_cache_fileinfo(struct sim_fs *fs,
 	fileinfo[5] = record_length & 0xff;
 	fileinfo[6] = file_status;
 
-	path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, op->id);
-	fs->fd = L_TFR(open(path, O_WRONLY | O_CREAT | O_TRUNC, SIM_CACHE_MODE));
-	g_free(path);
-
-	if (fs->fd == -1)
-		return;
-
-	if (L_TFR(write(fs->fd, fileinfo, SIM_CACHE_HEADER_SIZE)) ==
-			SIM_CACHE_HEADER_SIZE)
-		return;
+	sim_fs_set_cache_slot(fs, sim_pack_add(pack, op->id, fileinfo, length));
 
-	L_TFR(close(fs->fd));
-	fs->fd = -1;
+	if (fs->cache_slot >= 0)
+		sim_fs_history_mark_cached(fs, op->id);
 }
 
 static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
@@ -740,95 +1447,389 @@ static void sim_fs_op_info_cb(const struct ofono_error *error, int length,
 
 static gboolean sim_fs_op_check_cached(struct sim_fs *fs)
 {
-	const char *imsi = ofono_sim_get_imsi(fs->sim);
-	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
 	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
-	char *path;
-	int fd;
-	ssize_t len;
-	unsigned char fileinfo[SIM_CACHE_HEADER_SIZE];
+	struct sim_pack *pack = sim_fs_pack(fs);
+	struct sim_pack_entry *entry;
+	const unsigned char *fileinfo;
+	int slot;
 	int error_type;
 	int file_length;
 	enum ofono_sim_file_structure structure;
 	int record_length;
 	unsigned char file_status;
 
-	if (imsi == NULL || phase == OFONO_SIM_PHASE_UNKNOWN)
+	if (pack == NULL)
 		return FALSE;
 
-	path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, op->id);
+	slot = sim_pack_find(pack, op->id);
+	if (slot < 0)
+		return FALSE;
+
+	entry = sim_pack_entry(pack, slot);
+	fileinfo = entry->header;
+
+	error_type = fileinfo[0];
+	file_length = (fileinfo[1] << 8) | fileinfo[2];
+	structure = fileinfo[3];
+	record_length = (fileinfo[4] << 8) | fileinfo[5];
+	file_status = fileinfo[6];
+
+	if (structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT)
+		record_length = file_length;
 
-	if (path == NULL)
+	if (record_length == 0 || file_length < record_length ||
+			entry->length < (uint32_t) file_length)
 		return FALSE;
 
-	fd = L_TFR(open(path, O_RDWR));
-	g_free(path);
+	op->length = file_length;
+	op->record_length = record_length;
+	sim_fs_set_cache_slot(fs, slot);
+	op->cacheable = TRUE;
+	sim_fs_history_mark_cached(fs, op->id);
 
-	if (fd == -1) {
-		if (errno != ENOENT)
-			DBG("Error %i opening cache file for "
-					"fileid %04x, IMSI %s",
-					errno, op->id, imsi);
+	if (error_type != OFONO_ERROR_TYPE_NO_ERROR ||
+			structure != op->structure) {
+		sim_fs_op_error(fs);
+		return TRUE;
+	}
+
+	if (op->info_only == TRUE) {
+		/*
+		 * It's an info-only request, so there is no need to request
+		 * actual contents of the EF. Just return the EF-info.
+		 */
+		sim_fs_read_info_cb_t cb = op->cb;
+
+		cb(1, file_status, op->length,
+			op->record_length, op->userdata);
+
+		sim_fs_end_current(fs);
+	} else if (structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT) {
+		if (op->num_bytes == 0)
+			op->num_bytes = op->length;
+
+		op->current = op->offset / 256;
+		fs->op_source = g_idle_add(sim_fs_op_read_block, fs);
+	} else {
+		op->current = 1;
+		fs->op_source = g_idle_add(sim_fs_op_read_record, fs);
+	}
+
+	return TRUE;
+}
+
+static struct sim_fs_warm *sim_fs_warm_find(struct sim_fs *fs,
+						struct sim_fs_op *op)
+{
+	GSList *l;
+
+	for (l = fs->warm; l; l = l->next) {
+		struct sim_fs_warm *w = l->data;
+
+		if (w->id == op->id && w->structure == op->structure &&
+				w->path_len == op->path_len &&
+				memcmp(w->path, op->path, op->path_len) == 0)
+			return w;
+	}
+
+	return NULL;
+}
+
+static void sim_fs_warm_free(gpointer pointer)
+{
+	struct sim_fs_warm *w = pointer;
+
+	/* The read still queued for it just runs without a callback */
+	if (w->op)
+		w->op->cb = NULL;
+
+	g_free(w->data);
+	g_free(w);
+}
+
+/* Id of -1 drops everything */
+static void sim_fs_warm_remove(struct sim_fs *fs, int id)
+{
+	GSList *l = fs->warm;
+
+	while (l) {
+		struct sim_fs_warm *w = l->data;
+
+		l = l->next;
+
+		if (id != -1 && w->id != id)
+			continue;
+
+		fs->warm = g_slist_remove(fs->warm, w);
+		sim_fs_warm_free(w);
+	}
+}
+
+static void sim_fs_warm_read_cb(int ok, int total_length, int record,
+				const unsigned char *data,
+				int record_length, void *userdata)
+{
+	struct sim_fs_warm *w = userdata;
+	struct sim_fs *fs = w->fs;
+
+	if (!ok || total_length <= 0 || record_length <= 0)
+		goto drop;
+
+	if (w->data == NULL) {
+		w->data = g_try_malloc(total_length);
+		if (w->data == NULL)
+			goto drop;
+
+		w->length = total_length;
+		w->record_length = record_length;
+	}
+
+	if (record == 0) {
+		memcpy(w->data, data, total_length);
+		w->op = NULL;
+		return;
+	}
+
+	if (record_length != w->record_length ||
+			record * record_length > w->length)
+		goto drop;
+
+	memcpy(w->data + (record - 1) * record_length, data, record_length);
+
+	if (record == w->length / record_length)
+		w->op = NULL;
+
+	return;
+
+drop:
+	fs->warm = g_slist_remove(fs->warm, w);
+	sim_fs_warm_free(w);
+}
+
+static void sim_fs_warm_read(struct sim_fs *fs, const unsigned char *entry)
+{
+	struct sim_fs_warm *w;
+	struct sim_fs_op *op;
+
+	switch (entry[2]) {
+	case OFONO_SIM_FILE_STRUCTURE_TRANSPARENT:
+	case OFONO_SIM_FILE_STRUCTURE_FIXED:
+	case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
+		break;
+	default:
+		return;
+	}
+
+	if (entry[3] > sizeof(op->path))
+		return;
+
+	op = g_try_new0(struct sim_fs_op, 1);
+	if (op == NULL)
+		return;
+
+	op->id = (entry[0] << 8) | entry[1];
+	op->structure = entry[2];
+	op->path_len = entry[3];
+	memcpy(op->path, entry + 4, op->path_len);
+	op->is_read = TRUE;
+
+	if (sim_fs_warm_find(fs, op)) {
+		g_free(op);
+		return;
+	}
+
+	w = g_try_new0(struct sim_fs_warm, 1);
+	if (w == NULL) {
+		g_free(op);
+		return;
+	}
+
+	w->fs = fs;
+	w->op = op;
+	w->id = op->id;
+	w->structure = op->structure;
+	memcpy(w->path, op->path, op->path_len);
+	w->path_len = op->path_len;
+	fs->warm = g_slist_prepend(fs->warm, w);
+
+	op->cb = sim_fs_warm_read_cb;
+	op->userdata = w;
+
+	if (fs->op_q == NULL)
+		fs->op_q = g_queue_new();
+
+	g_queue_push_tail(fs->op_q, op);
+
+	if (g_queue_get_length(fs->op_q) == 1)
+		fs->op_source = g_idle_add(sim_fs_op_next, fs);
+	else
+		sim_fs_prefetch_schedule(fs);
+}
+
+/* Whether the boot prefetch has or will have the file of a read */
+static gboolean sim_fs_op_is_warm(struct sim_fs *fs, struct sim_fs_op *op)
+{
+	if (op->info_only || op->cb == (gconstpointer) sim_fs_warm_read_cb)
+		return FALSE;
+
+	return sim_fs_warm_find(fs, op) != NULL;
+}
+
+/* Serves the read at the head of the queue from the boot prefetch */
+static gboolean sim_fs_op_check_warm(struct sim_fs *fs)
+{
+	struct sim_fs_op *op = g_queue_peek_head(fs->op_q);
+	struct sim_fs_warm *w;
+
+	if (op->info_only || fs->session || fs->warm == NULL)
+		return FALSE;
+
+	w = sim_fs_warm_find(fs, op);
+	if (w == NULL || w->op != NULL)
+		return FALSE;
+
+	/* Leave what made it into the pack to the pack */
+	if (sim_fs_op_is_cached(fs, op)) {
+		sim_fs_history_mark_cached(fs, op->id);
+		return FALSE;
+	}
+
+	return sim_fs_op_deliver(fs, w->data, w->length, w->record_length);
+}
+
+static void sim_fs_history_add(struct sim_fs *fs, struct sim_fs_op *op)
+{
+	struct sim_fs_history_entry entry;
+	unsigned int i;
+
+	for (i = 0; i < fs->history->len; i++) {
+		struct sim_fs_history_entry *e = &g_array_index(fs->history,
+					struct sim_fs_history_entry, i);
+
+		if (e->id == op->id && e->structure == op->structure &&
+				e->path_len == op->path_len &&
+				memcmp(e->path, op->path, op->path_len) == 0)
+			return;
+	}
+
+	if (fs->history->len >= SIM_HISTORY_MAX)
+		return;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.id = op->id;
+	entry.structure = op->structure;
+	memcpy(entry.path, op->path, op->path_len);
+	entry.path_len = op->path_len;
+
+	g_array_append_val(fs->history, entry);
+}
+
+static void sim_fs_history_mark_cached(struct sim_fs *fs, int id)
+{
+	unsigned int i;
+
+	if (fs->history == NULL)
+		return;
+
+	for (i = 0; i < fs->history->len; i++) {
+		struct sim_fs_history_entry *e = &g_array_index(fs->history,
+					struct sim_fs_history_entry, i);
+
+		if (e->id == id)
+			e->cached = TRUE;
+	}
+}
+
+static gboolean sim_fs_history_save(gpointer user_data)
+{
+	struct sim_fs *fs = user_data;
+	unsigned char buf[1 + SIM_HISTORY_MAX * SIM_HISTORY_ENTRY_SIZE];
+	unsigned char *p = buf + 1;
+	unsigned int i;
+
+	fs->history_source = 0;
+
+	buf[0] = SIM_HISTORY_VERSION;
+
+	for (i = 0; i < fs->history->len; i++) {
+		struct sim_fs_history_entry *e = &g_array_index(fs->history,
+					struct sim_fs_history_entry, i);
+
+		if (e->cached)
+			continue;
+
+		memset(p, 0, SIM_HISTORY_ENTRY_SIZE);
+		p[0] = e->id >> 8;
+		p[1] = e->id & 0xff;
+		p[2] = e->structure;
+		p[3] = e->path_len;
+		memcpy(p + 4, e->path, e->path_len);
+		p += SIM_HISTORY_ENTRY_SIZE;
+	}
+
+	write_file(buf, p - buf, SIM_CACHE_MODE, SIM_HISTORY_PATH,
+			fs->history_iccid);
+
+	sim_fs_history_stop(fs);
+
+	return FALSE;
+}
 
-		return FALSE;
-	}
+void sim_fs_history_start(struct sim_fs *fs, const char *iccid)
+{
+	unsigned char buf[1 + SIM_HISTORY_MAX * SIM_HISTORY_ENTRY_SIZE];
+	ssize_t len;
+	ssize_t i;
 
-	len = L_TFR(read(fd, fileinfo, SIM_CACHE_HEADER_SIZE));
+	sim_fs_history_stop(fs);
 
-	if (len != SIM_CACHE_HEADER_SIZE)
-		goto error;
+	if (iccid == NULL || fs->driver == NULL ||
+			fs->driver->read_file_info == NULL)
+		return;
 
-	error_type = fileinfo[0];
-	file_length = (fileinfo[1] << 8) | fileinfo[2];
-	structure = fileinfo[3];
-	record_length = (fileinfo[4] << 8) | fileinfo[5];
-	file_status = fileinfo[6];
+	fs->history = g_array_new(FALSE, FALSE,
+					sizeof(struct sim_fs_history_entry));
+	fs->history_iccid = g_strdup(iccid);
 
-	if (structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT)
-		record_length = file_length;
+	len = read_file(buf, sizeof(buf), SIM_HISTORY_PATH, iccid);
+	if (len < 1 || buf[0] != SIM_HISTORY_VERSION)
+		return;
 
-	if (record_length == 0 || file_length < record_length)
-		goto error;
+	DBG("Reading %zd files ahead", (len - 1) / SIM_HISTORY_ENTRY_SIZE);
 
-	op->length = file_length;
-	op->record_length = record_length;
-	memcpy(fs->bitmap, fileinfo + SIM_FILE_INFO_SIZE,
-			SIM_CACHE_HEADER_SIZE - SIM_FILE_INFO_SIZE);
-	fs->fd = fd;
+	for (i = 1; i + SIM_HISTORY_ENTRY_SIZE <= len;
+			i += SIM_HISTORY_ENTRY_SIZE)
+		sim_fs_warm_read(fs, buf + i);
+}
 
-	if (error_type != OFONO_ERROR_TYPE_NO_ERROR ||
-			structure != op->structure) {
-		sim_fs_op_error(fs);
-		return TRUE;
-	}
+void sim_fs_history_ready(struct sim_fs *fs)
+{
+	if (fs->history == NULL || fs->history_source)
+		return;
 
-	if (op->info_only == TRUE) {
-		/*
-		 * It's an info-only request, so there is no need to request
-		 * actual contents of the EF. Just return the EF-info.
-		 */
-		sim_fs_read_info_cb_t cb = op->cb;
+	fs->history_source = g_timeout_add_seconds(SIM_HISTORY_WINDOW,
+							sim_fs_history_save, fs);
+}
 
-		cb(1, file_status, op->length,
-			op->record_length, op->userdata);
+void sim_fs_history_stop(struct sim_fs *fs)
+{
+	if (fs == NULL)
+		return;
 
-		sim_fs_end_current(fs);
-	} else if (structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT) {
-		if (op->num_bytes == 0)
-			op->num_bytes = op->length;
+	if (fs->history_source) {
+		g_source_remove(fs->history_source);
+		fs->history_source = 0;
+	}
 
-		op->current = op->offset / 256;
-		fs->op_source = g_idle_add(sim_fs_op_read_block, fs);
-	} else {
-		op->current = 1;
-		fs->op_source = g_idle_add(sim_fs_op_read_record, fs);
+	if (fs->history) {
+		g_array_free(fs->history, TRUE);
+		fs->history = NULL;
 	}
 
-	return TRUE;
+	g_free(fs->history_iccid);
+	fs->history_iccid = NULL;
 
-error:
-	L_TFR(close(fd));
-	return FALSE;
+	sim_fs_warm_remove(fs, -1);
 }
 
 static void sim_fs_read_session_cb(const struct ofono_error *error,
@@ -924,6 +1925,354 @@ static void get_session_cb(ofono_bool_t active, int session_id,
 			op->path_len, session_read_info_cb, fs);
 }
 
+static void sim_fs_prefetch_read_cb(const struct ofono_error *error,
+					const unsigned char *data, int len,
+					void *user);
+
+static int sim_fs_unit_length(int length, int unit_len,
+				enum ofono_sim_file_structure structure,
+				int unit)
+{
+	if (structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT)
+		return MIN(length - unit * 256, 256);
+
+	return unit_len;
+}
+
+static void sim_fs_prefetch_next_unit(struct sim_fs_prefetch *pf)
+{
+	const struct ofono_sim_driver *driver = pf->fs->driver;
+	struct sim_fs_op *op = pf->op;
+	int unit = pf->next_unit;
+	int len;
+
+	if (unit > pf->last_unit)
+		return;
+
+	len = sim_fs_unit_length(pf->length, pf->unit_len, pf->structure,
+					unit);
+
+	switch (pf->structure) {
+	case OFONO_SIM_FILE_STRUCTURE_TRANSPARENT:
+		if (driver->read_file_transparent == NULL)
+			return;
+
+		pf->pending = TRUE;
+		driver->read_file_transparent(pf->fs->sim, op->id,
+						unit * 256, len,
+						op->path_len ? op->path : NULL,
+						op->path_len,
+						sim_fs_prefetch_read_cb, pf);
+		break;
+	case OFONO_SIM_FILE_STRUCTURE_FIXED:
+		if (driver->read_file_linear == NULL)
+			return;
+
+		pf->pending = TRUE;
+		driver->read_file_linear(pf->fs->sim, op->id, unit, len,
+						NULL, 0,
+						sim_fs_prefetch_read_cb, pf);
+		break;
+	case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
+		if (driver->read_file_cyclic == NULL)
+			return;
+
+		pf->pending = TRUE;
+		driver->read_file_cyclic(pf->fs->sim, op->id, unit, len,
+						NULL, 0,
+						sim_fs_prefetch_read_cb, pf);
+		break;
+	}
+}
+
+static void sim_fs_prefetch_read_cb(const struct ofono_error *error,
+					const unsigned char *data, int len,
+					void *user)
+{
+	struct sim_fs_prefetch *pf = user;
+	struct sim_fs *fs = pf->fs;
+	int unit = pf->next_unit;
+	gboolean head_waiting;
+
+	pf->pending = FALSE;
+
+	if (pf->op == NULL) {
+		sim_fs_prefetch_free(pf);
+		return;
+	}
+
+	head_waiting = pf->head_waiting;
+	pf->head_waiting = FALSE;
+
+	/*
+	 * On failure the prefetch simply stops, the op reads the rest
+	 * itself once it is at the head and reports any error from there
+	 */
+	if (error->type == OFONO_ERROR_TYPE_NO_ERROR &&
+			len == sim_fs_unit_length(pf->length, pf->unit_len,
+							pf->structure, unit)) {
+		memcpy(pf->data + (unit - pf->first_unit) * pf->unit_len,
+			data, len);
+		pf->next_unit += 1;
+
+		sim_fs_prefetch_next_unit(pf);
+	}
+
+	if (pf->pending == FALSE)
+		sim_fs_prefetch_schedule(fs);
+
+	if (head_waiting)
+		sim_fs_op_request_unit(fs, pf->op);
+}
+
+static void sim_fs_prefetch_info_cb(const struct ofono_error *error,
+					int length,
+					enum ofono_sim_file_structure structure,
+					int record_length,
+					const unsigned char access[3],
+					unsigned char file_status,
+					void *data)
+{
+	struct sim_fs_prefetch *pf = data;
+	struct sim_fs *fs = pf->fs;
+	struct sim_fs_op *op = pf->op;
+	gboolean head_waiting;
+	int num_bytes;
+
+	pf->pending = FALSE;
+
+	if (op == NULL) {
+		sim_fs_prefetch_free(pf);
+		return;
+	}
+
+	head_waiting = pf->head_waiting;
+	pf->head_waiting = FALSE;
+
+	pf->info_done = TRUE;
+	pf->error = *error;
+	pf->length = length;
+	pf->structure = structure;
+	pf->record_length = record_length;
+	pf->file_status = file_status;
+
+	if (access)
+		memcpy(pf->access, access, sizeof(pf->access));
+
+	if (error->type != OFONO_ERROR_TYPE_NO_ERROR || op->info_only ||
+			structure != op->structure || length == 0)
+		goto done;
+
+	if (structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT) {
+		num_bytes = op->num_bytes ? op->num_bytes : length;
+
+		pf->unit_len = 256;
+		pf->first_unit = op->offset / 256;
+		pf->last_unit = (op->offset + num_bytes - 1) / 256;
+	} else {
+		if (record_length == 0 || record_length > 256)
+			goto done;
+
+		pf->unit_len = record_length;
+		pf->first_unit = 1;
+		pf->last_unit = length / record_length;
+	}
+
+	pf->next_unit = pf->first_unit;
+	pf->data = g_try_malloc((pf->last_unit - pf->first_unit + 1) *
+					pf->unit_len);
+
+	if (pf->data)
+		sim_fs_prefetch_next_unit(pf);
+
+done:
+	if (pf->pending == FALSE)
+		sim_fs_prefetch_schedule(fs);
+
+	if (head_waiting)
+		sim_fs_op_info_cb(error, length, structure, record_length,
+					access, file_status, fs);
+}
+
+static gboolean sim_fs_op_is_cached(struct sim_fs *fs, struct sim_fs_op *op)
+{
+	struct sim_pack *pack = sim_fs_pack(fs);
+
+	if (pack == NULL)
+		return FALSE;
+
+	if (sim_fs_lru_find(fs, op))
+		return TRUE;
+
+	return sim_pack_find(pack, op->id) >= 0;
+}
+
+static gboolean sim_fs_prefetch_next(gpointer user_data)
+{
+	struct sim_fs *fs = user_data;
+	unsigned int limit = fs->driver->max_pending_reads;
+	unsigned int in_flight = 1;
+	struct sim_fs_prefetch *pf;
+	struct sim_fs_op *op;
+	GList *l;
+
+	fs->prefetch_source = 0;
+
+	if (fs->op_q == NULL || fs->session)
+		return FALSE;
+
+	l = g_queue_peek_head_link(fs->op_q);
+	if (l == NULL)
+		return FALSE;
+
+	for (l = l->next; l && in_flight < limit; l = l->next) {
+		op = l->data;
+
+		/* Never read ahead of a write */
+		if (op->is_read == FALSE)
+			break;
+
+		if (op->prefetch) {
+			if (op->prefetch->pending)
+				in_flight += 1;
+
+			continue;
+		}
+
+		if (op->cb == NULL || op->no_prefetch)
+			continue;
+
+		/* Cached files are read from disk when their turn comes */
+		if (sim_fs_op_is_cached(fs, op)) {
+			op->no_prefetch = TRUE;
+			continue;
+		}
+
+		if (sim_fs_op_is_warm(fs, op))
+			continue;
+
+		pf = g_try_new0(struct sim_fs_prefetch, 1);
+		if (pf == NULL)
+			break;
+
+		pf->fs = fs;
+		pf->op = op;
+		pf->pending = TRUE;
+		op->prefetch = pf;
+		in_flight += 1;
+
+		fs->driver->read_file_info(fs->sim, op->id,
+						op->path_len ? op->path : NULL,
+						op->path_len,
+						sim_fs_prefetch_info_cb, pf);
+	}
+
+	return FALSE;
+}
+
+static void sim_fs_prefetch_schedule(struct sim_fs *fs)
+{
+	if (fs->prefetch_source || fs->driver == NULL ||
+			fs->driver->max_pending_reads < 2)
+		return;
+
+	if (fs->op_q == NULL || g_queue_get_length(fs->op_q) < 2)
+		return;
+
+	fs->prefetch_source = g_idle_add(sim_fs_prefetch_next, fs);
+}
+
+static void sim_fs_op_request_info(struct sim_fs *fs, struct sim_fs_op *op)
+{
+	struct sim_fs_prefetch *pf = op->prefetch;
+
+	if (pf && pf->info_done) {
+		sim_fs_op_info_cb(&pf->error, pf->length, pf->structure,
+					pf->record_length, pf->access,
+					pf->file_status, fs);
+		return;
+	}
+
+	if (pf && pf->pending) {
+		pf->head_waiting = TRUE;
+		return;
+	}
+
+	fs->driver->read_file_info(fs->sim, op->id,
+					op->path_len ? op->path : NULL,
+					op->path_len,
+					sim_fs_op_info_cb, fs);
+}
+
+/* Reads the current block or record of the op, from the prefetch if we can */
+static void sim_fs_op_request_unit(struct sim_fs *fs, struct sim_fs_op *op)
+{
+	const struct ofono_sim_driver *driver = fs->driver;
+	struct sim_fs_prefetch *pf = op->prefetch;
+	int len = sim_fs_unit_length(op->length, op->record_length,
+					op->structure, op->current);
+
+	if (pf && pf->data && op->current >= pf->first_unit &&
+			op->current < pf->next_unit) {
+		const unsigned char *data = pf->data +
+				(op->current - pf->first_unit) * pf->unit_len;
+		struct ofono_error error = {
+			.type = OFONO_ERROR_TYPE_NO_ERROR,
+		};
+
+		if (op->structure == OFONO_SIM_FILE_STRUCTURE_TRANSPARENT)
+			sim_fs_op_read_block_cb(&error, data, len, fs);
+		else
+			sim_fs_op_retrieve_cb(&error, data, len, fs);
+
+		return;
+	}
+
+	if (pf && pf->data && pf->pending && op->current == pf->next_unit) {
+		pf->head_waiting = TRUE;
+		return;
+	}
+
+	switch (op->structure) {
+	case OFONO_SIM_FILE_STRUCTURE_TRANSPARENT:
+		if (driver->read_file_transparent == NULL) {
+			sim_fs_op_error(fs);
+			return;
+		}
+
+		driver->read_file_transparent(fs->sim, op->id,
+						op->current * 256, len,
+						op->path_len ? op->path : NULL,
+						op->path_len,
+						sim_fs_op_read_block_cb, fs);
+		break;
+	case OFONO_SIM_FILE_STRUCTURE_FIXED:
+		if (driver->read_file_linear == NULL) {
+			sim_fs_op_error(fs);
+			return;
+		}
+
+		driver->read_file_linear(fs->sim, op->id, op->current,
+						op->record_length,
+						NULL, 0,
+						sim_fs_op_retrieve_cb, fs);
+		break;
+	case OFONO_SIM_FILE_STRUCTURE_CYCLIC:
+		if (driver->read_file_cyclic == NULL) {
+			sim_fs_op_error(fs);
+			return;
+		}
+
+		driver->read_file_cyclic(fs->sim, op->id, op->current,
+						op->record_length,
+						NULL, 0,
+						sim_fs_op_retrieve_cb, fs);
+		break;
+	default:
+		ofono_error("Unrecognized file structure, this can't happen");
+	}
+}
+
 static gboolean sim_fs_op_next(gpointer user_data)
 {
 	struct sim_fs *fs = user_data;
@@ -943,14 +2292,17 @@ static gboolean sim_fs_op_next(gpointer user_data)
 	}
 
 	if (op->is_read == TRUE) {
+		if (sim_fs_op_check_warm(fs))
+			return FALSE;
+
+		if (sim_fs_op_check_lru(fs))
+			return FALSE;
+
 		if (sim_fs_op_check_cached(fs))
 			return FALSE;
 
 		if (!fs->session) {
-			driver->read_file_info(fs->sim, op->id,
-						op->path_len ? op->path : NULL,
-						op->path_len,
-						sim_fs_op_info_cb, fs);
+			sim_fs_op_request_info(fs, op);
 		} else {
 			if (fs->watch_id)
 				fs->driver->session_read_info(fs->sim,
@@ -963,6 +2315,9 @@ static gboolean sim_fs_op_next(gpointer user_data)
 						fs, session_destroy_cb);
 		}
 	} else {
+		sim_fs_warm_remove(fs, op->id);
+		sim_fs_lru_remove(fs, op->id);
+
 		switch (op->structure) {
 		case OFONO_SIM_FILE_STRUCTURE_TRANSPARENT:
 			driver->write_file_transparent(fs->sim, op->id, 0,
@@ -1026,6 +2381,8 @@ int sim_fs_read_info(struct ofono_sim_context *context, int id,
 
 	if (g_queue_get_length(fs->op_q) == 1)
 		fs->op_source = g_idle_add(sim_fs_op_next, fs);
+	else
+		sim_fs_prefetch_schedule(fs);
 
 	return 0;
 }
@@ -1077,10 +2434,15 @@ int sim_fs_read(struct ofono_sim_context *context, int id,
 	memcpy(op->path, path, path_len);
 	op->path_len = path_len;
 
+	if (fs->history && fs->session == NULL)
+		sim_fs_history_add(fs, op);
+
 	g_queue_push_tail(fs->op_q, op);
 
 	if (g_queue_get_length(fs->op_q) == 1)
 		fs->op_source = g_idle_add(sim_fs_op_next, fs);
+	else
+		sim_fs_prefetch_schedule(fs);
 
 	return 0;
 }
@@ -1270,14 +2632,25 @@ void sim_fs_cache_flush(struct sim_fs *fs)
 {
 	const char *imsi = ofono_sim_get_imsi(fs->sim);
 	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
+	struct sim_pack *pack = sim_fs_pack(fs);
 	char *path = g_strdup_printf(SIM_CACHE_BASEPATH, imsi, phase);
 	struct dirent **entries;
-	int len = scandir(path, &entries, NULL, alphasort);
+	int len;
+
+	if (pack) {
+		sim_pack_reset(pack);
+		sim_pack_sync(pack);
+	}
+
+	fs->cache_slot = -1;
+	sim_fs_warm_remove(fs, -1);
+	sim_fs_lru_remove(fs, -1);
 
+	len = scandir(path, &entries, NULL, alphasort);
 	g_free(path);
 
 	if (len > 0) {
-		/* Remove all file ids */
+		/* Remove the per file id caches of older versions */
 		while (len--) {
 			remove_cachefile(imsi, phase, entries[len]);
 			g_free(entries[len]);
@@ -1291,12 +2664,28 @@ void sim_fs_cache_flush(struct sim_fs *fs)
 
 void sim_fs_cache_flush_file(struct sim_fs *fs, int id)
 {
-	const char *imsi = ofono_sim_get_imsi(fs->sim);
-	enum ofono_sim_phase phase = ofono_sim_get_phase(fs->sim);
-	char *path = g_strdup_printf(SIM_CACHE_PATH, imsi, phase, id);
+	struct sim_pack *pack;
+	int slot;
 
-	remove(path);
-	g_free(path);
+	sim_fs_warm_remove(fs, id);
+	sim_fs_lru_remove(fs, id);
+
+	pack = sim_fs_pack(fs);
+	if (pack == NULL)
+		return;
+
+	slot = sim_pack_find(pack, id);
+	if (slot < 0)
+		return;
+
+	sim_pack_entry(pack, slot)->valid = 0;
+	memset(pack->pending[slot], 0, sizeof(pack->pending[slot]));
+	pack->generation += 1;
+	pack->dirty = TRUE;
+	sim_pack_sync(pack);
+
+	if (fs->cache_slot == slot)
+		fs->cache_slot = -1;
 }
 
 void sim_fs_image_cache_flush(struct sim_fs *fs)
@@ -54,6 +54,15 @@ int sim_fs_read_info(struct ofono_sim_context *context, int id,
 
 void sim_fs_check_version(struct sim_fs *fs);
 
+/*
+ * The EFs read from sim_fs_history_start() until a while after
+ * sim_fs_history_ready() are remembered per ICCID and read in one batch
+ * by the sim_fs_history_start() of the next boot
+ */
+void sim_fs_history_start(struct sim_fs *fs, const char *iccid);
+void sim_fs_history_ready(struct sim_fs *fs);
+void sim_fs_history_stop(struct sim_fs *fs);
+
 int sim_fs_write(struct ofono_sim_context *context, int id,
 			ofono_sim_file_write_cb_t cb,
 			enum ofono_sim_file_structure structure, int record,
@@ -50,6 +50,9 @@
 #define TXQ_MAX_RETRIES 4
 #define NETWORK_TIMEOUT 332
 
+/* Seconds the fragments of an incomplete concatenated message are kept */
+#define ASSEMBLY_LIFETIME (24 * 3600)
+
 static gboolean tx_next(gpointer user_data);
 
 static GSList *g_drivers = NULL;
@@ -65,10 +68,12 @@ struct ofono_sms {
 	DBusMessage *pending;
 	struct ofono_phone_number sca;
 	struct sms_assembly *assembly;
+	guint assembly_source;
 	guint ref;
 	GQueue *txq;
-	unsigned long tx_counter;
+	struct sms_tx_backup *tx_backup;
 	guint tx_source;
+	GSList *tx_submits;
 	struct ofono_message_waiting *mw;
 	unsigned int mw_watch;
 	ofono_bool_t registered;
@@ -93,12 +98,17 @@ struct pending_pdu {
 	unsigned char pdu[176];
 	int tpdu_len;
 	int pdu_len;
+	gboolean submitted;
+	gboolean sent;
 };
 
 struct tx_queue_entry {
 	struct pending_pdu *pdus;
 	unsigned char num_pdus;
 	unsigned char cur_pdu;
+	unsigned char num_sent;
+	unsigned char pending;
+	gboolean failed;
 	struct sms_address receiver;
 	struct ofono_uuid uuid;
 	unsigned int retry;
@@ -106,7 +116,13 @@ struct tx_queue_entry {
 	ofono_sms_txq_submit_cb_t cb;
 	void *data;
 	ofono_destroy_func destroy;
-	unsigned long id;
+};
+
+/* A PDU handed to the driver, up to max_pending_submits at once */
+struct tx_submit {
+	struct ofono_sms *sms;
+	struct tx_queue_entry *entry;
+	unsigned char pdu;
 };
 
 static gboolean uuid_equal(gconstpointer v1, gconstpointer v2)
@@ -693,8 +709,7 @@ static void sms_tx_queue_remove_entry(struct ofono_sms *sms, GList *entry_list,
 	if (entry->flags & OFONO_SMS_SUBMIT_FLAG_EXPOSE_DBUS) {
 		struct message *m;
 
-		sms_tx_backup_free(sms->imsi, entry->id, entry->flags,
-					ofono_uuid_to_str(&entry->uuid));
+		sms_tx_backup_done(sms->tx_backup, entry->uuid.uuid);
 
 		m = g_hash_table_lookup(sms->messages, &entry->uuid);
 
@@ -711,53 +726,99 @@ done:
 	tx_queue_entry_destroy(entry);
 }
 
-static void tx_finished(const struct ofono_error *error, int mr, void *data)
+static void tx_schedule(struct ofono_sms *sms)
+{
+	if (sms->tx_source || sms->registered == FALSE)
+		return;
+
+	if (g_queue_get_length(sms->txq) == 0)
+		return;
+
+	sms->tx_source = g_timeout_add(0, tx_next, sms);
+}
+
+/* Removes the entry once it is sent or failed and nothing is in flight */
+static void tx_entry_check_done(struct ofono_sms *sms,
+					struct tx_queue_entry *entry)
 {
-	struct ofono_sms *sms = data;
-	struct tx_queue_entry *entry = g_queue_peek_head(sms->txq);
-	gboolean ok = error->type == OFONO_ERROR_TYPE_NO_ERROR;
 	enum message_state tx_state;
 
-	DBG("tx_finished %p", entry);
+	if (entry->pending > 0)
+		return;
+
+	if (entry->failed)
+		tx_state = MESSAGE_STATE_FAILED;
+	else if (entry->num_sent == entry->num_pdus)
+		tx_state = MESSAGE_STATE_SENT;
+	else
+		return;
+
+	sms_tx_queue_remove_entry(sms, g_queue_find(sms->txq, entry),
+					tx_state);
+}
+
+static void tx_finished(const struct ofono_error *error, int mr, void *data)
+{
+	struct tx_submit *submit = data;
+	struct ofono_sms *sms = submit->sms;
+	struct tx_queue_entry *entry = submit->entry;
+	unsigned char seq = submit->pdu;
+
+	DBG("tx_finished %p pdu %u", entry, seq);
+
+	sms->tx_submits = g_slist_remove(sms->tx_submits, submit);
+	g_free(submit);
 
-	sms->flags &= ~MESSAGE_MANAGER_FLAG_TXQ_ACTIVE;
+	if (sms->tx_submits == NULL)
+		sms->flags &= ~MESSAGE_MANAGER_FLAG_TXQ_ACTIVE;
+
+	entry->pdus[seq].submitted = FALSE;
+	entry->pending -= 1;
+
+	if (error->type != OFONO_ERROR_TYPE_NO_ERROR) {
+		/* Sent again once tx_next gets back to it */
+		if (seq < entry->cur_pdu)
+			entry->cur_pdu = seq;
 
-	if (ok == FALSE) {
 		/* Retry again when back in online mode */
 		/* Note this does not increment retry count */
-		if (sms->registered == FALSE)
-			return;
-
-		tx_state = MESSAGE_STATE_FAILED;
+		if (sms->registered == FALSE || entry->failed)
+			goto done;
 
 		/* Retry done only for Network Timeout failure */
 		if (error->type == OFONO_ERROR_TYPE_CMS &&
 				error->error != NETWORK_TIMEOUT)
-			goto next_q;
+			goto fail;
 
 		if (!(entry->flags & OFONO_SMS_SUBMIT_FLAG_RETRY))
-			goto next_q;
+			goto fail;
 
 		entry->retry += 1;
 
 		if (entry->retry < TXQ_MAX_RETRIES) {
 			DBG("Sending failed, retry in %d secs",
 					entry->retry * 5);
+
+			/* Nothing new is submitted until then */
+			if (sms->tx_source)
+				g_source_remove(sms->tx_source);
+
 			sms->tx_source = g_timeout_add_seconds(entry->retry * 5,
 								tx_next, sms);
 			return;
 		}
 
 		DBG("Max retries reached, giving up");
-		goto next_q;
+fail:
+		entry->failed = TRUE;
+		goto done;
 	}
 
 	if (entry->flags & OFONO_SMS_SUBMIT_FLAG_EXPOSE_DBUS)
-		sms_tx_backup_remove(sms->imsi, entry->id, entry->flags,
-						ofono_uuid_to_str(&entry->uuid),
-						entry->cur_pdu);
+		sms_tx_backup_sent(sms->tx_backup, entry->uuid.uuid, seq);
 
-	entry->cur_pdu += 1;
+	entry->pdus[seq].sent = TRUE;
+	entry->num_sent += 1;
 	entry->retry = 0;
 
 	if (entry->flags & OFONO_SMS_SUBMIT_FLAG_REQUEST_SR)
@@ -767,48 +828,77 @@ static void tx_finished(const struct ofono_error *error, int mr, void *data)
 							mr, time(NULL),
 							entry->num_pdus);
 
-	if (entry->cur_pdu < entry->num_pdus) {
-		sms->tx_source = g_timeout_add(0, tx_next, sms);
-		return;
-	}
+done:
+	tx_entry_check_done(sms, entry);
+	tx_schedule(sms);
+}
 
-	tx_state = MESSAGE_STATE_SENT;
+/* Returns the first entry with a PDU left to submit, skipping failed ones */
+static struct tx_queue_entry *tx_next_entry(struct ofono_sms *sms)
+{
+	GList *l;
 
-next_q:
-	sms_tx_queue_remove_entry(sms, g_queue_peek_head_link(sms->txq),
-					tx_state);
+	for (l = g_queue_peek_head_link(sms->txq); l; l = l->next) {
+		struct tx_queue_entry *entry = l->data;
 
-	if (sms->registered == FALSE)
-		return;
+		if (entry->failed)
+			continue;
 
-	if (g_queue_peek_head(sms->txq)) {
-		DBG("Scheduling next");
-		sms->tx_source = g_timeout_add(0, tx_next, sms);
+		while (entry->cur_pdu < entry->num_pdus &&
+				(entry->pdus[entry->cur_pdu].submitted ||
+				entry->pdus[entry->cur_pdu].sent))
+			entry->cur_pdu += 1;
+
+		if (entry->cur_pdu < entry->num_pdus)
+			return entry;
 	}
+
+	return NULL;
 }
 
 static gboolean tx_next(gpointer user_data)
 {
 	struct ofono_sms *sms = user_data;
-	int send_mms = 0;
-	struct tx_queue_entry *entry = g_queue_peek_head(sms->txq);
-	struct pending_pdu *pdu = &entry->pdus[entry->cur_pdu];
+	unsigned int window = MAX(sms->driver->max_pending_submits, 1U);
+	struct tx_queue_entry *entry;
+	struct tx_submit *submit;
+	struct pending_pdu *pdu;
+	int send_mms;
 
-	DBG("tx_next: %p", entry);
+	DBG("tx_next: %u in flight", g_slist_length(sms->tx_submits));
 
 	sms->tx_source = 0;
 
-	if (sms->registered == FALSE)
-		return FALSE;
+	/*
+	 * A submit can fail right away and schedule a retry or another
+	 * tx_next, so stop as soon as a source is pending
+	 */
+	while (sms->registered && sms->tx_source == 0 &&
+			g_slist_length(sms->tx_submits) < window) {
+		entry = tx_next_entry(sms);
+		if (entry == NULL)
+			break;
+
+		send_mms = g_queue_get_length(sms->txq) > 1 ||
+				(entry->num_pdus - entry->cur_pdu) > 1;
 
-	if (g_queue_get_length(sms->txq) > 1
-			|| (entry->num_pdus - entry->cur_pdu) > 1)
-		send_mms = 1;
+		submit = g_new0(struct tx_submit, 1);
+		submit->sms = sms;
+		submit->entry = entry;
+		submit->pdu = entry->cur_pdu;
 
-	sms->flags |= MESSAGE_MANAGER_FLAG_TXQ_ACTIVE;
+		pdu = &entry->pdus[entry->cur_pdu];
+		pdu->submitted = TRUE;
+		entry->pending += 1;
+		entry->cur_pdu += 1;
 
-	sms->driver->submit(sms, pdu->pdu, pdu->pdu_len, pdu->tpdu_len,
-				send_mms, tx_finished, sms);
+		sms->tx_submits = g_slist_prepend(sms->tx_submits, submit);
+		sms->flags |= MESSAGE_MANAGER_FLAG_TXQ_ACTIVE;
+
+		sms->driver->submit(sms, pdu->pdu, pdu->pdu_len,
+					pdu->tpdu_len, send_mms,
+					tx_finished, submit);
+	}
 
 	return FALSE;
 }
@@ -1110,6 +1200,7 @@ int __ofono_sms_txq_cancel(struct ofono_sms *sms, const struct ofono_uuid *uuid)
 {
 	GList *l;
 	struct tx_queue_entry *entry;
+	unsigned int retry;
 
 	l = g_queue_find_custom(sms->txq, uuid, entry_compare_by_uuid);
 
@@ -1118,32 +1209,29 @@ int __ofono_sms_txq_cancel(struct ofono_sms *sms, const struct ofono_uuid *uuid)
 
 	entry = l->data;
 
-	if (entry == g_queue_peek_head(sms->txq)) {
-		/*
-		 * Fail if any pdu was already transmitted or if we are
-		 * waiting the answer from driver.
-		 */
-		if (entry->cur_pdu > 0)
-			return -EPERM;
+	/*
+	 * Fail if any pdu was already transmitted or if we are
+	 * waiting the answer from driver.
+	 */
+	if (entry->num_sent > 0 || entry->pending > 0)
+		return -EPERM;
 
-		if (sms->flags & MESSAGE_MANAGER_FLAG_TXQ_ACTIVE)
-			return -EPERM;
-		/*
-		 * Make sure we don't call tx_next() if there are no entries
-		 * and that next entry doesn't have to wait a 'retry time'
-		 * from this one.
-		 */
-		if (sms->tx_source) {
-			g_source_remove(sms->tx_source);
-			sms->tx_source = 0;
-
-			if (g_queue_get_length(sms->txq) > 1)
-				sms->tx_source = g_timeout_add(0, tx_next, sms);
-		}
-	}
+	retry = entry->retry;
 
 	sms_tx_queue_remove_entry(sms, l, MESSAGE_STATE_CANCELLED);
 
+	/*
+	 * Make sure we don't call tx_next() if there are no entries
+	 * and that next entry doesn't have to wait a 'retry time'
+	 * from this one.
+	 */
+	if (retry > 0 && sms->tx_source) {
+		g_source_remove(sms->tx_source);
+		sms->tx_source = 0;
+
+		tx_schedule(sms);
+	}
+
 	return 0;
 }
 
@@ -1443,6 +1531,43 @@ static void sms_dispatch(struct ofono_sms *sms, GSList *sms_list)
 	}
 }
 
+static void assembly_schedule_expire(struct ofono_sms *sms);
+
+static gboolean assembly_expire(gpointer user_data)
+{
+	struct ofono_sms *sms = user_data;
+
+	sms->assembly_source = 0;
+
+	sms_assembly_expire(sms->assembly, time(NULL) - ASSEMBLY_LIFETIME);
+	assembly_schedule_expire(sms);
+
+	return FALSE;
+}
+
+/* Arms a timer for when the oldest incomplete message is due */
+static void assembly_schedule_expire(struct ofono_sms *sms)
+{
+	time_t oldest;
+	time_t now;
+	guint delay = 0;
+
+	if (sms->assembly_source)
+		return;
+
+	oldest = sms_assembly_oldest(sms->assembly);
+	if (oldest == 0)
+		return;
+
+	now = time(NULL);
+
+	if (oldest + ASSEMBLY_LIFETIME > now)
+		delay = oldest + ASSEMBLY_LIFETIME - now;
+
+	sms->assembly_source = g_timeout_add_seconds(delay, assembly_expire,
+							sms);
+}
+
 static void handle_deliver(struct ofono_sms *sms, const struct sms *incoming)
 {
 	GSList *l;
@@ -1463,8 +1588,10 @@ static void handle_deliver(struct ofono_sms *sms, const struct sms *incoming)
 						&incoming->deliver.oaddr,
 						ref, max, seq);
 
-		if (sms_list == NULL)
+		if (sms_list == NULL) {
+			assembly_schedule_expire(sms);
 			return;
+		}
 
 		sms_dispatch(sms, sms_list);
 		g_slist_free_full(sms_list, g_free);
@@ -1777,6 +1904,14 @@ static void sms_remove(struct ofono_atom *atom)
 		sms->tx_source = 0;
 	}
 
+	g_slist_free_full(sms->tx_submits, g_free);
+	sms->tx_submits = NULL;
+
+	if (sms->assembly_source) {
+		g_source_remove(sms->assembly_source);
+		sms->assembly_source = 0;
+	}
+
 	if (sms->assembly) {
 		sms_assembly_free(sms->assembly);
 		sms->assembly = NULL;
@@ -1788,6 +1923,11 @@ static void sms_remove(struct ofono_atom *atom)
 		sms->txq = NULL;
 	}
 
+	if (sms->tx_backup) {
+		sms_tx_backup_free(sms->tx_backup);
+		sms->tx_backup = NULL;
+	}
+
 	if (sms->settings) {
 		g_key_file_set_integer(sms->settings, SETTINGS_GROUP,
 					"NextReference", sms->ref);
@@ -1948,7 +2088,7 @@ static void sms_restore_tx_queue(struct ofono_sms *sms)
 
 	DBG("");
 
-	backupq = sms_tx_queue_load(sms->imsi);
+	backupq = sms_tx_queue_load(sms->tx_backup);
 
 	if (backupq == NULL)
 		return;
@@ -1983,7 +2123,6 @@ static void sms_restore_tx_queue(struct ofono_sms *sms)
 		message_set_data(m, txq_entry);
 		g_hash_table_insert(sms->messages, &txq_entry->uuid, m);
 
-		txq_entry->id = sms->tx_counter++;
 		g_queue_push_tail(sms->txq, txq_entry);
 
 loop_out:
@@ -2045,6 +2184,7 @@ void ofono_sms_register(struct ofono_sms *sms)
 		sms->assembly = sms_assembly_new(imsi);
 
 		sms->sr_assembly = status_report_assembly_new(imsi);
+		sms->tx_backup = sms_tx_backup_new(imsi);
 
 		sms_load_settings(sms, imsi);
 	} else {
@@ -2053,6 +2193,9 @@ void ofono_sms_register(struct ofono_sms *sms)
 		sms->bearer = 3; /* Default to CS then PS */
 	}
 
+	/* Fragments restored from the backup may be due already */
+	assembly_schedule_expire(sms);
+
 	if (sms->driver->bearer_set)
 		sms->driver->bearer_set(sms, sms->bearer,
 						bearer_init_callback, sms);
@@ -2117,31 +2260,30 @@ int __ofono_sms_txq_submit(struct ofono_sms *sms, GSList *list,
 			sms->ref = sms->ref + 1;
 	}
 
-	entry->id = sms->tx_counter++;
-
 	g_queue_push_tail(sms->txq, entry);
 
-	if (sms->registered && g_queue_get_length(sms->txq) == 1)
-		sms->tx_source = g_timeout_add(0, tx_next, sms);
+	/* Sent right away if the send window has room for it */
+	tx_schedule(sms);
 
 	if (uuid)
 		memcpy(uuid, &entry->uuid, sizeof(*uuid));
 
 	if (flags & OFONO_SMS_SUBMIT_FLAG_EXPOSE_DBUS) {
-		const char *uuid_str;
+		struct sms_tx_backup_pdu *pdus;
 		unsigned char i;
 
-		uuid_str = ofono_uuid_to_str(&entry->uuid);
+		pdus = g_new(struct sms_tx_backup_pdu, entry->num_pdus);
 
 		for (i = 0; i < entry->num_pdus; i++) {
-			struct pending_pdu *pdu;
-
-			pdu = &entry->pdus[i];
-
-			sms_tx_backup_store(sms->imsi, entry->id, entry->flags,
-						uuid_str, i, pdu->pdu,
-						pdu->pdu_len, pdu->tpdu_len);
+			pdus[i].pdu = entry->pdus[i].pdu;
+			pdus[i].pdu_len = entry->pdus[i].pdu_len;
+			pdus[i].tpdu_len = entry->pdus[i].tpdu_len;
 		}
+
+		sms_tx_backup_store(sms->tx_backup, entry->flags,
+					entry->uuid.uuid, pdus,
+					entry->num_pdus);
+		g_free(pdus);
 	}
 
 	if (cb)
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -43,15 +44,78 @@
 
 #define SMS_BACKUP_MODE 0600
 #define SMS_BACKUP_PATH STORAGEDIR "/%s/sms_assembly"
-#define SMS_BACKUP_PATH_DIR SMS_BACKUP_PATH "/%s-%i-%i"
-#define SMS_BACKUP_PATH_FILE SMS_BACKUP_PATH_DIR "/%03i"
+#define SMS_BACKUP_LOG STORAGEDIR "/%s/sms_assembly.log"
+
+/* Log size from which it is rewritten once it is mostly stale records */
+#define SMS_BACKUP_LOG_COMPACT_SIZE 4096
+
+/* Appends to the backups of this period share a single sync */
+#define SMS_BACKUP_SYNC_DELAY 100
 
 #define SMS_SR_BACKUP_PATH STORAGEDIR "/%s/sms_sr"
 #define SMS_SR_BACKUP_PATH_FILE SMS_SR_BACKUP_PATH "/%s-%s"
 
 #define SMS_TX_BACKUP_PATH STORAGEDIR "/%s/tx_queue"
-#define SMS_TX_BACKUP_PATH_DIR SMS_TX_BACKUP_PATH "/%lu-%lu-%s"
-#define SMS_TX_BACKUP_PATH_FILE SMS_TX_BACKUP_PATH_DIR "/%03i"
+#define SMS_TX_BACKUP_JOURNAL STORAGEDIR "/%s/tx_queue.journal"
+
+/* Journal size from which it is rewritten once it is mostly done messages */
+#define SMS_TX_BACKUP_COMPACT_SIZE 16384
+
+enum sms_backup_record_type {
+	SMS_BACKUP_RECORD_FRAGMENT =	1,
+	SMS_BACKUP_RECORD_REMOVE =	2,
+};
+
+/*
+ * Record of the SMS assembly log, followed by len bytes of the serialized
+ * fragment.  Removals carry no data and drop all the fragments of the
+ * message identified by address, ref and max
+ */
+struct sms_backup_record {
+	guint32 check;
+	guint8 type;
+	guint8 max;
+	guint8 seq;
+	guint8 addr_len;
+	guint16 ref;
+	guint8 len;
+	guint8 reserved;
+	gint64 ts;
+	guint8 addr[12];
+} __attribute__((packed));
+
+enum sms_tx_record_type {
+	SMS_TX_RECORD_MESSAGE =	1,
+	SMS_TX_RECORD_SENT =	2,
+	SMS_TX_RECORD_DONE =	3,
+};
+
+/*
+ * Record of the SMS TX queue journal.  A message is queued with all its
+ * pdus in a single record, seq being the number of pdus and the data
+ * holding the tpdu length, the length and the bytes of each.  Then a
+ * record marks every pdu sent, seq being its number, and a last one
+ * marks the message done
+ */
+struct sms_tx_record {
+	guint32 check;
+	guint8 type;
+	guint8 seq;
+	guint16 len;
+	guint32 flags;
+	guint8 uuid[SMS_MSGID_LEN];
+} __attribute__((packed));
+
+/* A message replayed from the TX queue journal */
+struct sms_tx_journal_entry {
+	unsigned char uuid[SMS_MSGID_LEN];
+	unsigned long flags;
+	unsigned char *pdus;
+	guint16 len;
+	guint8 num_pdus;
+	unsigned int sent[8];
+	gboolean done;
+};
 
 #define SMS_ADDR_FMT "%24[0-9A-F]"
 #define SMS_MSGID_FMT "%40[0-9A-F]"
@@ -2403,8 +2467,8 @@ gboolean sms_address_to_hex_string(const struct sms_address *in, char *straddr)
 	return TRUE;
 }
 
-static void sms_assembly_load(struct sms_assembly *assembly,
-				const struct dirent *dir)
+static void sms_assembly_load_legacy_dir(struct sms_assembly *assembly,
+						const struct dirent *dir)
 {
 	struct sms_address addr;
 	DECLARE_SMS_ADDR_STR(straddr);
@@ -2478,317 +2542,833 @@ static void sms_assembly_load(struct sms_assembly *assembly,
 	free(segments);
 }
 
-static gboolean sms_assembly_store(struct sms_assembly *assembly,
-				struct sms_assembly_node *node,
-				const struct sms *sms, guint8 seq)
+/* Restores the fragments of older versions, kept one file per fragment */
+static gboolean sms_assembly_load_legacy(struct sms_assembly *assembly)
 {
-	unsigned char buf[177];
+	char *path;
+	struct dirent **entries;
 	int len;
-	DECLARE_SMS_ADDR_STR(straddr);
 
-	if (assembly->imsi == NULL)
-		return FALSE;
+	path = g_strdup_printf(SMS_BACKUP_PATH, assembly->imsi);
+	len = scandir(path, &entries, NULL, alphasort);
+	g_free(path);
 
-	if (sms_address_to_hex_string(&node->addr, straddr) == FALSE)
+	if (len < 0)
 		return FALSE;
 
-	len = sms_serialize(buf, sms);
+	while (len--) {
+		sms_assembly_load_legacy_dir(assembly, entries[len]);
+		free(entries[len]);
+	}
 
-	if (write_file(buf, len, SMS_BACKUP_MODE,
-				SMS_BACKUP_PATH_FILE, assembly->imsi, straddr,
-				node->ref, node->max_fragments, seq) != len)
-		return FALSE;
+	free(entries);
 
 	return TRUE;
 }
 
-static void sms_assembly_backup_free(struct sms_assembly *assembly,
-					struct sms_assembly_node *node)
+/* Removes a backup directory of older versions and its subdirectories */
+static void sms_backup_remove_legacy(const char *path)
 {
-	char *path;
-	int seq;
-	DECLARE_SMS_ADDR_STR(straddr);
+	char *dir_path;
+	char *file;
+	struct dirent **entries;
+	struct dirent **segments;
+	int len;
+	int i;
+	int j;
 
-	if (assembly->imsi == NULL)
-		return;
+	len = scandir(path, &entries, NULL, alphasort);
 
-	if (sms_address_to_hex_string(&node->addr, straddr) == FALSE)
-		return;
+	for (i = 0; i < len; i++) {
+		if (entries[i]->d_type != DT_DIR ||
+				entries[i]->d_name[0] == '.')
+			goto next;
 
-	for (seq = 0; seq < node->max_fragments; seq++) {
-		int offset = seq / 32;
-		int bit = 1 << (seq % 32);
+		dir_path = g_strdup_printf("%s/%s", path, entries[i]->d_name);
+		j = scandir(dir_path, &segments, NULL, alphasort);
 
-		if (node->bitmap[offset] & bit) {
-			path = g_strdup_printf(SMS_BACKUP_PATH_FILE,
-					assembly->imsi, straddr,
-					node->ref, node->max_fragments, seq);
-			unlink(path);
-			g_free(path);
+		while (j-- > 0) {
+			file = g_strdup_printf("%s/%s", dir_path,
+						segments[j]->d_name);
+
+			if (segments[j]->d_type == DT_REG)
+				unlink(file);
+
+			g_free(file);
+			free(segments[j]);
 		}
+
+		if (j == -1)
+			free(segments);
+
+		rmdir(dir_path);
+		g_free(dir_path);
+next:
+		free(entries[i]);
 	}
 
-	path = g_strdup_printf(SMS_BACKUP_PATH_DIR, assembly->imsi, straddr,
-				node->ref, node->max_fragments);
+	if (len >= 0)
+		free(entries);
+
 	rmdir(path);
-	g_free(path);
 }
 
-struct sms_assembly *sms_assembly_new(const char *imsi)
+/* FNV-1a, enough to tell a torn or zero filled tail from a record */
+static guint32 sms_backup_checksum(guint32 check, const void *data,
+					size_t len)
 {
-	struct sms_assembly *ret = g_new0(struct sms_assembly, 1);
-	char *path;
-	struct dirent **entries;
-	int len;
-
-	if (imsi) {
-		ret->imsi = imsi;
-
-		/* Restore state from backup */
+	const unsigned char *p = data;
+	size_t i;
 
-		path = g_strdup_printf(SMS_BACKUP_PATH, imsi);
-		len = scandir(path, &entries, NULL, alphasort);
-		g_free(path);
+	for (i = 0; i < len; i++)
+		check = (check ^ p[i]) * 16777619U;
 
-		if (len < 0)
-			return ret;
+	return check;
+}
 
-		while (len--) {
-			sms_assembly_load(ret, entries[len]);
-			free(entries[len]);
-		}
+static guint32 sms_backup_record_check(const struct sms_backup_record *rec,
+					const unsigned char *data)
+{
+	guint32 check;
 
-		free(entries);
-	}
+	check = sms_backup_checksum(2166136261U,
+				(const unsigned char *) rec + sizeof(rec->check),
+				sizeof(*rec) - sizeof(rec->check));
 
-	return ret;
+	return sms_backup_checksum(check, data, rec->len);
 }
 
-void sms_assembly_free(struct sms_assembly *assembly)
+static guint32 sms_tx_record_check(const struct sms_tx_record *rec,
+					const unsigned char *data)
 {
-	GSList *l;
-
-	for (l = assembly->assembly_list; l; l = l->next) {
-		struct sms_assembly_node *node = l->data;
+	guint32 check;
 
-		g_slist_free_full(node->fragment_list, g_free);
-		g_free(node);
-	}
+	check = sms_backup_checksum(2166136261U,
+				(const unsigned char *) rec + sizeof(rec->check),
+				sizeof(*rec) - sizeof(rec->check));
 
-	g_slist_free(assembly->assembly_list);
-	g_free(assembly);
+	return sms_backup_checksum(check, data, rec->len);
 }
 
-GSList *sms_assembly_add_fragment(struct sms_assembly *assembly,
-					const struct sms *sms, time_t ts,
-					const struct sms_address *addr,
-					guint16 ref, guint8 max, guint8 seq)
+static gboolean sms_backup_record_init(struct sms_backup_record *rec,
+					guint8 type,
+					const struct sms_assembly_node *node,
+					guint8 seq, const unsigned char *data,
+					guint8 len)
 {
-	return sms_assembly_add_fragment_backup(assembly, sms,
-						ts, addr, ref, max, seq, TRUE);
-}
+	int offset = 0;
 
-static GSList *sms_assembly_add_fragment_backup(struct sms_assembly *assembly,
-					const struct sms *sms, time_t ts,
-					const struct sms_address *addr,
-					guint16 ref, guint8 max, guint8 seq,
-					gboolean backup)
-{
-	unsigned int offset = seq / 32;
-	unsigned int bit = 1 << (seq % 32);
-	GSList *l;
-	GSList *prev;
-	struct sms *newsms;
-	struct sms_assembly_node *node;
-	GSList *completed;
-	unsigned int position;
-	unsigned int i;
-	unsigned int j;
+	memset(rec, 0, sizeof(*rec));
 
-	prev = NULL;
+	if (sms_encode_address_field(&node->addr, FALSE,
+						rec->addr, &offset) == FALSE)
+		return FALSE;
 
-	for (l = assembly->assembly_list; l; prev = l, l = l->next) {
-		node = l->data;
+	rec->type = type;
+	rec->max = node->max_fragments;
+	rec->seq = seq;
+	rec->addr_len = offset;
+	rec->ref = node->ref;
+	rec->len = len;
+	rec->ts = node->ts;
+	rec->check = sms_backup_record_check(rec, data);
 
-		if (node->addr.number_type != addr->number_type)
-			continue;
+	return TRUE;
+}
 
-		if (node->addr.numbering_plan != addr->numbering_plan)
-			continue;
+static guint sms_assembly_node_hash(gconstpointer key)
+{
+	const struct sms_assembly_node *node = key;
 
-		if (strcmp(node->addr.address, addr->address))
-			continue;
+	return g_str_hash(node->addr.address) ^ node->ref;
+}
 
-		if (ref != node->ref)
-			continue;
+static gboolean sms_assembly_node_equal(gconstpointer a, gconstpointer b)
+{
+	const struct sms_assembly_node *node_a = a;
+	const struct sms_assembly_node *node_b = b;
 
-		/*
-		 * Message Reference and address the same, but max is not
-		 * ignore the SMS completely
-		 */
-		if (max != node->max_fragments)
-			return NULL;
+	if (node_a->ref != node_b->ref)
+		return FALSE;
 
-		/* Now check if we already have this seq number */
-		if (node->bitmap[offset] & bit)
-			return NULL;
+	if (node_a->addr.number_type != node_b->addr.number_type)
+		return FALSE;
 
-		/*
-		 * Iterate over the bitmap to find in which position
-		 * should the fragment be inserted -- basically we
-		 * walk each bit in the bitmap until the bit we care
-		 * about (offset:bit) and count which are stored --
-		 * that gives us in which position we have to insert.
-		 */
-		position = 0;
-		for (i = 0; i < offset; i++)
-			for (j = 0; j < 32; j++)
-				if (node->bitmap[i] & (1 << j))
-					position += 1;
+	if (node_a->addr.numbering_plan != node_b->addr.numbering_plan)
+		return FALSE;
 
-		for (j = 1; j < bit; j = j << 1)
-			if (node->bitmap[offset] & j)
-				position += 1;
+	return strcmp(node_a->addr.address, node_b->addr.address) == 0;
+}
 
-		goto out;
-	}
+static struct sms_assembly_node *sms_assembly_lookup(
+					struct sms_assembly *assembly,
+					const struct sms_address *addr,
+					guint16 ref)
+{
+	struct sms_assembly_node key;
 
-	node = g_new0(struct sms_assembly_node, 1);
-	memcpy(&node->addr, addr, sizeof(struct sms_address));
-	node->ts = ts;
-	node->ref = ref;
-	node->max_fragments = max;
+	memcpy(&key.addr, addr, sizeof(struct sms_address));
+	key.ref = ref;
 
-	assembly->assembly_list = g_slist_prepend(assembly->assembly_list,
-							node);
+	return g_hash_table_lookup(assembly->assembly_table, &key);
+}
 
-	prev = NULL;
-	l = assembly->assembly_list;
-	position = 0;
+static struct sms_assembly_node *sms_assembly_find(
+					struct sms_assembly *assembly,
+					const struct sms_address *addr,
+					guint16 ref, guint8 max)
+{
+	struct sms_assembly_node *node;
 
-out:
-	newsms = g_new(struct sms, 1);
+	node = sms_assembly_lookup(assembly, addr, ref);
+	if (node == NULL || node->max_fragments != max)
+		return NULL;
 
-	memcpy(newsms, sms, sizeof(struct sms));
-	node->fragment_list = g_slist_insert(node->fragment_list,
-						newsms, position);
-	node->bitmap[offset] |= bit;
-	node->num_fragments += 1;
+	return node;
+}
 
-	if (node->num_fragments < node->max_fragments) {
-		if (backup)
-			sms_assembly_store(assembly, node, sms, seq);
+/*
+ * Incomplete messages are also kept in a binary min-heap on their
+ * timestamp, so that expiring them never walks the ones to keep
+ */
+static void sms_assembly_heap_set(GPtrArray *heap, guint i,
+					struct sms_assembly_node *node)
+{
+	g_ptr_array_index(heap, i) = node;
+	node->heap_index = i;
+}
 
-		return NULL;
-	}
+static void sms_assembly_heap_up(GPtrArray *heap, guint i)
+{
+	struct sms_assembly_node *node = g_ptr_array_index(heap, i);
+	struct sms_assembly_node *parent;
 
-	completed = node->fragment_list;
+	while (i > 0) {
+		parent = g_ptr_array_index(heap, (i - 1) / 2);
 
-	sms_assembly_backup_free(assembly, node);
+		if (parent->ts <= node->ts)
+			break;
 
-	if (prev)
-		prev->next = l->next;
-	else
-		assembly->assembly_list = l->next;
+		sms_assembly_heap_set(heap, i, parent);
+		i = (i - 1) / 2;
+	}
 
-	g_free(node);
-	g_slist_free_1(l);
-	return completed;
+	sms_assembly_heap_set(heap, i, node);
 }
 
-/*!
- * Expires all incomplete messages that have been received at time prior
- * to one given by before argument.  The fragment list is freed and the
- * SMSes are vaporized.
- */
-void sms_assembly_expire(struct sms_assembly *assembly, time_t before)
+static void sms_assembly_heap_down(GPtrArray *heap, guint i)
 {
-	GSList *cur;
-	GSList *prev;
-	GSList *tmp;
+	struct sms_assembly_node *node = g_ptr_array_index(heap, i);
+	struct sms_assembly_node *child;
+	guint c;
 
-	prev = NULL;
-	cur = assembly->assembly_list;
-
-	while (cur) {
-		struct sms_assembly_node *node = cur->data;
+	while ((c = 2 * i + 1) < heap->len) {
+		child = g_ptr_array_index(heap, c);
 
-		if (node->ts > before) {
-			prev = cur;
-			cur = cur->next;
-			continue;
-		}
+		if (c + 1 < heap->len) {
+			struct sms_assembly_node *right;
 
-		sms_assembly_backup_free(assembly, node);
+			right = g_ptr_array_index(heap, c + 1);
 
-		g_slist_free_full(node->fragment_list, g_free);
-		g_free(node);
+			if (right->ts < child->ts) {
+				child = right;
+				c += 1;
+			}
+		}
 
-		if (prev)
-			prev->next = cur->next;
-		else
-			assembly->assembly_list = cur->next;
+		if (node->ts <= child->ts)
+			break;
 
-		tmp = cur;
-		cur = cur->next;
-		g_slist_free_1(tmp);
+		sms_assembly_heap_set(heap, i, child);
+		i = c;
 	}
-}
 
-static gboolean sha1_equal(gconstpointer v1, gconstpointer v2)
-{
-	return memcmp(v1, v2, SMS_MSGID_LEN) == 0;
+	sms_assembly_heap_set(heap, i, node);
 }
 
-static guint sha1_hash(gconstpointer v)
+static void sms_assembly_node_add(struct sms_assembly *assembly,
+					struct sms_assembly_node *node)
 {
-	guint h;
+	GPtrArray *heap = assembly->expiry_heap;
 
-	memcpy(&h, v, sizeof(h));
+	g_hash_table_add(assembly->assembly_table, node);
 
-	return h;
+	g_ptr_array_add(heap, node);
+	sms_assembly_heap_up(heap, heap->len - 1);
 }
 
-static void sr_assembly_load_backup(GHashTable *assembly_table,
-					const char *imsi,
-					const struct dirent *addr_dir)
+static void sms_assembly_node_remove(struct sms_assembly *assembly,
+					struct sms_assembly_node *node)
 {
-	struct sms_address addr;
-	DECLARE_SMS_ADDR_STR(straddr);
-	struct id_table_node *node;
-	GHashTable *id_table;
-	int r;
-	char *assembly_table_key;
-	unsigned int *id_table_key;
-	char msgid_str[SMS_MSGID_LEN * 2 + 1];
-	unsigned char msgid[SMS_MSGID_LEN];
-	char endc;
+	GPtrArray *heap = assembly->expiry_heap;
+	guint i = node->heap_index;
+	struct sms_assembly_node *last;
 
-	if (addr_dir->d_type != DT_REG)
-		return;
+	g_hash_table_remove(assembly->assembly_table, node);
 
-	/*
-	 * All SMS-messages under the same IMSI-code are
-	 * included in the same directory.
-	 * So, SMS-address and message ID are included in the same file name
-	 * Max of SMS address size is 12 bytes, hex encoded
-	 * Max of SMS SHA1 hash is 20 bytes, hex encoded
-	 */
-	if (sscanf(addr_dir->d_name, SMS_ADDR_FMT "-" SMS_MSGID_FMT "%c",
-				straddr, msgid_str, &endc) != 2)
-		return;
+	last = g_ptr_array_index(heap, heap->len - 1);
+	g_ptr_array_set_size(heap, heap->len - 1);
 
-	if (sms_assembly_extract_address(straddr, &addr) == FALSE)
+	if (last == node)
 		return;
 
-	if (strlen(msgid_str) != 2 * SMS_MSGID_LEN)
-		return;
+	sms_assembly_heap_set(heap, i, last);
+	sms_assembly_heap_up(heap, i);
+	sms_assembly_heap_down(heap, last->heap_index);
+}
 
-	if (decode_hex_own_buf(msgid_str, 2 * SMS_MSGID_LEN,
-				NULL, 0, msgid) == NULL)
-		return;
+static void sms_assembly_node_free(struct sms_assembly *assembly,
+					struct sms_assembly_node *node)
+{
+	sms_assembly_node_remove(assembly, node);
 
-	node = g_new0(struct id_table_node, 1);
+	g_slist_free_full(node->fragment_list, g_free);
+	g_free(node);
+}
+
+/*
+ * Replays the log, returns TRUE if it holds anything besides the
+ * fragments still being assembled and should be rewritten
+ */
+static gboolean sms_assembly_load_log(struct sms_assembly *assembly)
+{
+	struct sms_backup_record rec;
+	struct sms_assembly_node *node;
+	struct sms_address addr;
+	struct sms segment;
+	const unsigned char *data;
+	unsigned char *buf;
+	struct stat st;
+	GSList *completed;
+	gboolean dirty = FALSE;
+	size_t off = 0;
+	guint8 before;
+	char *path;
+	int offset;
+	int fd;
+
+	path = g_strdup_printf(SMS_BACKUP_LOG, assembly->imsi);
+	fd = L_TFR(open(path, O_RDONLY | O_CLOEXEC));
+	g_free(path);
+
+	if (fd == -1)
+		return FALSE;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		L_TFR(close(fd));
+		return FALSE;
+	}
+
+	buf = g_try_malloc(st.st_size);
+
+	if (buf == NULL || L_TFR(read(fd, buf, st.st_size)) != st.st_size)
+		st.st_size = 0;
+
+	L_TFR(close(fd));
+
+	while (off + sizeof(rec) <= (size_t) st.st_size) {
+		memcpy(&rec, buf + off, sizeof(rec));
+		data = buf + off + sizeof(rec);
+
+		if (off + sizeof(rec) + rec.len > (size_t) st.st_size)
+			break;
+
+		if (rec.check != sms_backup_record_check(&rec, data))
+			break;
+
+		off += sizeof(rec) + rec.len;
+		offset = 0;
+
+		if (sms_decode_address_field(rec.addr, rec.addr_len, &offset,
+						FALSE, &addr) == FALSE) {
+			dirty = TRUE;
+			continue;
+		}
+
+		node = sms_assembly_find(assembly, &addr, rec.ref, rec.max);
+
+		if (rec.type == SMS_BACKUP_RECORD_REMOVE) {
+			if (node)
+				sms_assembly_node_free(assembly, node);
+
+			dirty = TRUE;
+			continue;
+		}
+
+		if (rec.type != SMS_BACKUP_RECORD_FRAGMENT ||
+				!sms_deserialize(data, &segment, rec.len)) {
+			dirty = TRUE;
+			continue;
+		}
+
+		before = node ? node->num_fragments : 0;
+
+		completed = sms_assembly_add_fragment_backup(assembly, &segment,
+						rec.ts, &addr, rec.ref,
+						rec.max, rec.seq, FALSE);
+		if (completed) {
+			g_slist_free_full(completed, g_free);
+			dirty = TRUE;
+			continue;
+		}
+
+		node = sms_assembly_find(assembly, &addr, rec.ref, rec.max);
+
+		if (node == NULL || node->num_fragments == before) {
+			dirty = TRUE;
+			continue;
+		}
+
+		node->backup_len += sizeof(rec) + rec.len;
+	}
+
+	g_free(buf);
+
+	assembly->backup_size = st.st_size;
+	assembly->backup_live = st.st_size;
+
+	return dirty || off != (size_t) st.st_size;
+}
+
+static void sms_assembly_sync(struct sms_assembly *assembly)
+{
+	if (assembly->backup_sync_source) {
+		g_source_remove(assembly->backup_sync_source);
+		assembly->backup_sync_source = 0;
+	}
+
+	/* As with a failed append, what is on disk can't be trusted */
+	if (assembly->backup_fd >= 0 && fdatasync(assembly->backup_fd) < 0)
+		assembly->backup_compact = TRUE;
+}
+
+static gboolean sms_assembly_sync_timeout(gpointer user_data)
+{
+	struct sms_assembly *assembly = user_data;
+
+	assembly->backup_sync_source = 0;
+	sms_assembly_sync(assembly);
+
+	return FALSE;
+}
+
+/* Rewrites the log with only the fragments of incomplete messages */
+static gboolean sms_assembly_compact(struct sms_assembly *assembly)
+{
+	struct sms_backup_record rec;
+	unsigned char buf[177];
+	GByteArray *log;
+	gboolean ret = TRUE;
+	GSList *f;
+	char *path;
+	guint i;
+	int seq;
+	int len;
+
+	log = g_byte_array_new();
+
+	for (i = 0; i < assembly->expiry_heap->len; i++) {
+		struct sms_assembly_node *node =
+				g_ptr_array_index(assembly->expiry_heap, i);
+
+		node->backup_len = 0;
+		seq = -1;
+
+		for (f = node->fragment_list; f; f = f->next) {
+			/* Fragments are kept in the order of their seq bits */
+			do
+				seq += 1;
+			while (!(node->bitmap[seq / 32] & (1 << (seq % 32))));
+
+			len = sms_serialize(buf, f->data);
+
+			if (sms_backup_record_init(&rec,
+						SMS_BACKUP_RECORD_FRAGMENT,
+						node, seq, buf, len) == FALSE)
+				continue;
+
+			g_byte_array_append(log, (guint8 *) &rec, sizeof(rec));
+			g_byte_array_append(log, buf, len);
+			node->backup_len += sizeof(rec) + len;
+		}
+	}
+
+	/* The rewrite replaces whatever was still to be synced */
+	if (assembly->backup_sync_source) {
+		g_source_remove(assembly->backup_sync_source);
+		assembly->backup_sync_source = 0;
+	}
+
+	if (assembly->backup_fd >= 0) {
+		L_TFR(close(assembly->backup_fd));
+		assembly->backup_fd = -1;
+	}
+
+	if (log->len == 0) {
+		path = g_strdup_printf(SMS_BACKUP_LOG, assembly->imsi);
+		unlink(path);
+		g_free(path);
+	} else if (write_file_durable(log->data, log->len, SMS_BACKUP_MODE,
+				SMS_BACKUP_LOG, assembly->imsi) != log->len)
+		ret = FALSE;
+
+	if (ret) {
+		assembly->backup_size = log->len;
+		assembly->backup_live = log->len;
+		assembly->backup_compact = FALSE;
+	}
+
+	g_byte_array_free(log, TRUE);
+
+	return ret;
+}
+
+static void sms_assembly_check_compact(struct sms_assembly *assembly)
+{
+	if (assembly->imsi == NULL)
+		return;
+
+	if (assembly->backup_compact ||
+			(assembly->backup_size > SMS_BACKUP_LOG_COMPACT_SIZE &&
+			assembly->backup_size - assembly->backup_live >
+						assembly->backup_live))
+		sms_assembly_compact(assembly);
+}
+
+static gboolean sms_assembly_append(struct sms_assembly *assembly,
+					const struct sms_backup_record *rec,
+					const unsigned char *data)
+{
+	unsigned char buf[sizeof(*rec) + 256];
+	size_t len = sizeof(*rec) + rec->len;
+	char *path;
+
+	if (assembly->backup_fd < 0) {
+		path = g_strdup_printf(SMS_BACKUP_LOG, assembly->imsi);
+
+		if (create_dirs(path, SMS_BACKUP_MODE | S_IXUSR) == 0)
+			assembly->backup_fd = L_TFR(open(path,
+					O_WRONLY | O_CREAT | O_APPEND |
+					O_CLOEXEC, SMS_BACKUP_MODE));
+
+		/* The log may have just been created */
+		if (assembly->backup_fd >= 0 && sync_parent_dir(path) < 0) {
+			L_TFR(close(assembly->backup_fd));
+			assembly->backup_fd = -1;
+		}
+
+		g_free(path);
+	}
+
+	memcpy(buf, rec, sizeof(*rec));
+
+	if (rec->len)
+		memcpy(buf + sizeof(*rec), data, rec->len);
+
+	if (assembly->backup_fd < 0 ||
+			L_TFR(write(assembly->backup_fd, buf, len)) !=
+								(ssize_t) len) {
+		/*
+		 * Whatever made it to the log might end in a torn record
+		 * hiding everything after it, start over from memory
+		 */
+		assembly->backup_compact = TRUE;
+		return FALSE;
+	}
+
+	assembly->backup_size += len;
+
+	if (assembly->backup_sync_source == 0)
+		assembly->backup_sync_source =
+				g_timeout_add(SMS_BACKUP_SYNC_DELAY,
+						sms_assembly_sync_timeout,
+						assembly);
+
+	return TRUE;
+}
+
+static gboolean sms_assembly_store(struct sms_assembly *assembly,
+				struct sms_assembly_node *node,
+				const struct sms *sms, guint8 seq)
+{
+	struct sms_backup_record rec;
+	unsigned char buf[177];
+	int len;
+
+	if (assembly->imsi == NULL)
+		return FALSE;
+
+	len = sms_serialize(buf, sms);
+
+	if (sms_backup_record_init(&rec, SMS_BACKUP_RECORD_FRAGMENT,
+					node, seq, buf, len) == FALSE)
+		return FALSE;
+
+	node->backup_len += sizeof(rec) + len;
+	assembly->backup_live += sizeof(rec) + len;
+
+	return sms_assembly_append(assembly, &rec, buf);
+}
+
+static void sms_assembly_backup_free(struct sms_assembly *assembly,
+					struct sms_assembly_node *node)
+{
+	struct sms_backup_record rec;
+
+	if (assembly->imsi == NULL || assembly->restoring)
+		return;
+
+	assembly->backup_live -= node->backup_len;
+	node->backup_len = 0;
+
+	if (sms_backup_record_init(&rec, SMS_BACKUP_RECORD_REMOVE,
+					node, 0, NULL, 0) == FALSE)
+		return;
+
+	sms_assembly_append(assembly, &rec, NULL);
+}
+
+struct sms_assembly *sms_assembly_new(const char *imsi)
+{
+	struct sms_assembly *ret = g_new0(struct sms_assembly, 1);
+	gboolean legacy;
+
+	ret->backup_fd = -1;
+	ret->assembly_table = g_hash_table_new(sms_assembly_node_hash,
+						sms_assembly_node_equal);
+	ret->expiry_heap = g_ptr_array_new();
+
+	if (imsi) {
+		ret->imsi = imsi;
+
+		/* Restore state from backup */
+		ret->restoring = TRUE;
+		legacy = sms_assembly_load_legacy(ret);
+		ret->backup_compact = sms_assembly_load_log(ret) || legacy;
+		ret->restoring = FALSE;
+
+		sms_assembly_check_compact(ret);
+
+		if (legacy && !ret->backup_compact) {
+			char *path = g_strdup_printf(SMS_BACKUP_PATH, imsi);
+
+			sms_backup_remove_legacy(path);
+			g_free(path);
+		}
+	}
+
+	return ret;
+}
+
+void sms_assembly_free(struct sms_assembly *assembly)
+{
+	guint i;
+
+	for (i = 0; i < assembly->expiry_heap->len; i++) {
+		struct sms_assembly_node *node =
+				g_ptr_array_index(assembly->expiry_heap, i);
+
+		g_slist_free_full(node->fragment_list, g_free);
+		g_free(node);
+	}
+
+	sms_assembly_sync(assembly);
+
+	if (assembly->backup_fd >= 0)
+		L_TFR(close(assembly->backup_fd));
+
+	g_hash_table_destroy(assembly->assembly_table);
+	g_ptr_array_free(assembly->expiry_heap, TRUE);
+	g_free(assembly);
+}
+
+/*!
+ * Returns the timestamp of the oldest incomplete message, or 0 if there
+ * is none.  Useful to schedule the next sms_assembly_expire()
+ */
+time_t sms_assembly_oldest(struct sms_assembly *assembly)
+{
+	struct sms_assembly_node *node;
+
+	if (assembly->expiry_heap->len == 0)
+		return 0;
+
+	node = g_ptr_array_index(assembly->expiry_heap, 0);
+
+	return node->ts;
+}
+
+GSList *sms_assembly_add_fragment(struct sms_assembly *assembly,
+					const struct sms *sms, time_t ts,
+					const struct sms_address *addr,
+					guint16 ref, guint8 max, guint8 seq)
+{
+	GSList *completed;
+
+	completed = sms_assembly_add_fragment_backup(assembly, sms,
+						ts, addr, ref, max, seq, TRUE);
+	sms_assembly_check_compact(assembly);
+
+	return completed;
+}
+
+static GSList *sms_assembly_add_fragment_backup(struct sms_assembly *assembly,
+					const struct sms *sms, time_t ts,
+					const struct sms_address *addr,
+					guint16 ref, guint8 max, guint8 seq,
+					gboolean backup)
+{
+	unsigned int offset = seq / 32;
+	unsigned int bit = 1 << (seq % 32);
+	struct sms *newsms;
+	struct sms_assembly_node *node;
+	GSList *completed;
+	unsigned int position;
+	unsigned int i;
+	unsigned int j;
+
+	node = sms_assembly_lookup(assembly, addr, ref);
+
+	if (node) {
+		/*
+		 * Message Reference and address the same, but max is not
+		 * ignore the SMS completely
+		 */
+		if (max != node->max_fragments)
+			return NULL;
+
+		/* Now check if we already have this seq number */
+		if (node->bitmap[offset] & bit)
+			return NULL;
+
+		/*
+		 * Iterate over the bitmap to find in which position
+		 * should the fragment be inserted -- basically we
+		 * walk each bit in the bitmap until the bit we care
+		 * about (offset:bit) and count which are stored --
+		 * that gives us in which position we have to insert.
+		 */
+		position = 0;
+		for (i = 0; i < offset; i++)
+			for (j = 0; j < 32; j++)
+				if (node->bitmap[i] & (1 << j))
+					position += 1;
+
+		for (j = 1; j < bit; j = j << 1)
+			if (node->bitmap[offset] & j)
+				position += 1;
+	} else {
+		node = g_new0(struct sms_assembly_node, 1);
+		memcpy(&node->addr, addr, sizeof(struct sms_address));
+		node->ts = ts;
+		node->ref = ref;
+		node->max_fragments = max;
+
+		sms_assembly_node_add(assembly, node);
+
+		position = 0;
+	}
+
+	newsms = g_new(struct sms, 1);
+
+	memcpy(newsms, sms, sizeof(struct sms));
+	node->fragment_list = g_slist_insert(node->fragment_list,
+						newsms, position);
+	node->bitmap[offset] |= bit;
+	node->num_fragments += 1;
+
+	if (node->num_fragments < node->max_fragments) {
+		if (backup)
+			sms_assembly_store(assembly, node, sms, seq);
+
+		return NULL;
+	}
+
+	completed = node->fragment_list;
+
+	sms_assembly_backup_free(assembly, node);
+	sms_assembly_node_remove(assembly, node);
+
+	g_free(node);
+	return completed;
+}
+
+/*!
+ * Expires all incomplete messages that have been received at time prior
+ * to one given by before argument.  The fragment list is freed and the
+ * SMSes are vaporized.
+ */
+void sms_assembly_expire(struct sms_assembly *assembly, time_t before)
+{
+	struct sms_assembly_node *node;
+
+	while (assembly->expiry_heap->len > 0) {
+		node = g_ptr_array_index(assembly->expiry_heap, 0);
+
+		if (node->ts > before)
+			break;
+
+		sms_assembly_backup_free(assembly, node);
+		sms_assembly_node_free(assembly, node);
+	}
+
+	sms_assembly_check_compact(assembly);
+}
+
+static gboolean sha1_equal(gconstpointer v1, gconstpointer v2)
+{
+	return memcmp(v1, v2, SMS_MSGID_LEN) == 0;
+}
+
+static guint sha1_hash(gconstpointer v)
+{
+	guint h;
+
+	memcpy(&h, v, sizeof(h));
+
+	return h;
+}
+
+static void sr_assembly_load_backup(GHashTable *assembly_table,
+					const char *imsi,
+					const struct dirent *addr_dir)
+{
+	struct sms_address addr;
+	DECLARE_SMS_ADDR_STR(straddr);
+	struct id_table_node *node;
+	GHashTable *id_table;
+	int r;
+	char *assembly_table_key;
+	unsigned int *id_table_key;
+	char msgid_str[SMS_MSGID_LEN * 2 + 1];
+	unsigned char msgid[SMS_MSGID_LEN];
+	char endc;
+
+	if (addr_dir->d_type != DT_REG)
+		return;
+
+	/*
+	 * All SMS-messages under the same IMSI-code are
+	 * included in the same directory.
+	 * So, SMS-address and message ID are included in the same file name
+	 * Max of SMS address size is 12 bytes, hex encoded
+	 * Max of SMS SHA1 hash is 20 bytes, hex encoded
+	 */
+	if (sscanf(addr_dir->d_name, SMS_ADDR_FMT "-" SMS_MSGID_FMT "%c",
+				straddr, msgid_str, &endc) != 2)
+		return;
+
+	if (sms_assembly_extract_address(straddr, &addr) == FALSE)
+		return;
+
+	if (strlen(msgid_str) != 2 * SMS_MSGID_LEN)
+		return;
+
+	if (decode_hex_own_buf(msgid_str, 2 * SMS_MSGID_LEN,
+				NULL, 0, msgid) == NULL)
+		return;
+
+	node = g_new0(struct id_table_node, 1);
 
 	r = read_file((unsigned char *) node,
 			sizeof(struct id_table_node),
@@ -3262,157 +3842,641 @@ static int sms_tx_queue_filter(const struct dirent *dirent)
 	return 1;
 }
 
+static void sms_tx_journal_entry_free(gpointer data)
+{
+	struct sms_tx_journal_entry *entry = data;
+
+	g_free(entry->pdus);
+	g_free(entry);
+}
+
+static struct sms_tx_journal_entry *sms_tx_journal_entry_new(
+					const unsigned char *uuid,
+					unsigned long flags,
+					const struct sms_tx_backup_pdu *pdus,
+					guint8 num_pdus)
+{
+	struct sms_tx_journal_entry *entry;
+	unsigned char *p;
+	guint8 i;
+
+	entry = g_new0(struct sms_tx_journal_entry, 1);
+	memcpy(entry->uuid, uuid, SMS_MSGID_LEN);
+	entry->flags = flags;
+	entry->num_pdus = num_pdus;
+
+	for (i = 0; i < num_pdus; i++)
+		entry->len += 2 + pdus[i].pdu_len;
+
+	entry->pdus = g_malloc(entry->len);
+
+	for (i = 0, p = entry->pdus; i < num_pdus; i++) {
+		p[0] = pdus[i].tpdu_len;
+		p[1] = pdus[i].pdu_len;
+		memcpy(p + 2, pdus[i].pdu, pdus[i].pdu_len);
+		p += 2 + pdus[i].pdu_len;
+	}
+
+	return entry;
+}
+
 /*
- * populate the queue with tx_backup_entry from stored backup
- * data.
+ * Restores the queue of older versions, kept one directory per message
+ * and one file per pdu, in the order of the directory names
  */
-GQueue *sms_tx_queue_load(const char *imsi)
+static GSList *sms_tx_queue_load_legacy(const char *imsi)
 {
-	GQueue *retq = 0;
+	GSList *entries = NULL;
+	struct sms_tx_backup_pdu pdus[255];
+	unsigned char *buf;
 	char *path;
-	struct dirent **entries;
+	struct dirent **dirs;
 	int len;
 	int i;
-	unsigned long id;
-
-	if (imsi == NULL)
-		return NULL;
 
 	path = g_strdup_printf(SMS_TX_BACKUP_PATH, imsi);
+	len = scandir(path, &dirs, sms_tx_queue_filter, versionsort);
+	g_free(path);
 
-	len = scandir(path, &entries, sms_tx_queue_filter, versionsort);
 	if (len < 0)
-		goto nodir_exit;
+		return NULL;
 
-	retq = g_queue_new();
+	buf = g_try_malloc(255 * 176);
+	if (buf == NULL) {
+		for (i = 0; i < len; i++)
+			free(dirs[i]);
+
+		free(dirs);
+		return NULL;
+	}
 
-	for (i = 0, id = 0; i < len; i++) {
-		char uuid[SMS_MSGID_LEN * 2 + 1];
+	for (i = 0; i < len; i++) {
+		char uuid_str[SMS_MSGID_LEN * 2 + 1];
+		unsigned char uuid[SMS_MSGID_LEN];
 		GSList *msg_list;
+		GSList *l;
 		unsigned long oldid;
 		unsigned long flags;
-		char *oldpath, *newpath;
-		struct txq_backup_entry *entry;
-		struct dirent *dir = entries[i];
+		guint8 num_pdus = 0;
 		char endc;
 
-		if (sscanf(dir->d_name, "%lu-%lu-" SMS_MSGID_FMT "%c",
-					&oldid, &flags, uuid, &endc) != 3)
-			continue;
+		if (sscanf(dirs[i]->d_name, "%lu-%lu-" SMS_MSGID_FMT "%c",
+					&oldid, &flags, uuid_str, &endc) != 3)
+			goto next;
 
-		if (strlen(uuid) !=  2 * SMS_MSGID_LEN)
-			continue;
+		if (strlen(uuid_str) != 2 * SMS_MSGID_LEN)
+			goto next;
 
-		msg_list = sms_tx_load(imsi, dir);
-		if (msg_list == NULL)
-			continue;
+		msg_list = sms_tx_load(imsi, dirs[i]);
 
-		entry = g_new0(struct txq_backup_entry, 1);
-		entry->msg_list = msg_list;
-		entry->flags = flags;
-		decode_hex_own_buf(uuid, -1, NULL, 0, entry->uuid);
+		for (l = msg_list; l && num_pdus < 255; l = l->next) {
+			struct sms_tx_backup_pdu *pdu = &pdus[num_pdus];
+			unsigned char *pdu_buf = buf + num_pdus * 176;
 
-		g_queue_push_tail(retq, entry);
+			if (sms_encode(l->data, &pdu->pdu_len, &pdu->tpdu_len,
+						pdu_buf) == FALSE)
+				continue;
 
-		/* Don't bother re-shuffling the ids if they are the same */
-		if (oldid == id) {
-			id++;
-			continue;
+			pdu->pdu = pdu_buf;
+			num_pdus += 1;
 		}
 
-		oldpath = g_strdup_printf("%s/%s", path, dir->d_name);
-		newpath = g_strdup_printf(SMS_TX_BACKUP_PATH_DIR,
-						imsi, id++, flags, uuid);
+		g_slist_free_full(msg_list, g_free);
 
-		/* rename directory to reflect new position in queue */
-		rename(oldpath, newpath);
+		if (num_pdus == 0)
+			goto next;
 
-		g_free(newpath);
-		g_free(oldpath);
+		decode_hex_own_buf(uuid_str, -1, NULL, 0, uuid);
+		entries = g_slist_prepend(entries,
+					sms_tx_journal_entry_new(uuid, flags,
+							pdus, num_pdus));
+
+next:
+		free(dirs[i]);
 	}
 
-	for (i = 0; i < len; i++)
-		g_free(entries[i]);
+	free(dirs);
+	g_free(buf);
 
-	g_free(entries);
+	return g_slist_reverse(entries);
+}
 
-nodir_exit:
-	g_free(path);
-	return retq;
+static gboolean sms_tx_journal_entry_valid(const unsigned char *pdus,
+						guint16 len, guint8 num_pdus)
+{
+	guint16 off = 0;
+	guint8 i;
+
+	for (i = 0; i < num_pdus; i++) {
+		if (off + 2 > len || pdus[off + 1] > 176)
+			return FALSE;
+
+		off += 2 + pdus[off + 1];
+	}
+
+	return off == len;
 }
 
-gboolean sms_tx_backup_store(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid,
-				guint8 seq, const unsigned char *pdu,
-				int pdu_len, int tpdu_len)
+/*
+ * Replays the journal into the list of messages that are not done yet,
+ * in the order they were queued.  Sets dirty if the journal holds
+ * anything else
+ */
+static GSList *sms_tx_journal_replay(const unsigned char *buf, size_t len,
+					gboolean *dirty)
 {
-	unsigned char buf[177];
-	int len;
+	GHashTable *table = g_hash_table_new(sha1_hash, sha1_equal);
+	struct sms_tx_journal_entry *entry;
+	struct sms_tx_record rec;
+	const unsigned char *data;
+	GSList *entries = NULL;
+	GSList *live = NULL;
+	GSList *l;
+	size_t off = 0;
 
-	if (!imsi)
-		return FALSE;
+	while (off + sizeof(rec) <= len) {
+		memcpy(&rec, buf + off, sizeof(rec));
+		data = buf + off + sizeof(rec);
 
-	memcpy(buf + 1, pdu, pdu_len);
-	buf[0] = tpdu_len;
-	len = pdu_len + 1;
+		if (off + sizeof(rec) + rec.len > len)
+			break;
 
-	/*
-	 * file name is: imsi/tx_queue/order-flags-uuid/pdu
-	 */
-	if (write_file(buf, len, SMS_BACKUP_MODE, SMS_TX_BACKUP_PATH_FILE,
-					imsi, id, flags, uuid, seq) != len)
-		return FALSE;
+		if (rec.check != sms_tx_record_check(&rec, data))
+			break;
 
-	return TRUE;
+		off += sizeof(rec) + rec.len;
+		entry = g_hash_table_lookup(table, rec.uuid);
+
+		switch (rec.type) {
+		case SMS_TX_RECORD_MESSAGE:
+			if (entry || !sms_tx_journal_entry_valid(data, rec.len,
+								rec.seq)) {
+				*dirty = TRUE;
+				break;
+			}
+
+			entry = g_new0(struct sms_tx_journal_entry, 1);
+			memcpy(entry->uuid, rec.uuid, SMS_MSGID_LEN);
+			entry->flags = rec.flags;
+			entry->num_pdus = rec.seq;
+			entry->len = rec.len;
+			entry->pdus = g_memdup(data, rec.len);
+
+			g_hash_table_insert(table, entry->uuid, entry);
+			entries = g_slist_prepend(entries, entry);
+			break;
+		case SMS_TX_RECORD_SENT:
+			if (entry && rec.seq < entry->num_pdus)
+				entry->sent[rec.seq / 32] |= 1 << (rec.seq % 32);
+
+			*dirty = TRUE;
+			break;
+		case SMS_TX_RECORD_DONE:
+			if (entry) {
+				entry->done = TRUE;
+				g_hash_table_remove(table, rec.uuid);
+			}
+
+			*dirty = TRUE;
+			break;
+		default:
+			*dirty = TRUE;
+		}
+	}
+
+	if (off != len)
+		*dirty = TRUE;
+
+	g_hash_table_destroy(table);
+
+	for (l = entries; l; l = l->next) {
+		entry = l->data;
+
+		if (entry->done)
+			sms_tx_journal_entry_free(entry);
+		else
+			live = g_slist_prepend(live, entry);
+	}
+
+	g_slist_free(entries);
+
+	return live;
 }
 
-void sms_tx_backup_free(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid)
+static void sms_tx_journal_append(GByteArray *out, guint8 type,
+					const unsigned char *uuid,
+					unsigned long flags, guint8 seq,
+					const unsigned char *data, guint16 len)
 {
+	struct sms_tx_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.seq = seq;
+	rec.len = len;
+	rec.flags = flags;
+	memcpy(rec.uuid, uuid, SMS_MSGID_LEN);
+	rec.check = sms_tx_record_check(&rec, data);
+
+	g_byte_array_append(out, (guint8 *) &rec, sizeof(rec));
+
+	if (len)
+		g_byte_array_append(out, data, len);
+}
+
+static void sms_tx_journal_close(struct sms_tx_backup *backup)
+{
+	if (backup->fd < 0)
+		return;
+
+	/* Records still waiting for their sync */
+	if (backup->sync_source) {
+		g_source_remove(backup->sync_source);
+		backup->sync_source = 0;
+		fdatasync(backup->fd);
+	}
+
+	L_TFR(close(backup->fd));
+	backup->fd = -1;
+}
+
+/*
+ * Rewrites the journal with the given messages.  With renumber the pdus
+ * already sent are dropped, otherwise they are kept along with their
+ * sent records so the pdu numbers the queue uses stay valid.  On failure
+ * the old journal and its accounting are left as they were
+ */
+static gboolean sms_tx_journal_rewrite(struct sms_tx_backup *backup,
+					GSList *entries, gboolean renumber)
+{
+	GByteArray *out;
+	GHashTable *messages;
+	unsigned char *buf;
+	const unsigned char *p;
+	guint16 len;
+	guint8 num_pdus;
+	guint start;
 	char *path;
-	struct dirent **entries;
-	int len;
+	GSList *l;
+	guint8 i;
+	gboolean ret = TRUE;
 
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH_DIR,
-					imsi, id, flags, uuid);
+	buf = g_try_malloc(255 * 178);
+	if (buf == NULL)
+		return FALSE;
 
-	len = scandir(path, &entries, NULL, versionsort);
+	out = g_byte_array_new();
+	messages = g_hash_table_new_full(sha1_hash, sha1_equal, g_free, NULL);
 
-	if (len < 0)
-		goto nodir_exit;
+	for (l = entries; l; l = l->next) {
+		struct sms_tx_journal_entry *entry = l->data;
+
+		start = out->len;
+		p = entry->pdus;
+		len = 0;
+		num_pdus = 0;
 
-	/* skip '..' and '.' entries */
-	while (len-- > 2) {
-		struct dirent *dir = entries[len];
-		char *file = g_strdup_printf("%s/%s", path, dir->d_name);
+		for (i = 0; i < entry->num_pdus; i++) {
+			gboolean sent = entry->sent[i / 32] & (1 << (i % 32));
 
-		unlink(file);
-		g_free(file);
+			if (!renumber || !sent) {
+				memcpy(buf + len, p, 2 + p[1]);
+				len += 2 + p[1];
+				num_pdus += 1;
+			}
+
+			p += 2 + p[1];
+		}
+
+		if (num_pdus == 0)
+			continue;
+
+		sms_tx_journal_append(out, SMS_TX_RECORD_MESSAGE, entry->uuid,
+					entry->flags, num_pdus, buf, len);
 
-		g_free(entries[len]);
+		for (i = 0; !renumber && i < entry->num_pdus; i++)
+			if (entry->sent[i / 32] & (1 << (i % 32)))
+				sms_tx_journal_append(out, SMS_TX_RECORD_SENT,
+						entry->uuid, entry->flags,
+						i, NULL, 0);
+
+		g_hash_table_insert(messages,
+					g_memdup(entry->uuid, SMS_MSGID_LEN),
+					GUINT_TO_POINTER(out->len - start));
 	}
 
-	g_free(entries[1]);
-	g_free(entries[0]);
-	g_free(entries);
+	g_free(buf);
 
-	rmdir(path);
+	if (out->len == 0) {
+		path = g_strdup_printf(SMS_TX_BACKUP_JOURNAL, backup->imsi);
 
-nodir_exit:
+		if (unlink(path) < 0 && errno != ENOENT)
+			ret = FALSE;
+
+		g_free(path);
+	} else if (write_file_durable(out->data, out->len, SMS_BACKUP_MODE,
+				SMS_TX_BACKUP_JOURNAL, backup->imsi) !=
+							(ssize_t) out->len)
+		ret = FALSE;
+
+	if (ret) {
+		/* The old file is gone, appends go to the new one */
+		sms_tx_journal_close(backup);
+
+		g_hash_table_destroy(backup->messages);
+		backup->messages = messages;
+		backup->size = out->len;
+		backup->live = out->len;
+	} else
+		g_hash_table_destroy(messages);
+
+	g_byte_array_free(out, TRUE);
+
+	return ret;
+}
+
+static GSList *sms_tx_journal_read(struct sms_tx_backup *backup,
+					gboolean *dirty)
+{
+	GSList *entries = NULL;
+	unsigned char *buf;
+	struct stat st;
+	char *path;
+	int fd;
+
+	path = g_strdup_printf(SMS_TX_BACKUP_JOURNAL, backup->imsi);
+	fd = L_TFR(open(path, O_RDONLY | O_CLOEXEC));
 	g_free(path);
+
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		buf = g_try_malloc(st.st_size);
+
+		/* One sequential pass over the whole journal */
+		if (buf && L_TFR(read(fd, buf, st.st_size)) == st.st_size)
+			entries = sms_tx_journal_replay(buf, st.st_size, dirty);
+
+		g_free(buf);
+	}
+
+	L_TFR(close(fd));
+
+	return entries;
+}
+
+static gboolean sms_tx_journal_sync_timeout(gpointer user_data)
+{
+	struct sms_tx_backup *backup = user_data;
+
+	backup->sync_source = 0;
+
+	if (backup->fd >= 0)
+		fdatasync(backup->fd);
+
+	return FALSE;
 }
 
-void sms_tx_backup_remove(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid,
-				guint8 seq)
+/*
+ * Only the records of new messages are synced right away, a sent or done
+ * record lost in a crash just has a pdu sent again.  Those are synced
+ * with the next message or after SMS_BACKUP_SYNC_DELAY
+ */
+static void sms_tx_journal_write(struct sms_tx_backup *backup,
+					GByteArray *rec, gboolean sync)
 {
 	char *path;
 
-	path = g_strdup_printf(SMS_TX_BACKUP_PATH_FILE,
-					imsi, id, flags, uuid, seq);
-	unlink(path);
+	if (backup->fd < 0) {
+		path = g_strdup_printf(SMS_TX_BACKUP_JOURNAL, backup->imsi);
 
-	g_free(path);
+		if (create_dirs(path, SMS_BACKUP_MODE | S_IXUSR) == 0)
+			backup->fd = L_TFR(open(path, O_WRONLY | O_CREAT |
+						O_APPEND | O_CLOEXEC,
+						SMS_BACKUP_MODE));
+
+		/* The journal may have just been created */
+		if (backup->fd >= 0 && sync_parent_dir(path) < 0)
+			sms_tx_journal_close(backup);
+
+		g_free(path);
+
+		if (backup->fd < 0)
+			return;
+	}
+
+	if (L_TFR(write(backup->fd, rec->data, rec->len)) !=
+						(ssize_t) rec->len)
+		goto error;
+
+	if (!sync) {
+		backup->size += rec->len;
+
+		if (backup->sync_source == 0)
+			backup->sync_source =
+				g_timeout_add(SMS_BACKUP_SYNC_DELAY,
+						sms_tx_journal_sync_timeout,
+						backup);
+		return;
+	}
+
+	if (backup->sync_source) {
+		g_source_remove(backup->sync_source);
+		backup->sync_source = 0;
+	}
+
+	if (fdatasync(backup->fd) == 0) {
+		backup->size += rec->len;
+		return;
+	}
+
+error:
+	/* Reopened on the next write in case the fd went bad */
+	sms_tx_journal_close(backup);
+}
+
+struct sms_tx_backup *sms_tx_backup_new(const char *imsi)
+{
+	struct sms_tx_backup *backup;
+
+	if (imsi == NULL)
+		return NULL;
+
+	backup = g_new0(struct sms_tx_backup, 1);
+	backup->imsi = g_strdup(imsi);
+	backup->messages = g_hash_table_new_full(sha1_hash, sha1_equal,
+							g_free, NULL);
+	backup->fd = -1;
+
+	return backup;
+}
+
+void sms_tx_backup_free(struct sms_tx_backup *backup)
+{
+	if (backup == NULL)
+		return;
+
+	sms_tx_journal_close(backup);
+	g_hash_table_destroy(backup->messages);
+	g_free(backup->imsi);
+	g_free(backup);
+}
+
+/*
+ * populate the queue with tx_backup_entry from stored backup
+ * data.
+ */
+GQueue *sms_tx_queue_load(struct sms_tx_backup *backup)
+{
+	GQueue *retq;
+	GSList *entries;
+	GSList *l;
+	gboolean dirty = FALSE;
+	char *path;
+	guint8 i;
+
+	if (backup == NULL)
+		return NULL;
+
+	entries = sms_tx_queue_load_legacy(backup->imsi);
+	entries = g_slist_concat(entries, sms_tx_journal_read(backup, &dirty));
+
+	/*
+	 * The queue restarts from its first unsent pdu of every message.
+	 * The older backup goes only once the journal holds its messages
+	 */
+	if (sms_tx_journal_rewrite(backup, entries, TRUE)) {
+		path = g_strdup_printf(SMS_TX_BACKUP_PATH, backup->imsi);
+		sms_backup_remove_legacy(path);
+		g_free(path);
+	}
+
+	retq = g_queue_new();
+
+	for (l = entries; l; l = l->next) {
+		struct sms_tx_journal_entry *entry = l->data;
+		struct txq_backup_entry *backup_entry;
+		const unsigned char *p = entry->pdus;
+		GSList *msg_list = NULL;
+		struct sms s;
+
+		for (i = 0; i < entry->num_pdus; i++, p += 2 + p[1]) {
+			if (entry->sent[i / 32] & (1 << (i % 32)))
+				continue;
+
+			if (sms_decode(p + 2, p[1], TRUE, p[0], &s) == FALSE)
+				continue;
+
+			msg_list = g_slist_prepend(msg_list,
+						g_memdup(&s, sizeof(s)));
+		}
+
+		if (msg_list == NULL)
+			continue;
+
+		backup_entry = g_new0(struct txq_backup_entry, 1);
+		backup_entry->msg_list = g_slist_reverse(msg_list);
+		backup_entry->flags = entry->flags;
+		memcpy(backup_entry->uuid, entry->uuid, SMS_MSGID_LEN);
+
+		g_queue_push_tail(retq, backup_entry);
+	}
+
+	g_slist_free_full(entries, sms_tx_journal_entry_free);
+
+	return retq;
+}
+
+gboolean sms_tx_backup_store(struct sms_tx_backup *backup,
+				unsigned long flags, const unsigned char *uuid,
+				const struct sms_tx_backup_pdu *pdus,
+				guint8 num_pdus)
+{
+	struct sms_tx_journal_entry *entry;
+	GByteArray *rec;
+	size_t size;
+
+	if (backup == NULL)
+		return FALSE;
+
+	entry = sms_tx_journal_entry_new(uuid, flags, pdus, num_pdus);
+	rec = g_byte_array_new();
+
+	/* A single record for all the pdus of the message */
+	sms_tx_journal_append(rec, SMS_TX_RECORD_MESSAGE, uuid, flags,
+				num_pdus, entry->pdus, entry->len);
+	sms_tx_journal_entry_free(entry);
+
+	size = backup->size;
+	sms_tx_journal_write(backup, rec, TRUE);
+
+	if (backup->size != size) {
+		g_hash_table_replace(backup->messages,
+					g_memdup(uuid, SMS_MSGID_LEN),
+					GUINT_TO_POINTER(rec->len));
+		backup->live += rec->len;
+	}
+
+	g_byte_array_free(rec, TRUE);
+
+	return backup->size != size;
+}
+
+void sms_tx_backup_sent(struct sms_tx_backup *backup,
+				const unsigned char *uuid, guint8 seq)
+{
+	GByteArray *rec;
+	gpointer bytes;
+
+	if (backup == NULL)
+		return;
+
+	rec = g_byte_array_new();
+	sms_tx_journal_append(rec, SMS_TX_RECORD_SENT, uuid, 0, seq, NULL, 0);
+	sms_tx_journal_write(backup, rec, FALSE);
+
+	/* Counted as live until the message is done, see rewrite */
+	bytes = g_hash_table_lookup(backup->messages, uuid);
+
+	if (bytes) {
+		g_hash_table_replace(backup->messages,
+				g_memdup(uuid, SMS_MSGID_LEN),
+				GUINT_TO_POINTER(GPOINTER_TO_UINT(bytes) +
+								rec->len));
+		backup->live += rec->len;
+	}
+
+	g_byte_array_free(rec, TRUE);
+}
+
+void sms_tx_backup_done(struct sms_tx_backup *backup,
+				const unsigned char *uuid)
+{
+	GByteArray *rec;
+	GSList *entries;
+	gboolean dirty = FALSE;
+
+	if (backup == NULL)
+		return;
+
+	rec = g_byte_array_new();
+	sms_tx_journal_append(rec, SMS_TX_RECORD_DONE, uuid, 0, 0, NULL, 0);
+	sms_tx_journal_write(backup, rec, FALSE);
+	g_byte_array_free(rec, TRUE);
+
+	backup->live -= GPOINTER_TO_UINT(g_hash_table_lookup(backup->messages,
+								uuid));
+	g_hash_table_remove(backup->messages, uuid);
+
+	if (backup->size <= SMS_TX_BACKUP_COMPACT_SIZE ||
+			backup->size - backup->live <= backup->live)
+		return;
+
+	/* Mostly finished messages, keep the live ones with their pdu ids */
+	entries = sms_tx_journal_read(backup, &dirty);
+	sms_tx_journal_rewrite(backup, entries, FALSE);
+	g_slist_free_full(entries, sms_tx_journal_entry_free);
 }
 
 static inline GSList *sms_list_append(GSList *l, const struct sms *in)
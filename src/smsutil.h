@@ -380,11 +380,20 @@ struct sms_assembly_node {
 	guint8 max_fragments;
 	guint8 num_fragments;
 	unsigned int bitmap[8];
+	unsigned int backup_len;
+	unsigned int heap_index;
 };
 
 struct sms_assembly {
 	const char *imsi;
-	GSList *assembly_list;
+	GHashTable *assembly_table;	/* by address and ref */
+	GPtrArray *expiry_heap;		/* min-heap on ts */
+	int backup_fd;
+	guint backup_sync_source;
+	size_t backup_size;
+	size_t backup_live;
+	gboolean backup_compact;
+	gboolean restoring;
 };
 
 struct id_table_node {
@@ -436,6 +445,21 @@ struct txq_backup_entry {
 	unsigned long flags;
 };
 
+struct sms_tx_backup_pdu {
+	const unsigned char *pdu;
+	int pdu_len;
+	int tpdu_len;
+};
+
+struct sms_tx_backup {
+	char *imsi;
+	GHashTable *messages;	/* uuid -> bytes in the journal */
+	size_t size;
+	size_t live;
+	int fd;			/* journal open for appending, or -1 */
+	guint sync_source;
+};
+
 static inline gboolean is_bit_set(unsigned char oct, int bit)
 {
 	int mask = 1 << bit;
@@ -529,6 +553,7 @@ GSList *sms_assembly_add_fragment(struct sms_assembly *assembly,
 					const struct sms_address *addr,
 					guint16 ref, guint8 max, guint8 seq);
 void sms_assembly_expire(struct sms_assembly *assembly, time_t before);
+time_t sms_assembly_oldest(struct sms_assembly *assembly);
 gboolean sms_address_to_hex_string(const struct sms_address *in, char *straddr);
 
 struct status_report_assembly *status_report_assembly_new(const char *imsi);
@@ -545,16 +570,17 @@ void status_report_assembly_add_fragment(struct status_report_assembly
 void status_report_assembly_expire(struct status_report_assembly *assembly,
 					time_t before);
 
-gboolean sms_tx_backup_store(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid,
-				guint8 seq, const unsigned char *pdu,
-				int pdu_len, int tpdu_len);
-void sms_tx_backup_remove(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid,
-				guint8 seq);
-void sms_tx_backup_free(const char *imsi, unsigned long id,
-				unsigned long flags, const char *uuid);
-GQueue *sms_tx_queue_load(const char *imsi);
+struct sms_tx_backup *sms_tx_backup_new(const char *imsi);
+void sms_tx_backup_free(struct sms_tx_backup *backup);
+gboolean sms_tx_backup_store(struct sms_tx_backup *backup,
+				unsigned long flags, const unsigned char *uuid,
+				const struct sms_tx_backup_pdu *pdus,
+				guint8 num_pdus);
+void sms_tx_backup_sent(struct sms_tx_backup *backup,
+				const unsigned char *uuid, guint8 seq);
+void sms_tx_backup_done(struct sms_tx_backup *backup,
+				const unsigned char *uuid);
+GQueue *sms_tx_queue_load(struct sms_tx_backup *backup);
 
 GSList *sms_text_prepare(const char *to, const char *utf8, guint16 ref,
 				gboolean use_16bit,
@@ -25,11 +25,13 @@
 
 #include <ofono/storage.h>
 
+#include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #include <glib.h>
@@ -37,6 +39,37 @@
 
 #include "storage.h"
 
+/* Seconds storage_sync() requests are collected before writing them */
+#define STORAGE_SYNC_DELAY 1
+
+/* Milliseconds write_file() renames are collected before syncing dirs */
+#define STORAGE_DIR_SYNC_DELAY 100
+
+/*
+ * Settings are written behind: storage_sync() only marks a keyfile as
+ * dirty and all dirty keyfiles are serialized together a little later.
+ * The writes themselves, including the fsync and rename done by
+ * g_file_set_contents(), happen in order on a single worker thread.
+ */
+struct storage_write {
+	char *path;
+	char *data;
+	gsize length;
+};
+
+static GHashTable *dirty_stores;	/* GKeyFile * -> path */
+static guint sync_source;
+static GThreadPool *writer;
+
+/* Paths with writes still queued or running, shared with the writer */
+static GMutex writes_lock;
+static GCond writes_cond;
+static GHashTable *writes_pending;	/* path -> number of writes */
+
+/* Directories with renames write_file() did not sync yet */
+static GHashTable *dirs_to_sync;
+static guint dir_sync_source;
+
 const char *ofono_config_dir(void)
 {
 	return CONFIGDIR;
@@ -110,6 +143,70 @@ ssize_t read_file(unsigned char *buffer, size_t len,
 	return r;
 }
 
+static int sync_dir(const char *dir)
+{
+	int fd;
+	int r;
+
+	fd = L_TFR(open(dir, O_RDONLY | O_DIRECTORY));
+	if (fd == -1)
+		return -1;
+
+	r = fsync(fd);
+	L_TFR(close(fd));
+
+	return r;
+}
+
+/* Makes the entry of path in its directory, e.g. a new file, durable */
+int sync_parent_dir(const char *path)
+{
+	char *dir = g_path_get_dirname(path);
+	int r;
+
+	r = sync_dir(dir);
+	g_free(dir);
+
+	return r;
+}
+
+static void sync_dirs(void)
+{
+	GHashTableIter iter;
+	gpointer key;
+
+	if (dirs_to_sync == NULL)
+		return;
+
+	g_hash_table_iter_init(&iter, dirs_to_sync);
+
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		sync_dir(key);
+
+	g_hash_table_remove_all(dirs_to_sync);
+}
+
+static gboolean sync_dirs_timeout(gpointer user_data)
+{
+	dir_sync_source = 0;
+	sync_dirs();
+
+	return FALSE;
+}
+
+static void sync_dir_later(const char *path)
+{
+	if (dirs_to_sync == NULL)
+		dirs_to_sync = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, NULL);
+
+	g_hash_table_add(dirs_to_sync, g_path_get_dirname(path));
+
+	if (dir_sync_source == 0)
+		dir_sync_source = g_timeout_add(STORAGE_DIR_SYNC_DELAY,
+						sync_dirs_timeout, NULL);
+}
+
 /*
  * Write a buffer to a file in a transactionally safe form
  *
@@ -117,20 +214,23 @@ ssize_t read_file(unsigned char *buffer, size_t len,
  * @path_fmt+args. However, to make sure the file contents are
  * consistent (ie: a crash right after opening or during write()
  * doesn't leave a file half baked), the contents are written to a
- * file with a temporary name and when closed, it is renamed to the
- * specified name (@path_fmt+args).
+ * file with a temporary name, synced, and renamed over the specified
+ * name (@path_fmt+args).
+ *
+ * The rename itself reaches the disk with the next sync of the
+ * directory, which is shared by all the writes of a short period so a
+ * burst of writes costs a single one.  Callers that must not lose the
+ * new contents once this returns use write_file_durable() instead.
  */
-ssize_t write_file(const unsigned char *buffer, size_t len, mode_t mode,
-			const char *path_fmt, ...)
+static ssize_t write_file_va(const unsigned char *buffer, size_t len,
+				mode_t mode, gboolean durable,
+				const char *path_fmt, va_list ap)
 {
-	va_list ap;
 	char *tmp_path, *path;
 	ssize_t r;
 	int fd;
 
-	va_start(ap, path_fmt);
 	path = g_strdup_vprintf(path_fmt, ap);
-	va_end(ap);
 
 	tmp_path = g_strdup_printf("%s.XXXXXX.tmp", path);
 
@@ -144,6 +244,10 @@ ssize_t write_file(const unsigned char *buffer, size_t len, mode_t mode,
 
 	r = L_TFR(write(fd, buffer, len));
 
+	/* Otherwise a crash could leave the renamed file without its data */
+	if (r == (ssize_t) len && fdatasync(fd) == -1)
+		r = -1;
+
 	L_TFR(close(fd));
 
 	if (r != (ssize_t) len) {
@@ -152,18 +256,20 @@ ssize_t write_file(const unsigned char *buffer, size_t len, mode_t mode,
 	}
 
 	/*
-	 * Now that the file contents are written, rename to the real
+	 * Now that the file contents are on disk, rename to the real
 	 * file name; this way we are uniquely sure that the whole
-	 * thing is there.
+	 * thing is there, and the old contents are replaced atomically.
 	 */
-	unlink(path);
-
-	/* conserve @r's value from 'write' */
-	if (link(tmp_path, path) == -1)
+	if (rename(tmp_path, path) == -1)
+		r = -1;
+	else if (durable == FALSE)
+		sync_dir_later(path);
+	else if (sync_parent_dir(path) == -1)
 		r = -1;
 
 error_write:
-	unlink(tmp_path);
+	if (r == -1)
+		unlink(tmp_path);
 error_mkstemp_full:
 error_create_dirs:
 	g_free(tmp_path);
@@ -171,6 +277,140 @@ error_create_dirs:
 	return r;
 }
 
+ssize_t write_file(const unsigned char *buffer, size_t len, mode_t mode,
+			const char *path_fmt, ...)
+{
+	va_list ap;
+	ssize_t r;
+
+	va_start(ap, path_fmt);
+	r = write_file_va(buffer, len, mode, FALSE, path_fmt, ap);
+	va_end(ap);
+
+	return r;
+}
+
+/* Like write_file() but the rename is on disk as well when it returns */
+ssize_t write_file_durable(const unsigned char *buffer, size_t len,
+				mode_t mode, const char *path_fmt, ...)
+{
+	va_list ap;
+	ssize_t r;
+
+	va_start(ap, path_fmt);
+	r = write_file_va(buffer, len, mode, TRUE, path_fmt, ap);
+	va_end(ap);
+
+	return r;
+}
+
+static char *storage_path(const char *imsi, const char *store)
+{
+	if (imsi)
+		return g_strdup_printf(STORAGEDIR "/%s/%s", imsi, store);
+
+	return g_strdup_printf(STORAGEDIR "/%s", store);
+}
+
+static void storage_write_func(gpointer data, gpointer user_data)
+{
+	struct storage_write *w = data;
+	gpointer count;
+
+	if (create_dirs(w->path, S_IRUSR | S_IWUSR | S_IXUSR) == 0)
+		g_file_set_contents(w->path, w->data, w->length, NULL);
+
+	g_mutex_lock(&writes_lock);
+
+	count = g_hash_table_lookup(writes_pending, w->path);
+
+	if (GPOINTER_TO_UINT(count) > 1)
+		g_hash_table_insert(writes_pending, g_strdup(w->path),
+				GUINT_TO_POINTER(GPOINTER_TO_UINT(count) - 1));
+	else
+		g_hash_table_remove(writes_pending, w->path);
+
+	g_cond_broadcast(&writes_cond);
+	g_mutex_unlock(&writes_lock);
+
+	g_free(w->data);
+	g_free(w->path);
+	g_free(w);
+}
+
+static void storage_queue_write(const char *path, GKeyFile *keyfile)
+{
+	struct storage_write *w;
+	gpointer count;
+
+	w = g_new0(struct storage_write, 1);
+	w->path = g_strdup(path);
+	w->data = g_key_file_to_data(keyfile, &w->length, NULL);
+
+	g_mutex_lock(&writes_lock);
+
+	if (writes_pending == NULL)
+		writes_pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, NULL);
+
+	count = g_hash_table_lookup(writes_pending, path);
+	g_hash_table_insert(writes_pending, g_strdup(path),
+				GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+
+	g_mutex_unlock(&writes_lock);
+
+	if (writer == NULL)
+		writer = g_thread_pool_new(storage_write_func, NULL, 1,
+						FALSE, NULL);
+
+	/* Without a thread the write is done right away */
+	if (writer == NULL) {
+		storage_write_func(w, NULL);
+		return;
+	}
+
+	g_thread_pool_push(writer, w, NULL);
+}
+
+static gboolean storage_flush_dirty(gpointer key, gpointer value,
+					gpointer user_data)
+{
+	const char *path = user_data;
+
+	if (path && g_str_equal(path, value) == FALSE)
+		return FALSE;
+
+	storage_queue_write(value, key);
+
+	return TRUE;
+}
+
+static gboolean storage_sync_timeout(gpointer user_data)
+{
+	sync_source = 0;
+
+	if (dirty_stores)
+		g_hash_table_foreach_remove(dirty_stores, storage_flush_dirty,
+						NULL);
+
+	return FALSE;
+}
+
+/* Waits until everything queued for path is on disk */
+static void storage_wait(const char *path)
+{
+	if (dirty_stores)
+		g_hash_table_foreach_remove(dirty_stores, storage_flush_dirty,
+						(gpointer) path);
+
+	g_mutex_lock(&writes_lock);
+
+	while (writes_pending && g_hash_table_contains(writes_pending, path))
+		g_cond_wait(&writes_cond, &writes_lock);
+
+	g_mutex_unlock(&writes_lock);
+}
+
 GKeyFile *storage_open(const char *imsi, const char *store)
 {
 	GKeyFile *keyfile;
@@ -179,14 +419,12 @@ GKeyFile *storage_open(const char *imsi, const char *store)
 	if (store == NULL)
 		return NULL;
 
-	if (imsi)
-		path = g_strdup_printf(STORAGEDIR "/%s/%s", imsi, store);
-	else
-		path = g_strdup_printf(STORAGEDIR "/%s", store);
+	path = storage_path(imsi, store);
 
 	keyfile = g_key_file_new();
 
 	if (path) {
+		storage_wait(path);
 		g_key_file_load_from_file(keyfile, path, 0, NULL);
 		g_free(path);
 	}
@@ -197,35 +435,78 @@ GKeyFile *storage_open(const char *imsi, const char *store)
 void storage_sync(const char *imsi, const char *store, GKeyFile *keyfile)
 {
 	char *path;
-	char *data;
-	gsize length = 0;
 
-	if (imsi)
-		path = g_strdup_printf(STORAGEDIR "/%s/%s", imsi, store);
-	else
-		path = g_strdup_printf(STORAGEDIR "/%s", store);
-
-	if (path == NULL)
+	if (keyfile == NULL)
 		return;
 
-	if (create_dirs(path, S_IRUSR | S_IWUSR | S_IXUSR) != 0) {
-		g_free(path);
+	path = storage_path(imsi, store);
+	if (path == NULL)
 		return;
-	}
 
-	data = g_key_file_to_data(keyfile, &length, NULL);
+	if (dirty_stores == NULL)
+		dirty_stores = g_hash_table_new_full(g_direct_hash,
+							g_direct_equal,
+							NULL, g_free);
 
-	g_file_set_contents(path, data, length, NULL);
+	g_hash_table_replace(dirty_stores, keyfile, path);
 
-	g_free(data);
-	g_free(path);
+	if (sync_source == 0)
+		sync_source = g_timeout_add_seconds(STORAGE_SYNC_DELAY,
+							storage_sync_timeout,
+							NULL);
 }
 
 void storage_close(const char *imsi, const char *store, GKeyFile *keyfile,
 			gboolean save)
 {
-	if (save == TRUE)
-		storage_sync(imsi, store, keyfile);
+	char *path;
+
+	/* A sync requested earlier still has to happen */
+	if (dirty_stores && g_hash_table_remove(dirty_stores, keyfile))
+		save = TRUE;
+
+	if (save == TRUE) {
+		path = storage_path(imsi, store);
+		storage_queue_write(path, keyfile);
+		g_free(path);
+	}
 
 	g_key_file_free(keyfile);
 }
+
+void storage_cleanup(void)
+{
+	if (sync_source) {
+		g_source_remove(sync_source);
+		sync_source = 0;
+	}
+
+	if (dirty_stores) {
+		g_hash_table_foreach_remove(dirty_stores, storage_flush_dirty,
+						NULL);
+		g_hash_table_destroy(dirty_stores);
+		dirty_stores = NULL;
+	}
+
+	/* Lets the writer finish whatever is queued */
+	if (writer) {
+		g_thread_pool_free(writer, FALSE, TRUE);
+		writer = NULL;
+	}
+
+	if (writes_pending) {
+		g_hash_table_destroy(writes_pending);
+		writes_pending = NULL;
+	}
+
+	if (dir_sync_source) {
+		g_source_remove(dir_sync_source);
+		dir_sync_source = 0;
+	}
+
+	if (dirs_to_sync) {
+		sync_dirs();
+		g_hash_table_destroy(dirs_to_sync);
+		dirs_to_sync = NULL;
+	}
+}
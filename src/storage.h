@@ -32,7 +32,16 @@ ssize_t write_file(const unsigned char *buffer, size_t len, mode_t mode,
 			const char *path_fmt, ...)
 	__attribute__((format(printf, 4, 5)));
 
+ssize_t write_file_durable(const unsigned char *buffer, size_t len,
+				mode_t mode, const char *path_fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+int sync_parent_dir(const char *path);
+
 GKeyFile *storage_open(const char *imsi, const char *store);
 void storage_sync(const char *imsi, const char *store, GKeyFile *keyfile);
 void storage_close(const char *imsi, const char *store, GKeyFile *keyfile,
 			gboolean save);
+
+/* Writes out all pending changes, to be called on shutdown */
+void storage_cleanup(void);
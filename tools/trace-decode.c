@@ -0,0 +1,289 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <glib.h>
+
+#include "gatchat/frametrace.h"
+
+struct trace_file {
+	char *name;
+	gchar *contents;
+	gsize length;
+};
+
+struct trace_entry {
+	const struct trace_file *file;
+	const struct frame_trace_record *rec;
+	unsigned int seq;
+};
+
+static gboolean option_version = FALSE;
+static gboolean option_hex = FALSE;
+
+static GOptionEntry options[] = {
+	{ "version", 'v', 0, G_OPTION_ARG_NONE, &option_version,
+				"Show version information and exit" },
+	{ "hex", 'x', 0, G_OPTION_ARG_NONE, &option_hex,
+				"Dump AT frames in hex as well" },
+	{ NULL },
+};
+
+static const char *transport_name(uint8_t transport)
+{
+	switch (transport) {
+	case FRAME_TRACE_AT:
+		return "AT";
+	case FRAME_TRACE_QMI:
+		return "QMI";
+	case FRAME_TRACE_RIL:
+		return "RIL";
+	case FRAME_TRACE_ISI:
+		return "ISI";
+	}
+
+	return "???";
+}
+
+static const struct frame_trace_header *file_header(
+						const struct trace_file *file)
+{
+	return (const void *) file->contents;
+}
+
+static gboolean load_file(const char *name, struct trace_file *file,
+				GArray *entries)
+{
+	const struct frame_trace_header *hdr;
+	const uint8_t *ring;
+	GError *error = NULL;
+	uint64_t pos;
+	unsigned int seq = 0;
+
+	if (!g_file_get_contents(name, &file->contents, &file->length,
+								&error)) {
+		g_printerr("%s: %s\n", name, error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	file->name = g_path_get_basename(name);
+	hdr = file_header(file);
+
+	if (file->length < sizeof(*hdr) || hdr->magic != FRAME_TRACE_MAGIC ||
+			hdr->version != FRAME_TRACE_VERSION ||
+			file->length < sizeof(*hdr) + hdr->size) {
+		g_printerr("%s: not a frame trace\n", name);
+		return FALSE;
+	}
+
+	ring = (const uint8_t *) (hdr + 1);
+
+	for (pos = hdr->tail; pos < hdr->head; ) {
+		const struct frame_trace_record *rec;
+		struct trace_entry entry;
+		uint32_t off = pos % hdr->size;
+
+		rec = (const void *) (ring + off);
+
+		if (rec->size < 8 || rec->size % 8 ||
+				off + rec->size > hdr->size) {
+			g_printerr("%s: corrupt record at %llu\n", name,
+					(unsigned long long) pos);
+			break;
+		}
+
+		pos += rec->size;
+
+		if (rec->type != FRAME_TRACE_FRAME)
+			continue;
+
+		if (rec->size < sizeof(*rec) + rec->caplen)
+			continue;
+
+		entry.file = file;
+		entry.rec = rec;
+		entry.seq = seq++;
+		g_array_append_val(entries, entry);
+	}
+
+	return TRUE;
+}
+
+static gint entry_compare(gconstpointer a, gconstpointer b)
+{
+	const struct trace_entry *ea = a;
+	const struct trace_entry *eb = b;
+
+	if (ea->rec->timestamp != eb->rec->timestamp)
+		return ea->rec->timestamp < eb->rec->timestamp ? -1 : 1;
+
+	if (ea->file != eb->file)
+		return ea->file < eb->file ? -1 : 1;
+
+	return ea->seq < eb->seq ? -1 : 1;
+}
+
+static void print_hex(const uint8_t *buf, size_t len)
+{
+	static const char hexdigits[] = "0123456789abcdef";
+	char str[68];
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		str[((i % 16) * 3) + 0] = ' ';
+		str[((i % 16) * 3) + 1] = hexdigits[buf[i] >> 4];
+		str[((i % 16) * 3) + 2] = hexdigits[buf[i] & 0xf];
+		str[(i % 16) + 51] = isprint(buf[i]) ? buf[i] : '.';
+
+		if ((i + 1) % 16 == 0) {
+			memset(str + 48, ' ', 3);
+			str[67] = '\0';
+			g_print("   %s\n", str);
+		}
+	}
+
+	if (i % 16 > 0) {
+		memset(str + (i % 16) * 3, ' ', (16 - i % 16) * 3 + 3);
+		str[(i % 16) + 51] = '\0';
+		g_print("   %s\n", str);
+	}
+}
+
+static void print_text(const uint8_t *buf, size_t len)
+{
+	GString *str = g_string_sized_new(len + 8);
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] == '\r')
+			g_string_append(str, "<CR>");
+		else if (buf[i] == '\n')
+			g_string_append(str, "<LF>");
+		else if (isprint(buf[i]))
+			g_string_append_c(str, buf[i]);
+		else
+			g_string_append_printf(str, "\\x%02x", buf[i]);
+	}
+
+	g_print("    %s\n", str->str);
+	g_string_free(str, TRUE);
+}
+
+static void print_entry(const struct trace_entry *entry, uint64_t base)
+{
+	const struct frame_trace_header *hdr = file_header(entry->file);
+	const struct frame_trace_record *rec = entry->rec;
+	const uint8_t *data = (const uint8_t *) (rec + 1);
+	uint64_t ts = rec->timestamp - base;
+
+	g_print("%6llu.%06llu %s %s %c %u",
+		(unsigned long long) (ts / 1000000000ULL),
+		(unsigned long long) (ts % 1000000000ULL / 1000),
+		entry->file->name, transport_name(hdr->transport),
+		rec->dir == FRAME_TRACE_TX ? '>' : '<', rec->len);
+
+	if (rec->caplen < rec->len)
+		g_print(" (%u captured)", rec->caplen);
+
+	if (hdr->transport == FRAME_TRACE_ISI)
+		g_print(" dev 0x%02x res 0x%02x", rec->tag >> 8,
+							rec->tag & 0xff);
+
+	g_print("\n");
+
+	if (hdr->transport == FRAME_TRACE_AT) {
+		print_text(data, rec->caplen);
+
+		if (!option_hex)
+			return;
+	}
+
+	print_hex(data, rec->caplen);
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct trace_file *files;
+	GArray *entries;
+	unsigned int i;
+	int loaded = 0;
+
+	context = g_option_context_new("FILE...");
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (g_option_context_parse(context, &argc, &argv, &error) == FALSE) {
+		if (error != NULL) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (option_version == TRUE) {
+		g_print("%s\n", VERSION);
+		exit(0);
+	}
+
+	if (argc < 2) {
+		g_printerr("Missing trace files\n");
+		exit(1);
+	}
+
+	files = g_new0(struct trace_file, argc - 1);
+	entries = g_array_new(FALSE, FALSE, sizeof(struct trace_entry));
+
+	for (i = 1; i < (unsigned int) argc; i++)
+		if (load_file(argv[i], &files[i - 1], entries))
+			loaded++;
+
+	/* Frames of all files are merged on the shared monotonic clock */
+	g_array_sort(entries, entry_compare);
+
+	for (i = 0; i < entries->len; i++) {
+		const struct trace_entry *first =
+			&g_array_index(entries, struct trace_entry, 0);
+
+		print_entry(&g_array_index(entries, struct trace_entry, i),
+				first->rec->timestamp);
+	}
+
+	g_array_free(entries, TRUE);
+
+	for (i = 0; i < (unsigned int) argc - 1; i++) {
+		g_free(files[i].name);
+		g_free(files[i].contents);
+	}
+
+	g_free(files);
+
+	return loaded > 0 ? 0 : 1;
+}
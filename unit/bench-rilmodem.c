@@ -0,0 +1,455 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Load/latency benchmark for GRil and the rilmodem SMS atom.
+ *
+ * The rilmodem test engine acts as rild and answers every request with a
+ * canned reply. The benchmark keeps a window of SEND_SMS submissions in
+ * flight at a given rate, optionally injects NEW_SMS indications (which
+ * the atom acknowledges), and reports per-request latency percentiles,
+ * message throughput and heap allocations per message.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <glib.h>
+
+#include <ofono/modem.h>
+#include <ofono/types.h>
+#include <ofono/sms.h>
+
+#include <gril.h>
+
+#include "common.h"
+#include "ril_constants.h"
+#include "rilmodem-test-engine.h"
+
+static int option_count = 10000;
+static int option_window = 8;
+static int option_rate;
+static int option_unsol_rate;
+
+static GOptionEntry options[] = {
+	{ "count", 'n', 0, G_OPTION_ARG_INT, &option_count,
+				"Number of SMS submissions (default 10000)" },
+	{ "window", 'w', 0, G_OPTION_ARG_INT, &option_window,
+				"Submissions in flight (default 8)" },
+	{ "rate", 'r', 0, G_OPTION_ARG_INT, &option_rate,
+				"Submissions per second, 0 for no limit" },
+	{ "unsol-rate", 'u', 0, G_OPTION_ARG_INT, &option_unsol_rate,
+				"NEW_SMS indications per second" },
+	{ NULL },
+};
+
+/*
+ * Count heap allocations by wrapping the glibc allocator. GLib uses the
+ * system allocator, so this covers g_malloc and friends as well.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long alloc_count;
+
+void *malloc(size_t size)
+{
+	alloc_count++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	return __libc_realloc(ptr, size);
+}
+#define ALLOC_COUNT() (alloc_count)
+#else
+#define ALLOC_COUNT() (0UL)
+#endif
+
+static const unsigned char submit_pdu[] = {
+	0x00, 0x11, 0x00, 0x09, 0x81, 0x36, 0x54, 0x39, 0x80, 0xf5, 0x00, 0x00,
+	0xa7, 0x0a, 0xc8, 0x37, 0x3b, 0x0c, 0x6a, 0xd7, 0xdd, 0xe4, 0x37
+};
+
+/* SEND_SMS reply: messageRef=1, ackPDU=NULL, errorCode=0 */
+static const unsigned char rsp_send_sms[] = {
+	0x01, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00
+};
+
+static const struct rilmodem_bench_reply replies[] = {
+	{
+		.request = RIL_REQUEST_SEND_SMS,
+		.error = RIL_E_SUCCESS,
+		.data = rsp_send_sms,
+		.size = sizeof(rsp_send_sms),
+	},
+	/* SMS_ACKNOWLEDGE gets the default empty reply */
+};
+
+/* RIL_UNSOL_RESPONSE_NEW_SMS, same PDU as in test-rilmodem-sms */
+static const unsigned char unsol_new_sms[] = {
+	0x00, 0x00, 0x00, 0xA0, 0x01, 0x00, 0x00, 0x00, 0xEB, 0x03, 0x00, 0x00,
+	0x48, 0x00, 0x00, 0x00, 0x30, 0x00, 0x37, 0x00, 0x39, 0x00, 0x31, 0x00,
+	0x34, 0x00, 0x33, 0x00, 0x30, 0x00, 0x36, 0x00, 0x30, 0x00, 0x37, 0x00,
+	0x33, 0x00, 0x30, 0x00, 0x31, 0x00, 0x31, 0x00, 0x46, 0x00, 0x30, 0x00,
+	0x30, 0x00, 0x34, 0x00, 0x30, 0x00, 0x42, 0x00, 0x39, 0x00, 0x31, 0x00,
+	0x34, 0x00, 0x33, 0x00, 0x33, 0x00, 0x36, 0x00, 0x35, 0x00, 0x34, 0x00,
+	0x33, 0x00, 0x39, 0x00, 0x38, 0x00, 0x30, 0x00, 0x46, 0x00, 0x35, 0x00,
+	0x30, 0x00, 0x30, 0x00, 0x30, 0x00, 0x30, 0x00, 0x33, 0x00, 0x31, 0x00,
+	0x30, 0x00, 0x31, 0x00, 0x31, 0x00, 0x33, 0x00, 0x32, 0x00, 0x31, 0x00,
+	0x32, 0x00, 0x30, 0x00, 0x30, 0x00, 0x32, 0x00, 0x34, 0x00, 0x30, 0x00,
+	0x30, 0x00, 0x41, 0x00, 0x43, 0x00, 0x38, 0x00, 0x33, 0x00, 0x37, 0x00,
+	0x33, 0x00, 0x42, 0x00, 0x30, 0x00, 0x43, 0x00, 0x36, 0x00, 0x41, 0x00,
+	0x44, 0x00, 0x37, 0x00, 0x44, 0x00, 0x44, 0x00, 0x45, 0x00, 0x34, 0x00,
+	0x33, 0x00, 0x37, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+struct bench {
+	GRil *ril;
+	struct engine_data *engined;
+	struct ofono_sms *sms;
+	gint64 *sent_at;		/* Submission time, by sequence */
+	gint64 *latency;		/* Completion latency, by sequence */
+	int next;			/* Next submission */
+	int completed;
+	int failed;
+	int in_flight;
+	unsigned int delivered;
+	unsigned int unsol_sent;
+	gint64 start;
+	gint64 end;
+	unsigned long allocs_start;
+	unsigned long allocs_end;
+	guint rate_source;
+	guint unsol_source;
+};
+
+static const struct rilmodem_test_data no_steps;
+
+static const struct ofono_sms_driver *smsdriver;
+
+/* Declarations && Re-implementations of core functions. */
+void ril_sms_exit(void);
+void ril_sms_init(void);
+
+struct ofono_sms {
+	void *driver_data;
+	struct bench *bench;
+};
+
+struct ofono_sms *ofono_sms_create(struct ofono_modem *modem,
+					unsigned int vendor,
+					const char *driver,
+					void *data)
+{
+	struct bench *b = data;
+	struct ofono_sms *sms = g_new0(struct ofono_sms, 1);
+	int retval;
+
+	sms->bench = b;
+
+	retval = smsdriver->probe(sms, OFONO_RIL_VENDOR_AOSP, b->ril);
+	g_assert(retval == 0);
+
+	return sms;
+}
+
+int ofono_sms_driver_register(const struct ofono_sms_driver *d)
+{
+	if (smsdriver == NULL)
+		smsdriver = d;
+
+	return 0;
+}
+
+void ofono_sms_set_data(struct ofono_sms *sms, void *data)
+{
+	sms->driver_data = data;
+}
+
+void *ofono_sms_get_data(struct ofono_sms *sms)
+{
+	return sms->driver_data;
+}
+
+void ofono_sms_register(struct ofono_sms *sms)
+{
+}
+
+void ofono_sms_driver_unregister(const struct ofono_sms_driver *d)
+{
+}
+
+void ofono_sms_deliver_notify(struct ofono_sms *sms, const unsigned char *pdu,
+							int len, int tpdu_len)
+{
+	sms->bench->delivered += 1;
+}
+
+void ofono_sms_status_notify(struct ofono_sms *sms, const unsigned char *pdu,
+							int len, int tpdu_len)
+{
+	ofono_sms_deliver_notify(sms, pdu, len, tpdu_len);
+}
+
+static void fill_window(struct bench *b);
+
+static void finish(struct bench *b)
+{
+	b->end = g_get_monotonic_time();
+	b->allocs_end = ALLOC_COUNT();
+
+	if (b->rate_source)
+		g_source_remove(b->rate_source);
+
+	if (b->unsol_source)
+		g_source_remove(b->unsol_source);
+
+	b->rate_source = 0;
+	b->unsol_source = 0;
+
+	rilmodem_test_engine_quit(b->engined);
+}
+
+/* The submit callback only carries the sequence number */
+static struct bench *current;
+
+static void submit_done(const struct ofono_error *error, int mr,
+								gpointer data)
+{
+	struct bench *b = current;
+	int seq = GPOINTER_TO_INT(data);
+
+	b->latency[seq] = g_get_monotonic_time() - b->sent_at[seq];
+	b->in_flight -= 1;
+	b->completed += 1;
+
+	if (error->type != OFONO_ERROR_TYPE_NO_ERROR)
+		b->failed += 1;
+
+	if (b->completed == option_count) {
+		finish(b);
+		return;
+	}
+
+	if (option_rate == 0)
+		fill_window(b);
+}
+
+static void submit_one(struct bench *b)
+{
+	int seq = b->next++;
+
+	b->in_flight += 1;
+	b->sent_at[seq] = g_get_monotonic_time();
+
+	smsdriver->submit(b->sms, submit_pdu, sizeof(submit_pdu),
+				sizeof(submit_pdu) - 1, 0, submit_done,
+				GINT_TO_POINTER(seq));
+}
+
+static void fill_window(struct bench *b)
+{
+	while (b->in_flight < option_window && b->next < option_count)
+		submit_one(b);
+}
+
+/* Paced mode: one tick per millisecond, release what the rate allows */
+static gboolean rate_tick(gpointer data)
+{
+	struct bench *b = data;
+	gint64 elapsed = g_get_monotonic_time() - b->start;
+	gint64 due = elapsed * option_rate / G_USEC_PER_SEC + 1;
+
+	while (b->next < due && b->next < option_count &&
+			b->in_flight < option_window)
+		submit_one(b);
+
+	if (b->next == option_count) {
+		b->rate_source = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean unsol_tick(gpointer data)
+{
+	struct bench *b = data;
+
+	rilmodem_test_engine_write_socket(b->engined, unsol_new_sms,
+						sizeof(unsol_new_sms));
+	b->unsol_sent += 1;
+
+	return TRUE;
+}
+
+static gboolean start_bench(gpointer data)
+{
+	struct bench *b = data;
+
+	b->start = g_get_monotonic_time();
+	b->allocs_start = ALLOC_COUNT();
+
+	if (option_unsol_rate > 0)
+		b->unsol_source = g_timeout_add(MAX(1000 / option_unsol_rate,
+							1), unsol_tick, b);
+
+	if (option_rate > 0)
+		b->rate_source = g_timeout_add(1, rate_tick, b);
+	else
+		fill_window(b);
+
+	return FALSE;
+}
+
+static void server_connect_cb(gpointer data)
+{
+	struct bench *b = data;
+
+	/* This causes local impl of _create() to call driver's probe func. */
+	b->sms = ofono_sms_create(NULL, OFONO_RIL_VENDOR_AOSP, "rilmodem", b);
+
+	/* Let the atom register for its indications first */
+	g_idle_add(start_bench, b);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	gint64 la = *(const gint64 *) a;
+	gint64 lb = *(const gint64 *) b;
+
+	return (la > lb) - (la < lb);
+}
+
+static gint64 percentile(const gint64 *sorted, int n, double p)
+{
+	int idx = (int) (p * (n - 1) + 0.5);
+
+	return sorted[idx];
+}
+
+static void report(struct bench *b)
+{
+	const struct rilmodem_bench_stats *stats =
+			rilmodem_test_engine_get_bench_stats(b->engined);
+	double secs = (b->end - b->start) / (double) G_USEC_PER_SEC;
+	unsigned int messages;
+
+	qsort(b->latency, b->completed, sizeof(gint64), compare_latency);
+
+	/* Every parcel crossing the socket, in either direction */
+	messages = stats->requests + stats->replies + b->unsol_sent;
+
+	printf("submissions:   %d (%d failed), window %d, rate %s\n",
+			b->completed, b->failed, option_window,
+			option_rate ? "paced" : "unlimited");
+	printf("latency (us):  p50 %" G_GINT64_FORMAT
+			" p90 %" G_GINT64_FORMAT
+			" p99 %" G_GINT64_FORMAT
+			" p99.9 %" G_GINT64_FORMAT
+			" max %" G_GINT64_FORMAT "\n",
+			percentile(b->latency, b->completed, 0.50),
+			percentile(b->latency, b->completed, 0.90),
+			percentile(b->latency, b->completed, 0.99),
+			percentile(b->latency, b->completed, 0.999),
+			b->latency[b->completed - 1]);
+	printf("indications:   %u sent, %u delivered\n",
+			b->unsol_sent, b->delivered);
+	printf("throughput:    %.0f submissions/s, %.0f messages/s\n",
+			b->completed / secs, messages / secs);
+	printf("socket bytes:  %zu in, %zu out\n",
+			stats->bytes_in, stats->bytes_out);
+
+#ifdef __GLIBC__
+	printf("allocations:   %.1f per message\n",
+			(b->allocs_end - b->allocs_start) / (double) messages);
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *err = NULL;
+	struct bench *b;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (g_option_context_parse(context, &argc, &argv, &err) == FALSE) {
+		fprintf(stderr, "%s\n", err->message);
+		g_error_free(err);
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	if (option_count < 1 || option_window < 1) {
+		fprintf(stderr, "count and window must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	ril_sms_init();
+
+	b = g_new0(struct bench, 1);
+	b->sent_at = g_new0(gint64, option_count);
+	b->latency = g_new0(gint64, option_count);
+	current = b;
+
+	b->engined = rilmodem_test_engine_create(server_connect_cb,
+							&no_steps, b);
+	rilmodem_test_engine_set_bench(b->engined, replies,
+					G_N_ELEMENTS(replies));
+
+	b->ril = g_ril_new(rilmodem_test_engine_get_socket_name(b->engined),
+						OFONO_RIL_VENDOR_AOSP);
+	g_assert(b->ril != NULL);
+
+	rilmodem_test_engine_start(b->engined);
+
+	report(b);
+
+	smsdriver->remove(b->sms);
+	g_free(b->sms);
+	g_ril_unref(b->ril);
+	rilmodem_test_engine_remove(b->engined);
+	ril_sms_exit();
+
+	g_free(b->sent_at);
+	g_free(b->latency);
+	g_free(b);
+
+	return EXIT_SUCCESS;
+}
@@ -51,6 +51,27 @@ struct engine_data {
 	struct rilmodem_test_data rtd;
 	int step_i;
 	void *user_data;
+
+	/* Benchmark mode */
+	const struct rilmodem_bench_reply *replies;
+	int num_replies;
+	GByteArray *rx;
+	GByteArray *tx;
+	struct rilmodem_bench_stats stats;
+};
+
+struct req_hdr {
+	/* Warning: length is stored in network order */
+	uint32_t length;
+	uint32_t reqid;
+	uint32_t serial;
+};
+
+struct rsp_hdr {
+	uint32_t length;
+	uint32_t unsolicited;
+	uint32_t serial;
+	uint32_t error;
 };
 
 static void send_parcel(struct engine_data *ed)
@@ -73,6 +94,90 @@ static void send_parcel(struct engine_data *ed)
 	rilmodem_test_engine_next_step(ed);
 }
 
+static const struct rilmodem_bench_reply *bench_find_reply(
+					struct engine_data *ed, int request)
+{
+	int i;
+
+	for (i = 0; i < ed->num_replies; i++)
+		if (ed->replies[i].request == request)
+			return &ed->replies[i];
+
+	return NULL;
+}
+
+static void bench_reply(struct engine_data *ed, const struct req_hdr *req)
+{
+	static const struct rilmodem_bench_reply empty = { 0 };
+	const struct rilmodem_bench_reply *reply;
+	struct rsp_hdr rsp;
+
+	reply = bench_find_reply(ed, req->reqid);
+	if (reply == NULL)
+		reply = &empty;
+
+	/* Length does not include the length field. Network order. */
+	rsp.length = htonl(sizeof(rsp) - sizeof(rsp.length) + reply->size);
+	rsp.unsolicited = 0;
+	rsp.serial = req->serial;
+	rsp.error = reply->error;
+
+	g_byte_array_append(ed->tx, (const guint8 *) &rsp, sizeof(rsp));
+
+	if (reply->size)
+		g_byte_array_append(ed->tx, reply->data, reply->size);
+
+	ed->stats.replies += 1;
+}
+
+/*
+ * Requests may arrive coalesced or split across reads, so split the
+ * stream on the length fields and answer everything with one write.
+ */
+static gboolean on_bench_rx_data(struct engine_data *ed)
+{
+	GIOStatus status;
+	gsize rbytes;
+	guint8 buf[MAX_REQUEST_SIZE];
+	gsize consumed = 0;
+
+	status = g_io_channel_read_chars(ed->server_io, (gchar *) buf,
+						sizeof(buf), &rbytes, NULL);
+	if (status != G_IO_STATUS_NORMAL) {
+		ed->connection_watch = 0;
+		return FALSE;
+	}
+
+	ed->stats.bytes_in += rbytes;
+	g_byte_array_append(ed->rx, buf, rbytes);
+
+	while (ed->rx->len - consumed >= sizeof(struct req_hdr)) {
+		struct req_hdr req;
+		gsize plen;
+
+		memcpy(&req, ed->rx->data + consumed, sizeof(req));
+		plen = ntohl(req.length) + sizeof(req.length);
+
+		if (ed->rx->len - consumed < plen)
+			break;
+
+		ed->stats.requests += 1;
+		bench_reply(ed, &req);
+		consumed += plen;
+	}
+
+	g_byte_array_remove_range(ed->rx, 0, consumed);
+
+	if (ed->tx->len > 0) {
+		rilmodem_test_engine_write_socket(ed, ed->tx->data,
+							ed->tx->len);
+		ed->stats.bytes_out += ed->tx->len;
+		g_byte_array_set_size(ed->tx, 0);
+	}
+
+	return TRUE;
+}
+
 static gboolean on_rx_data(GIOChannel *chan, GIOCondition cond, gpointer data)
 {
 	struct engine_data *ed = data;
@@ -85,6 +190,9 @@ static gboolean on_rx_data(GIOChannel *chan, GIOCondition cond, gpointer data)
 	if (cond == G_IO_NVAL)
 		return FALSE;
 
+	if (ed->replies)
+		return on_bench_rx_data(ed);
+
 	buf = g_malloc0(MAX_REQUEST_SIZE);
 
 	status = g_io_channel_read_chars(ed->server_io, buf, MAX_REQUEST_SIZE,
@@ -144,6 +252,12 @@ void rilmodem_test_engine_remove(struct engine_data *ed)
 	if (ed->connection_watch)
 		g_source_remove(ed->connection_watch);
 
+	if (ed->rx)
+		g_byte_array_free(ed->rx, TRUE);
+
+	if (ed->tx)
+		g_byte_array_free(ed->tx, TRUE);
+
 	g_assert(ed->server_sk);
 	close(ed->server_sk);
 	remove(ed->sock_name);
@@ -278,3 +392,29 @@ void rilmodem_test_engine_start(struct engine_data *ed)
 	g_main_loop_run(mainloop);
 	g_main_loop_unref(mainloop);
 }
+
+void rilmodem_test_engine_set_bench(struct engine_data *ed,
+				const struct rilmodem_bench_reply *replies,
+				int num_replies)
+{
+	static const struct rilmodem_bench_reply none = { 0 };
+
+	/* A non NULL table is what switches the engine to benchmark mode */
+	ed->replies = replies ? replies : &none;
+	ed->num_replies = replies ? num_replies : 0;
+
+	/* Sized up front so that the engine does not skew allocation counts */
+	ed->rx = g_byte_array_sized_new(MAX_REQUEST_SIZE * 4);
+	ed->tx = g_byte_array_sized_new(MAX_REQUEST_SIZE * 4);
+}
+
+const struct rilmodem_bench_stats *rilmodem_test_engine_get_bench_stats(
+							struct engine_data *ed)
+{
+	return &ed->stats;
+}
+
+void rilmodem_test_engine_quit(struct engine_data *ed)
+{
+	g_main_loop_quit(mainloop);
+}
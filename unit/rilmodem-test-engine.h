@@ -54,6 +54,25 @@ struct rilmodem_test_data {
 	int num_steps;
 };
 
+/*
+ * In benchmark mode the engine does not follow steps. Every request is
+ * answered with the reply registered for its request id, or with an
+ * empty RIL_E_SUCCESS reply if there is none.
+ */
+struct rilmodem_bench_reply {
+	int request;
+	uint32_t error;
+	const unsigned char *data;
+	size_t size;
+};
+
+struct rilmodem_bench_stats {
+	unsigned int requests;
+	unsigned int replies;
+	size_t bytes_in;
+	size_t bytes_out;
+};
+
 void rilmodem_test_engine_remove(struct engine_data *ed);
 
 struct engine_data *rilmodem_test_engine_create(
@@ -72,3 +91,10 @@ const struct rilmodem_test_step *rilmodem_test_engine_get_current_step(
 							struct engine_data *ed);
 
 void rilmodem_test_engine_start(struct engine_data *ed);
+
+void rilmodem_test_engine_set_bench(struct engine_data *ed,
+				const struct rilmodem_bench_reply *replies,
+				int num_replies);
+const struct rilmodem_bench_stats *rilmodem_test_engine_get_bench_stats(
+							struct engine_data *ed);
+void rilmodem_test_engine_quit(struct engine_data *ed);
@@ -0,0 +1,145 @@
+/*
+ *
+ *  oFono - Open Source Telephony
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "latency.h"
+
+struct report {
+	unsigned int entries;
+	unsigned int count;
+	char command[64];
+	struct latency_hist hist;
+};
+
+static void collect(const char *transport, const char *command,
+			const struct latency_hist *hist, void *user_data)
+{
+	struct report *report = user_data;
+
+	report->entries++;
+	report->count += hist->count;
+	g_strlcpy(report->command, command, sizeof(report->command));
+	memcpy(&report->hist, hist, sizeof(*hist));
+}
+
+static void test_buckets(void)
+{
+	unsigned int i;
+
+	g_assert(latency_bucket_lower(0) == 0);
+	g_assert(latency_bucket_lower(4) == 4);
+	g_assert(latency_bucket_lower(8) == 8);
+	g_assert(latency_bucket_lower(9) == 10);
+
+	/* Bucket bounds grow by at most a quarter */
+	for (i = 5; i < LATENCY_BUCKETS; i++) {
+		uint32_t lo = latency_bucket_lower(i - 1);
+		uint32_t hi = latency_bucket_lower(i);
+
+		g_assert(hi > lo);
+		g_assert((uint64_t) (hi - lo) * 4 <= lo);
+	}
+}
+
+static void test_record(void)
+{
+	struct latency_stats *stats;
+	struct report report;
+	uint64_t now;
+	int i;
+
+	latency_set_owner("/modem0");
+	stats = latency_stats_new("at");
+	latency_set_owner(NULL);
+
+	now = latency_now();
+
+	for (i = 0; i < 100; i++)
+		latency_stats_record_name(stats, "+CSQ", now - 1000);
+
+	/* Never sent, must not be counted */
+	latency_stats_record_name(stats, "+CSQ", 0);
+
+	memset(&report, 0, sizeof(report));
+	latency_foreach("/modem0", collect, &report);
+	g_assert(report.entries == 1);
+	g_assert(report.count == 100);
+	g_assert_cmpstr(report.command, ==, "+CSQ");
+	g_assert(report.hist.max >= 1000);
+	g_assert(latency_hist_percentile(&report.hist, 50) >= 1000);
+	g_assert(latency_hist_percentile(&report.hist, 99) <=
+							report.hist.max);
+
+	memset(&report, 0, sizeof(report));
+	latency_foreach("/modem1", collect, &report);
+	g_assert(report.entries == 0);
+
+	latency_reset("/modem0");
+
+	memset(&report, 0, sizeof(report));
+	latency_foreach("/modem0", collect, &report);
+	g_assert(report.entries == 0);
+
+	latency_stats_free(stats);
+}
+
+static void format_id(uint32_t id, char *buf, size_t len)
+{
+	g_snprintf(buf, len, "req-%u", id);
+}
+
+static void test_overflow(void)
+{
+	struct latency_stats *stats;
+	struct report report;
+	uint64_t now = latency_now();
+	uint32_t i;
+
+	stats = latency_stats_new("ril");
+	latency_stats_set_format(stats, format_id);
+
+	for (i = 0; i < 1000; i++)
+		latency_stats_record(stats, i, now);
+
+	memset(&report, 0, sizeof(report));
+	latency_foreach(NULL, collect, &report);
+
+	/* Distinct commands are capped, the rest is lumped together */
+	g_assert(report.entries < 1000);
+	g_assert(report.count == 1000);
+
+	latency_stats_free(stats);
+}
+
+int main(int argc, char **argv)
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/testlatency/Buckets", test_buckets);
+	g_test_add_func("/testlatency/Record", test_record);
+	g_test_add_func("/testlatency/Overflow", test_overflow);
+
+	return g_test_run();
+}
@@ -89,7 +89,7 @@ static void test_serialize_assembly(void)
 				sms_address_to_string(&sms.deliver.oaddr));
 	}
 
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	decode_hex_own_buf(assembly_pdu2, -1, &pdu_len, 0, pdu);
@@ -113,7 +113,141 @@ static void test_serialize_assembly(void)
 
 	g_assert(l != NULL);
 
+	g_slist_free_full(l, g_free);
 	sms_assembly_free(assembly);
+
+	/* Completed messages must not be restored */
+	assembly = sms_assembly_new("1234");
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+
+	sms_assembly_free(assembly);
+}
+
+static void test_serialize_assembly_expire(void)
+{
+	unsigned char pdu[176];
+	long pdu_len;
+	struct sms sms;
+	struct sms_assembly *assembly = sms_assembly_new("1234");
+	guint16 ref;
+	guint8 max;
+	guint8 seq;
+	GSList *l;
+	int i;
+
+	decode_hex_own_buf(assembly_pdu1, -1, &pdu_len, 0, pdu);
+	sms_decode(pdu, pdu_len, FALSE, assembly_pdu_len1, &sms);
+	sms_extract_concatenation(&sms, &ref, &max, &seq);
+
+	/* Enough messages for the log to be compacted on the way */
+	for (i = 0; i < 64; i++) {
+		l = sms_assembly_add_fragment(assembly, &sms, time(NULL),
+						&sms.deliver.oaddr, i, max, seq);
+		g_assert(l == NULL);
+	}
+
+	sms_assembly_expire(assembly, time(NULL) - 40);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 64);
+
+	sms_assembly_expire(assembly, time(NULL) + 40);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+
+	sms_assembly_free(assembly);
+
+	assembly = sms_assembly_new("1234");
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+
+	sms_assembly_free(assembly);
+}
+
+static void tx_backup_store(struct sms_tx_backup *backup,
+				unsigned char id, const char *text)
+{
+	struct sms_tx_backup_pdu pdus[8];
+	unsigned char buf[8][176];
+	unsigned char uuid[SMS_MSGID_LEN];
+	GSList *msg_list;
+	GSList *l;
+	int num_pdus = 0;
+
+	msg_list = sms_text_prepare("555", text, id, FALSE, FALSE);
+	g_assert(msg_list);
+
+	for (l = msg_list; l; l = l->next, num_pdus++) {
+		g_assert(sms_encode(l->data, &pdus[num_pdus].pdu_len,
+					&pdus[num_pdus].tpdu_len,
+					buf[num_pdus]));
+		pdus[num_pdus].pdu = buf[num_pdus];
+	}
+
+	g_slist_free_full(msg_list, g_free);
+
+	memset(uuid, id, sizeof(uuid));
+	g_assert(sms_tx_backup_store(backup, 0, uuid, pdus, num_pdus));
+}
+
+static const char *tx_backup_text = "Lorem ipsum dolor sit amet, consectetur "
+	"adipiscing elit, sed do eiusmod tempor incididunt ut labore et "
+	"dolore magna aliqua. Ut enim ad minim veniam, quis nostrud "
+	"exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat";
+
+static void test_serialize_tx_queue(void)
+{
+	struct sms_tx_backup *backup = sms_tx_backup_new("1234");
+	struct txq_backup_entry *entry;
+	unsigned char uuid[SMS_MSGID_LEN];
+	GQueue *q;
+
+	q = sms_tx_queue_load(backup);
+	g_assert(g_queue_get_length(q) == 0);
+	g_queue_free(q);
+
+	tx_backup_store(backup, 1, tx_backup_text);
+	tx_backup_store(backup, 2, "Short");
+	tx_backup_store(backup, 3, tx_backup_text);
+
+	memset(uuid, 1, sizeof(uuid));
+	sms_tx_backup_sent(backup, uuid, 0);
+
+	memset(uuid, 2, sizeof(uuid));
+	sms_tx_backup_sent(backup, uuid, 0);
+	sms_tx_backup_done(backup, uuid);
+
+	sms_tx_backup_free(backup);
+
+	/* Messages come back in order, without the pdus already sent */
+	backup = sms_tx_backup_new("1234");
+	q = sms_tx_queue_load(backup);
+	g_assert(g_queue_get_length(q) == 2);
+
+	entry = g_queue_pop_head(q);
+	g_assert(entry->uuid[0] == 1);
+	g_assert(g_slist_length(entry->msg_list) == 1);
+	g_slist_free_full(entry->msg_list, g_free);
+	g_free(entry);
+
+	entry = g_queue_pop_head(q);
+	g_assert(entry->uuid[0] == 3);
+	g_assert(g_slist_length(entry->msg_list) == 2);
+	g_slist_free_full(entry->msg_list, g_free);
+	g_free(entry);
+
+	g_queue_free(q);
+
+	memset(uuid, 1, sizeof(uuid));
+	sms_tx_backup_done(backup, uuid);
+
+	memset(uuid, 3, sizeof(uuid));
+	sms_tx_backup_done(backup, uuid);
+
+	sms_tx_backup_free(backup);
+
+	backup = sms_tx_backup_new("1234");
+	q = sms_tx_queue_load(backup);
+	g_assert(g_queue_get_length(q) == 0);
+	g_queue_free(q);
+
+	sms_tx_backup_free(backup);
 }
 
 int main(int argc, char **argv)
@@ -122,6 +256,10 @@ int main(int argc, char **argv)
 
 	g_test_add_func("/testsms/Test SMS Assembly Serialize",
 			test_serialize_assembly);
+	g_test_add_func("/testsms/Test SMS Assembly Serialize Expire",
+			test_serialize_assembly_expire);
+	g_test_add_func("/testsms/Test SMS TX Queue Serialize",
+			test_serialize_tx_queue);
 
 	return g_test_run();
 }
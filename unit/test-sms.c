@@ -1040,17 +1040,17 @@ static void test_assembly(void)
 				sms_address_to_string(&sms.deliver.oaddr));
 	}
 
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	sms_assembly_expire(assembly, time(NULL) + 40);
 
-	g_assert(g_slist_length(assembly->assembly_list) == 0);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
 
 	sms_extract_concatenation(&sms, &ref, &max, &seq);
 	l = sms_assembly_add_fragment(assembly, &sms, time(NULL),
 					&sms.deliver.oaddr, ref, max, seq);
-	g_assert(g_slist_length(assembly->assembly_list) == 1);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
 	g_assert(l == NULL);
 
 	decode_hex_own_buf(assembly_pdu2, -1, &pdu_len, 0, pdu);
@@ -1096,6 +1096,69 @@ static void test_assembly(void)
 	g_free(reencoded);
 }
 
+static void test_assembly_expire(void)
+{
+	static const int ages[] = { 30, 10, 50, 20, 40, 0 };
+	unsigned char pdu[176];
+	long pdu_len;
+	struct sms sms;
+	struct sms_assembly *assembly = sms_assembly_new(NULL);
+	time_t now = time(NULL);
+	guint16 ref;
+	guint8 max;
+	guint8 seq;
+	GSList *l;
+	unsigned int i;
+
+	decode_hex_own_buf(assembly_pdu1, -1, &pdu_len, 0, pdu);
+	sms_decode(pdu, pdu_len, FALSE, assembly_pdu_len1, &sms);
+	sms_extract_concatenation(&sms, &ref, &max, &seq);
+
+	g_assert(sms_assembly_oldest(assembly) == 0);
+
+	for (i = 0; i < G_N_ELEMENTS(ages); i++) {
+		l = sms_assembly_add_fragment(assembly, &sms, now - ages[i],
+						&sms.deliver.oaddr, i, max, seq);
+		g_assert(l == NULL);
+	}
+
+	g_assert(sms_assembly_oldest(assembly) == now - 50);
+
+	/* Complete the one in the middle of the heap */
+	decode_hex_own_buf(assembly_pdu2, -1, &pdu_len, 0, pdu);
+	sms_decode(pdu, pdu_len, FALSE, assembly_pdu_len2, &sms);
+	sms_extract_concatenation(&sms, &ref, &max, &seq);
+
+	l = sms_assembly_add_fragment(assembly, &sms, now,
+					&sms.deliver.oaddr, 3, max, seq);
+	g_assert(l == NULL);
+
+	decode_hex_own_buf(assembly_pdu3, -1, &pdu_len, 0, pdu);
+	sms_decode(pdu, pdu_len, FALSE, assembly_pdu_len3, &sms);
+	sms_extract_concatenation(&sms, &ref, &max, &seq);
+
+	l = sms_assembly_add_fragment(assembly, &sms, now,
+					&sms.deliver.oaddr, 3, max, seq);
+	g_assert(l != NULL);
+	g_slist_free_full(l, g_free);
+
+	g_assert(g_hash_table_size(assembly->assembly_table) == 5);
+
+	sms_assembly_expire(assembly, now - 35);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 3);
+	g_assert(sms_assembly_oldest(assembly) == now - 30);
+
+	sms_assembly_expire(assembly, now - 10);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 1);
+	g_assert(sms_assembly_oldest(assembly) == now);
+
+	sms_assembly_expire(assembly, now);
+	g_assert(g_hash_table_size(assembly->assembly_table) == 0);
+	g_assert(sms_assembly_oldest(assembly) == 0);
+
+	sms_assembly_free(assembly);
+}
+
 static const char *test_no_fragmentation_7bit = "This is testing !";
 static const char *expected_no_fragmentation_7bit = "079153485002020911000C915"
 			"348870420140000A71154747A0E4ACF41F4F29C9E769F4121";
@@ -1781,6 +1844,7 @@ int main(int argc, char **argv)
 			&ems_udh_test_2, test_ems_udh);
 
 	g_test_add_func("/testsms/Test Assembly", test_assembly);
+	g_test_add_func("/testsms/Test Assembly Expire", test_assembly_expire);
 	g_test_add_func("/testsms/Test Prepare 7Bit", test_prepare_7bit);
 
 	g_test_add_data_func("/testsms/Test Prepare Concat",